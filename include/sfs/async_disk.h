@@ -0,0 +1,121 @@
+// async_disk.h: Asynchronous disk emulator
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class AsyncDisk : public Disk {
+private:
+    struct Request {
+    	bool			    Write;  // Whether or not request is a write
+    	int			    Block;  // First block of request
+    	std::vector<struct iovec>   Iov;    // Buffers to transfer
+    };
+
+    struct Ring;			    // io_uring state (Linux only)
+
+    size_t  QueueDepth;			    // Maximum number of requests in flight
+    size_t  Inflight;			    // Number of requests in flight
+    std::string Error;			    // First error reported by a request
+
+    Ring   *Uring;			    // io_uring instance or nullptr
+    std::mutex RingLock;		    // Serializes io_uring submission and reaping
+    std::vector<Request> Slots;		    // io_uring requests by user_data
+    std::vector<size_t>  FreeSlots;	    // Unused entries of Slots
+
+    std::vector<std::thread> Workers;	    // Thread pool fallback
+    std::deque<Request>	 Queue;		    // Requests not yet picked up
+    std::mutex		 Lock;		    // Protects Queue, Inflight, Error
+    std::condition_variable Pending;	    // Signalled when Queue grows
+    std::condition_variable Completed;	    // Signalled when Inflight drops
+    bool		 Stopping;	    // Tells workers to exit
+
+    // Try to set up io_uring; returns whether or not it is available
+    bool setup_uring();
+
+    // Release io_uring resources
+    void teardown_uring();
+
+    // Reap finished io_uring completions
+    // @param	wait	    Block until at least one completion is available
+    void reap_uring(bool wait);
+
+    // Worker thread body for the fallback pool
+    void work();
+
+    // Queue request, blocking while QueueDepth requests are in flight
+    void submit(Request &&request);
+
+    // Perform request synchronously
+    // @param	request	    Request to perform
+    // @param	done	    Bytes already transferred
+    // Returns empty string on success or error description.
+    std::string transfer(Request &request, size_t done);
+
+protected:
+    // Queue reads of consecutive blocks (completed by wait)
+    void read_blocks(int blocknum, struct iovec *iov, int iovcnt) override;
+
+    // Queue writes of consecutive blocks (completed by wait)
+    void write_blocks(int blocknum, struct iovec *iov, int iovcnt) override;
+
+    // Wait for all queued requests
+    void wait() override { complete(); }
+
+    // Wait for all queued requests before syncing
+    void flush() override { complete(); }
+
+    // Wait for queued writes so they cannot land after the range is zeroed
+    bool zero_blocks(int blocknum, size_t nblocks) override {
+    	complete();
+    	return Disk::zero_blocks(blocknum, nblocks);
+    }
+
+public:
+    // Largest number of blocks carried by one request, so long contiguous
+    // runs are spread across the queue instead of occupying one slot
+    const static size_t MAX_REQUEST_BLOCKS = 16;
+
+    // Constructor
+    // @param	depth	    Maximum number of requests in flight
+    AsyncDisk(size_t depth = 32) : QueueDepth(depth > 0 ? depth : 1), Inflight(0),
+    				  Uring(nullptr), Stopping(false) {}
+
+    // Destructor
+    ~AsyncDisk();
+
+    // Open disk image and start io_uring or worker threads
+    // @param	path	    Path to disk image
+    // @param	nblocks	    Number of blocks in disk image
+    // Throws runtime_error exception on error.
+    void open(const char *path, size_t nblocks) override;
+
+    // Return maximum number of requests in flight
+    size_t queue_depth() const { return QueueDepth; }
+
+    // Return whether or not requests go through io_uring
+    bool uring() const { return Uring != nullptr; }
+
+    // Queue read of contiguous blocks, bypassing the block cache
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes, valid until complete
+    void submit_read(int blocknum, size_t nblocks, char *data);
+
+    // Queue write of contiguous blocks, bypassing the block cache
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes, valid until complete
+    void submit_write(int blocknum, size_t nblocks, char *data);
+
+    // Wait for every queued request to finish
+    // Throws runtime_error exception if any of them failed.
+    void complete();
+};
@@ -0,0 +1,95 @@
+// bitmap.h: Free-space bitmap
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+class Bitmap {
+private:
+    std::vector<uint64_t> Words;    // One bit per block, set when free
+    std::vector<uint64_t> Summary;  // One bit per word, set when it has a free bit
+    size_t  Bits;		    // Number of blocks tracked
+    size_t  Free;		    // Number of set bits
+    size_t  Cursor;		    // Next-fit hint: where the next search starts
+
+    // Refresh summary bit of a word after it changed
+    void summarize(size_t word) {
+    	if (Words[word]) {
+    	    Summary[word / 64] |= 1ull << (word % 64);
+	} else {
+    	    Summary[word / 64] &= ~(1ull << (word % 64));
+	}
+    }
+
+    // Find first set bit at or after index (no wrap around)
+    // Returns Bits if there is none.
+    size_t find(size_t index) const;
+
+    // Count set bits from index up to the first clear one, stopping at n
+    size_t run(size_t index, size_t n) const;
+
+    // Clear bits [start, end) and move the cursor past them
+    void take(size_t start, size_t end);
+
+public:
+    // Constructor
+    // @param	bits	    Number of blocks to track
+    // @param	free	    Whether or not every block starts out free
+    Bitmap(size_t bits = 0, bool free = false) { assign(bits, free); }
+
+    // Reinitialize bitmap
+    // @param	bits	    Number of blocks to track
+    // @param	free	    Whether or not every block starts out free
+    void assign(size_t bits, bool free);
+
+    // Return number of blocks tracked
+    size_t size() const { return Bits; }
+
+    // Return number of free blocks
+    size_t count() const { return Free; }
+
+    // Return whether or not block is free
+    bool test(size_t index) const { return Words[index / 64] & (1ull << (index % 64)); }
+
+    // Mark block as free
+    void set(size_t index);
+
+    // Mark block as used
+    void reset(size_t index);
+
+    // Return 64 blocks starting at block 64*index (set bits are free)
+    uint64_t word(size_t index) const { return Words[index]; }
+
+    // Return number of words
+    size_t words() const { return Words.size(); }
+
+    // Replace 64 blocks starting at block 64*index (set bits are free)
+    void assignWord(size_t index, uint64_t bits);
+
+    // Allocate one free block, searching from the next-fit cursor and
+    // wrapping around once
+    // Returns block or -1 if there is no free block.
+    ssize_t allocate();
+
+    // Allocate up to n contiguous free blocks starting at the first free
+    // block after the next-fit cursor
+    // @param	n	    Maximum number of blocks to allocate
+    // @param	length	    Set to number of blocks allocated
+    // Returns first block of the run or -1 if there is no free block.
+    ssize_t allocateRun(size_t n, size_t &length);
+
+    // Allocate up to n contiguous free blocks, preferring a run that starts
+    // at goal, then the first run of n blocks, then the longest run seen
+    // @param	n	    Maximum number of blocks to allocate
+    // @param	goal	    Block that would continue an existing run
+    // @param	length	    Set to number of blocks allocated
+    // Returns first block of the run or -1 if there is no free block.
+    ssize_t allocateExtent(size_t n, size_t goal, size_t &length);
+
+    // Move next-fit cursor
+    void seek(size_t index) { Cursor = index < Bits ? index : 0; }
+};
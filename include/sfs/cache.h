@@ -0,0 +1,80 @@
+// cache.h: LRU block cache
+
+#pragma once
+
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <stdlib.h>
+
+class BlockCache {
+public:
+    // Callback used to write a dirty block back to its home location
+    typedef std::function<void(int blocknum, const char *data)> Writer;
+
+private:
+    struct Entry {
+    	int		    Block;  // Block number on disk
+    	bool		    Dirty;  // Whether or not block differs from disk
+    	std::vector<char>   Data;   // Cached contents
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    size_t	BlockSize;  // Number of bytes per cached block
+    size_t	Capacity;   // Maximum number of cached blocks
+    EntryList	Entries;    // Entries in LRU order, most recent first
+    std::unordered_map<int, EntryList::iterator> Index;
+
+    // Drop least recently used entry, writing it back if dirty
+    void evict(const Writer &writer);
+
+public:
+    BlockCache(size_t blocksize) : BlockSize(blocksize), Capacity(0) {}
+
+    // Return maximum number of cached blocks (0 means disabled)
+    size_t capacity() const { return Capacity; }
+
+    // Return number of cached blocks
+    size_t size() const { return Entries.size(); }
+
+    // Change capacity
+    // @param	capacity    New maximum number of cached blocks
+    // @param	writer	    Used to write back dirty blocks that are evicted
+    // Returns number of evicted blocks.
+    size_t resize(size_t capacity, const Writer &writer);
+
+    // Copy cached block into data and mark it most recently used
+    // @param	blocknum    Block to look up
+    // @param	data	    Buffer to copy into
+    // Returns whether or not block was cached.
+    bool lookup(int blocknum, char *data);
+
+    // Insert or replace cached block
+    // @param	blocknum    Block to cache
+    // @param	data	    Contents of block
+    // @param	dirty	    Whether or not contents still need to be written
+    // @param	writer	    Used to write back dirty block that is evicted
+    // Returns whether or not another block was evicted.
+    bool insert(int blocknum, const char *data, bool dirty, const Writer &writer);
+
+    // Replace contents of block only if it is already cached
+    // @param	blocknum    Block to update
+    // @param	data	    Contents of block
+    // @param	dirty	    Whether or not contents still need to be written
+    // Returns whether or not block was cached.
+    bool update(int blocknum, const char *data, bool dirty);
+
+    // Write back block if it is cached and dirty
+    // @param	blocknum    Block to write back
+    // @param	writer	    Used to write back dirty block
+    // Returns whether or not block was written.
+    bool flush(int blocknum, const Writer &writer);
+
+    // Write back all dirty blocks in ascending block order
+    // @param	writer	    Used to write back dirty blocks
+    // Returns number of blocks written.
+    size_t flush(const Writer &writer);
+};
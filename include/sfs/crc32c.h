@@ -0,0 +1,29 @@
+// crc32c.h: CRC-32C (Castagnoli) checksums
+
+#pragma once
+
+#include <cstdint>
+
+#include <stdlib.h>
+
+// The CRC-32C of iSCSI, ext4 and Btrfs, with the SSE4.2 crc32 instruction
+// where the CPU has it and a table-driven version that takes 8 bytes a
+// step otherwise. Both give the same results; which one compute() uses is
+// decided on its first call.
+namespace CRC32C {
+    // Checksum buffer
+    // @param	data	    Data to checksum
+    // @param	length	    Number of bytes of data
+    // @param	crc	    Checksum of the data that came before, to continue it
+    // @return	Checksum of the data so far
+    uint32_t compute(const char *data, size_t length, uint32_t crc = 0);
+
+    // The same with the table-driven version
+    uint32_t computeTable(const char *data, size_t length, uint32_t crc = 0);
+
+    // The same with the crc32 instruction; only if hardware() says so
+    uint32_t computeHardware(const char *data, size_t length, uint32_t crc = 0);
+
+    // Return whether or not the CPU has the crc32 instruction
+    bool hardware();
+}
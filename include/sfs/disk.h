@@ -2,15 +2,59 @@
 
 #pragma once
 
+#include "sfs/cache.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 #include <stdlib.h>
+#include <sys/uio.h>
 
+// All I/O is positional and the block cache is locked, so a Disk may be
+// used from several threads at once. Writers of the same block must still
+// be serialized by the caller.
 class Disk {
-private:
-    int	    FileDescriptor; // File descriptor of disk image
-    size_t  Blocks;	    // Number of blocks in disk image
-    size_t  Reads;	    // Number of reads performed
-    size_t  Writes;	    // Number of writes performed
-    size_t  Mounts;	    // Number of mounts
+protected:
+    typedef std::atomic<size_t> Counter;
+
+    int	     FileDescriptor; // File descriptor of disk image
+    size_t   Blocks;	     // Number of blocks in disk image
+    Counter  Reads;	     // Number of reads performed
+    Counter  Writes;	     // Number of writes performed
+    size_t   Mounts;	     // Number of mounts
+    Counter  CacheHits;	     // Number of reads served by the block cache
+    Counter  CacheMisses;    // Number of reads that missed the block cache
+    Counter  CacheEvictions; // Number of blocks evicted from the block cache
+
+    BlockCache	Cache;	     // Write-back cache (disabled when capacity is 0)
+    std::mutex	CacheLock;   // Protects Cache
+
+    // Read consecutive blocks from disk image, bypassing the cache
+    // @param	blocknum    First block to read from
+    // @param	iov	    Buffers to scatter into (multiples of BLOCK_SIZE)
+    // @param	iovcnt	    Number of buffers
+    virtual void read_blocks(int blocknum, struct iovec *iov, int iovcnt);
+
+    // Write consecutive blocks to disk image, bypassing the cache
+    // @param	blocknum    First block to write to
+    // @param	iov	    Buffers to gather from (multiples of BLOCK_SIZE)
+    // @param	iovcnt	    Number of buffers
+    virtual void write_blocks(int blocknum, struct iovec *iov, int iovcnt);
+
+    // Wait for blocks passed to read_blocks/write_blocks to be transferred
+    // (backends may return from those before the transfer is done)
+    virtual void wait() {}
+
+    // Make written blocks durable in the disk image (called by sync)
+    virtual void flush() {}
+
+    // Zero consecutive blocks of the disk image without transferring them
+    // @param	blocknum    First block to zero
+    // @param	nblocks	    Number of blocks to zero
+    // Returns false if the image cannot do this, in which case zeroed
+    // buffers are written with write_blocks instead.
+    virtual bool zero_blocks(int blocknum, size_t nblocks);
 
     // Check parameters
     // @param	blocknum    Block to operate on
@@ -18,21 +62,38 @@ private:
     // Throws invalid_argument exception on error.
     void sanity_check(int blocknum, char *data);
 
+private:
+    // Read block from disk image, bypassing the cache
+    void read_block(int blocknum, char *data);
+
+    // Write block to disk image, bypassing the cache
+    void write_block(int blocknum, const char *data);
+
+    // Return writer used by the cache to write back dirty blocks
+    BlockCache::Writer write_back();
+
 public:
     // Number of bytes per block
     const static size_t BLOCK_SIZE = 4096;
+
+    // One block of a scatter/gather request
+    struct Request {
+    	int	Block;	    // Block to operate on
+    	char   *Data;	    // Buffer of BLOCK_SIZE bytes to operate on
+    };
     
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0),
+	     CacheHits(0), CacheMisses(0), CacheEvictions(0), Cache(BLOCK_SIZE) {}
     
     // Destructor
-    ~Disk();
+    virtual ~Disk();
 
     // Open disk image
     // @param	path	    Path to disk image
     // @param	nblocks	    Number of blocks in disk image
     // Throws runtime_error exception on error.
-    void open(const char *path, size_t nblocks);
+    virtual void open(const char *path, size_t nblocks);
 
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
@@ -46,6 +107,27 @@ public:
     // Decrement mounts
     void unmount() { if (Mounts > 0) Mounts--; }
 
+    // Return I/O statistics
+    size_t reads() const { return Reads; }
+    size_t writes() const { return Writes; }
+    size_t cache_hits() const { return CacheHits; }
+    size_t cache_misses() const { return CacheMisses; }
+    size_t cache_evictions() const { return CacheEvictions; }
+
+    // Return capacity of block cache (in terms of blocks)
+    size_t cache_size() const { return Cache.capacity(); }
+
+    // Set capacity of block cache, writing back any evicted dirty blocks
+    // @param	nblocks	    Number of blocks to cache (0 disables the cache)
+    void set_cache_size(size_t nblocks);
+
+    // Write all dirty cached blocks back to the disk image
+    void sync();
+
+    // Write back cached copy of a single block if it is dirty
+    // @param	blocknum    Block to write back
+    void sync(int blocknum);
+
     // Read block from disk
     // @param	blocknum    Block to read from
     // @param	data	    Buffer to read into
@@ -55,4 +137,31 @@ public:
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
     void write(int blocknum, char *data);
+
+    // Read contiguous range of blocks from disk
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to read into
+    void read(int blocknum, size_t nblocks, char *data);
+
+    // Write contiguous range of blocks to disk
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    void write(int blocknum, size_t nblocks, char *data);
+
+    // Zero contiguous range of blocks, deallocating them in the image where
+    // the file system supports it (cached copies are replaced by zeros)
+    // @param	blocknum    First block to zero
+    // @param	nblocks	    Number of blocks to zero
+    // Throws invalid_argument exception if the range is out of bounds.
+    void zero(int blocknum, size_t nblocks);
+
+    // Read list of blocks, merging physically consecutive ones into one call
+    // @param	requests    Blocks to read and buffers to read into
+    void readv(const std::vector<Request> &requests);
+
+    // Write list of blocks, merging physically consecutive ones into one call
+    // @param	requests    Blocks to write and buffers to write from
+    void writev(const std::vector<Request> &requests);
 };
@@ -2,44 +2,235 @@
 
 #pragma once
 
+#include "sfs/bitmap.h"
+#include "sfs/crc32c.h"
 #include "sfs/disk.h"
+#include "sfs/journal.h"
+#include "sfs/rwlock.h"
 
 #ifdef __APPLE__
 #include <sys/types.h>
 #endif
 
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 
+/// create, remove, stat, read, write and sync may be called from several
+/// threads at once; format, mount and unmount may not overlap with anything
 class FileSystem {
 public:
   const static uint32_t MAGIC_NUMBER = 0xf0f03410;
   const static uint32_t INODES_PER_BLOCK = 128;
   const static uint32_t POINTERS_PER_INODE = 5;
   const static uint32_t POINTERS_PER_BLOCK = 1024;
+  const static uint32_t BITS_PER_BLOCK = Disk::BLOCK_SIZE * 8;
+
+  /// marks superblocks whose optional fields below `Inodes` are meaningful;
+  /// older images may have anything there
+  const static uint32_t FEATURE_MAGIC = 0xf0f0fea7;
+  /// a free-block bitmap follows the inode blocks
+  const static uint32_t FEATURE_BITMAP = 1u << 0;
+  /// a metadata journal follows the bitmap
+  const static uint32_t FEATURE_JOURNAL = 1u << 1;
+  /// inodes map their blocks with extents instead of block pointers
+  const static uint32_t FEATURE_EXTENTS = 1u << 2;
+
+  /// inode records are LARGE_INODE_SIZE bytes or more with a 64-bit size,
+  /// and pointer inodes add double and triple indirect blocks
+  const static uint32_t FEATURE_LARGE_FILES = 1u << 3;
+
+  /// large inode records keep the contents of files that fit after the
+  /// first LARGE_INODE_SIZE bytes instead of in data blocks
+  const static uint32_t FEATURE_INLINE_DATA = 1u << 4;
+
+  /// large inode records mark new files as compressed, stored in clusters
+  /// of CLUSTER_BLOCKS blocks that are compressed together
+  const static uint32_t FEATURE_COMPRESSION = 1u << 5;
+
+  /// identical data blocks are shared, with a reference count and a hash
+  /// of each kept in a table after the journal
+  const static uint32_t FEATURE_DEDUP = 1u << 6;
+
+  /// files can be cloned and the inode table snapshotted, sharing blocks
+  /// counted in the same table; a block after it lists the snapshots
+  const static uint32_t FEATURE_CLONES = 1u << 7;
+
+  /// every data block has a CRC-32C, kept in a table after the snapshot
+  /// table, that reads check it against
+  const static uint32_t FEATURE_CHECKSUMS = 1u << 8;
+
+  /// extents kept in an inode record (32 bytes, or large); further extents
+  /// go to a chain of overflow blocks
+  const static uint32_t EXTENTS_PER_INODE = 2;
+  const static uint32_t EXTENTS_PER_LARGE_INODE = 5;
+  const static uint32_t EXTENTS_PER_BLOCK = (Disk::BLOCK_SIZE - 8) / 8;
+
+  /// entries of the block reference table in one of its blocks
+  const static uint32_t REFS_PER_BLOCK = Disk::BLOCK_SIZE / 16;
+
+  /// entries of the checksum table in one of its blocks
+  const static uint32_t CHECKSUMS_PER_BLOCK = Disk::BLOCK_SIZE / 4;
+
+  /// the superblock block keeps one bit per region of the checksum table
+  /// after the first CHECKSUM_REGIONS_OFFSET bytes; see checksumRegions
+  const static uint32_t CHECKSUM_REGIONS_OFFSET = 256;
+  const static uint32_t CHECKSUM_REGIONS = (Disk::BLOCK_SIZE - CHECKSUM_REGIONS_OFFSET) * 8;
+
+  /// snapshots the snapshot table has room for
+  const static uint32_t MAX_SNAPSHOTS = Disk::BLOCK_SIZE / 8;
+
+  /// size of the inode records format writes with FEATURE_LARGE_FILES
+  const static uint32_t LARGE_INODE_SIZE = 64;
+  /// size of the inode records format writes with FEATURE_INLINE_DATA, and
+  /// the largest a mount accepts with it
+  const static uint32_t INLINE_INODE_SIZE = 512;
+  const static uint32_t INLINE_DATA_MAX = INLINE_INODE_SIZE - LARGE_INODE_SIZE;
+
+  /// inode flag: the file's contents are in the inode record
+  const static uint32_t INODE_INLINE_DATA = 1u << 0;
+  /// inode flag: the file's blocks hold compressed clusters
+  const static uint32_t INODE_COMPRESSED = 1u << 1;
+
+  /// blocks of a compressed file compressed together; a cluster that does
+  /// not save a block is stored as it is
+  const static uint32_t CLUSTER_BLOCKS = 16;
+  const static size_t CLUSTER_BYTES = CLUSTER_BLOCKS * Disk::BLOCK_SIZE;
+
+  /// format gives the journal 1/JOURNAL_FRACTION of the disk, at most
+  /// JOURNAL_MAX_BLOCKS, and leaves it out below JOURNAL_MIN_BLOCKS; a sync
+  /// only commits as one transaction if what it logged fits in it
+  const static uint32_t JOURNAL_FRACTION = 64;
+  const static uint32_t JOURNAL_MIN_BLOCKS = 16;
+  const static uint32_t JOURNAL_MAX_BLOCKS = 4096;
+
+  /// superblock state of a cleanly unmounted file system
+  const static uint32_t STATE_CLEAN = 1;
+
+  /// number of inode block maps kept in memory
+  const static size_t BLOCK_MAPS = 256;
+  /// number of inodes with readahead state kept in memory
+  const static size_t READAHEAD_STREAMS = 16;
+  /// first readahead window in blocks, doubled on every sequential read
+  const static uint32_t READAHEAD_INITIAL = 4;
+  /// number of inodes whose last cluster is kept decompressed in memory
+  const static size_t CLUSTER_CACHE_FILES = 16;
+  /// number of reader/writer locks that inodes are hashed onto
+  const static size_t INODE_LOCKS = 1024;
+  /// inode blocks a mount worker reads at a time
+  const static uint32_t MOUNT_CHUNK_BLOCKS = 64;
 
 private:
-  struct SuperBlock {     // Superblock structure
-    uint32_t MagicNumber; // File system magic number
-    uint32_t Blocks;      // Number of blocks in file system
-    uint32_t InodeBlocks; // Number of blocks reserved for inodes
-    uint32_t Inodes;      // Number of inodes in file system
+  struct SuperBlock {       // Superblock structure
+    uint32_t MagicNumber;   // File system magic number
+    uint32_t Blocks;        // Number of blocks in file system
+    uint32_t InodeBlocks;   // Number of blocks reserved for inodes
+    uint32_t Inodes;        // Number of inodes in file system
+    uint32_t FeatureMagic;  // FEATURE_MAGIC if the fields below are valid
+    uint32_t Features;      // Bitmask of FEATURE_* flags
+    uint32_t State;         // STATE_CLEAN if unmounted cleanly
+    uint32_t BitmapBlocks;  // Number of blocks in the free-block bitmap
+    uint32_t JournalBlocks; // Number of blocks in the metadata journal
+    uint32_t InodeSize;     // Bytes per inode record with large files
+    uint32_t RefBlocks;     // Number of blocks in the block reference table
+    uint32_t ChecksumBlocks; // Number of blocks in the checksum table
   };
 
-  struct Inode {
+  struct RefEntry {         // Block reference table entry, one per block
+    uint64_t Hash;          // hashBlock() of the contents, 0 if unknown
+    uint32_t Count;         // Inodes and pointer blocks pointing to it
+    uint32_t Reserved;
+  };
+
+  struct SnapshotEntry {    // Snapshot table entry
+    uint32_t Head;          // First block of the snapshot, 0 if unused
+    uint32_t Inodes;        // Number of inodes it holds
+  };
+
+  struct SnapshotHeader {   // Start of each block of a snapshot
+    uint32_t Next;          // Next block of the snapshot, 0 if none
+    uint32_t Count;         // Inumbers that follow, then as many records
+  };
+
+  struct Extent {
+    uint32_t Start;  // First disk block of the run
+    uint32_t Length; // Number of blocks in the run
+  };
+
+  struct PointerRecord {                 // Inode record with block pointers
+    uint32_t Valid;                      // Whether or not inode is valid
+    uint32_t Size;                       // Size of file
+    uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+    uint32_t Indirect;                   // Indirect pointer
+  };
+
+  struct ExtentRecord {                  // Inode record with extents
     uint32_t Valid;                      // Whether or not inode is valid
     uint32_t Size;                       // Size of file
+    uint32_t Extents;                    // Number of extents
+    uint32_t Overflow;                   // First overflow block, 0 if none
+    Extent Inline[EXTENTS_PER_INODE];    // First extents
+  };
+
+  struct LargePointerRecord {            // Inode record of large files with block pointers
+    uint32_t Valid;                      // Whether or not inode is valid
+    uint32_t Flags;                      // Bitmask of INODE_* flags
+    uint64_t Size;                       // Size of file
+    uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+    uint32_t Indirect;                   // Indirect pointer
+    uint32_t DoubleIndirect;             // Block of indirect pointers
+    uint32_t TripleIndirect;             // Block of double indirect pointers
+  };
+
+  struct LargeExtentRecord {             // Inode record of large files with extents
+    uint32_t Valid;                      // Whether or not inode is valid
+    uint32_t Flags;                      // Bitmask of INODE_* flags
+    uint64_t Size;                       // Size of file
+    uint32_t Extents;                    // Number of extents
+    uint32_t Overflow;                   // First overflow block, 0 if none
+    Extent Inline[EXTENTS_PER_LARGE_INODE]; // First extents
+  };
+
+  struct ExtentBlock {                   // Overflow block of extents
+    uint32_t Next;                       // Next overflow block, 0 if none
+    uint32_t Count;                      // Extents used in this block
+    Extent Extents[EXTENTS_PER_BLOCK];   // Further extents
+  };
+
+  /// an inode as kept in the inode table, whatever its record format
+  struct Inode {
+    uint32_t Valid;                      // Whether or not inode is valid
+    uint32_t Flags;                      // Bitmask of INODE_* flags
+    uint64_t Size;                       // Size of file
     uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
     uint32_t Indirect;                   // Indirect pointer
+    uint32_t DoubleIndirect;             // Block of indirect pointers
+    uint32_t TripleIndirect;             // Block of double indirect pointers
+    uint32_t Extents;                    // Number of extents
+    uint32_t Overflow;                   // First overflow block, 0 if none
+    Extent Inline[EXTENTS_PER_LARGE_INODE]; // First extents
+    char Data[INLINE_DATA_MAX];          // Contents with INODE_INLINE_DATA
+  };
+
+  struct SuperBlockTail {                 // The superblock block as a whole
+    char Super[CHECKSUM_REGIONS_OFFSET];   // SuperBlock, with room to grow
+    uint8_t ChecksumRegions[CHECKSUM_REGIONS / 8]; // Bits of checksumRegions
   };
 
   union Block {
     SuperBlock Super;                      // Superblock
-    Inode Inodes[INODES_PER_BLOCK];        // Inode block
+    SuperBlockTail Tail;                   // Superblock and what follows it
     uint32_t Pointers[POINTERS_PER_BLOCK]; // Pointer block
+    ExtentBlock Overflow;                  // Extent overflow block
+    SnapshotEntry Snapshots[MAX_SNAPSHOTS]; // Snapshot table
     char Data[Disk::BLOCK_SIZE];           // Data block
   };
 
@@ -56,79 +247,862 @@ private:
     return getSuperblock(disk);
   }
 
+  static bool hasFeature(const SuperBlock &superblock, uint32_t feature) {
+    return superblock.FeatureMagic == FEATURE_MAGIC && (superblock.Features & feature);
+  }
+
+  bool hasFeature(uint32_t feature) const {
+    return hasFeature(superblock, feature);
+  }
+
+  /// the free-block bitmap starts right after the inode blocks
+  static uint32_t getBitmapStart(const SuperBlock &superblock) {
+    return superblock.InodeBlocks + 1;
+  }
+
+  /// the journal starts right after the bitmap
+  static uint32_t getJournalStart(const SuperBlock &superblock) {
+    return getBitmapStart(superblock) + superblock.BitmapBlocks;
+  }
+
+  /// the block reference table starts right after the journal
+  static uint32_t getRefStart(const SuperBlock &superblock) {
+    return getJournalStart(superblock) + (hasFeature(superblock, FEATURE_JOURNAL) ? superblock.JournalBlocks : 0);
+  }
+
+  /// whether blocks may be shared, and counted in the reference table
+  static bool hasRefs(const SuperBlock &superblock) {
+    return hasFeature(superblock, FEATURE_DEDUP) || hasFeature(superblock, FEATURE_CLONES);
+  }
+
+  bool hasRefs() const {
+    return hasRefs(superblock);
+  }
+
+  /// the snapshot table follows the reference table
+  static uint32_t getSnapshotTable(const SuperBlock &superblock) {
+    return getRefStart(superblock) + superblock.RefBlocks;
+  }
+
+  /// the checksum table follows the snapshot table
+  static uint32_t getChecksumStart(const SuperBlock &superblock) {
+    return getRefStart(superblock) + (hasRefs(superblock) ? superblock.RefBlocks : 0) +
+           (hasFeature(superblock, FEATURE_CLONES) ? 1 : 0);
+  }
+
+  /// first block after the metadata; optional fields of images without
+  /// the matching feature may hold anything
+  static uint32_t getDataStart(const SuperBlock &superblock) {
+    if (!hasFeature(superblock, FEATURE_BITMAP)) {
+      return getBitmapStart(superblock);
+    }
+    return getChecksumStart(superblock) + (hasFeature(superblock, FEATURE_CHECKSUMS) ? superblock.ChecksumBlocks : 0);
+  }
+
+  void writeSuperblock();
+
+  /// size of one inode record on disk
+  static uint32_t getInodeRecordSize(const SuperBlock &superblock) {
+    if (hasFeature(superblock, FEATURE_LARGE_FILES)) {
+      return superblock.InodeSize;
+    }
+    return hasFeature(superblock, FEATURE_EXTENTS) ? sizeof(ExtentRecord) : sizeof(PointerRecord);
+  }
+
+  static uint32_t getInodesPerBlock(const SuperBlock &superblock) {
+    return Disk::BLOCK_SIZE / getInodeRecordSize(superblock);
+  }
+
+  uint32_t getInodesPerBlock() const {
+    return getInodesPerBlock(superblock);
+  }
+
+  /// bytes of file contents an inode record can hold
+  static uint32_t getInlineCapacity(const SuperBlock &superblock) {
+    return hasFeature(superblock, FEATURE_INLINE_DATA) ? superblock.InodeSize - LARGE_INODE_SIZE : 0;
+  }
+
+  /// extents that fit in an inode record
+  static uint32_t getInodeExtents(const SuperBlock &superblock) {
+    return hasFeature(superblock, FEATURE_LARGE_FILES) ? EXTENTS_PER_LARGE_INODE : EXTENTS_PER_INODE;
+  }
+
+  /// pointer blocks holding data block pointers that an inode can reach:
+  /// the indirect block, then those of the double and triple indirect ones
+  static uint32_t getMaxLeaves(const SuperBlock &superblock) {
+    if (!hasFeature(superblock, FEATURE_LARGE_FILES)) {
+      return 1;
+    }
+    return 1 + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+  }
+
+  /// most blocks a file can have
+  static uint32_t getMaxBlocks(const SuperBlock &superblock) {
+    if (hasFeature(superblock, FEATURE_EXTENTS)) {
+      // only the size limits an extent-mapped file
+      return hasFeature(superblock, FEATURE_LARGE_FILES) ? UINT32_MAX : UINT32_MAX / Disk::BLOCK_SIZE;
+    }
+    return POINTERS_PER_INODE + getMaxLeaves(superblock) * POINTERS_PER_BLOCK;
+  }
+
+  /// convert inode record `index` of an inode block to and from an Inode
+  static void decodeInode(const SuperBlock &superblock, const Block &block, uint32_t index, Inode &inode);
+  static void encodeInode(const SuperBlock &superblock, const Inode &inode, uint32_t index, Block &block);
+
+  /// write a metadata block, through the journal if there is one
+  void writeMetadata(uint32_t blocknum, char *data) {
+    if (journal) {
+      journal->log(blocknum, data);
+    } else {
+      disk->write(blocknum, data);
+    }
+  }
+
+  /// write several metadata blocks, in one call if there is no journal
+  void writeMetadata(const std::vector<Disk::Request> &requests) {
+    if (journal) {
+      for (const auto &request : requests) {
+        journal->log(request.Block, request.Data);
+      }
+    } else {
+      disk->writev(requests);
+    }
+  }
+
+  /// sync before an operation once what the journal holds uncommitted takes
+  /// half of it, so each sync still commits as one transaction
+  void syncIfCrowded() {
+    if (journal && journal->crowded()) {
+      sync();
+    }
+  }
+
+  /// read a metadata block, which the journal may hold a newer copy of
+  void readMetadata(uint32_t blocknum, char *data) {
+    if (!journal || !journal->lookup(blocknum, data)) {
+      disk->read(blocknum, data);
+    }
+  }
+
+  /// serialize the part of `freeBlocks` covered by one bitmap block
+  static void packBitmap(const Bitmap &freeBlocks, uint32_t bitmapIndex, Block &block);
+
+  /// fill freeBlocks from the on-disk bitmap
+  void loadBitmap();
+
+  /// write bitmap blocks changed since the last call (or all of them)
+  void writeBitmap(bool all);
+
+  /// fill `refs` from the block reference table, and write the table
+  /// blocks changed since the last call (or all of them)
+  void loadRefs();
+  void writeRefs(bool all);
+
+  /// rebuild `dedupIndex` from the counted blocks of `refs`
+  void indexRefs();
+
+  /// remember that the table block holding the entry of `blk` is stale;
+  /// the caller holds refsLock
+  void markRefDirty(uint32_t blk) {
+    dirtyRefBlocks[blk / REFS_PER_BLOCK] = true;
+  }
+
+  /// hash of a block's contents for dedup, never 0
+  static uint64_t hashBlock(const char *data);
+
+  /// count the first reference to the new data block `blk` holding `data`
+  void trackDataBlock(uint32_t blk, const char *data);
+
+  /// take one more reference to `blk`, which for a new block is its first
+  void holdBlock(uint32_t blk);
+
+  /// drop one reference to `blk`, freeing it with the last one
+  void releaseBlock(uint32_t blk);
+
+  /// the same for pointer block `blk`, which also drops what it points to
+  /// when it is freed: data blocks at level 0, else pointer blocks a level
+  /// lower
+  void releaseMapBlock(uint32_t blk, int level);
+
+  /// take references to the blocks inode `inode` points to, so a copy of
+  /// it can be stored; overflow blocks are copied rather than shared.
+  /// False if the disk is full, and then nothing changed.
+  bool shareInodeBlocks(Inode &inode);
+
+  /// drop the references of a stored inode to its blocks
+  void releaseInodeBlocks(const Inode &inode);
+
+  /// the inodes of the snapshot starting at block `head`, by inumber, and
+  /// the blocks holding them
+  void loadSnapshot(uint32_t head, const std::function<void(uint32_t, char *)> &read,
+                    std::vector<std::pair<uint32_t, Inode>> &inodes, std::vector<uint32_t> &blocks);
+
+  /// fill `checksums` from the checksum table, and write the table blocks
+  /// changed since the last call (or all of them)
+  void loadChecksums();
+  void writeChecksums(bool all);
+
+  /// recompute the checksums of the blocks in use in the regions marked
+  /// in checksumRegions, and drop those of free blocks, after writes that
+  /// may not have been synced
+  void rebuildChecksums();
+
+  /// data blocks in one region of checksumRegions, a whole number of
+  /// checksum table blocks
+  static uint32_t getChecksumRegionBlocks(const SuperBlock &superblock) {
+    return (superblock.ChecksumBlocks + CHECKSUM_REGIONS - 1) / CHECKSUM_REGIONS * CHECKSUMS_PER_BLOCK;
+  }
+
+  /// unmark the regions whose table entries a sync has just written, unless
+  /// they were written again since it began
+  void clearChecksumRegions();
+
+  /// checksum table entry for a block holding `data`; 0 means none, so a
+  /// CRC of 0 is stored as ~0
+  static uint32_t checksumBlock(const char *data) {
+    const uint32_t crc = CRC32C::compute(data, Disk::BLOCK_SIZE);
+    return crc == 0 ? ~0u : crc;
+  }
+
+  /// remember that the table block holding the entry of `blk` is stale;
+  /// the caller holds checksumsLock
+  void markChecksumDirty(uint32_t blk) {
+    dirtyChecksumBlocks[blk / CHECKSUMS_PER_BLOCK] = true;
+  }
+
+  /// write data blocks, recording their checksums
+  void writeData(const std::vector<Disk::Request> &requests);
+  void writeData(uint32_t blk, char *data) {
+    writeData(std::vector<Disk::Request>(1, Disk::Request{(int)blk, data}));
+  }
+
+  /// whether requests [first, last) of blocks just read match their
+  /// checksums; a mismatch is counted as a checksum error
+  bool verifyData(const std::vector<Disk::Request> &requests, size_t first = 0, size_t last = SIZE_MAX);
+
+  /// read data blocks; false if one of them does not match its checksum
+  bool readData(const std::vector<Disk::Request> &requests) {
+    disk->readv(requests);
+    return verifyData(requests);
+  }
+  bool readData(uint32_t blk, char *data) {
+    return readData(std::vector<Disk::Request>(1, Disk::Request{(int)blk, data}));
+  }
+
+  /// take or release every inode lock, in order
+  void lockInodes();
+  void unlockInodes();
+
   uint32_t getInodeBlkIndex(uint32_t inumber) const {
-    return inumber / INODES_PER_BLOCK + 1;
+    return inumber / getInodesPerBlock() + 1;
   }
 
-  Inode &getInode(uint32_t inumber, Block &inodeBlock) const {
-    uint32_t inodeBlkIndex = getInodeBlkIndex(inumber);
-    uint32_t offset = inumber % INODES_PER_BLOCK;
-    disk->read(inodeBlkIndex, inodeBlock.Data);
-    return inodeBlock.Inodes[offset];
+  /// non-free inodes of one inode block, locked together
+  struct InodeShard {
+    std::mutex Lock;                            // protects the fields below
+    std::unordered_map<uint32_t, Inode> Inodes; // inodes by inumber
+    bool Dirty = false;                         // on-disk copy is out of date
+  };
+
+  /// copy inode `inumber` out of the table; false if it is not valid
+  bool loadInode(size_t inumber, Inode &inode);
+
+  /// put a changed inode back and mark its inode block dirty
+  void storeInode(uint32_t inumber, const Inode &inode);
+
+  /// the lock held shared by readers and exclusive by writers of `inumber`
+  RWLock &getInodeLock(size_t inumber) {
+    return inodeLocks[inumber % INODE_LOCKS];
   }
 
+  /// what one mount worker found, merged once all workers are done
+  struct ScanState {
+    Bitmap FreeInodes;                // set for free inodes of its chunks
+    Bitmap Claimed;                   // set for blocks its inodes point to
+    Bitmap Data;                      // with shared blocks, set for those
+    Bitmap Pointers;                  // used as data or as pointer blocks
+    std::vector<uint32_t> Duplicates; // blocks it saw claimed twice
+    std::vector<uint32_t> Shared;     // blocks it saw used again the same way
+    std::exception_ptr Error;         // first exception it ran into
+    std::atomic<uint64_t> *Visited = nullptr; // shared by all workers: set
+                                      // for pointer blocks one of them read
+  };
+
+  /// blocks check() found in use, shared by its workers; the kinds are
+  /// only kept when blocks may be shared
+  struct CheckMaps {
+    std::unique_ptr<std::atomic<uint64_t>[]> Claimed;  // used by anything
+    std::unique_ptr<std::atomic<uint64_t>[]> Data;     // used as a data block
+    std::unique_ptr<std::atomic<uint64_t>[]> Pointers; // as a pointer or overflow block
+    std::unique_ptr<std::atomic<uint64_t>[]> Other;    // as any other metadata
+  };
+
+  /// how check() found a block it claimed
+  enum CheckClaim { CLAIM_FIRST, CLAIM_SHARED, CLAIM_DUPLICATE };
+
+  /// a pointer check() found to a block already in use, to be cleared
+  struct CheckSlot {
+    uint32_t Inumber; // inode it belongs to
+    uint32_t Holder;  // pointer or overflow block holding it, 0 for the inode record
+    uint32_t Index;   // pointer there (direct, then indirect, double, triple), or extent
+    bool Extent;      // whether it is an extent, which becomes a hole
+  };
+
+  /// what one check() worker found, merged once all workers are done
+  struct CheckState {
+    CheckMaps *Maps = nullptr;          // shared by all workers
+    bool Repair = false;                // write back the fixes it makes
+    int Snapshot = -1;                  // snapshot being checked, -1 for the inode table
+    bool Damaged = false;               // that snapshot has a problem
+    size_t Inodes = 0;                  // valid inodes it checked
+    std::vector<std::pair<uint32_t, std::string>> Problems; // by inumber
+    std::vector<uint32_t> Shared;       // blocks it saw used again the same way
+    std::vector<CheckSlot> Duplicates;  // pointers to blocks already in use
+    std::vector<uint32_t> Snapshots;    // damaged snapshots, once merged
+    std::exception_ptr Error;           // first exception it ran into
+  };
+
+  /// whether a superblock describes a layout mount can use
+  static bool checkSuperblock(const SuperBlock &superblock);
+
+  /// check every inode and snapshot, claiming their blocks in fresh `maps`,
+  /// and merge what the workers found into `found`
+  void checkScan(CheckMaps &maps, bool repair, CheckState &found);
+
+  /// check chunks of inode blocks, taking the next chunk from `next` until
+  /// none are left
+  void checkInodeBlocks(std::atomic<uint32_t> &next, CheckState &state);
+
+  /// check one valid inode (or one that should be free) whose record holds
+  /// a size of `recordSize`, fixing `inode`; true if it changed
+  bool checkInode(uint32_t inumber, Inode &inode, uint64_t recordSize, CheckState &state);
+  bool checkExtents(uint32_t inumber, Inode &inode, uint64_t blocks, CheckState &state);
+
+  /// check pointer `blk` to a data block (level -1) or a pointer block at
+  /// `level`, as for releaseMapBlock, that maps `count` inode blocks; true
+  /// if it was cleared
+  bool checkPointer(uint32_t &blk, int level, uint64_t count, const CheckSlot &slot, CheckState &state);
+
+  /// check the extent at `slot`, `covered` inode blocks into a file of
+  /// `blocks`; true if it changed
+  bool checkExtent(Extent &extent, uint64_t &covered, uint64_t blocks, const CheckSlot &slot, CheckState &state);
+
+  /// claim `blk` in `maps` as a block of `kind` (one of its bitmaps, null
+  /// without shared blocks); a block claimed again only as the same kind
+  /// is shared
+  static CheckClaim checkClaim(CheckMaps &maps, std::atomic<uint64_t> *kind, uint32_t blk);
+
+  /// add a problem with inode `inumber` (UINT32_MAX for a snapshot itself)
+  static void checkProblem(CheckState &state, uint32_t inumber, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+  /// compare the bitmap, reference and checksum tables with the blocks in
+  /// `maps`, adding what differs to `problems` if given; with `repair` the
+  /// table blocks that differ are rewritten
+  void checkTables(const CheckMaps &maps, std::vector<uint32_t> shared, bool repair, std::vector<std::string> *problems);
+
+  /// fill the inode table and `freeInodes` from one inode block
+  void loadInodeBlock(uint32_t index, const Block &block, Bitmap &freeInodes);
+
+  /// load chunks of inode blocks, taking the next chunk from `next` until
+  /// none are left; with `scan` the blocks of their inodes are claimed too
+  void scanInodeBlocks(std::atomic<uint32_t> &next, bool scan, ScanState &state);
+
+  /// write inode blocks changed since the last call
+  void writeInodes();
+
   /// return the disk block index for a given inode block index
-  uint32_t getDiskBlkNo_direct(const Inode &inode, uint32_t blockIndex) {
+  static uint32_t getDiskBlkNo_direct(const Inode &inode, uint32_t blockIndex) {
     assert(blockIndex < 5);
     return inode.Direct[blockIndex];
   }
 
-  uint32_t getDiskBlkNo_indirect(const uint32_t (&pointers)[1024], uint32_t blockIndex) {
+  static uint32_t getDiskBlkNo_indirect(const uint32_t (&pointers)[1024], uint32_t blockIndex) {
     assert(blockIndex >= 5);
     return pointers[blockIndex - 5];
   }
 
-  /// helper function combining the above two
-  uint32_t getDiskBlkNo(const Inode &inode, uint32_t blockIndex, Block &indirectBlk) {
-    uint32_t diskBlkNo;
-    if (blockIndex < 5) {
-      diskBlkNo = getDiskBlkNo_direct(inode, blockIndex);
-    } else {
-      disk->read(inode.Indirect, indirectBlk.Data);
-      diskBlkNo = getDiskBlkNo_indirect(indirectBlk.Pointers, blockIndex);
-    }
-    return diskBlkNo;
-  }
+  /// logical to physical block map of one inode. Pointer blocks that hold
+  /// data block pointers (leaves) are read when a block they map is first
+  /// needed; the indirect blocks above them are read with the map.
+  struct BlockMap {
+    std::vector<uint32_t> Blocks;  // disk block backing each inode block, 0 for a hole
+    std::vector<uint32_t> Leaves;  // leaf k maps Blocks[5 + 1024k ...], 0 if all holes
+    std::vector<uint32_t> Seconds; // blocks of the triple indirect block, 0 if all holes
+    std::vector<uint32_t> Meta;    // double and triple indirect (0 if unused), or overflow blocks
+    std::vector<bool> Loaded;      // leaves already read into Blocks
+    std::vector<bool> DirtyLeaves; // leaves not yet written
+    std::vector<bool> DirtySeconds; // Seconds not yet written
+    uint32_t Runs;                 // extents that Blocks makes up
+    bool Dirty;                    // double, triple or extents not yet written
+    std::mutex Lock;               // serializes readers loading leaves
+  };
+
+  /// fill `map` from `inode`, reading pointer blocks with `read`, and every
+  /// leaf too with `leaves`; never yields more blocks than the size calls for
+  static void loadBlockMap(const SuperBlock &superblock, const Inode &inode, BlockMap &map,
+                           const std::function<void(uint32_t, char *)> &read, bool leaves);
+
+  /// read leaf `k` of `map` into its Blocks
+  static void loadLeaf(BlockMap &map, uint32_t k, const std::function<void(uint32_t, char *)> &read);
+
+  /// make sure Blocks[first..last] of `map` have been read
+  void loadMapRange(BlockMap &map, uint32_t first, uint32_t last);
+
+  /// block map of `inumber`, reading its indirect block on first use; the
+  /// caller holds the inode lock, shared to read or exclusive to change it
+  std::shared_ptr<BlockMap> getBlockMap(uint32_t inumber, const Inode &inode);
+
+  /// write the indirect or overflow blocks of `inode` if its map changed;
+  /// extents kept in the inode record are updated in `inode`
+  void flushBlockMap(Inode &inode, BlockMap &map);
+
+  /// sequential access state and prefetched blocks of one inode
+  struct Readahead {
+    std::mutex Lock;           // serializes readers of the stream
+    size_t NextOffset;         // offset a sequential read would start at
+    uint32_t Window;           // blocks to prefetch past the next read
+    uint32_t First;            // inode block index of Blocks[0]
+    std::vector<Block> Blocks; // prefetched blocks
+    std::vector<bool> Used;    // whether each prefetched block was read
+  };
+
+  /// readahead state of `inumber`, created on first use
+  std::shared_ptr<Readahead> getReadaheadState(uint32_t inumber);
+
+  /// forget prefetched blocks of `ra` before inode block `index`; the
+  /// caller holds `ra.Lock`
+  void dropReadahead(Readahead &ra, uint32_t index);
+
+  /// forget everything prefetched for `inumber`
+  void dropReadahead(uint32_t inumber);
+
+  /// start of the first block of a compressed cluster
+  struct ClusterHeader {
+    uint32_t Length; // Bytes of compressed data after the header
+    uint32_t Size;   // Bytes they decompress to
+  };
+
+  /// the contents of one cluster of a compressed file
+  struct Cluster {
+    uint32_t Index;         // cluster number within the file
+    std::vector<char> Data; // CLUSTER_BYTES of contents, zeros past the end
+  };
+
+  /// A cluster of a compressed file holds its first blocks in a prefix of
+  /// its map entries. If all the entries up to the end of the file are set
+  /// the cluster is stored as it is; if only a shorter prefix is, those
+  /// blocks start with a ClusterHeader and the compressed contents; none
+  /// set is a hole.
+
+  /// read cluster `index` of a file of `size` bytes into CLUSTER_BYTES of
+  /// `data`; false if it does not decompress
+  bool loadCluster(BlockMap &map, uint32_t index, size_t size, char *data);
+
+  /// write the first `bytes` of `data` as cluster `index`, which ends at
+  /// the end of the file or covers CLUSTER_BLOCKS; the old blocks are freed
+  /// once the new ones are written. False if the disk is full, and then
+  /// the cluster is left as it was.
+  bool storeCluster(Inode &inode, BlockMap &map, uint32_t index, const char *data, size_t bytes);
+
+  /// read, write, truncate and punch holes in a compressed file, cluster
+  /// by cluster; the caller holds the inode lock and has the map
+  ssize_t readCompressed(uint32_t inumber, BlockMap &map, size_t size, char *data, size_t length, size_t offset);
+  ssize_t writeCompressed(uint32_t inumber, Inode &inode, BlockMap &map, const char *data, size_t length, size_t offset);
+  bool truncateCompressed(Inode &inode, BlockMap &map, size_t size);
+  bool punchCompressed(Inode &inode, BlockMap &map, size_t offset, size_t end);
+
+  /// the cluster of `inumber` kept decompressed, if any
+  std::shared_ptr<const Cluster> getCachedCluster(uint32_t inumber);
+  void cacheCluster(uint32_t inumber, const std::shared_ptr<const Cluster> &cluster);
+  void dropCluster(uint32_t inumber);
+
+  /// data blocks a dedup write has yet to write, by block number
+  typedef std::unordered_map<uint32_t, const char *> PendingWrites;
+
+  /// write a file whose blocks may be shared block by block
+  ssize_t writeShared(uint32_t inumber, Inode &inode, BlockMap &map, const char *data, size_t length, size_t offset);
+
+  /// make inode block `index` hold `data`: with dedup a hole if it is all
+  /// zeros or an identical block if there is one, else the same block if
+  /// nothing else uses it, or else a new block. Blocks to write go to
+  /// `pending`. False if the disk is full, and then the block is left as it
+  /// was.
+  bool storeSharedBlock(Inode &inode, BlockMap &map, uint32_t index, const char *data, PendingWrites &pending);
 
   /// alocate one free block and make them not free
   ssize_t allocateBlock() {
-    for (std::size_t i = 1; i < freeBlocks.size(); ++i) {
-      if (freeBlocks[i]) {
-        freeBlocks[i] = false;
-        return i;
-      }
+    std::lock_guard<std::mutex> guard(freeBlocksLock);
+    auto blk = freeBlocks.allocate();
+    if (blk != -1) {
+      markBitmapDirty(blk);
     }
-    return -1;
+    return blk;
   }
 
-  uint32_t blockCount(const Inode &inode) const {
+  /// allocate up to `n` contiguous free blocks; `length` receives how many.
+  /// With a `goal` the run continues at it if it can, or else is the
+  /// first run long enough
+  ssize_t allocateRun(uint32_t n, size_t &length, ssize_t goal = -1) {
+    std::lock_guard<std::mutex> guard(freeBlocksLock);
+    auto start = goal < 0 ? freeBlocks.allocateRun(n, length) : freeBlocks.allocateExtent(n, goal, length);
+    for (size_t i = 0; i < length; ++i) {
+      markBitmapDirty(start + i);
+    }
+    return start;
+  }
+
+  /// remember that the on-disk bitmap block covering `index` is stale;
+  /// the caller holds freeBlocksLock
+  void markBitmapDirty(uint32_t index) {
+    if (!dirtyBitmapBlocks.empty()) {
+      dirtyBitmapBlocks[index / BITS_PER_BLOCK] = true;
+    }
+  }
+
+  /// data blocks an inode maps; inline contents take none
+  static uint32_t blockCount(const Inode &inode) {
+    if (inode.Flags & INODE_INLINE_DATA) {
+      return 0;
+    }
     return (inode.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
   }
 
   /// make `index` to be a free block
   void reclaimBlock(uint32_t index) {
-    freeBlocks[index] = true;
+    if (journal) {
+      journal->revoke(index);
+    }
+    if (hasFeature(FEATURE_CHECKSUMS)) {
+      std::lock_guard<std::mutex> guard(checksumsLock);
+      if (checksums[index] != 0) {
+        checksums[index] = 0;
+        markChecksumDirty(index);
+      }
+    }
+    std::lock_guard<std::mutex> guard(freeBlocksLock);
+    freeBlocks.set(index);
+    markBitmapDirty(index);
   }
 
-  ssize_t allocateBlockForInode(Inode &inode);
+  /// point inode block `index` of the map, a hole so far, at the allocated
+  /// data block `blk`; the caller reserves map blocks with
+  /// reserveMapBlocks first
+  ssize_t allocateBlockForInode(Inode &inode, BlockMap &map, uint32_t index, uint32_t blk);
+
+  /// allocate the leaf that inode block `index` needs, and the pointer
+  /// blocks above it, if they are missing; returns how many were
+  /// allocated, or -1 if the disk is full
+  int reserveMapBlocks(Inode &inode, BlockMap &map, uint32_t index);
+
+  /// free the leaves of `map` from the one holding inode block `first` on
+  /// (up to the one holding `last`) that map only holes or lie past the
+  /// end, and the pointer blocks above them left with nothing to point to
+  void releaseMapBlocks(Inode &inode, BlockMap &map, uint32_t first, uint32_t last = UINT32_MAX);
+
+  /// point inode blocks [first, first + blocks.size()) of `map` at
+  /// `blocks`, 0 for a hole; the caller reserves the leaves of the others.
+  /// False if the extents would not fit, and then nothing changed.
+  bool replaceMapBlocks(Inode &inode, BlockMap &map, size_t first, const std::vector<uint32_t> &blocks);
+
+  /// give the file its own copy of the pointer blocks on the way to inode
+  /// blocks [first, last] that it shares, so they can be changed; false if
+  /// the disk is full
+  bool unshareMapRange(Inode &inode, BlockMap &map, uint32_t first, uint32_t last);
+
+  /// replace the shared pointer block `blk` (at `level`, as for
+  /// releaseMapBlock) by a copy of it; false if the disk is full
+  bool copySharedBlock(uint32_t &blk, int level);
+
+  /// holes from inode block `index` on that can be filled before
+  /// reserveMapBlocks has to allocate another block
+  uint32_t getMapRoom(const BlockMap &map, uint32_t index) const;
+
+  /// whether `blk` following `prev` in a block map continues an extent;
+  /// holes (block 0) make runs of their own
+  static bool continuesRun(uint32_t prev, uint32_t blk) {
+    return prev == 0 ? blk == 0 : blk == prev + 1;
+  }
+
+  /// runs of consecutive data blocks in `blocks`; holes take none but
+  /// end the run before them
+  static uint32_t countDataRuns(const std::vector<uint32_t> &blocks) {
+    uint32_t runs = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      runs += blocks[i] != 0 && (i == 0 || blocks[i] != blocks[i - 1] + 1 || blocks[i - 1] == 0);
+    }
+    return runs;
+  }
+
+  /// allocate the overflow blocks that the runs of `map` need; false if
+  /// the disk is full
+  bool reserveExtentBlocks(BlockMap &map);
+
+  /// make `map` cover `blocks` inode blocks, adding holes or freeing the
+  /// blocks past the new end; false if the disk is too full for the hole
+  bool resizeBlockMap(Inode &inode, BlockMap &map, uint32_t blocks);
 
-  void initFreeBlocks_forInodeBlock(const Inode (&inodes)[INODES_PER_BLOCK]);
+  /// move inline contents of `inode` to a first data block; false if the
+  /// disk is full
+  bool spillInline(Inode &inode, BlockMap &map);
+
+  /// zero bytes [from, to) of the file, all within one block, unless that
+  /// block is a hole; false if a shared block could not be copied
+  bool zeroBlockRange(Inode &inode, BlockMap &map, size_t from, size_t to);
+
+  /// claim every block used by the inodes of one inode block
+  void initFreeBlocks_forInodeBlock(const Block &block, ScanState &state);
+
+  /// claim the blocks of one inode; a pointer block another inode shares
+  /// is claimed again, but what it points to only the first time
+  void claimInodeBlocks(const Inode &inode, ScanState &state);
+
+  /// mark `blk` as used in `state`, remembering it if it already was
+  static void claimBlock(ScanState &state, uint32_t blk) {
+    // a hole has no block, and a pointer past the end of the disk cannot
+    // be claimed
+    if (blk == 0 || blk >= state.Claimed.size()) {
+      return;
+    }
+    if (state.Claimed.test(blk)) {
+      state.Duplicates.push_back(blk);
+    }
+    state.Claimed.set(blk);
+  }
+
+  /// the same for a data or pointer block (its `kind`), which may be
+  /// shared if the file system counts references
+  static void claimSharedBlock(ScanState &state, Bitmap &kind, uint32_t blk) {
+    if (blk == 0 || blk >= state.Claimed.size()) {
+      return;
+    }
+    if (state.Claimed.test(blk)) {
+      const bool shared = kind.size() > 0 && kind.test(blk);
+      (shared ? state.Shared : state.Duplicates).push_back(blk);
+      return;
+    }
+    state.Claimed.set(blk);
+    if (kind.size() > 0) {
+      kind.set(blk);
+    }
+  }
 
   // TODO: Internal member variables
   Disk *disk = nullptr;
+  // Superblock of the mounted file system
+  SuperBlock superblock;
   // Bitmap for freeblocks, true indicating free
-  std::vector<bool> freeBlocks;
+  Bitmap freeBlocks;
+  // Bitmap blocks whose on-disk copy is out of date (empty without a bitmap)
+  std::vector<bool> dirtyBitmapBlocks;
+  // Protects freeBlocks and dirtyBitmapBlocks
+  std::mutex freeBlocksLock;
+  // Inode table of the mounted file system, one shard per inode block
+  std::unique_ptr<InodeShard[]> inodeShards;
+  // Bitmap for inodes, true indicating free
+  Bitmap freeInodes;
+  // Protects freeInodes
+  std::mutex freeInodesLock;
+  // Per-inode reader/writer locks, shared by inodes with the same hash
+  RWLock inodeLocks[INODE_LOCKS];
+  // Block maps of recently used inodes, clean between calls
+  std::unordered_map<uint32_t, std::shared_ptr<BlockMap>> blockMaps;
+  // Protects blockMaps
+  std::mutex blockMapsLock;
+  // Serializes sync so metadata blocks are written in order
+  std::mutex syncLock;
+  // Held shared while inodes are created, cloned or removed, and
+  // exclusively while the snapshots change or the inode table is rolled back
+  RWLock tableLock;
+  // Metadata journal, if the file system has one
+  std::unique_ptr<Journal> journal;
+  // Transactions replayed by the last mount
+  size_t journalReplayed = 0;
+  // Threads used to scan the inode table on mount, 0 means one per CPU
+  size_t mountThreads = 0;
+  // Blocks found claimed more than once by the last mount scan
+  std::vector<uint32_t> duplicateBlocks;
+  // Readahead state of recently read inodes
+  std::unordered_map<uint32_t, std::shared_ptr<Readahead>> readaheads;
+  // Protects readaheads
+  std::mutex readaheadsLock;
+  // Largest readahead window in blocks, 0 disables readahead
+  std::atomic<size_t> readaheadMax{0};
+  // Prefetched blocks that a later read used
+  std::atomic<size_t> readaheadHits{0};
+  // Prefetched blocks dropped without being read
+  std::atomic<size_t> readaheadWasted{0};
+  // Last cluster used of recently used compressed files
+  std::unordered_map<uint32_t, std::shared_ptr<const Cluster>> clusters;
+  // Protects clusters
+  std::mutex clustersLock;
+  // Bytes of clusters written to compressed files, and of the blocks they took
+  std::atomic<size_t> compressionInput{0};
+  std::atomic<size_t> compressionOutput{0};
+  // Time spent compressing and decompressing clusters
+  std::atomic<uint64_t> codecNanoseconds{0};
+  // Block reference table, one entry per block, with dedup
+  std::vector<RefEntry> refs;
+  // Counted data blocks by the hash of their contents
+  std::unordered_map<uint64_t, uint32_t> dedupIndex;
+  // Reference table blocks whose on-disk copy is out of date
+  std::vector<bool> dirtyRefBlocks;
+  // Protects refs, dedupIndex and dirtyRefBlocks
+  std::mutex refsLock;
+  // Blocks written that an identical block was found for
+  std::atomic<size_t> dedupHits{0};
+  // Checksum table, one entry per block, 0 for blocks without one
+  std::vector<uint32_t> checksums;
+  // Checksum table blocks whose on-disk copy is out of date
+  std::vector<bool> dirtyChecksumBlocks;
+  // Regions of the checksum table whose data blocks may be newer than
+  // their entries on disk, as kept in the superblock block: a region is
+  // marked there before its first data write, and unmarked once a sync has
+  // written the table after that write, so a mount after a crash only has
+  // to recompute the entries of marked regions
+  std::vector<bool> checksumRegions;
+  // Regions written since the current sync began
+  std::vector<bool> writtenRegions;
+  // Data writes in flight to each region
+  std::vector<uint32_t> busyRegions;
+  // Protects checksums, dirtyChecksumBlocks and the regions above
+  std::mutex checksumsLock;
+  // Blocks read that did not match their checksum
+  std::atomic<size_t> checksumErrors{0};
+  // Entries the last mount found out of date in marked regions
+  size_t checksumsRecomputed = 0;
 
 public:
+  ~FileSystem() { unmount(); }
+
   static void debug(Disk *disk);
-  static bool format(Disk *disk);
+  /// write a new, empty file system; a fast format only clears the inode
+  /// table and leaves data blocks as they are, since nothing reads a data
+  /// block before it has been written. `journal` reserves a metadata
+  /// journal on disks large enough for one; `features` may add
+  /// FEATURE_EXTENTS to map files with extents, FEATURE_LARGE_FILES for
+  /// 64-bit sizes and double and triple indirect blocks, and
+  /// FEATURE_INLINE_DATA (which implies large files) to keep small files
+  /// in their inode, FEATURE_COMPRESSION (which does too) to compress new
+  /// files, FEATURE_DEDUP (not with compression) to share identical data
+  /// blocks, FEATURE_CLONES (nor with it) for clone() and snapshots, and
+  /// FEATURE_CHECKSUMS to checksum data blocks.
+  static bool format(Disk *disk, bool fast = false, bool journal = true, uint32_t features = 0);
 
   bool mount(Disk *disk);
+  void unmount();
+  /// write back metadata, committing it to the journal if there is one
+  void sync();
+  /// copy journaled metadata to its home blocks now
+  void checkpoint();
 
   ssize_t create();
   bool remove(size_t inumber);
   ssize_t stat(size_t inumber);
 
+  /// create a file with the contents of `inumber` that shares its blocks
+  /// until either is written; block-mapped files share their pointer
+  /// blocks too, so this takes a constant number of count updates
+  ssize_t clone(size_t inumber);
+
+  /// save a copy of the inode table that shares every file's blocks, and
+  /// return its number; -1 if the disk or the snapshot table is full
+  ssize_t snapshot();
+  /// make the inode table what it was when snapshot `id` was taken
+  bool rollback(size_t id);
+  /// delete snapshot `id`, freeing the blocks only it still uses
+  bool removeSnapshot(size_t id);
+  /// numbers of the snapshots there are
+  std::vector<size_t> getSnapshots();
+
+  /// writes may start past the end of the file; the blocks in between are
+  /// left as holes, which read back as zeros and take no space
   ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
   ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+  /// set the size of a file, freeing the blocks past a smaller one or
+  /// leaving a hole up to a larger one
+  bool truncate(size_t inumber, size_t size);
+  /// free the blocks wholly inside [offset, offset + length) of a file and
+  /// zero the rest of the range; the size does not change
+  bool punchHole(size_t inumber, size_t offset, size_t length);
+
+  /// runs of consecutive data blocks that a file is stored in, which is
+  /// how many seeks reading it through takes; -1 if it is not valid
+  ssize_t getRuns(size_t inumber);
+  /// move the data blocks of a file into as few runs as the free space
+  /// allows, and return how many runs it takes then; -1 if it is not
+  /// valid or one of its blocks does not match its checksum. Blocks
+  /// shared with other files stay where they are.
+  ssize_t defragment(size_t inumber);
+
+  /// inodes in the inode table, valid or not
+  size_t getInodeCount() const { return disk ? superblock.Inodes : 0; }
+
+  /// whether the mounted file system has a journal, and how many of its
+  /// transactions the mount replayed
+  bool hasJournal() const { return journal != nullptr; }
+  size_t getJournalReplayed() const { return journalReplayed; }
+  size_t getJournalCommits() const { return journal ? journal->commits() : 0; }
+
+  /// threads that read the inode table on mount and check (0 means one
+  /// per CPU)
+  size_t getMountThreads() const { return mountThreads; }
+  void setMountThreads(size_t threads) { mountThreads = threads; }
+
+  /// blocks that more than one inode (or an inode and the metadata) point
+  /// to, as found by the last mount that had to scan the inode table
+  const std::vector<uint32_t> &getDuplicateBlocks() const { return duplicateBlocks; }
+
+  /// largest readahead window in blocks (0 means disabled)
+  size_t getReadahead() const { return readaheadMax; }
+  void setReadahead(size_t blocks);
+  size_t getReadaheadHits() const { return readaheadHits; }
+  size_t getReadaheadWasted() const { return readaheadWasted; }
+
+  /// bytes of clusters written to compressed files, the bytes of blocks
+  /// they took on disk, and the time spent in the codec either way
+  size_t getCompressionInput() const { return compressionInput; }
+  size_t getCompressionOutput() const { return compressionOutput; }
+  double getCodecSeconds() const { return codecNanoseconds / 1e9; }
+
+  /// blocks written that were found on disk already and shared instead
+  size_t getDedupHits() const { return dedupHits; }
+
+  /// check the blocks with a checksum among [first, first + count) against
+  /// it, adding those that do not match to `corrupt`, and return how many
+  /// were checked. Writers wait while a batch is read, so a large image is
+  /// best scrubbed a few thousand blocks at a time.
+  size_t scrub(size_t first, size_t count, std::vector<uint32_t> &corrupt);
+
+  /// blocks that reads and scrubs found not to match their checksum
+  size_t getChecksumErrors() const { return checksumErrors; }
+
+  /// checksums the last mount recomputed after a crash, for blocks written
+  /// after the table was last synced
+  size_t getChecksumsRecomputed() const { return checksumsRecomputed; }
+
+  /// what check() found
+  struct CheckReport {
+    std::vector<std::string> Problems; // one line for each problem
+    size_t Inodes = 0;                 // files in use
+    size_t Blocks = 0;                 // blocks in use, metadata included
+    bool Clean = false;                // the image was unmounted cleanly, so
+                                       // its bitmap and tables were checked
+  };
+
+  /// check an image that is not mounted: that every pointer of its files
+  /// and snapshots is in range and within the file's size, that no block
+  /// is used twice unless it is counted as shared, and after a clean
+  /// unmount that the bitmap, reference counts and checksum table agree
+  /// with that. Only metadata is read, never file data, and the inode
+  /// table is split between getMountThreads() workers. The journal is
+  /// replayed first, as mount would, which is the only write made without
+  /// `repair`. With `repair` every problem is fixed:
+  /// bad pointers are cleared (a bad extent becomes a hole, and of two
+  /// files using a block, whichever the scan reached second loses it),
+  /// sizes and flags are cut down to what the image allows, damaged
+  /// snapshots are removed and the tables are rewritten. False if the
+  /// superblock is not valid, and then nothing else is looked at.
+  bool check(Disk *disk, bool repair, CheckReport &report);
 };
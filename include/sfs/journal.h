@@ -0,0 +1,166 @@
+// journal.h: Metadata write-ahead journal
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Metadata blocks are logged into a running transaction, committed to a
+// circular region of the disk in groups, and copied to their home blocks
+// later by a checkpoint thread. Mount replays committed transactions that
+// were not checkpointed yet.
+//
+// Block 0 of the region is a header naming the oldest transaction still
+// needed; the rest is the log. A transaction is one or more descriptor
+// blocks, each listing home blocks and followed by the logged copies of
+// them, and a single commit block with a checksum of all of them, so a
+// commit is replayed whole or not at all.
+class Journal {
+public:
+    const static uint32_t HEADER_MAGIC	    = 0x4a524e48;
+    const static uint32_t DESCRIPTOR_MAGIC  = 0x4a524e44;
+    const static uint32_t COMMIT_MAGIC	    = 0x4a524e43;
+
+    // Home blocks listed by one descriptor
+    const static size_t DESCRIPTOR_BLOCKS = Disk::BLOCK_SIZE / sizeof(uint32_t) - 3;
+
+    // Smallest usable region: header, descriptor, one block and commit
+    const static size_t MIN_BLOCKS = 4;
+
+    // Log blocks taken by a transaction of `count` blocks
+    static size_t transaction_blocks(size_t count) {
+    	return count + (count + DESCRIPTOR_BLOCKS - 1) / DESCRIPTOR_BLOCKS + 1;
+    }
+
+private:
+    struct Header {
+    	uint32_t    Magic;	// HEADER_MAGIC
+    	uint32_t    Sequence;	// Sequence number of the transaction at Head
+    	uint32_t    Head;	// Log position of the oldest needed transaction
+    };
+
+    struct Descriptor {
+    	uint32_t    Magic;	// DESCRIPTOR_MAGIC
+    	uint32_t    Sequence;	// Sequence number of the transaction
+    	uint32_t    Count;	// Number of logged blocks that follow
+    	uint32_t    Blocks[DESCRIPTOR_BLOCKS]; // Home block of each of them
+    };
+
+    struct Commit {
+    	uint32_t    Magic;	// COMMIT_MAGIC
+    	uint32_t    Sequence;	// Sequence number of the transaction
+    	uint32_t    Count;	// Number of logged blocks
+    	uint32_t    Checksum;	// checksum() of the descriptor and blocks
+    };
+
+    typedef std::map<uint32_t, std::vector<char>> BlockMap;
+
+    Disk       *Device;	    // Disk holding the region
+    uint32_t	Start;	    // First block of the region (the header)
+    uint32_t	Length;	    // Number of log blocks after the header
+    uint32_t	Head;	    // Log position of the oldest needed transaction
+    uint32_t	Tail;	    // Log position of the next transaction
+    uint32_t	Used;	    // Log blocks between Head and Tail
+    uint32_t	Sequence;   // Sequence number of the next transaction
+    uint32_t	HeadSequence; // Sequence number of the transaction at Head
+
+    BlockMap	Running;    // Logged blocks not yet committed
+    BlockMap	Committing; // Blocks being written by commit
+    BlockMap	Committed;  // Newest committed copy of blocks not checkpointed
+    std::mutex	Lock;	    // Protects the three maps above
+
+    std::mutex	CommitLock; // Serializes commit, checkpoint and log space
+
+    std::thread		    Checkpointer;   // Background checkpoint thread
+    std::condition_variable Wakeup;	    // Wakes the checkpoint thread
+    bool		    Stopping;	    // Tells the checkpoint thread to exit
+
+    std::atomic<size_t> Commits;	// Number of transactions committed
+    std::atomic<size_t> LoggedBlocks;	// Number of blocks written to the log
+    std::atomic<size_t> Checkpoints;	// Number of checkpoints taken
+    std::atomic<size_t> Oversized;	// Number of commits too large for the log
+
+    // Absolute block of log position
+    // @param	position    Log position (wraps around)
+    int block(uint32_t position) const { return Start + 1 + position % Length; }
+
+    // Checksum of one transaction
+    // @param	descriptors Descriptors of the transaction
+    // @param	blocks	    Logged blocks, in descriptor order
+    static uint32_t checksum(const std::vector<Descriptor> &descriptors, const std::vector<const char *> &blocks);
+
+    // Write header naming Head and HeadSequence
+    void write_header();
+
+    // Write Committing to the log as one transaction (CommitLock held)
+    void write_transaction();
+
+    // Copy committed blocks home and empty the log (CommitLock held)
+    void checkpoint_locked();
+
+    // Body of the checkpoint thread
+    void work();
+
+public:
+    // Constructor; starts the checkpoint thread
+    // @param	disk	    Disk holding the region
+    // @param	start	    First block of the region
+    // @param	blocks	    Number of blocks in the region
+    Journal(Disk *disk, uint32_t start, uint32_t blocks);
+
+    // Destructor; checkpoints everything committed and stops the thread
+    ~Journal();
+
+    // Write an empty journal header (the rest of the region is ignored)
+    // @param	disk	    Disk holding the region
+    // @param	start	    First block of the region
+    static void format(Disk *disk, uint32_t start);
+
+    // Copy committed transactions that were not checkpointed to their home
+    // blocks and empty the log. Call before reading any metadata.
+    // Returns number of transactions replayed.
+    size_t replay();
+
+    // Add block to the running transaction, replacing an older copy; the
+    // transaction is only committed by commit
+    // @param	blocknum    Home block
+    // @param	data	    New contents (BLOCK_SIZE bytes)
+    void log(uint32_t blocknum, const char *data);
+
+    // Return whether the running transaction takes half of the log, so the
+    // caller should commit at the next point where its metadata agrees
+    bool crowded();
+
+    // Copy newest logged contents of block that has not reached home yet
+    // @param	blocknum    Home block
+    // @param	data	    Buffer to copy into
+    // Returns whether or not block was in the journal.
+    bool lookup(uint32_t blocknum, char *data);
+
+    // Forget block that is about to be freed, so no logged copy can land
+    // on it once it is reused for data
+    // @param	blocknum    Home block
+    void revoke(uint32_t blocknum);
+
+    // Commit the running transaction, after writing back the disk's
+    // cached blocks so no committed metadata points at unwritten data. A
+    // transaction larger than the whole log cannot be made atomic, and is
+    // written home after a checkpoint as it would be without a journal.
+    void commit();
+
+    // Copy everything committed to its home blocks now
+    void checkpoint();
+
+    // Return statistics
+    size_t commits() const { return Commits; }
+    size_t logged_blocks() const { return LoggedBlocks; }
+    size_t checkpoints() const { return Checkpoints; }
+    size_t oversized() const { return Oversized; }
+};
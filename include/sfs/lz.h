@@ -0,0 +1,34 @@
+// lz.h: LZ77 block compression
+
+#pragma once
+
+#include <cstdint>
+
+#include <stdlib.h>
+
+// A byte-oriented LZ77 codec in the style of LZ4: a sequence is a token
+// byte holding a literal length and a match length, the literals, and a
+// 16-bit match offset. It needs no dictionary or state between calls.
+namespace LZ {
+    // Shortest match worth encoding
+    const size_t MIN_MATCH = 4;
+    // Farthest back a match may start
+    const size_t MAX_OFFSET = 65535;
+
+    // Compress buffer
+    // @param	src	    Data to compress
+    // @param	length	    Number of bytes of src
+    // @param	dst	    Buffer for the compressed data
+    // @param	capacity    Size of dst
+    // @return	Number of bytes written to dst, or 0 if they would not fit
+    size_t compress(const char *src, size_t length, char *dst, size_t capacity);
+
+    // Decompress buffer
+    // @param	src	    Compressed data
+    // @param	srcLength   Number of bytes of src
+    // @param	dst	    Buffer for the original data
+    // @param	length	    Number of bytes the original data had
+    // @return	Whether or not src was well formed and decoded to exactly
+    //		length bytes
+    bool decompress(const char *src, size_t srcLength, char *dst, size_t length);
+}
@@ -0,0 +1,39 @@
+// mapped_disk.h: Memory-mapped disk emulator
+
+#pragma once
+
+#include "sfs/disk.h"
+
+class MappedDisk : public Disk {
+private:
+    char   *Mapping;	    // Disk image mapped into memory
+
+protected:
+    // Copy blocks out of the mapping
+    void read_blocks(int blocknum, struct iovec *iov, int iovcnt) override;
+
+    // Copy blocks into the mapping
+    void write_blocks(int blocknum, struct iovec *iov, int iovcnt) override;
+
+    // Write dirty pages of the mapping back to the disk image
+    void flush() override;
+
+public:
+    // Default constructor
+    MappedDisk() : Mapping(nullptr) {}
+
+    // Destructor
+    ~MappedDisk();
+
+    // Open and map disk image
+    // @param	path	    Path to disk image
+    // @param	nblocks	    Number of blocks in disk image
+    // Throws runtime_error exception on error.
+    void open(const char *path, size_t nblocks) override;
+
+    // Return pointer to a block inside the mapping for zero-copy access
+    // @param	blocknum    Block to access
+    // Any dirty cached copy is written back first; the pointer stays valid
+    // until the disk is destroyed. Counts as one block read.
+    const char *block(int blocknum);
+};
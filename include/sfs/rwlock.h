@@ -0,0 +1,38 @@
+// rwlock.h: Reader/writer lock
+
+#pragma once
+
+#include <pthread.h>
+
+class RWLock {
+private:
+    pthread_rwlock_t Lock;
+
+public:
+    RWLock() { pthread_rwlock_init(&Lock, NULL); }
+    ~RWLock() { pthread_rwlock_destroy(&Lock); }
+
+    RWLock(const RWLock &) = delete;
+    RWLock &operator=(const RWLock &) = delete;
+
+    // Exclusive access (usable with std::lock_guard)
+    void lock() { pthread_rwlock_wrlock(&Lock); }
+    void unlock() { pthread_rwlock_unlock(&Lock); }
+
+    // Shared access
+    void lock_shared() { pthread_rwlock_rdlock(&Lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&Lock); }
+};
+
+// Holds an RWLock in shared mode for the lifetime of the guard
+class SharedGuard {
+private:
+    RWLock &Lock;
+
+public:
+    SharedGuard(RWLock &lock) : Lock(lock) { Lock.lock_shared(); }
+    ~SharedGuard() { Lock.unlock_shared(); }
+
+    SharedGuard(const SharedGuard &) = delete;
+    SharedGuard &operator=(const SharedGuard &) = delete;
+};
@@ -0,0 +1,122 @@
+// aio_bench.cpp: Copyout throughput vs. queue depth for AsyncDisk
+
+#include "sfs/async_disk.h"
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct Result {
+    size_t  Depth;
+    bool    Uring;
+    double  Seconds;
+    size_t  Bytes;
+};
+
+// Fill a fresh image with as many maximum-size files as fit
+size_t populate(const char *path, size_t nblocks) {
+    const size_t fileSize = (FileSystem::POINTERS_PER_INODE + FileSystem::POINTERS_PER_BLOCK) * Disk::BLOCK_SIZE;
+
+    Disk disk;
+    disk.open(path, nblocks);
+    FileSystem::format(&disk);
+
+    FileSystem fs;
+    fs.mount(&disk);
+
+    std::vector<char> data(fileSize);
+    for (size_t i = 0; i < data.size(); i++) {
+    	data[i] = rand();
+    }
+
+    size_t files = 0;
+    while (true) {
+    	ssize_t inumber = fs.create();
+    	if (inumber < 0) {
+    	    break;
+	}
+    	ssize_t written = fs.write(inumber, data.data(), data.size(), 0);
+    	if (written < (ssize_t)data.size()) {
+    	    fs.remove(inumber);
+    	    break;
+	}
+    	files++;
+    }
+    return files;
+}
+
+// Drop the image from the page cache so every run starts cold
+void evict(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+    	return;
+    }
+    fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+}
+
+Result copyout(const char *path, size_t nblocks, size_t depth, size_t files, size_t chunk) {
+    evict(path);
+
+    AsyncDisk disk(depth);
+    disk.open(path, nblocks);
+
+    FileSystem fs;
+    fs.mount(&disk);
+
+    std::vector<char> buffer(chunk);
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t inumber = 0; inumber < files; inumber++) {
+    	size_t offset = 0;
+    	ssize_t result;
+    	while ((result = fs.read(inumber, buffer.data(), buffer.size(), offset)) > 0) {
+    	    offset += result;
+	}
+    	bytes += offset;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return Result{depth, disk.uring(), elapsed.count(), bytes};
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/aio_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 16384;
+    size_t	chunk	= argc > 3 ? atoi(argv[3]) : (4 << 20);
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [chunk bytes]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    try {
+    	size_t files = populate(path, nblocks);
+    	for (size_t depth = 1; depth <= 64; depth *= 2) {
+    	    results.push_back(copyout(path, nblocks, depth, files, chunk));
+	}
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-6s %-8s %12s %12s\n", "depth", "engine", "MiB", "MiB/s");
+    for (auto &result : results) {
+    	printf("%-6lu %-8s %12.1f %12.1f\n", result.Depth, result.Uring ? "io_uring" : "threads",
+    	       result.Bytes / 1048576.0, result.Bytes / 1048576.0 / result.Seconds);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
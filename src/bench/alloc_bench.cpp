@@ -0,0 +1,102 @@
+// alloc_bench.cpp: Allocate/reclaim throughput of the free-block bitmap
+
+#include "sfs/bitmap.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// The allocator FileSystem used before Bitmap: a linear scan from block 1
+class LinearAllocator {
+private:
+    std::vector<bool> FreeBlocks;
+
+public:
+    LinearAllocator(size_t bits) : FreeBlocks(bits, true) {}
+
+    ssize_t allocate() {
+    	for (size_t i = 1; i < FreeBlocks.size(); ++i) {
+    	    if (FreeBlocks[i]) {
+    	    	FreeBlocks[i] = false;
+    	    	return i;
+	    }
+	}
+    	return -1;
+    }
+
+    void reclaim(size_t index) { FreeBlocks[index] = true; }
+
+    void take(size_t index) { FreeBlocks[index] = false; }
+};
+
+class BitmapAllocator {
+private:
+    Bitmap FreeBlocks;
+
+public:
+    BitmapAllocator(size_t bits) : FreeBlocks(bits, true) { FreeBlocks.reset(0); }
+
+    ssize_t allocate() { return FreeBlocks.allocate(); }
+
+    void reclaim(size_t index) { FreeBlocks.set(index); }
+
+    void take(size_t index) { FreeBlocks.reset(index); }
+};
+
+// Fill the allocator to `fill`, then time `ops` reclaim + allocate pairs of
+// random blocks. Returns nanoseconds per pair.
+template <typename Allocator>
+double churn(size_t bits, double fill, size_t ops) {
+    Allocator allocator(bits);
+    std::vector<size_t> allocated;
+    for (size_t i = 1; i < bits * fill; i++) {
+    	allocator.take(i);
+    	allocated.push_back(i);
+    }
+
+    std::mt19937 random(42);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t op = 0; op < ops; op++) {
+    	size_t victim = random() % allocated.size();
+    	allocator.reclaim(allocated[victim]);
+    	allocated[victim] = allocator.allocate();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / ops;
+}
+
+// Time allocating every block of an empty allocator. Returns nanoseconds
+// per allocation.
+template <typename Allocator>
+double fill(size_t bits) {
+    Allocator allocator(bits);
+    auto start = std::chrono::steady_clock::now();
+    while (allocator.allocate() != -1);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / bits;
+}
+
+int main(int argc, char *argv[]) {
+    size_t bits = argc > 1 ? atol(argv[1]) : (1 << 20);
+    size_t ops  = argc > 2 ? atol(argv[2]) : 200;
+
+    if (argc > 3) {
+    	fprintf(stderr, "Usage: %s [blocks] [operations]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    // The linear fill is quadratic, so it only runs on a slice of the disk
+    size_t slice = bits < 16384 ? bits : 16384;
+
+    printf("%-28s %14s %14s\n", "workload (ns/op)", "linear", "bitmap");
+    printf("%-28s %14.1f %14.1f\n", "fill (16K blocks)", fill<LinearAllocator>(slice), fill<BitmapAllocator>(slice));
+    for (double full : {0.5, 0.9, 0.99}) {
+    	char name[64];
+    	snprintf(name, sizeof(name), "churn %zu blocks, %2.0f%% full", bits, full * 100);
+    	printf("%-28s %14.1f %14.1f\n", name, churn<LinearAllocator>(bits, full, ops), churn<BitmapAllocator>(bits, full, ops));
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+// checksum_bench.cpp: Throughput of the CRC-32C kernels over 4 KiB blocks, in GB/s
+
+#include "sfs/crc32c.h"
+#include "sfs/disk.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct Result {
+    const char *Name;
+    double	Seconds;	// Time to checksum every block once per round
+    uint32_t	Checksum;	// Checksum of the checksums, to compare the kernels
+};
+
+// A byte at a time with one table, as the baseline the others replace
+uint32_t computeBytewise(const char *data, size_t length, uint32_t crc) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+    	for (uint32_t b = 0; b < 256; b++) {
+    	    uint32_t entry = b;
+    	    for (int bit = 0; bit < 8; bit++) {
+    	    	entry = entry & 1 ? (entry >> 1) ^ 0x82f63b78 : entry >> 1;
+	    }
+    	    table[b] = entry;
+	}
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+    	crc = (crc >> 8) ^ table[(crc ^ (unsigned char)data[i]) & 0xff];
+    }
+    return ~crc;
+}
+
+Result run(const std::vector<char> &data, size_t rounds, uint32_t (*kernel)(const char *, size_t, uint32_t), const char *name) {
+    Result result{name, 0, 0};
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; round++) {
+    	for (size_t offset = 0; offset < data.size(); offset += Disk::BLOCK_SIZE) {
+    	    uint32_t crc = kernel(data.data() + offset, Disk::BLOCK_SIZE, 0);
+    	    result.Checksum = computeBytewise((const char *)&crc, sizeof(crc), result.Checksum);
+	}
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Seconds = elapsed.count();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    // By default the blocks fit in the CPU caches, so this measures the
+    // kernels rather than memory bandwidth
+    size_t bytes  = argc > 1 ? atol(argv[1]) << 20 : 1ul << 20;
+    size_t rounds = argc > 2 ? atoi(argv[2]) : 1024;
+
+    if (argc > 3 || bytes == 0 || rounds == 0) {
+    	fprintf(stderr, "Usage: %s [MiB] [rounds]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    // Random blocks, so nothing about the data helps any kernel
+    std::vector<char> data(bytes / Disk::BLOCK_SIZE * Disk::BLOCK_SIZE);
+    std::mt19937 random(1);
+    for (auto &c : data) {
+    	c = random();
+    }
+
+    std::vector<Result> results;
+    results.push_back(run(data, rounds, computeBytewise, "bytewise"));
+    results.push_back(run(data, rounds, CRC32C::computeTable, "table"));
+    if (CRC32C::hardware()) {
+    	results.push_back(run(data, rounds, CRC32C::computeHardware, "sse4.2"));
+    }
+
+    printf("\n%-10s %10s %10s %10s\n", "kernel", "ms", "GB/s", "checksum");
+    for (auto &result : results) {
+    	printf("%-10s %10.1f %10.2f %10x\n", result.Name, result.Seconds * 1e3,
+    	       data.size() * rounds / result.Seconds / 1e9, result.Checksum);
+    }
+    printf("compute() uses %s\n", CRC32C::hardware() ? "sse4.2" : "table");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+// clone_bench.cpp: Disk I/O and time to copy a large file, copied through the file system vs. cloned
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const size_t CHUNK = 1 << 20;
+
+// After the copy is made, about one block in CHANGED of it is overwritten
+const size_t CHANGED = 100;
+
+struct Result {
+    const char *Name;
+    size_t	Writes;		// Disk writes to make the copy, including the sync
+    size_t	Reads;		// Disk reads to make it
+    double	Seconds;	// Time to make it
+    size_t	ChangeWrites;	// Disk writes to then change a few of its blocks
+    double	ChangeSeconds;	// Time to change them
+};
+
+// Write a `bytes` file, then copy it either by reading it back and writing
+// a new file in 1 MiB chunks or with clone(), and overwrite a few scattered
+// blocks of the copy
+Result run(const char *path, size_t nblocks, uint32_t features, size_t bytes, bool clone, const char *name) {
+    Result result{name, 0, 0, 0, 0, 0};
+    Disk disk;
+    disk.open(path, nblocks);
+    if (!FileSystem::format(&disk, true, true, features)) {
+    	throw std::runtime_error("format failed");
+    }
+
+    FileSystem fs;
+    fs.mount(&disk);
+    ssize_t source = fs.create();
+    std::vector<char> data(CHUNK);
+    std::mt19937 random(1);
+    for (size_t offset = 0; offset < bytes; offset += CHUNK) {
+    	const size_t length = std::min(CHUNK, bytes - offset);
+    	for (size_t i = 0; i < length; i++) {
+    	    data[i] = random();
+	}
+    	if (fs.write(source, data.data(), length, offset) != (ssize_t)length) {
+    	    throw std::runtime_error("the image is too small for the file");
+	}
+    }
+    fs.sync();
+    disk.sync();
+
+    size_t writes = disk.writes();
+    size_t reads = disk.reads();
+    auto start = std::chrono::steady_clock::now();
+    ssize_t copy;
+    if (clone) {
+    	copy = fs.clone(source);
+    	if (copy < 0) {
+    	    throw std::runtime_error("clone failed");
+	}
+    } else {
+    	copy = fs.create();
+    	for (size_t offset = 0; offset < bytes; offset += CHUNK) {
+    	    const size_t length = std::min(CHUNK, bytes - offset);
+    	    if (fs.read(source, data.data(), length, offset) != (ssize_t)length ||
+    	    	fs.write(copy, data.data(), length, offset) != (ssize_t)length) {
+    	    	throw std::runtime_error("the image is too small for two copies");
+	    }
+	}
+    }
+    fs.sync();
+    disk.sync();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Writes = disk.writes() - writes;
+    result.Reads = disk.reads() - reads;
+    result.Seconds = elapsed.count();
+
+    writes = disk.writes();
+    start = std::chrono::steady_clock::now();
+    std::vector<char> block(Disk::BLOCK_SIZE, 1);
+    for (size_t blk = 0; blk < bytes / Disk::BLOCK_SIZE; blk += CHANGED) {
+    	if (fs.write(copy, block.data(), block.size(), blk * Disk::BLOCK_SIZE) != (ssize_t)block.size()) {
+    	    throw std::runtime_error("write to the copy failed");
+	}
+    }
+    fs.sync();
+    disk.sync();
+    elapsed = std::chrono::steady_clock::now() - start;
+    result.ChangeWrites = disk.writes() - writes;
+    result.ChangeSeconds = elapsed.count();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/clone_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 262144;
+    size_t	bytes	= argc > 3 ? atol(argv[3]) << 20 : 256ul << 20;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [file MiB]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    const uint32_t pointers = FileSystem::FEATURE_LARGE_FILES | FileSystem::FEATURE_CLONES;
+    const uint32_t extents  = pointers | FileSystem::FEATURE_EXTENTS;
+    std::vector<Result> results;
+    try {
+    	results.push_back(run(path, nblocks, pointers, bytes, false, "copy"));
+    	results.push_back(run(path, nblocks, pointers, bytes, true, "clone"));
+    	results.push_back(run(path, nblocks, extents, bytes, false, "copy/ext"));
+    	results.push_back(run(path, nblocks, extents, bytes, true, "clone/ext"));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-10s %10s %10s %10s %12s %12s\n", "copy", "writes", "reads", "ms", "change wr", "change ms");
+    for (auto &result : results) {
+    	printf("%-10s %10lu %10lu %10.1f %12lu %12.1f\n", result.Name, result.Writes, result.Reads, result.Seconds * 1e3,
+    	       result.ChangeWrites, result.ChangeSeconds * 1e3);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
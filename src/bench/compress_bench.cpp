@@ -0,0 +1,126 @@
+// compress_bench.cpp: Disk I/O and time to write and read log-like text, plain vs. compressed
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const size_t CHUNK = 1 << 20;
+
+struct Result {
+    const char *Name;
+    size_t	Writes;		// Disk writes to save the file
+    size_t	Reads;		// Disk reads to read it back after a remount
+    double	WriteSeconds;	// Time to save it, including the sync
+    double	ReadSeconds;	// Time to read it back
+    double	Ratio;		// Bytes written per byte of blocks they took
+    double	CodecSeconds;	// Time spent compressing and decompressing
+};
+
+// Lines of a made-up server log
+std::string makeLog(size_t bytes) {
+    std::string log;
+    for (size_t i = 0; log.size() < bytes; i++) {
+    	char line[128];
+    	snprintf(line, sizeof(line), "2026-10-16 12:%02lu:%02lu INFO request %lu from 10.0.%lu.%lu served in %lums\n",
+    		 i / 60 % 60, i % 60, i * 7919 % 100000, i % 7, i * 13 % 251, i * 31 % 300);
+    	log += line;
+    }
+    log.resize(bytes);
+    return log;
+}
+
+// Write `log` in 1 MiB chunks, then remount with no block cache and read it
+// back in chunks of the same size
+Result run(const char *path, size_t nblocks, uint32_t features, const std::string &log, const char *name) {
+    Result result{name, 0, 0, 0, 0, 0, 0};
+    {
+    	Disk disk;
+    	disk.open(path, nblocks);
+    	if (!FileSystem::format(&disk, true, true, features)) {
+    	    throw std::runtime_error("format failed");
+	}
+
+    	FileSystem fs;
+    	fs.mount(&disk);
+    	ssize_t inumber = fs.create();
+
+    	const size_t before = disk.writes();
+    	auto start = std::chrono::steady_clock::now();
+    	for (size_t offset = 0; offset < log.size(); offset += CHUNK) {
+    	    const size_t length = std::min(CHUNK, log.size() - offset);
+    	    if (fs.write(inumber, (char *)log.data() + offset, length, offset) != (ssize_t)length) {
+    	    	throw std::runtime_error("the image is too small for the file");
+	    }
+	}
+    	fs.sync();
+    	disk.sync();
+    	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    	result.Writes = disk.writes() - before;
+    	result.WriteSeconds = elapsed.count();
+    	result.Ratio = fs.getCompressionOutput() ? (double)fs.getCompressionInput() / fs.getCompressionOutput() : 1;
+    	result.CodecSeconds = fs.getCodecSeconds();
+    }
+
+    Disk disk;
+    disk.open(path, nblocks);
+    disk.set_cache_size(0);
+
+    FileSystem fs;
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("mount failed");
+    }
+
+    std::vector<char> data(CHUNK);
+    const size_t before = disk.reads();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < log.size(); offset += CHUNK) {
+    	const size_t length = std::min(CHUNK, log.size() - offset);
+    	if (fs.read(0, data.data(), length, offset) != (ssize_t)length || log.compare(offset, length, data.data(), length) != 0) {
+    	    throw std::runtime_error("read failed");
+	}
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Reads = disk.reads() - before;
+    result.ReadSeconds = elapsed.count();
+    result.CodecSeconds += fs.getCodecSeconds();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/compress_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 65536;
+    size_t	bytes	= argc > 3 ? atol(argv[3]) << 20 : 128ul << 20;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [file MiB]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    const std::string log = makeLog(bytes);
+    std::vector<Result> results;
+    try {
+    	results.push_back(run(path, nblocks, FileSystem::FEATURE_LARGE_FILES, log, "plain"));
+    	results.push_back(run(path, nblocks, FileSystem::FEATURE_COMPRESSION, log, "compress"));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-9s %10s %10s %10s %10s %8s %10s\n", "file", "writes", "write ms", "reads", "read ms", "ratio", "codec ms");
+    for (auto &result : results) {
+    	printf("%-9s %10lu %10.1f %10lu %10.1f %8.2f %10.1f\n", result.Name, result.Writes, result.WriteSeconds * 1e3,
+    	       result.Reads, result.ReadSeconds * 1e3, result.Ratio, result.CodecSeconds * 1e3);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
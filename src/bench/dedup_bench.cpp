@@ -0,0 +1,139 @@
+// dedup_bench.cpp: Disk I/O and space to save near-identical images, plain vs. deduplicated
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const size_t CHUNK = 1 << 20;
+
+// Each copy changes about one block in CHANGED of the base image
+const size_t CHANGED = 100;
+
+struct Result {
+    const char *Name;
+    size_t	Writes;		// Disk writes to save the images
+    size_t	Stored;		// Data blocks they take
+    size_t	Reads;		// Disk reads to read them back after a remount
+    double	WriteSeconds;	// Time to save them, including the sync
+    double	ReadSeconds;	// Time to read them back
+};
+
+// A base image of random blocks, and copies of it with a few blocks changed
+std::vector<std::string> makeImages(size_t copies, size_t bytes) {
+    std::mt19937 random(1);
+    std::vector<std::string> images(copies, std::string(bytes, 0));
+    for (auto &c : images[0]) {
+    	c = random();
+    }
+    for (size_t i = 1; i < copies; i++) {
+    	images[i] = images[0];
+    	for (size_t blk = 0; blk < bytes / Disk::BLOCK_SIZE; blk++) {
+    	    if (random() % CHANGED == 0) {
+    	    	images[i][blk * Disk::BLOCK_SIZE + random() % Disk::BLOCK_SIZE] ^= 1;
+	    }
+	}
+    }
+    return images;
+}
+
+// Copy every image into its own file in 1 MiB chunks, then remount with no
+// block cache and read them all back in chunks of the same size
+Result run(const char *path, size_t nblocks, uint32_t features, const std::vector<std::string> &images, const char *name) {
+    Result result{name, 0, 0, 0, 0, 0};
+    {
+    	Disk disk;
+    	disk.open(path, nblocks);
+    	if (!FileSystem::format(&disk, true, true, features)) {
+    	    throw std::runtime_error("format failed");
+	}
+
+    	FileSystem fs;
+    	fs.mount(&disk);
+
+    	const size_t before = disk.writes();
+    	auto start = std::chrono::steady_clock::now();
+    	for (auto &image : images) {
+    	    ssize_t inumber = fs.create();
+    	    for (size_t offset = 0; offset < image.size(); offset += CHUNK) {
+    	    	const size_t length = std::min(CHUNK, image.size() - offset);
+    	    	if (fs.write(inumber, (char *)image.data() + offset, length, offset) != (ssize_t)length) {
+    	    	    throw std::runtime_error("the image is too small for the files");
+		}
+	    }
+	}
+    	fs.sync();
+    	disk.sync();
+    	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    	result.Writes = disk.writes() - before;
+    	result.WriteSeconds = elapsed.count();
+    	result.Stored = images.size() * ((images[0].size() + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE) - fs.getDedupHits();
+    }
+
+    Disk disk;
+    disk.open(path, nblocks);
+    disk.set_cache_size(0);
+
+    FileSystem fs;
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("mount failed");
+    }
+
+    std::vector<char> data(CHUNK);
+    const size_t before = disk.reads();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < images.size(); i++) {
+    	const auto &image = images[i];
+    	for (size_t offset = 0; offset < image.size(); offset += CHUNK) {
+    	    const size_t length = std::min(CHUNK, image.size() - offset);
+    	    if (fs.read(i, data.data(), length, offset) != (ssize_t)length || image.compare(offset, length, data.data(), length) != 0) {
+    	    	throw std::runtime_error("read failed");
+	    }
+	}
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Reads = disk.reads() - before;
+    result.ReadSeconds = elapsed.count();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/dedup_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 65536;
+    size_t	copies	= argc > 3 ? atoi(argv[3]) : 8;
+    size_t	bytes	= argc > 4 ? atol(argv[4]) << 20 : 16ul << 20;
+
+    if (argc > 5 || copies == 0) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [copies] [image MiB]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    const auto images = makeImages(copies, bytes);
+    std::vector<Result> results;
+    try {
+    	results.push_back(run(path, nblocks, FileSystem::FEATURE_EXTENTS | FileSystem::FEATURE_LARGE_FILES, images, "plain"));
+    	results.push_back(run(path, nblocks, FileSystem::FEATURE_EXTENTS | FileSystem::FEATURE_LARGE_FILES | FileSystem::FEATURE_DEDUP,
+    			      images, "dedup"));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-8s %10s %10s %10s %10s %10s\n", "images", "writes", "write ms", "stored", "reads", "read ms");
+    for (auto &result : results) {
+    	printf("%-8s %10lu %10.1f %10lu %10lu %10.1f\n", result.Name, result.Writes, result.WriteSeconds * 1e3,
+    	       result.Stored, result.Reads, result.ReadSeconds * 1e3);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
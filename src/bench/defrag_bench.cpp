@@ -0,0 +1,123 @@
+// defrag_bench.cpp: Runs and sequential read time of files written in interleaved chunks, before and after defragment
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const size_t CHUNK = 1 << 20;
+
+// Files are appended to in turn this many blocks at a time
+const size_t STRIDE = 4;
+
+struct Result {
+    const char *Name;
+    size_t	Runs;		// Runs the files take together
+    double	Seconds;	// Time to read them through after a remount
+};
+
+// Read every file through in 1 MiB chunks, with no block cache
+Result measure(const char *path, size_t nblocks, size_t files, size_t bytes, const char *name) {
+    Result result{name, 0, 0};
+    Disk disk;
+    disk.open(path, nblocks);
+    disk.set_cache_size(0);
+
+    FileSystem fs;
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("mount failed");
+    }
+
+    std::vector<char> data(CHUNK);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t inumber = 0; inumber < files; inumber++) {
+    	result.Runs += fs.getRuns(inumber);
+    	for (size_t offset = 0; offset < bytes; offset += CHUNK) {
+    	    const size_t length = std::min(CHUNK, bytes - offset);
+    	    if (fs.read(inumber, data.data(), length, offset) != (ssize_t)length) {
+    	    	throw std::runtime_error("read failed");
+	    }
+	}
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Seconds = elapsed.count();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/defrag_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 131072;
+    size_t	files	= argc > 3 ? atoi(argv[3]) : 4;
+    size_t	bytes	= argc > 4 ? atol(argv[4]) << 20 : 32ul << 20;
+
+    if (argc > 5 || files == 0) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [files] [file MiB]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    double defragSeconds = 0;
+    try {
+    	// The files grow side by side, so each one's blocks are spread out
+    	{
+    	    Disk disk;
+    	    disk.open(path, nblocks);
+    	    if (!FileSystem::format(&disk, true, true, FileSystem::FEATURE_LARGE_FILES)) {
+    	    	throw std::runtime_error("format failed");
+	    }
+    	    FileSystem fs;
+    	    fs.mount(&disk);
+    	    std::vector<char> data(STRIDE * Disk::BLOCK_SIZE);
+    	    for (auto &c : data) {
+    	    	c = rand();
+	    }
+    	    for (size_t i = 0; i < files; i++) {
+    	    	fs.create();
+	    }
+    	    for (size_t offset = 0; offset < bytes; offset += data.size()) {
+    	    	const size_t length = std::min(data.size(), bytes - offset);
+    	    	for (size_t inumber = 0; inumber < files; inumber++) {
+    	    	    if (fs.write(inumber, data.data(), length, offset) != (ssize_t)length) {
+    	    	    	throw std::runtime_error("the image is too small for the files");
+		    }
+		}
+	    }
+	}
+    	results.push_back(measure(path, nblocks, files, bytes, "before"));
+
+    	{
+    	    Disk disk;
+    	    disk.open(path, nblocks);
+    	    FileSystem fs;
+    	    fs.mount(&disk);
+    	    auto start = std::chrono::steady_clock::now();
+    	    for (size_t inumber = 0; inumber < files; inumber++) {
+    	    	fs.defragment(inumber);
+	    }
+    	    fs.sync();
+    	    disk.sync();
+    	    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    	    defragSeconds = elapsed.count();
+	}
+    	results.push_back(measure(path, nblocks, files, bytes, "after"));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-8s %10s %10s\n", "files", "runs", "read ms");
+    for (auto &result : results) {
+    	printf("%-8s %10lu %10.1f\n", result.Name, result.Runs, result.Seconds * 1e3);
+    }
+    printf("defragment took %.1f ms\n", defragSeconds * 1e3);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+// extent_bench.cpp: Largest file and sequential throughput, pointers vs. extents
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct Result {
+    const char *Name;
+    size_t	Bytes;	    // Bytes the file took before the write stopped
+    double	Write;	    // Seconds to write it
+    double	Read;	    // Seconds to read it back
+};
+
+// Write one file in 1 MiB chunks until it reaches `bytes` or stops growing,
+// then read it back
+Result run(const char *path, size_t nblocks, uint32_t features, size_t bytes, const char *name) {
+    const size_t CHUNK = 1 << 20;
+
+    Disk disk;
+    disk.open(path, nblocks);
+    if (!FileSystem::format(&disk, true, true, features)) {
+    	throw std::runtime_error("format failed");
+    }
+
+    FileSystem fs;
+    fs.mount(&disk);
+    ssize_t inumber = fs.create();
+
+    std::vector<char> data(CHUNK);
+    for (size_t i = 0; i < data.size(); i++) {
+    	data[i] = rand();
+    }
+
+    Result result{name, 0, 0, 0};
+    auto start = std::chrono::steady_clock::now();
+    while (result.Bytes < bytes) {
+    	size_t length = std::min(CHUNK, bytes - result.Bytes);
+    	ssize_t written = fs.write(inumber, data.data(), length, result.Bytes);
+    	if (written <= 0) {
+    	    break;
+	}
+    	result.Bytes += written;
+    }
+    fs.sync();
+    disk.sync();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Write = elapsed.count();
+
+    start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < result.Bytes; offset += CHUNK) {
+    	if (fs.read(inumber, data.data(), CHUNK, offset) <= 0) {
+    	    throw std::runtime_error("read failed");
+	}
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    result.Read = elapsed.count();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/extent_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 131072;
+    size_t	bytes	= argc > 3 ? atol(argv[3]) << 20 : 256ul << 20;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [file MiB]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    try {
+    	results.push_back(run(path, nblocks, 0, bytes, "pointers"));
+    	results.push_back(run(path, nblocks, FileSystem::FEATURE_EXTENTS, bytes, "extents"));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-10s %12s %12s %12s\n", "format", "file MiB", "write MB/s", "read MB/s");
+    for (auto &result : results) {
+    	printf("%-10s %12.1f %12.1f %12.1f\n", result.Name, result.Bytes / 1048576.0,
+    	       result.Bytes / result.Write / 1e6, result.Bytes / result.Read / 1e6);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+// format_bench.cpp: Elapsed time of a full format vs. a fast format
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct Result {
+    double  Seconds;
+    size_t  Writes;
+};
+
+Result format(const char *path, size_t nblocks, bool fast) {
+    Disk disk;
+    disk.open(path, nblocks);
+
+    auto start = std::chrono::steady_clock::now();
+    if (!FileSystem::format(&disk, fast)) {
+    	throw std::runtime_error("format failed");
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return Result{elapsed.count(), disk.writes()};
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/format_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 262144;
+
+    if (argc > 3) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    Result full, fast;
+    try {
+    	full = format(path, nblocks, false);
+    	fast = format(path, nblocks, true);
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-8s %12s %12s\n", "format", "seconds", "writes");
+    printf("%-8s %12.3f %12lu\n", "full", full.Seconds, full.Writes);
+    printf("%-8s %12.3f %12lu\n", "fast", fast.Seconds, fast.Writes);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
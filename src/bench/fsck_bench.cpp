@@ -0,0 +1,124 @@
+// fsck_bench.cpp: Time and disk reads of a consistency check vs. number of threads and file size
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct Result {
+    size_t  FileBlocks;	// Data blocks in each file
+    size_t  Threads;
+    double  Seconds;
+    size_t  Reads;	// Disk reads of the check
+    size_t  Blocks;	// Blocks it found in use
+    size_t  Problems;
+};
+
+// Fill a fast-formatted image with files of `fileBlocks` blocks each
+size_t populate(const char *path, size_t nblocks, size_t fileBlocks) {
+    Disk disk;
+    disk.open(path, nblocks);
+    FileSystem::format(&disk, true, true, FileSystem::FEATURE_LARGE_FILES);
+
+    FileSystem fs;
+    fs.mount(&disk);
+
+    std::vector<char> data(fileBlocks * Disk::BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i++) {
+    	data[i] = rand();
+    }
+
+    size_t files = 0;
+    while (true) {
+    	ssize_t inumber = fs.create();
+    	if (inumber < 0) {
+    	    break;
+	}
+    	ssize_t written = fs.write(inumber, data.data(), data.size(), 0);
+    	if (written < (ssize_t)data.size()) {
+    	    fs.remove(inumber);
+    	    break;
+	}
+    	files++;
+    }
+    return files;
+}
+
+// Drop the image from the page cache so every run starts cold
+void evict(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+    	return;
+    }
+    fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+}
+
+Result check(const char *path, size_t nblocks, size_t fileBlocks, size_t threads) {
+    evict(path);
+
+    Result result{fileBlocks, threads, 0, 0, 0, 0};
+    Disk disk;
+    disk.open(path, nblocks);
+
+    FileSystem fs;
+    fs.setMountThreads(threads);
+
+    FileSystem::CheckReport report;
+    auto start = std::chrono::steady_clock::now();
+    if (!fs.check(&disk, false, report)) {
+    	throw std::runtime_error("check failed");
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Seconds  = elapsed.count();
+    result.Reads    = disk.reads();
+    result.Blocks   = report.Blocks;
+    result.Problems = report.Problems.size();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/fsck_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 262144;
+
+    if (argc > 3) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    // The same image filled with small files and with large ones: the check
+    // reads the inode table and pointer blocks, never the data blocks
+    const size_t sizes[] = {FileSystem::POINTERS_PER_INODE, 1000};
+    std::vector<Result> results;
+    try {
+    	for (size_t fileBlocks : sizes) {
+    	    populate(path, nblocks, fileBlocks);
+    	    for (size_t threads = 1; threads <= 8; threads *= 2) {
+    	    	results.push_back(check(path, nblocks, fileBlocks, threads));
+	    }
+	}
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-12s %-8s %10s %10s %10s %10s\n", "file blocks", "threads", "seconds", "reads", "in use", "problems");
+    for (auto &result : results) {
+    	printf("%-12lu %-8lu %10.3f %10lu %10lu %10lu\n", result.FileBlocks, result.Threads, result.Seconds,
+    	       result.Reads, result.Blocks, result.Problems);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+// inline_bench.cpp: Disk reads and time to read small files, data blocks vs. inline
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Files are 1 to MAX_FILE bytes, all small enough to be kept inline
+const size_t MAX_FILE = 400;
+
+struct Result {
+    const char *Name;
+    size_t	Files;	    // Files written and read back
+    size_t	Reads;	    // Disk reads while reading them
+    double	Seconds;    // Time to read them all
+};
+
+size_t fileSize(size_t i) {
+    return i * 7919 % MAX_FILE + 1;
+}
+
+char pattern(size_t i, size_t offset) {
+    return (char)(i * 31 + offset);
+}
+
+// Write `files` small files, then remount with no block cache and read each
+// one back once
+Result run(const char *path, size_t nblocks, uint32_t features, size_t files, const char *name) {
+    {
+    	Disk disk;
+    	disk.open(path, nblocks);
+    	if (!FileSystem::format(&disk, true, true, features)) {
+    	    throw std::runtime_error("format failed");
+	}
+
+    	FileSystem fs;
+    	fs.mount(&disk);
+    	std::vector<char> data(MAX_FILE);
+    	for (size_t i = 0; i < files; i++) {
+    	    for (size_t k = 0; k < fileSize(i); k++) {
+    	    	data[k] = pattern(i, k);
+	    }
+    	    ssize_t inumber = fs.create();
+    	    if (inumber < 0 || fs.write(inumber, data.data(), fileSize(i), 0) != (ssize_t)fileSize(i)) {
+    	    	throw std::runtime_error("the image is too small for that many files");
+	    }
+	}
+    }
+
+    Disk disk;
+    disk.open(path, nblocks);
+    disk.set_cache_size(0);
+
+    FileSystem fs;
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("mount failed");
+    }
+
+    Result result{name, files, 0, 0};
+    std::vector<char> data(MAX_FILE);
+    const size_t before = disk.reads();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files; i++) {
+    	if (fs.read(i, data.data(), data.size(), 0) != (ssize_t)fileSize(i) || data[fileSize(i) - 1] != pattern(i, fileSize(i) - 1)) {
+    	    throw std::runtime_error("read failed");
+	}
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Reads = disk.reads() - before;
+    result.Seconds = elapsed.count();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/inline_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 16384;
+    size_t	files	= argc > 3 ? atoi(argv[3]) : 10000;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [files]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    try {
+    	results.push_back(run(path, nblocks, FileSystem::FEATURE_LARGE_FILES, files, "blocks"));
+    	results.push_back(run(path, nblocks, FileSystem::FEATURE_INLINE_DATA, files, "inline"));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-8s %10s %16s %14s\n", "format", "files", "reads per file", "us per file");
+    for (auto &result : results) {
+    	printf("%-8s %10lu %16.2f %14.2f\n", result.Name, result.Files,
+    	       (double)result.Reads / result.Files, result.Seconds / result.Files * 1e6);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,312 @@
+// journal_crash.cpp: Kill a process after sync and during one, and check what mount recovers
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The journal gets 1/64 of the disk, enough to commit each sync below whole
+const size_t NBLOCKS = 1536;
+
+// Files written before the crash; sizes grow with the index, so most of
+// them need an indirect block
+const size_t FILES = 24;
+
+// Fills the rest of the disk so freed blocks are reused right away
+const size_t FILLER = FILES;
+
+// Bytes appended to the first half of the files after the second half
+// lost every other file
+const size_t EXTRA = 2 * Disk::BLOCK_SIZE;
+
+// Exit status of a process its disk killed part way through a write
+const int KILLED = 2;
+
+// Disk that lets `budget` more blocks through once armed, writing them one
+// at a time, and kills the process at the next one
+class KillingDisk : public Disk {
+    bool    Armed = false;
+    size_t  Budget = 0;
+
+protected:
+    void write_blocks(int blocknum, struct iovec *iov, int iovcnt) override {
+    	if (!Armed) {
+    	    Disk::write_blocks(blocknum, iov, iovcnt);
+    	    return;
+	}
+    	for (int i = 0; i < iovcnt; i++) {
+    	    for (size_t offset = 0; offset < iov[i].iov_len; offset += BLOCK_SIZE) {
+    	    	if (Budget == 0) {
+    	    	    _exit(KILLED);
+		}
+    	    	Budget--;
+    	    	struct iovec block = {(char *)iov[i].iov_base + offset, BLOCK_SIZE};
+    	    	Disk::write_blocks(blocknum++, &block, 1);
+	    }
+	}
+    }
+
+public:
+    void arm(size_t budget) {
+    	Budget = budget;
+    	Armed = true;
+    }
+};
+
+bool removed(size_t i) {
+    return i % 2 && i > FILES / 2;
+}
+
+size_t fileSize(size_t i, bool extended) {
+    return (i + 1) * 3 * Disk::BLOCK_SIZE / 2 + 123 + (extended && i < FILES / 2 ? EXTRA : 0);
+}
+
+// Size of a file of tear before and after its append
+size_t tornSize(size_t i, bool appended) {
+    return fileSize(i, false) + (appended ? EXTRA : 0);
+}
+
+char pattern(size_t i, size_t offset) {
+    return (char)(i * 31 + offset * 7 + offset / Disk::BLOCK_SIZE);
+}
+
+std::vector<char> contents(size_t i, size_t from, size_t to) {
+    std::vector<char> data(to - from);
+    for (size_t offset = from; offset < to; offset++) {
+    	data[offset - from] = pattern(i, offset);
+    }
+    return data;
+}
+
+// Write files, remove some, append to others, sync, then die before unmount;
+// the journal still holds the last commit since checkpoints trail commits
+void crash(const char *path) {
+    Disk disk;
+    disk.open(path, NBLOCKS);
+    disk.set_cache_size(64);
+
+    FileSystem fs;
+    fs.mount(&disk);
+    for (size_t i = 0; i < FILES; i++) {
+    	auto data = contents(i, 0, fileSize(i, false));
+    	ssize_t inumber = fs.create();
+    	if (inumber != (ssize_t)i || fs.write(inumber, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    	    _exit(EXIT_FAILURE);
+	}
+    	if (i % 8 == 7) {
+    	    fs.sync();
+	}
+    }
+    auto filler = contents(FILLER, 0, (FileSystem::POINTERS_PER_INODE + FileSystem::POINTERS_PER_BLOCK) * Disk::BLOCK_SIZE);
+    if (fs.create() != (ssize_t)FILLER || fs.write(FILLER, filler.data(), filler.size(), 0) <= 0) {
+    	_exit(EXIT_FAILURE);
+    }
+    fs.sync();
+
+    // freed indirect blocks are still in the journal when they are reused
+    for (size_t i = 0; i < FILES; i++) {
+    	if (removed(i) && !fs.remove(i)) {
+    	    _exit(EXIT_FAILURE);
+	}
+    }
+    for (size_t i = 0; i < FILES / 2; i++) {
+    	auto data = contents(i, fileSize(i, false), fileSize(i, true));
+    	if (fs.write(i, data.data(), data.size(), fileSize(i, false)) != (ssize_t)data.size()) {
+    	    _exit(EXIT_FAILURE);
+	}
+    }
+    fs.sync();
+
+    // not synced: takes the lowest free inode, which must still be free
+    // after the crash
+    auto data = contents(FILES, 0, fileSize(FILES, false));
+    ssize_t inumber = fs.create();
+    fs.write(inumber, data.data(), data.size(), 0);
+
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+// Write files and sync, then append to each of them and sync again with a
+// disk that dies after `budget` block writes, in the data, the log or home
+void tear(const char *path, size_t budget) {
+    KillingDisk disk;
+    disk.open(path, NBLOCKS);
+
+    FileSystem fs;
+    fs.mount(&disk);
+    for (size_t i = 0; i < FILES; i++) {
+    	auto data = contents(i, 0, fileSize(i, false));
+    	ssize_t inumber = fs.create();
+    	if (inumber != (ssize_t)i || fs.write(inumber, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    	    _exit(EXIT_FAILURE);
+	}
+    }
+    fs.sync();
+
+    disk.arm(budget);
+    for (size_t i = 0; i < FILES; i++) {
+    	auto data = contents(i, tornSize(i, false), tornSize(i, true));
+    	if (fs.write(i, data.data(), data.size(), tornSize(i, false)) != (ssize_t)data.size()) {
+    	    _exit(EXIT_FAILURE);
+	}
+    }
+    fs.sync();
+    _exit(EXIT_SUCCESS);
+}
+
+// Mount what tear left: each sync is whole or missing, so the files
+// appended to are the first few, and every file is as it was before or
+// after its append
+size_t checkTorn(const char *path, size_t budget) {
+    Disk disk;
+    disk.open(path, NBLOCKS);
+    FileSystem fs;
+    if (!fs.mount(&disk)) {
+    	fprintf(stderr, "killed after %lu writes: mount failed\n", budget);
+    	return 1;
+    }
+
+    size_t failures = fs.getDuplicateBlocks().size();
+    bool appended = true;
+    for (size_t i = 0; i < FILES; i++) {
+    	ssize_t size = fs.stat(i);
+    	const bool extended = size == (ssize_t)tornSize(i, true);
+    	if (!extended && size != (ssize_t)tornSize(i, false)) {
+    	    fprintf(stderr, "killed after %lu writes: inode %lu has the wrong size\n", budget, i);
+    	    failures++;
+    	    continue;
+	}
+    	if (extended && !appended) {
+    	    fprintf(stderr, "killed after %lu writes: inode %lu was appended to before inode %lu\n", budget, i, i - 1);
+    	    failures++;
+	}
+    	appended = extended;
+
+    	std::vector<char> data(size);
+    	if (fs.read(i, data.data(), data.size(), 0) != size || data != contents(i, 0, data.size())) {
+    	    fprintf(stderr, "killed after %lu writes: inode %lu has the wrong contents\n", budget, i);
+    	    failures++;
+	}
+    }
+
+    // nor may a pointer block of a later sync be there already
+    fs.unmount();
+    FileSystem::CheckReport report;
+    if (!FileSystem().check(&disk, false, report)) {
+    	report.Problems.push_back("check failed");
+    }
+    for (auto &problem : report.Problems) {
+    	fprintf(stderr, "killed after %lu writes: %s\n", budget, problem.c_str());
+    	failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/journal_crash.img";
+
+    if (argc > 2) {
+    	fprintf(stderr, "Usage: %s [image]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    size_t failures = 0;
+    try {
+    	{
+    	    Disk disk;
+    	    disk.open(path, NBLOCKS);
+    	    FileSystem::format(&disk);
+	}
+
+    	fflush(stdout);
+    	pid_t pid = fork();
+    	if (pid == 0) {
+    	    crash(path);
+	}
+    	int status;
+    	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    	    fprintf(stderr, "crashing child failed\n");
+    	    return EXIT_FAILURE;
+	}
+
+    	Disk disk;
+    	disk.open(path, NBLOCKS);
+    	FileSystem fs;
+    	if (!fs.mount(&disk) || !fs.hasJournal()) {
+    	    fprintf(stderr, "mount failed\n");
+    	    return EXIT_FAILURE;
+	}
+    	printf("replayed %lu journal transactions\n", fs.getJournalReplayed());
+    	if (fs.getJournalReplayed() == 0) {
+    	    failures++;
+	}
+    	for (auto block : fs.getDuplicateBlocks()) {
+    	    fprintf(stderr, "block %u is allocated more than once\n", block);
+    	    failures++;
+	}
+
+    	for (size_t i = 0; i <= FILLER; i++) {
+    	    ssize_t size = fs.stat(i);
+    	    if (removed(i)) {
+    	    	if (size >= 0) {
+    	    	    fprintf(stderr, "inode %lu should not exist\n", i);
+    	    	    failures++;
+		}
+    	    	continue;
+	    }
+    	    std::vector<char> data(i == FILLER ? size : fileSize(i, true));
+    	    if (size <= 0 || size != (ssize_t)data.size() || fs.read(i, data.data(), data.size(), 0) != size) {
+    	    	fprintf(stderr, "inode %lu has the wrong size\n", i);
+    	    	failures++;
+    	    	continue;
+	    }
+    	    if (data != contents(i, 0, data.size())) {
+    	    	fprintf(stderr, "inode %lu has the wrong contents\n", i);
+    	    	failures++;
+	    }
+	}
+
+    	// Kill a sync after every number of block writes until one finishes
+    	size_t kills = 0;
+    	for (size_t budget = 0; ; budget++) {
+    	    {
+    	    	Disk disk;
+    	    	disk.open(path, NBLOCKS);
+    	    	FileSystem::format(&disk, true);
+	    }
+
+    	    fflush(stdout);
+    	    pid_t pid = fork();
+    	    if (pid == 0) {
+    	    	tear(path, budget);
+	    }
+    	    int status;
+    	    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+    	    	(WEXITSTATUS(status) != EXIT_SUCCESS && WEXITSTATUS(status) != KILLED)) {
+    	    	fprintf(stderr, "tearing child failed\n");
+    	    	return EXIT_FAILURE;
+	    }
+    	    failures += checkTorn(path, budget);
+    	    if (WEXITSTATUS(status) == EXIT_SUCCESS) {
+    	    	break;
+	    }
+    	    kills++;
+	}
+    	printf("killed %lu syncs part way\n", kills);
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    unlink(path);
+    printf("%lu failures\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
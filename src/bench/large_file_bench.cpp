@@ -0,0 +1,121 @@
+// large_file_bench.cpp: Disk reads per random read of a file past the indirect block
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const size_t CHUNK = 1 << 20;
+
+// Random 4 KiB reads done after the remount
+const size_t READS = 4096;
+
+char pattern(size_t offset) {
+    return (char)(offset * 7 + offset / Disk::BLOCK_SIZE);
+}
+
+// Write one file of `bytes` in 1 MiB chunks on a large-file image
+size_t populate(const char *path, size_t nblocks, uint32_t features, size_t bytes) {
+    Disk disk;
+    disk.open(path, nblocks);
+    if (!FileSystem::format(&disk, true, true, features | FileSystem::FEATURE_LARGE_FILES)) {
+    	throw std::runtime_error("format failed");
+    }
+
+    FileSystem fs;
+    fs.mount(&disk);
+    ssize_t inumber = fs.create();
+
+    std::vector<char> data(CHUNK);
+    size_t written = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (written < bytes) {
+    	size_t length = std::min(CHUNK, bytes - written);
+    	for (size_t i = 0; i < length; i++) {
+    	    data[i] = pattern(written + i);
+	}
+    	ssize_t result = fs.write(inumber, data.data(), length, written);
+    	if (result <= 0) {
+    	    break;
+	}
+    	written += result;
+    }
+    fs.sync();
+    disk.sync();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("wrote %.1f MiB at %.1f MB/s\n", written / 1048576.0, written / elapsed.count() / 1e6);
+    return written;
+}
+
+// Remount with no cache or readahead, so every block the map needs is read
+// from the image, and count the reads behind each random read
+void measure(const char *path, size_t nblocks, size_t bytes) {
+    Disk disk;
+    disk.open(path, nblocks);
+    disk.set_cache_size(0);
+
+    FileSystem fs;
+    fs.setReadahead(0);
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("mount failed");
+    }
+
+    // the first read also loads the inode and the blocks above the leaves
+    const size_t blocks = bytes / Disk::BLOCK_SIZE;
+    char data[Disk::BLOCK_SIZE];
+    if (fs.read(0, data, sizeof(data), 0) != (ssize_t)sizeof(data)) {
+    	throw std::runtime_error("read failed");
+    }
+    size_t total = 0;
+    size_t most = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < READS; i++) {
+    	const size_t offset = (size_t)(rand() % blocks) * Disk::BLOCK_SIZE;
+    	const size_t before = disk.reads();
+    	if (fs.read(0, data, sizeof(data), offset) != (ssize_t)sizeof(data)) {
+    	    throw std::runtime_error("read failed");
+	}
+    	const size_t reads = disk.reads() - before;
+    	total += reads;
+    	most = reads > most ? reads : most;
+    	for (size_t k = 0; k < sizeof(data); k++) {
+    	    if (data[k] != pattern(offset + k)) {
+    	    	throw std::runtime_error("read returned the wrong contents");
+	    }
+	}
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%lu random reads: %.2f disk reads each, at most %lu, %.1f us each\n",
+    	   READS, (double)total / READS, most, elapsed.count() / READS * 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/large_file_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 262144;
+    size_t	bytes	= argc > 3 ? atol(argv[3]) << 20 : 768ul << 20;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [file MiB]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    try {
+    	printf("pointers:\n");
+    	measure(path, nblocks, populate(path, nblocks, 0, bytes));
+    	printf("extents:\n");
+    	measure(path, nblocks, populate(path, nblocks, FileSystem::FEATURE_EXTENTS, bytes));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+// mount_bench.cpp: Time of the mount-time inode scan vs. number of threads
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct Result {
+    size_t  Threads;
+    double  Seconds;
+    size_t  Duplicates;
+};
+
+// Fill a fast-formatted image with files that each need an indirect block
+size_t populate(const char *path, size_t nblocks) {
+    const size_t fileSize = 3 * FileSystem::POINTERS_PER_INODE * Disk::BLOCK_SIZE;
+
+    Disk disk;
+    disk.open(path, nblocks);
+    FileSystem::format(&disk, true);
+
+    FileSystem fs;
+    fs.mount(&disk);
+
+    std::vector<char> data(fileSize);
+    for (size_t i = 0; i < data.size(); i++) {
+    	data[i] = rand();
+    }
+
+    size_t files = 0;
+    while (true) {
+    	ssize_t inumber = fs.create();
+    	if (inumber < 0) {
+    	    break;
+	}
+    	ssize_t written = fs.write(inumber, data.data(), data.size(), 0);
+    	if (written < (ssize_t)data.size()) {
+    	    fs.remove(inumber);
+    	    break;
+	}
+    	files++;
+    }
+    return files;
+}
+
+// Pretend the last mount crashed so the next one has to scan every inode
+void dirty(const char *path, size_t nblocks) {
+    Disk disk;
+    disk.open(path, nblocks);
+
+    char block[Disk::BLOCK_SIZE];
+    disk.read(0, block);
+    // State is the seventh field of the superblock
+    ((uint32_t *)block)[6] = 0;
+    disk.write(0, block);
+}
+
+// Drop the image from the page cache so every run starts cold
+void evict(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+    	return;
+    }
+    fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+}
+
+Result mount(const char *path, size_t nblocks, size_t threads) {
+    evict(path);
+
+    Result result{threads, 0, 0};
+    {
+    	Disk disk;
+    	disk.open(path, nblocks);
+
+    	FileSystem fs;
+    	fs.setMountThreads(threads);
+
+    	auto start = std::chrono::steady_clock::now();
+    	if (!fs.mount(&disk)) {
+    	    throw std::runtime_error("mount failed");
+	}
+    	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    	result.Seconds = elapsed.count();
+    	result.Duplicates = fs.getDuplicateBlocks().size();
+    }
+
+    // unmount marked the image clean again
+    dirty(path, nblocks);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/mount_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 262144;
+
+    if (argc > 3) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    size_t files = 0;
+    try {
+    	files = populate(path, nblocks);
+    	dirty(path, nblocks);
+    	for (size_t threads = 1; threads <= 8; threads *= 2) {
+    	    results.push_back(mount(path, nblocks, threads));
+	}
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%lu files\n", files);
+    printf("%-8s %12s %12s\n", "threads", "seconds", "duplicates");
+    for (auto &result : results) {
+    	printf("%-8lu %12.3f %12lu\n", result.Threads, result.Seconds, result.Duplicates);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
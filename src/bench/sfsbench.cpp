@@ -0,0 +1,551 @@
+// sfsbench.cpp: Format, mount, metadata, throughput and small-file benchmarks, as text, CSV or JSON
+
+#include "sfs/async_disk.h"
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/mapped_disk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    const char *Path	 = "/tmp/sfsbench.img";
+    size_t	Blocks	 = 65536;
+    std::string Features = "large";
+    uint32_t	FeatureBits = FileSystem::FEATURE_LARGE_FILES;
+    std::vector<size_t> Sizes = {4096, 65536, 1 << 20};	// I/O sizes of the throughput workloads
+    size_t	Ops	 = 1000;	// Operations of each metadata, small-file and random workload
+    size_t	Rounds	 = 5;		// Formats and mounts of each kind
+    size_t	FileMiB	 = 64;		// Size of the file read and written in place
+    size_t	SmallSize = 1024;	// Size of each small file
+    std::string Workloads = "format,meta,small,mount,io";
+    std::string Output	 = "text";
+    bool	Mapped	 = false;
+    size_t	Depth	 = 0;
+    ssize_t	Cache	 = -1;		// Block cache capacity, -1 for the default
+};
+
+struct Result {
+    std::string Workload;
+    size_t  IOSize;	// Bytes per operation, 0 for metadata
+    size_t  Ops;
+    double  Seconds;	// For all operations, including the sync that ends a write workload
+    double  P50;	// Latency of one operation, in microseconds
+    double  P99;
+    double  Reads;	// Disk reads per operation
+    double  Writes;	// Disk writes per operation
+};
+
+// Times each operation of a workload and counts the disk I/O of all of them
+class Run {
+public:
+    Run(Disk &disk) : disk(disk), reads(disk.reads()), writes(disk.writes()), start(Clock::now()) {}
+
+    template <typename F>
+    void op(F f) {
+    	auto begin = Clock::now();
+    	f();
+    	latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - begin).count());
+    }
+
+    Result finish(const std::string &name, size_t ioSize) {
+    	std::chrono::duration<double> elapsed = Clock::now() - start;
+    	const size_t ops = latencies.size();
+    	std::sort(latencies.begin(), latencies.end());
+    	return Result{name, ioSize, ops, elapsed.count(), percentile(0.50), percentile(0.99),
+    	              (double)(disk.reads() - reads) / ops, (double)(disk.writes() - writes) / ops};
+    }
+
+private:
+    // Nearest-rank percentile of the sorted latencies
+    double percentile(double p) const {
+    	const size_t rank = (size_t)std::ceil(p * latencies.size());
+    	return latencies[std::max<size_t>(rank, 1) - 1];
+    }
+
+    Disk &disk;
+    size_t reads;
+    size_t writes;
+    Clock::time_point start;
+    std::vector<double> latencies;
+};
+
+bool selected(const Options &options, const char *workload) {
+    const std::string list = "," + options.Workloads + ",";
+    return list.find(std::string(",") + workload + ",") != std::string::npos;
+}
+
+// Feature names as `format` in the shell takes them
+bool parseFeatures(const std::string &list, uint32_t &features) {
+    std::vector<char> buffer(list.begin(), list.end());
+    buffer.push_back(0);
+    features = 0;
+    for (char *name = strtok(buffer.data(), ","); name != NULL; name = strtok(NULL, ",")) {
+    	if (streq(name, "extents")) {
+    	    features |= FileSystem::FEATURE_EXTENTS;
+	} else if (streq(name, "large")) {
+    	    features |= FileSystem::FEATURE_LARGE_FILES;
+	} else if (streq(name, "inline")) {
+    	    features |= FileSystem::FEATURE_INLINE_DATA;
+	} else if (streq(name, "compress")) {
+    	    features |= FileSystem::FEATURE_COMPRESSION;
+	} else if (streq(name, "dedup")) {
+    	    features |= FileSystem::FEATURE_DEDUP;
+	} else if (streq(name, "clones")) {
+    	    features |= FileSystem::FEATURE_CLONES;
+	} else if (streq(name, "checksums")) {
+    	    features |= FileSystem::FEATURE_CHECKSUMS;
+	} else {
+    	    return false;
+	}
+    }
+    return true;
+}
+
+// Write back and drop every cached block of the image, in the block cache
+// and in the page cache, so the next reads go to the disk
+void evict(const Options &options, Disk &disk) {
+    disk.sync();
+    const size_t capacity = disk.cache_size();
+    disk.set_cache_size(0);
+    disk.set_cache_size(capacity);
+
+    int fd = open(options.Path, O_RDONLY);
+    if (fd < 0) {
+    	return;
+    }
+    fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+}
+
+void format(const Options &options, Disk &disk, bool fast = true) {
+    if (!FileSystem::format(&disk, fast, true, options.FeatureBits)) {
+    	throw std::runtime_error("format failed");
+    }
+}
+
+void mount(FileSystem &fs, Disk &disk) {
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("mount failed");
+    }
+}
+
+// Pretend the last mount crashed so the next one has to scan every inode
+void dirty(Disk &disk) {
+    char block[Disk::BLOCK_SIZE];
+    disk.read(0, block);
+    // State is the seventh field of the superblock
+    ((uint32_t *)block)[6] = 0;
+    disk.write(0, block);
+    disk.sync();
+}
+
+std::vector<char> randomData(size_t length) {
+    std::vector<char> data(length);
+    std::mt19937 random(1);
+    for (size_t i = 0; i < length; i++) {
+    	data[i] = random();
+    }
+    return data;
+}
+
+// Full and fast formats of the whole image
+void benchFormat(const Options &options, Disk &disk, std::vector<Result> &results) {
+    for (bool fast : {false, true}) {
+    	Run run(disk);
+    	for (size_t i = 0; i < options.Rounds; i++) {
+    	    run.op([&] { format(options, disk, fast); });
+	}
+    	results.push_back(run.finish(fast ? "format-fast" : "format", 0));
+    }
+}
+
+// Create empty files, then remove them
+void benchMeta(const Options &options, Disk &disk, std::vector<Result> &results) {
+    format(options, disk);
+    FileSystem fs;
+    mount(fs, disk);
+
+    std::vector<ssize_t> inumbers;
+    Run create(disk);
+    for (size_t i = 0; i < options.Ops; i++) {
+    	create.op([&] {
+    	    ssize_t inumber = fs.create();
+    	    if (inumber < 0) {
+    	    	throw std::runtime_error("the image is out of inodes");
+	    }
+    	    inumbers.push_back(inumber);
+	});
+    }
+    fs.sync();
+    results.push_back(create.finish("create", 0));
+
+    Run remove(disk);
+    for (auto inumber : inumbers) {
+    	remove.op([&] { fs.remove(inumber); });
+    }
+    fs.sync();
+    results.push_back(remove.finish("remove", 0));
+    fs.unmount();
+}
+
+// Fill the image with small files, untimed
+void populate(const Options &options, FileSystem &fs, std::vector<ssize_t> &inumbers) {
+    std::vector<char> data = randomData(options.SmallSize);
+    for (size_t i = 0; i < options.Ops; i++) {
+    	ssize_t inumber = fs.create();
+    	if (inumber < 0 || fs.write(inumber, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    	    throw std::runtime_error("the image is too small for the small files");
+	}
+    	inumbers.push_back(inumber);
+    }
+}
+
+// Create and write small files, read them back after a remount, remove them
+void benchSmall(const Options &options, Disk &disk, std::vector<Result> &results) {
+    format(options, disk);
+    FileSystem fs;
+    mount(fs, disk);
+
+    std::vector<char> data = randomData(options.SmallSize);
+    std::vector<ssize_t> inumbers;
+    Run write(disk);
+    for (size_t i = 0; i < options.Ops; i++) {
+    	write.op([&] {
+    	    ssize_t inumber = fs.create();
+    	    if (inumber < 0 || fs.write(inumber, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    	    	throw std::runtime_error("the image is too small for the small files");
+	    }
+    	    inumbers.push_back(inumber);
+	});
+    }
+    fs.sync();
+    results.push_back(write.finish("small-write", options.SmallSize));
+
+    fs.unmount();
+    evict(options, disk);
+    mount(fs, disk);
+    std::vector<char> buffer(options.SmallSize);
+    Run read(disk);
+    for (auto inumber : inumbers) {
+    	read.op([&] {
+    	    if (fs.read(inumber, buffer.data(), buffer.size(), 0) != (ssize_t)buffer.size()) {
+    	    	throw std::runtime_error("small file read failed");
+	    }
+	});
+    }
+    results.push_back(read.finish("small-read", options.SmallSize));
+
+    Run remove(disk);
+    for (auto inumber : inumbers) {
+    	remove.op([&] { fs.remove(inumber); });
+    }
+    fs.sync();
+    results.push_back(remove.finish("small-remove", 0));
+    fs.unmount();
+}
+
+// Mount an image full of small files after a clean unmount and after a
+// crash, which scans the inode table to rebuild the bitmap
+void benchMount(const Options &options, Disk &disk, std::vector<Result> &results) {
+    format(options, disk);
+    {
+    	FileSystem fs;
+    	mount(fs, disk);
+    	std::vector<ssize_t> inumbers;
+    	populate(options, fs, inumbers);
+    	fs.unmount();
+    }
+
+    for (bool crashed : {false, true}) {
+    	FileSystem fs;
+    	Run run(disk);
+    	for (size_t i = 0; i < options.Rounds; i++) {
+    	    if (crashed) {
+    	    	dirty(disk);
+	    }
+    	    evict(options, disk);
+    	    run.op([&] { mount(fs, disk); });
+    	    fs.unmount();
+	}
+    	results.push_back(run.finish(crashed ? "mount-scan" : "mount", 0));
+    }
+}
+
+// Write a file sequentially, then after a remount read it sequentially,
+// read it at random and overwrite it at random, `ioSize` bytes at a time
+void benchIO(const Options &options, Disk &disk, size_t ioSize, std::vector<Result> &results) {
+    const size_t fileSize = (options.FileMiB << 20) / ioSize * ioSize;
+    const size_t ops = fileSize / ioSize;
+    if (ops == 0) {
+    	throw std::runtime_error("the file is smaller than one I/O");
+    }
+    format(options, disk);
+    FileSystem fs;
+    mount(fs, disk);
+
+    std::vector<char> data = randomData(ioSize);
+    ssize_t inumber = fs.create();
+    Run seqWrite(disk);
+    for (size_t offset = 0; offset < fileSize; offset += ioSize) {
+    	seqWrite.op([&] {
+    	    if (fs.write(inumber, data.data(), ioSize, offset) != (ssize_t)ioSize) {
+    	    	throw std::runtime_error("the image is too small for the file");
+	    }
+	});
+    }
+    fs.sync();
+    results.push_back(seqWrite.finish("seq-write", ioSize));
+
+    fs.unmount();
+    evict(options, disk);
+    mount(fs, disk);
+    Run seqRead(disk);
+    for (size_t offset = 0; offset < fileSize; offset += ioSize) {
+    	seqRead.op([&] {
+    	    if (fs.read(inumber, data.data(), ioSize, offset) != (ssize_t)ioSize) {
+    	    	throw std::runtime_error("sequential read failed");
+	    }
+	});
+    }
+    results.push_back(seqRead.finish("seq-read", ioSize));
+
+    // No more random I/O than the file holds, so large sizes stay quick
+    const size_t randomOps = std::min(options.Ops, ops);
+    std::mt19937 random(2);
+    std::uniform_int_distribution<size_t> pick(0, ops - 1);
+
+    fs.unmount();
+    evict(options, disk);
+    mount(fs, disk);
+    Run randRead(disk);
+    for (size_t i = 0; i < randomOps; i++) {
+    	const size_t offset = pick(random) * ioSize;
+    	randRead.op([&] {
+    	    if (fs.read(inumber, data.data(), ioSize, offset) != (ssize_t)ioSize) {
+    	    	throw std::runtime_error("random read failed");
+	    }
+	});
+    }
+    results.push_back(randRead.finish("rand-read", ioSize));
+
+    Run randWrite(disk);
+    for (size_t i = 0; i < randomOps; i++) {
+    	const size_t offset = pick(random) * ioSize;
+    	randWrite.op([&] {
+    	    if (fs.write(inumber, data.data(), ioSize, offset) != (ssize_t)ioSize) {
+    	    	throw std::runtime_error("random write failed");
+	    }
+	});
+    }
+    fs.sync();
+    results.push_back(randWrite.finish("rand-write", ioSize));
+    fs.unmount();
+}
+
+// Output
+
+double opsPerSecond(const Result &result) {
+    return result.Seconds > 0 ? result.Ops / result.Seconds : 0;
+}
+
+double mibPerSecond(const Result &result) {
+    return result.Seconds > 0 ? result.Ops * result.IOSize / result.Seconds / (1 << 20) : 0;
+}
+
+void printText(FILE *stream, const Options &options, const std::vector<Result> &results) {
+    fprintf(stream, "%s: %lu blocks, features %s\n", options.Path, options.Blocks,
+            options.Features.empty() ? "none" : options.Features.c_str());
+    fprintf(stream, "%-14s %8s %7s %9s %10s %9s %10s %10s %9s %9s\n", "workload", "io size", "ops", "seconds",
+            "ops/s", "MiB/s", "p50 us", "p99 us", "reads/op", "writes/op");
+    for (auto &result : results) {
+    	fprintf(stream, "%-14s %8lu %7lu %9.3f %10.1f %9.1f %10.1f %10.1f %9.2f %9.2f\n", result.Workload.c_str(),
+    	        result.IOSize, result.Ops, result.Seconds, opsPerSecond(result), mibPerSecond(result),
+    	        result.P50, result.P99, result.Reads, result.Writes);
+    }
+}
+
+void printCSV(FILE *stream, const std::vector<Result> &results) {
+    fprintf(stream, "workload,io_size,ops,seconds,ops_per_sec,mib_per_sec,p50_us,p99_us,reads_per_op,writes_per_op\n");
+    for (auto &result : results) {
+    	fprintf(stream, "%s,%lu,%lu,%.6f,%.1f,%.2f,%.1f,%.1f,%.3f,%.3f\n", result.Workload.c_str(), result.IOSize,
+    	        result.Ops, result.Seconds, opsPerSecond(result), mibPerSecond(result), result.P50, result.P99,
+    	        result.Reads, result.Writes);
+    }
+}
+
+void printJSON(FILE *stream, const Options &options, const std::vector<Result> &results) {
+    // Paths and feature names are printed as they are, so keep them free of quotes
+    fprintf(stream, "{\n  \"image\": \"%s\",\n  \"blocks\": %lu,\n  \"features\": \"%s\",\n  \"results\": [",
+            options.Path, options.Blocks, options.Features.c_str());
+    for (size_t i = 0; i < results.size(); i++) {
+    	const Result &result = results[i];
+    	fprintf(stream, "%s\n    {\"workload\": \"%s\", \"io_size\": %lu, \"ops\": %lu, \"seconds\": %.6f, "
+    	        "\"ops_per_sec\": %.1f, \"mib_per_sec\": %.2f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+    	        "\"reads_per_op\": %.3f, \"writes_per_op\": %.3f}", i ? "," : "", result.Workload.c_str(),
+    	        result.IOSize, result.Ops, result.Seconds, opsPerSecond(result), mibPerSecond(result),
+    	        result.P50, result.P99, result.Reads, result.Writes);
+    }
+    fprintf(stream, "\n  ]\n}\n");
+}
+
+// Main execution
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [image]\n", program);
+    fprintf(stderr, "    -b blocks     size of the image (default 65536)\n");
+    fprintf(stderr, "    -F features   features to format with, as with format (default large)\n");
+    fprintf(stderr, "    -w workloads  any of format,meta,small,mount,io (default all)\n");
+    fprintf(stderr, "    -s sizes      I/O sizes of the io workloads (default 4096,65536,1048576)\n");
+    fprintf(stderr, "    -f MiB        size of the file of the io workloads (default 64)\n");
+    fprintf(stderr, "    -n ops        operations of the meta, small and random workloads (default 1000)\n");
+    fprintf(stderr, "    -S bytes      size of each small file (default 1024)\n");
+    fprintf(stderr, "    -R rounds     formats and mounts of each kind (default 5)\n");
+    fprintf(stderr, "    -o format     text, csv or json (default text)\n");
+    fprintf(stderr, "    -m            memory-map the disk image\n");
+    fprintf(stderr, "    -q depth      keep up to depth asynchronous requests in flight\n");
+    fprintf(stderr, "    -c blocks     capacity of the block cache (0 disables it)\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    int	    option;
+
+    while ((option = getopt(argc, argv, "b:F:w:s:f:n:S:R:o:mq:c:")) != -1) {
+    	switch (option) {
+    	    case 'b':
+    	    	options.Blocks = atol(optarg);
+    	    	break;
+    	    case 'F':
+    	    	options.Features = optarg;
+    	    	break;
+    	    case 'w':
+    	    	options.Workloads = optarg;
+    	    	break;
+    	    case 's':
+    	    	options.Sizes.clear();
+    	    	for (char *size = strtok(optarg, ","); size != NULL; size = strtok(NULL, ",")) {
+    	    	    options.Sizes.push_back(atol(size));
+		}
+    	    	break;
+    	    case 'f':
+    	    	options.FileMiB = atol(optarg);
+    	    	break;
+    	    case 'n':
+    	    	options.Ops = atol(optarg);
+    	    	break;
+    	    case 'S':
+    	    	options.SmallSize = atol(optarg);
+    	    	break;
+    	    case 'R':
+    	    	options.Rounds = atol(optarg);
+    	    	break;
+    	    case 'o':
+    	    	options.Output = optarg;
+    	    	break;
+    	    case 'm':
+    	    	options.Mapped = true;
+    	    	break;
+    	    case 'q':
+    	    	options.Depth = atoi(optarg);
+    	    	break;
+    	    case 'c':
+    	    	options.Cache = atol(optarg);
+    	    	break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return EXIT_FAILURE;
+	}
+    }
+    if (argc - optind > 1) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+    if (argc - optind == 1) {
+    	options.Path = argv[optind];
+    }
+
+    const std::string output = options.Output;
+    if (!parseFeatures(options.Features, options.FeatureBits) ||
+    	(output != "text" && output != "csv" && output != "json") ||
+    	options.Ops == 0 || options.Rounds == 0 || options.SmallSize == 0 ||
+    	std::count(options.Sizes.begin(), options.Sizes.end(), 0)) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    // Disk prints its counters on stdout when it is closed, so the report
+    // goes to the original stdout and everything else to stderr
+    fflush(stdout);
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    std::vector<Result> results;
+    try {
+    	std::unique_ptr<Disk> disk;
+    	if (options.Mapped) {
+    	    disk.reset(new MappedDisk());
+	} else if (options.Depth > 0) {
+    	    disk.reset(new AsyncDisk(options.Depth));
+	} else {
+    	    disk.reset(new Disk());
+	}
+    	disk->open(options.Path, options.Blocks);
+    	if (options.Cache >= 0) {
+    	    disk->set_cache_size(options.Cache);
+	}
+
+    	if (selected(options, "format")) {
+    	    benchFormat(options, *disk, results);
+	}
+    	if (selected(options, "meta")) {
+    	    benchMeta(options, *disk, results);
+	}
+    	if (selected(options, "small")) {
+    	    benchSmall(options, *disk, results);
+	}
+    	if (selected(options, "mount")) {
+    	    benchMount(options, *disk, results);
+	}
+    	if (selected(options, "io")) {
+    	    for (size_t size : options.Sizes) {
+    	    	benchIO(options, *disk, size, results);
+	    }
+	}
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(options.Path);
+    	return EXIT_FAILURE;
+    }
+
+    if (output == "csv") {
+    	printCSV(report, results);
+    } else if (output == "json") {
+    	printJSON(report, options, results);
+    } else {
+    	printText(report, options, results);
+    }
+    fclose(report);
+
+    unlink(options.Path);
+    return EXIT_SUCCESS;
+}
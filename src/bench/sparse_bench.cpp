@@ -0,0 +1,126 @@
+// sparse_bench.cpp: Disk writes and time to save a mostly-zero file, dense vs. sparse
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const size_t CHUNK = 1 << 20;
+
+// Only the first DATA bytes of each 1 MiB chunk are nonzero, like a
+// checkpoint of a mostly-empty table
+const size_t DATA = 64 << 10;
+
+struct Result {
+    const char *Name;
+    size_t	Writes;		// Disk writes to save the file
+    size_t	Reads;		// Disk reads to read it back after a remount
+    double	WriteSeconds;	// Time to save it, including the sync
+    double	ReadSeconds;	// Time to read it back
+};
+
+char pattern(size_t offset) {
+    return offset % CHUNK < DATA ? (char)(offset * 7 + 1) : 0;
+}
+
+// Save a `bytes` checkpoint, either writing every chunk in full or only the
+// nonzero part of each one and truncating the file to its size, then remount
+// and read it all back
+Result run(const char *path, size_t nblocks, size_t bytes, bool sparse, const char *name) {
+    Result result{name, 0, 0, 0, 0};
+    std::vector<char> data(CHUNK);
+    {
+    	Disk disk;
+    	disk.open(path, nblocks);
+    	if (!FileSystem::format(&disk, true, true, FileSystem::FEATURE_EXTENTS | FileSystem::FEATURE_LARGE_FILES)) {
+    	    throw std::runtime_error("format failed");
+	}
+
+    	FileSystem fs;
+    	fs.mount(&disk);
+    	ssize_t inumber = fs.create();
+
+    	const size_t before = disk.writes();
+    	auto start = std::chrono::steady_clock::now();
+    	if (sparse && !fs.truncate(inumber, bytes)) {
+    	    throw std::runtime_error("truncate failed");
+	}
+    	for (size_t offset = 0; offset < bytes; offset += CHUNK) {
+    	    const size_t length = std::min(sparse ? DATA : CHUNK, bytes - offset);
+    	    for (size_t i = 0; i < length; i++) {
+    	    	data[i] = pattern(offset + i);
+	    }
+    	    if (fs.write(inumber, data.data(), length, offset) != (ssize_t)length) {
+    	    	throw std::runtime_error("the image is too small for the file");
+	    }
+	}
+    	fs.sync();
+    	disk.sync();
+    	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    	result.Writes = disk.writes() - before;
+    	result.WriteSeconds = elapsed.count();
+    }
+
+    Disk disk;
+    disk.open(path, nblocks);
+    disk.set_cache_size(0);
+
+    FileSystem fs;
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("mount failed");
+    }
+
+    const size_t before = disk.reads();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < bytes; offset += CHUNK) {
+    	const size_t length = std::min(CHUNK, bytes - offset);
+    	if (fs.read(0, data.data(), length, offset) != (ssize_t)length) {
+    	    throw std::runtime_error("read failed");
+	}
+    	for (size_t i = 0; i < length; i++) {
+    	    if (data[i] != pattern(offset + i)) {
+    	    	throw std::runtime_error("read returned the wrong contents");
+	    }
+	}
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.Reads = disk.reads() - before;
+    result.ReadSeconds = elapsed.count();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/sparse_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 131072;
+    size_t	bytes	= argc > 3 ? atol(argv[3]) << 20 : 256ul << 20;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [file MiB]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    try {
+    	results.push_back(run(path, nblocks, bytes, false, "dense"));
+    	results.push_back(run(path, nblocks, bytes, true, "sparse"));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-8s %12s %12s %12s %12s\n", "file", "writes", "write ms", "reads", "read ms");
+    for (auto &result : results) {
+    	printf("%-8s %12lu %12.1f %12lu %12.1f\n", result.Name, result.Writes, result.WriteSeconds * 1e3,
+    	       result.Reads, result.ReadSeconds * 1e3);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+// thread_bench.cpp: Read and overwrite throughput vs. number of client threads
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct Result {
+    size_t  Threads;
+    double  ReadSeconds;
+    double  WriteSeconds;
+    size_t  Bytes;
+};
+
+// Run `work(thread)` on `threads` threads and return the elapsed seconds
+template <typename Work>
+double timed(size_t threads, Work work) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t thread = 0; thread < threads; thread++) {
+    	workers.emplace_back(work, thread);
+    }
+    for (auto &worker : workers) {
+    	worker.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Every thread reads, then overwrites, its share of `files` in `chunk` sized
+// pieces; files are handed out round-robin so threads never share one
+Result run(FileSystem &fs, size_t threads, size_t files, size_t fileSize, size_t chunk) {
+    auto readFiles = [&](size_t thread) {
+    	std::vector<char> buffer(chunk);
+    	for (size_t inumber = thread; inumber < files; inumber += threads) {
+    	    for (size_t offset = 0; offset < fileSize; offset += chunk) {
+    	    	fs.read(inumber, buffer.data(), chunk, offset);
+	    }
+	}
+    };
+    auto writeFiles = [&](size_t thread) {
+    	std::vector<char> buffer(chunk, (char)thread);
+    	for (size_t inumber = thread; inumber < files; inumber += threads) {
+    	    for (size_t offset = 0; offset < fileSize; offset += chunk) {
+    	    	fs.write(inumber, buffer.data(), chunk, offset);
+	    }
+	}
+    };
+
+    double readSeconds = timed(threads, readFiles);
+    double writeSeconds = timed(threads, writeFiles);
+    return Result{threads, readSeconds, writeSeconds, files * fileSize};
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/thread_bench.img";
+    size_t	nblocks = argc > 2 ? atoi(argv[2]) : 16384;
+    size_t	maximum = argc > 3 ? atoi(argv[3]) : 8;
+    size_t	chunk	= 16 * Disk::BLOCK_SIZE;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [nblocks] [max threads]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    try {
+    	Disk disk;
+    	disk.open(path, nblocks);
+    	FileSystem::format(&disk);
+
+    	FileSystem fs;
+    	fs.mount(&disk);
+
+    	// fill about half the disk with 64-block files
+    	const size_t fileSize = 64 * Disk::BLOCK_SIZE;
+    	std::vector<char> data(fileSize);
+    	for (size_t i = 0; i < data.size(); i++) {
+    	    data[i] = rand();
+	}
+    	size_t files = 0;
+    	while ((files + 1) * 65 < nblocks / 2) {
+    	    ssize_t inumber = fs.create();
+    	    if (inumber < 0 || fs.write(inumber, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    	    	break;
+	    }
+    	    files++;
+	}
+    	fs.sync();
+
+    	for (size_t threads = 1; threads <= maximum; threads *= 2) {
+    	    results.push_back(run(fs, threads, files, fileSize, chunk));
+	}
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    printf("\n%-8s %12s %12s %12s\n", "threads", "MiB", "read MiB/s", "write MiB/s");
+    for (auto &result : results) {
+    	printf("%-8lu %12.1f %12.1f %12.1f\n", result.Threads, result.Bytes / 1048576.0,
+    	       result.Bytes / 1048576.0 / result.ReadSeconds, result.Bytes / 1048576.0 / result.WriteSeconds);
+    }
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
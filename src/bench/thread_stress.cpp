@@ -0,0 +1,190 @@
+// thread_stress.cpp: Concurrent create/write/read/remove against one FileSystem
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// A file that every thread reads while the others write their own files
+const size_t SHARED_SIZE = 64 * Disk::BLOCK_SIZE;
+
+std::atomic<size_t> Failures{0};
+
+void fail(size_t thread, const char *what, size_t inumber) {
+    fprintf(stderr, "thread %lu: %s (inode %lu)\n", thread, what, inumber);
+    Failures++;
+}
+
+char pattern(size_t inumber, size_t offset) {
+    return (char)(inumber * 131 + offset * 7 + offset / Disk::BLOCK_SIZE);
+}
+
+// Check `length` bytes of the shared file starting at `offset`
+void verifyShared(FileSystem &fs, size_t thread, size_t inumber, size_t offset, size_t length) {
+    std::vector<char> buffer(length);
+    ssize_t result = fs.read(inumber, buffer.data(), length, offset);
+    size_t expected = offset >= SHARED_SIZE ? 0 : std::min(length, SHARED_SIZE - offset);
+    if (result != (ssize_t)expected) {
+    	fail(thread, "short read of shared file", inumber);
+    	return;
+    }
+    for (size_t i = 0; i < expected; i++) {
+    	if (buffer[i] != pattern(inumber, offset + i)) {
+    	    fail(thread, "corrupt read of shared file", inumber);
+    	    return;
+	}
+    }
+}
+
+// Create a few files, write random ranges while keeping a reference copy,
+// read them back, and remove some of them again
+void worker(FileSystem &fs, size_t thread, size_t shared, size_t rounds) {
+    std::mt19937 random(thread);
+    std::vector<std::pair<ssize_t, std::vector<char>>> files;
+
+    for (size_t round = 0; round < rounds && Failures == 0; round++) {
+    	switch (random() % 6) {
+    	case 0: {
+    	    ssize_t inumber = fs.create();
+    	    if (inumber >= 0) {
+    	    	if (fs.stat(inumber) != 0) {
+    	    	    fail(thread, "new file is not empty", inumber);
+		}
+    	    	files.emplace_back(inumber, std::vector<char>());
+	    }
+    	    break;
+	}
+    	case 1:
+    	    if (!files.empty()) {
+    	    	size_t victim = random() % files.size();
+    	    	if (!fs.remove(files[victim].first)) {
+    	    	    fail(thread, "remove failed", files[victim].first);
+		}
+    	    	files.erase(files.begin() + victim);
+	    }
+    	    break;
+    	case 2:
+    	case 3:
+    	    if (!files.empty()) {
+    	    	auto &file = files[random() % files.size()];
+    	    	size_t offset = random() % (file.second.size() + 1);
+    	    	size_t length = 1 + random() % (3 * Disk::BLOCK_SIZE);
+    	    	std::vector<char> data(length);
+    	    	for (auto &c : data) {
+    	    	    c = random();
+		}
+    	    	ssize_t result = fs.write(file.first, data.data(), length, offset);
+    	    	if (result < 0) {
+    	    	    fail(thread, "write failed", file.first);
+    	    	    break;
+		}
+    	    	// a full disk may cut the write short
+    	    	if (offset + result > file.second.size()) {
+    	    	    file.second.resize(offset + result, 0);
+		}
+    	    	memcpy(file.second.data() + offset, data.data(), result);
+	    }
+    	    break;
+    	case 4:
+    	    if (!files.empty()) {
+    	    	auto &file = files[random() % files.size()];
+    	    	std::vector<char> buffer(file.second.size() + 1);
+    	    	// reading at the end of a file is an error, even at offset 0
+    	    	ssize_t expected = file.second.empty() ? -1 : file.second.size();
+    	    	ssize_t result = fs.read(file.first, buffer.data(), buffer.size(), 0);
+    	    	if (result != expected ||
+    	    	    (result > 0 && memcmp(buffer.data(), file.second.data(), result) != 0)) {
+    	    	    fail(thread, "read does not match what was written", file.first);
+		}
+    	    	if (fs.stat(file.first) != (ssize_t)file.second.size()) {
+    	    	    fail(thread, "stat does not match what was written", file.first);
+		}
+	    }
+    	    break;
+    	case 5: {
+    	    size_t offset = random() % SHARED_SIZE;
+    	    verifyShared(fs, thread, shared, offset, 1 + random() % (4 * Disk::BLOCK_SIZE));
+    	    if (round % 64 == 0) {
+    	    	fs.sync();
+	    }
+    	    break;
+	}
+	}
+    }
+
+    for (auto &file : files) {
+    	fs.remove(file.first);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *path	= argc > 1 ? argv[1] : "/tmp/thread_stress.img";
+    size_t	threads = argc > 2 ? atoi(argv[2]) : 8;
+    size_t	rounds	= argc > 3 ? atoi(argv[3]) : 2000;
+    size_t	nblocks = 4096;
+
+    if (argc > 4) {
+    	fprintf(stderr, "Usage: %s [image] [threads] [rounds]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    try {
+    	Disk disk;
+    	disk.open(path, nblocks);
+    	disk.set_cache_size(256);
+    	FileSystem::format(&disk);
+
+    	FileSystem fs;
+    	fs.mount(&disk);
+    	fs.setReadahead(16);
+
+    	ssize_t shared = fs.create();
+    	std::vector<char> data(SHARED_SIZE);
+    	for (size_t i = 0; i < data.size(); i++) {
+    	    data[i] = pattern(shared, i);
+	}
+    	if (shared < 0 || fs.write(shared, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    	    fprintf(stderr, "could not create shared file\n");
+    	    return EXIT_FAILURE;
+	}
+
+    	std::vector<std::thread> workers;
+    	for (size_t thread = 0; thread < threads; thread++) {
+    	    workers.emplace_back(worker, std::ref(fs), thread, shared, rounds);
+	}
+    	for (auto &thread : workers) {
+    	    thread.join();
+	}
+
+    	// everything but the shared file is gone, and its blocks with it
+    	fs.unmount();
+    	fs.mount(&disk);
+    	verifyShared(fs, 0, shared, 0, SHARED_SIZE);
+    	if (fs.stat(shared) != (ssize_t)SHARED_SIZE) {
+    	    fail(0, "shared file lost after remount", shared);
+	}
+    	for (size_t inumber = 0; inumber < 4 * FileSystem::INODES_PER_BLOCK; inumber++) {
+    	    if (inumber != (size_t)shared && fs.stat(inumber) >= 0) {
+    	    	fail(0, "removed file survived remount", inumber);
+	    }
+	}
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    	unlink(path);
+    	return EXIT_FAILURE;
+    }
+
+    unlink(path);
+    printf("%lu failures\n", Failures.load());
+    return Failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
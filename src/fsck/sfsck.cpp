@@ -0,0 +1,88 @@
+// sfsck.cpp: Check a file system image, and repair it
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <stdexcept>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Exit status, as with other fsck programs
+
+const int FSCK_OK	 = 0;	// no problems
+const int FSCK_REPAIRED	 = 1;	// problems, all repaired
+const int FSCK_PROBLEMS	 = 4;	// problems left as they are
+const int FSCK_ERROR	 = 8;	// the image could not be checked
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-r] [-j threads] <diskfile>\n", program);
+    fprintf(stderr, "    -r          repair the problems found\n");
+    fprintf(stderr, "    -j threads  scan the inode table with this many threads\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool   repair  = false;
+    size_t threads = 0;
+    int	   option;
+
+    while ((option = getopt(argc, argv, "rj:")) != -1) {
+    	switch (option) {
+    	    case 'r':
+    	    	repair = true;
+    	    	break;
+    	    case 'j':
+    	    	threads = atoi(optarg);
+    	    	break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return FSCK_ERROR;
+	}
+    }
+
+    if (argc - optind != 1) {
+    	usage(argv[0]);
+    	return FSCK_ERROR;
+    }
+
+    // the image is opened at the size it has, which open would change
+    const char *path = argv[optind];
+    struct stat st;
+    if (stat(path, &st) < 0 || st.st_size < (off_t)Disk::BLOCK_SIZE) {
+    	fprintf(stderr, "Unable to open disk %s\n", path);
+    	return FSCK_ERROR;
+    }
+
+    Disk disk;
+    try {
+    	disk.open(path, st.st_size / Disk::BLOCK_SIZE);
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", path, e.what());
+    	return FSCK_ERROR;
+    }
+
+    FileSystem fs;
+    fs.setMountThreads(threads);
+    FileSystem::CheckReport report;
+    bool checked = fs.check(&disk, repair, report);
+    for (auto &problem : report.Problems) {
+    	printf("%s\n", problem.c_str());
+    }
+    if (!checked) {
+    	printf("%s could not be checked.\n", path);
+    	return FSCK_ERROR;
+    }
+
+    printf("%lu inodes, %lu blocks in use.\n", report.Inodes, report.Blocks);
+    if (!report.Clean) {
+    	printf("not unmounted cleanly; the next mount rebuilds the bitmap.\n");
+    }
+    if (report.Problems.empty()) {
+    	printf("no problems found.\n");
+    	return FSCK_OK;
+    }
+    printf("%lu problems %s.\n", report.Problems.size(), repair ? "repaired" : "found");
+    return repair ? FSCK_REPAIRED : FSCK_PROBLEMS;
+}
@@ -0,0 +1,403 @@
+// async_disk.cpp: Asynchronous disk emulator
+
+#include "sfs/async_disk.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// <linux/fs.h> defines BLOCK_SIZE as 1024, which would shadow Disk::BLOCK_SIZE
+#undef BLOCK_SIZE
+
+// The kernel interface is used directly so there is no liburing dependency
+struct AsyncDisk::Ring {
+    int		FileDescriptor;
+    void       *SqPtr;
+    size_t	SqSize;
+    void       *CqPtr;
+    size_t	CqSize;
+    unsigned   *SqTail;
+    unsigned   *SqMask;
+    unsigned   *SqArray;
+    unsigned   *CqHead;
+    unsigned   *CqTail;
+    unsigned   *CqMask;
+    struct io_uring_sqe *Sqes;
+    size_t	SqesSize;
+    struct io_uring_cqe *Cqes;
+};
+
+bool AsyncDisk::setup_uring() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, QueueDepth, &params);
+    if (fd < 0) {
+    	return false;
+    }
+
+    Ring *ring = new Ring;
+    ring->FileDescriptor = fd;
+    ring->SqSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    ring->CqSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	ring->SqSize = ring->CqSize = std::max(ring->SqSize, ring->CqSize);
+    }
+    ring->SqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+
+    ring->SqPtr = mmap(NULL, ring->SqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	ring->CqPtr = ring->SqPtr;
+    } else {
+    	ring->CqPtr = mmap(NULL, ring->CqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = mmap(NULL, ring->SqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (ring->SqPtr == MAP_FAILED || ring->CqPtr == MAP_FAILED || sqes == MAP_FAILED) {
+    	if (sqes != MAP_FAILED) munmap(sqes, ring->SqesSize);
+    	if (ring->CqPtr != MAP_FAILED && ring->CqPtr != ring->SqPtr) munmap(ring->CqPtr, ring->CqSize);
+    	if (ring->SqPtr != MAP_FAILED) munmap(ring->SqPtr, ring->SqSize);
+    	close(fd);
+    	delete ring;
+    	return false;
+    }
+
+    char *sq = (char *)ring->SqPtr;
+    char *cq = (char *)ring->CqPtr;
+    ring->SqTail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->SqMask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->SqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->CqHead  = (unsigned *)(cq + params.cq_off.head);
+    ring->CqTail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->CqMask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->Sqes    = (struct io_uring_sqe *)sqes;
+    ring->Cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    Uring = ring;
+    Slots.resize(QueueDepth);
+    FreeSlots.clear();
+    for (size_t slot = 0; slot < QueueDepth; slot++) {
+    	FreeSlots.push_back(slot);
+    }
+    return true;
+}
+
+void AsyncDisk::teardown_uring() {
+    munmap(Uring->Sqes, Uring->SqesSize);
+    if (Uring->CqPtr != Uring->SqPtr) {
+    	munmap(Uring->CqPtr, Uring->CqSize);
+    }
+    munmap(Uring->SqPtr, Uring->SqSize);
+    close(Uring->FileDescriptor);
+    delete Uring;
+    Uring = nullptr;
+}
+
+void AsyncDisk::reap_uring(bool wait) {
+    unsigned head = *Uring->CqHead;
+    unsigned tail = __atomic_load_n(Uring->CqTail, __ATOMIC_ACQUIRE);
+
+    while (wait && head == tail) {
+    	if (syscall(__NR_io_uring_enter, Uring->FileDescriptor, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to wait for io_uring: %s", strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	tail = __atomic_load_n(Uring->CqTail, __ATOMIC_ACQUIRE);
+    }
+
+    for (; head != tail; head++) {
+    	struct io_uring_cqe *cqe = &Uring->Cqes[head & *Uring->CqMask];
+    	size_t slot = cqe->user_data;
+    	Request &request = Slots[slot];
+
+    	if (cqe->res < 0) {
+    	    if (Error.empty()) {
+    	    	char what[BUFSIZ];
+    	    	snprintf(what, BUFSIZ, "Unable to %s %d: %s", request.Write ? "write" : "read", request.Block, strerror(-cqe->res));
+    	    	Error = what;
+	    }
+	} else {
+    	    // Finish short transfers synchronously
+    	    std::string error = transfer(request, cqe->res);
+    	    if (!error.empty() && Error.empty()) {
+    	    	Error = error;
+	    }
+	}
+
+    	request.Iov.clear();
+    	FreeSlots.push_back(slot);
+    	Inflight--;
+    }
+
+    __atomic_store_n(Uring->CqHead, head, __ATOMIC_RELEASE);
+}
+#else
+struct AsyncDisk::Ring {};
+
+bool AsyncDisk::setup_uring() { return false; }
+void AsyncDisk::teardown_uring() {}
+void AsyncDisk::reap_uring(bool wait) {}
+#endif
+
+void AsyncDisk::open(const char *path, size_t nblocks) {
+    Disk::open(path, nblocks);
+
+    if (Uring != nullptr || !Workers.empty() || setup_uring()) {
+    	return;
+    }
+
+    // No io_uring: a few threads doing positional I/O keep requests in flight
+    size_t nworkers = std::min(QueueDepth, (size_t)8);
+    for (size_t i = 0; i < nworkers; i++) {
+    	Workers.push_back(std::thread(&AsyncDisk::work, this));
+    }
+}
+
+AsyncDisk::~AsyncDisk() {
+    try {
+    	sync();
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    }
+
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	Stopping = true;
+    }
+    Pending.notify_all();
+    for (auto &worker : Workers) {
+    	worker.join();
+    }
+
+    if (Uring != nullptr) {
+    	teardown_uring();
+    }
+}
+
+void AsyncDisk::work() {
+    while (true) {
+    	Request request;
+    	{
+    	    std::unique_lock<std::mutex> lock(Lock);
+    	    Pending.wait(lock, [this]() { return Stopping || !Queue.empty(); });
+    	    if (Queue.empty()) {
+    	    	return;
+	    }
+    	    request = std::move(Queue.front());
+    	    Queue.pop_front();
+	}
+
+    	std::string error = transfer(request, 0);
+
+    	{
+    	    std::lock_guard<std::mutex> guard(Lock);
+    	    if (!error.empty() && Error.empty()) {
+    	    	Error = error;
+	    }
+    	    Inflight--;
+	}
+    	Completed.notify_all();
+    }
+}
+
+std::string AsyncDisk::transfer(Request &request, size_t done) {
+    std::vector<struct iovec> iov = request.Iov;
+    off_t offset = (off_t)request.Block*BLOCK_SIZE + done;
+
+    // Skip what has already been transferred
+    size_t first = 0;
+    while (first < iov.size() && done >= iov[first].iov_len) {
+    	done -= iov[first++].iov_len;
+    }
+    if (first < iov.size()) {
+    	iov[first].iov_base = (char *)iov[first].iov_base + done;
+    	iov[first].iov_len -= done;
+    }
+
+    while (first < iov.size()) {
+    	int iovcnt = iov.size() - first;
+    	ssize_t result = request.Write ? pwritev(FileDescriptor, &iov[first], iovcnt, offset)
+				       : preadv(FileDescriptor, &iov[first], iovcnt, offset);
+    	if (result <= 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to %s %d: %s", request.Write ? "write" : "read", request.Block, strerror(errno));
+    	    return what;
+	}
+
+    	offset += result;
+    	while (first < iov.size() && (size_t)result >= iov[first].iov_len) {
+    	    result -= iov[first++].iov_len;
+	}
+    	if (first < iov.size()) {
+    	    iov[first].iov_base = (char *)iov[first].iov_base + result;
+    	    iov[first].iov_len -= result;
+	}
+    }
+
+    return "";
+}
+
+void AsyncDisk::submit(Request &&request) {
+#ifdef HAVE_IO_URING
+    if (Uring != nullptr) {
+    	std::lock_guard<std::mutex> guard(RingLock);
+    	while (Inflight >= QueueDepth || FreeSlots.empty()) {
+    	    reap_uring(true);
+	}
+
+    	size_t slot = FreeSlots.back();
+    	FreeSlots.pop_back();
+    	Slots[slot] = std::move(request);
+    	Request &queued = Slots[slot];
+
+    	unsigned tail  = *Uring->SqTail;
+    	unsigned index = tail & *Uring->SqMask;
+    	struct io_uring_sqe *sqe = &Uring->Sqes[index];
+    	memset(sqe, 0, sizeof(*sqe));
+    	sqe->opcode    = queued.Write ? IORING_OP_WRITEV : IORING_OP_READV;
+    	sqe->fd	       = FileDescriptor;
+    	sqe->addr      = (unsigned long)queued.Iov.data();
+    	sqe->len       = queued.Iov.size();
+    	sqe->off       = (off_t)queued.Block*BLOCK_SIZE;
+    	sqe->user_data = slot;
+    	Uring->SqArray[index] = index;
+    	__atomic_store_n(Uring->SqTail, tail + 1, __ATOMIC_RELEASE);
+    	Inflight++;
+
+    	while (syscall(__NR_io_uring_enter, Uring->FileDescriptor, 1, 0, 0, NULL, 0) < 0) {
+    	    if (errno != EINTR && errno != EAGAIN) {
+    	    	char what[BUFSIZ];
+    	    	snprintf(what, BUFSIZ, "Unable to submit to io_uring: %s", strerror(errno));
+    	    	throw std::runtime_error(what);
+	    }
+	}
+
+    	// Opportunistically free slots without blocking
+    	reap_uring(false);
+    	return;
+    }
+#endif
+
+    {
+    	std::unique_lock<std::mutex> lock(Lock);
+    	Completed.wait(lock, [this]() { return Inflight < QueueDepth; });
+    	Queue.push_back(std::move(request));
+    	Inflight++;
+    }
+    Pending.notify_one();
+}
+
+void AsyncDisk::complete() {
+    std::string error;
+
+    if (Uring != nullptr) {
+    	std::lock_guard<std::mutex> guard(RingLock);
+    	while (Inflight > 0) {
+    	    reap_uring(true);
+	}
+    	error.swap(Error);
+    } else {
+    	std::unique_lock<std::mutex> lock(Lock);
+    	Completed.wait(lock, [this]() { return Inflight == 0; });
+    	error.swap(Error);
+    }
+
+    if (!error.empty()) {
+    	throw std::runtime_error(error);
+    }
+}
+
+void AsyncDisk::read_blocks(int blocknum, struct iovec *iov, int iovcnt) {
+    Request request{false, blocknum, {}};
+    size_t  nblocks = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+    	char  *base = (char *)iov[i].iov_base;
+    	size_t left = iov[i].iov_len;
+    	while (left > 0) {
+    	    size_t length = std::min(left, (MAX_REQUEST_BLOCKS - nblocks)*BLOCK_SIZE);
+    	    request.Iov.push_back(iovec{base, length});
+    	    base    += length;
+    	    left    -= length;
+    	    nblocks += length / BLOCK_SIZE;
+    	    if (nblocks == MAX_REQUEST_BLOCKS) {
+    	    	int next = request.Block + nblocks;
+    	    	submit(std::move(request));
+    	    	request = Request{false, next, {}};
+    	    	nblocks = 0;
+	    }
+	}
+    	Reads += iov[i].iov_len / BLOCK_SIZE;
+    }
+
+    if (nblocks > 0) {
+    	submit(std::move(request));
+    }
+}
+
+void AsyncDisk::write_blocks(int blocknum, struct iovec *iov, int iovcnt) {
+    Request request{true, blocknum, {}};
+    size_t  nblocks = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+    	char  *base = (char *)iov[i].iov_base;
+    	size_t left = iov[i].iov_len;
+    	while (left > 0) {
+    	    size_t length = std::min(left, (MAX_REQUEST_BLOCKS - nblocks)*BLOCK_SIZE);
+    	    request.Iov.push_back(iovec{base, length});
+    	    base    += length;
+    	    left    -= length;
+    	    nblocks += length / BLOCK_SIZE;
+    	    if (nblocks == MAX_REQUEST_BLOCKS) {
+    	    	int next = request.Block + nblocks;
+    	    	submit(std::move(request));
+    	    	request = Request{true, next, {}};
+    	    	nblocks = 0;
+	    }
+	}
+    	Writes += iov[i].iov_len / BLOCK_SIZE;
+    }
+
+    if (nblocks > 0) {
+    	submit(std::move(request));
+    }
+}
+
+void AsyncDisk::submit_read(int blocknum, size_t nblocks, char *data) {
+    for (size_t i = 0; i < nblocks; i++) {
+    	sanity_check(blocknum + i, data);
+    	// The image must hold the latest contents before it is read around the cache
+    	sync(blocknum + i);
+    }
+
+    struct iovec iov = {data, nblocks*BLOCK_SIZE};
+    read_blocks(blocknum, &iov, 1);
+}
+
+void AsyncDisk::submit_write(int blocknum, size_t nblocks, char *data) {
+    for (size_t i = 0; i < nblocks; i++) {
+    	sanity_check(blocknum + i, data);
+    	// Keep any cached copy coherent with what is about to be written
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	Cache.update(blocknum + i, data + i*BLOCK_SIZE, false);
+    }
+
+    struct iovec iov = {data, nblocks*BLOCK_SIZE};
+    write_blocks(blocknum, &iov, 1);
+}
@@ -0,0 +1,182 @@
+// bitmap.cpp: Free-space bitmap
+
+#include "sfs/bitmap.h"
+
+void Bitmap::assign(size_t bits, bool free) {
+    Bits   = bits;
+    Free   = free ? bits : 0;
+    Cursor = 0;
+    Words.assign((bits + 63) / 64, free ? ~0ull : 0);
+    Summary.assign((Words.size() + 63) / 64, 0);
+
+    // Bits past the end must never look free
+    if (free && bits % 64) {
+    	Words.back() = (1ull << (bits % 64)) - 1;
+    }
+    for (size_t word = 0; word < Words.size(); word++) {
+    	summarize(word);
+    }
+}
+
+void Bitmap::set(size_t index) {
+    uint64_t &word = Words[index / 64];
+    uint64_t  mask = 1ull << (index % 64);
+    if (!(word & mask)) {
+    	word |= mask;
+    	Free++;
+    	summarize(index / 64);
+    }
+}
+
+void Bitmap::reset(size_t index) {
+    uint64_t &word = Words[index / 64];
+    uint64_t  mask = 1ull << (index % 64);
+    if (word & mask) {
+    	word &= ~mask;
+    	Free--;
+    	summarize(index / 64);
+    }
+}
+
+void Bitmap::assignWord(size_t index, uint64_t bits) {
+    if (index == Words.size() - 1 && Bits % 64) {
+    	bits &= (1ull << (Bits % 64)) - 1;
+    }
+    Free += __builtin_popcountll(bits);
+    Free -= __builtin_popcountll(Words[index]);
+    Words[index] = bits;
+    summarize(index);
+}
+
+size_t Bitmap::find(size_t index) const {
+    if (index >= Bits) {
+    	return Bits;
+    }
+
+    // Rest of the word containing index
+    size_t   word = index / 64;
+    uint64_t bits = Words[word] & (~0ull << (index % 64));
+    if (bits) {
+    	return word*64 + __builtin_ctzll(bits);
+    }
+
+    // Skip empty words 64 at a time through the summary
+    word++;
+    size_t group = word / 64;
+    if (group >= Summary.size()) {
+    	return Bits;
+    }
+    uint64_t summary = word % 64 ? Summary[group] & (~0ull << (word % 64)) : Summary[group];
+    while (!summary) {
+    	if (++group >= Summary.size()) {
+    	    return Bits;
+	}
+    	summary = Summary[group];
+    }
+
+    word = group*64 + __builtin_ctzll(summary);
+    return word*64 + __builtin_ctzll(Words[word]);
+}
+
+ssize_t Bitmap::allocate() {
+    size_t length;
+    return allocateRun(1, length);
+}
+
+size_t Bitmap::run(size_t index, size_t n) const {
+    // Extend the run a word at a time
+    size_t end = index;
+    while (end < Bits && end - index < n) {
+    	size_t   offset = end % 64;
+    	uint64_t bits   = Words[end / 64] >> offset;
+    	size_t   ones   = ~bits ? __builtin_ctzll(~bits) : 64;
+    	end += ones;
+    	if (offset + ones < 64) {
+    	    break;
+	}
+    }
+    if (end > Bits) {
+    	end = Bits;
+    }
+    return end - index < n ? end - index : n;
+}
+
+void Bitmap::take(size_t start, size_t end) {
+    // Clear the run a word at a time
+    for (size_t index = start; index < end;) {
+    	size_t   word  = index / 64;
+    	size_t   first = index % 64;
+    	size_t   count = end - index < 64 - first ? end - index : 64 - first;
+    	uint64_t mask  = count == 64 ? ~0ull : ((1ull << count) - 1) << first;
+    	Words[word] &= ~mask;
+    	summarize(word);
+    	index += count;
+    }
+
+    Free  -= end - start;
+    Cursor = end < Bits ? end : 0;
+}
+
+ssize_t Bitmap::allocateRun(size_t n, size_t &length) {
+    length = 0;
+    if (Free == 0 || n == 0) {
+    	return -1;
+    }
+
+    size_t start = find(Cursor);
+    if (start >= Bits) {
+    	start = find(0);
+    }
+
+    length = run(start, n);
+    take(start, start + length);
+    return start;
+}
+
+ssize_t Bitmap::allocateExtent(size_t n, size_t goal, size_t &length) {
+    length = 0;
+    if (Free == 0 || n == 0) {
+    	return -1;
+    }
+
+    // Growing the previous run keeps the file in one extent
+    if (goal < Bits && test(goal)) {
+    	length = run(goal, n);
+    	take(goal, goal + length);
+    	return goal;
+    }
+
+    // Otherwise walk the free runs from the cursor, wrapping around once,
+    // and give up on finding n blocks after a bounded number of them
+    const size_t MAX_RUNS = 1024;
+    size_t best = Bits, bestLength = 0, runs = 0;
+    size_t index = find(Cursor);
+    bool wrapped = false;
+    while (runs < MAX_RUNS) {
+    	if (index >= Bits) {
+    	    if (wrapped || Cursor == 0) {
+    	    	break;
+	    }
+    	    wrapped = true;
+    	    index = find(0);
+    	    continue;
+	}
+    	if (wrapped && index >= Cursor) {
+    	    break;
+	}
+    	size_t found = run(index, n);
+    	if (found > bestLength) {
+    	    best = index;
+    	    bestLength = found;
+	}
+    	if (found == n) {
+    	    break;
+	}
+    	index = find(index + found);
+    	runs++;
+    }
+
+    length = bestLength;
+    take(best, best + length);
+    return best;
+}
@@ -0,0 +1,104 @@
+// cache.cpp: LRU block cache
+
+#include "sfs/cache.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+void BlockCache::evict(const Writer &writer) {
+    Entry &victim = Entries.back();
+    if (victim.Dirty) {
+    	writer(victim.Block, victim.Data.data());
+    }
+    Index.erase(victim.Block);
+    Entries.pop_back();
+}
+
+size_t BlockCache::resize(size_t capacity, const Writer &writer) {
+    size_t evicted = 0;
+
+    Capacity = capacity;
+    while (Entries.size() > Capacity) {
+    	evict(writer);
+    	evicted++;
+    }
+    return evicted;
+}
+
+bool BlockCache::lookup(int blocknum, char *data) {
+    auto it = Index.find(blocknum);
+    if (it == Index.end()) {
+    	return false;
+    }
+
+    Entries.splice(Entries.begin(), Entries, it->second);
+    memcpy(data, it->second->Data.data(), BlockSize);
+    return true;
+}
+
+bool BlockCache::insert(int blocknum, const char *data, bool dirty, const Writer &writer) {
+    if (Capacity == 0) {
+    	return false;
+    }
+
+    auto it = Index.find(blocknum);
+    if (it != Index.end()) {
+    	Entries.splice(Entries.begin(), Entries, it->second);
+    	memcpy(it->second->Data.data(), data, BlockSize);
+    	it->second->Dirty = it->second->Dirty || dirty;
+    	return false;
+    }
+
+    bool evicted = false;
+    if (Entries.size() >= Capacity) {
+    	evict(writer);
+    	evicted = true;
+    }
+
+    Entries.push_front(Entry{blocknum, dirty, std::vector<char>(data, data + BlockSize)});
+    Index[blocknum] = Entries.begin();
+    return evicted;
+}
+
+bool BlockCache::update(int blocknum, const char *data, bool dirty) {
+    auto it = Index.find(blocknum);
+    if (it == Index.end()) {
+    	return false;
+    }
+
+    memcpy(it->second->Data.data(), data, BlockSize);
+    it->second->Dirty = dirty;
+    return true;
+}
+
+bool BlockCache::flush(int blocknum, const Writer &writer) {
+    auto it = Index.find(blocknum);
+    if (it == Index.end() || !it->second->Dirty) {
+    	return false;
+    }
+
+    writer(blocknum, it->second->Data.data());
+    it->second->Dirty = false;
+    return true;
+}
+
+size_t BlockCache::flush(const Writer &writer) {
+    std::vector<Entry *> dirty;
+    for (auto &entry : Entries) {
+    	if (entry.Dirty) {
+    	    dirty.push_back(&entry);
+	}
+    }
+
+    // Ascending order keeps write-back as sequential as possible
+    std::sort(dirty.begin(), dirty.end(), [](const Entry *a, const Entry *b) {
+    	return a->Block < b->Block;
+    });
+
+    for (auto entry : dirty) {
+    	writer(entry->Block, entry->Data.data());
+    	entry->Dirty = false;
+    }
+    return dirty.size();
+}
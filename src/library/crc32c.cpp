@@ -0,0 +1,172 @@
+// crc32c.cpp: CRC-32C (Castagnoli) checksums
+
+#include "sfs/crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+// Reflected Castagnoli polynomial
+const uint32_t POLYNOMIAL = 0x82f63b78;
+
+// Tables[k][b] is the CRC of byte b followed by k zero bytes, so eight
+// lookups advance the CRC by eight bytes at once
+struct Tables {
+    uint32_t Entries[8][256];
+
+    Tables() {
+    	for (uint32_t b = 0; b < 256; b++) {
+    	    uint32_t crc = b;
+    	    for (int bit = 0; bit < 8; bit++) {
+    	    	crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+	    }
+    	    Entries[0][b] = crc;
+	}
+    	for (uint32_t b = 0; b < 256; b++) {
+    	    for (int k = 1; k < 8; k++) {
+    	    	Entries[k][b] = (Entries[k - 1][b] >> 8) ^ Entries[0][Entries[k - 1][b] & 0xff];
+	    }
+	}
+    }
+};
+
+const Tables &tables() {
+    static const Tables instance;
+    return instance;
+}
+
+// Multiply a and b modulo the polynomial, bit-reflected as the CRC is
+uint32_t multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+    	if (a & m) {
+    	    product ^= b;
+	}
+    	b = b & 1 ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+// The hardware kernel runs three streams of STRIDE bytes side by side,
+// since the crc32 instruction can start every cycle but takes three to
+// finish. Shifts[k][b] moves byte k of a CRC past STRIDE zero bytes, which
+// is how the streams are put back together.
+const size_t STRIDE = 1360;
+
+struct Shifts {
+    uint32_t Entries[4][256];
+
+    Shifts() {
+    	// x^(8 * STRIDE), starting from x^0, which is the top bit reflected
+    	uint32_t power = 1u << 31;
+    	for (size_t i = 0; i < 8 * STRIDE; i++) {
+    	    power = multiply(power, 1u << 30);
+	}
+    	for (int k = 0; k < 4; k++) {
+    	    for (uint32_t b = 0; b < 256; b++) {
+    	    	Entries[k][b] = multiply(power, b << (8 * k));
+	    }
+	}
+    }
+
+    uint32_t shift(uint32_t crc) const {
+    	return Entries[0][crc & 0xff] ^ Entries[1][(crc >> 8) & 0xff] ^ Entries[2][(crc >> 16) & 0xff] ^
+    	       Entries[3][crc >> 24];
+    }
+};
+
+const Shifts &shifts() {
+    static const Shifts instance;
+    return instance;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32Hardware(const char *data, size_t length, uint32_t crc) {
+    uint64_t value = ~crc;
+    // Bytes up to an 8-byte boundary, then whole words
+    while (length > 0 && ((uintptr_t)data & 7)) {
+    	value = _mm_crc32_u8(value, *data++);
+    	length--;
+    }
+    if (length >= 3 * STRIDE) {
+    	const Shifts &table = shifts();
+    	do {
+    	    uint64_t second = 0, third = 0;
+    	    for (size_t i = 0; i < STRIDE; i += 8) {
+    	    	uint64_t words[3];
+    	    	memcpy(&words[0], data + i, 8);
+    	    	memcpy(&words[1], data + STRIDE + i, 8);
+    	    	memcpy(&words[2], data + 2 * STRIDE + i, 8);
+    	    	value  = _mm_crc32_u64(value, words[0]);
+    	    	second = _mm_crc32_u64(second, words[1]);
+    	    	third  = _mm_crc32_u64(third, words[2]);
+	    }
+    	    value   = table.shift(table.shift(value) ^ second) ^ third;
+    	    data   += 3 * STRIDE;
+    	    length -= 3 * STRIDE;
+	} while (length >= 3 * STRIDE);
+    }
+    while (length >= 8) {
+    	uint64_t word;
+    	memcpy(&word, data, sizeof(word));
+    	value = _mm_crc32_u64(value, word);
+    	data   += 8;
+    	length -= 8;
+    }
+    while (length > 0) {
+    	value = _mm_crc32_u8(value, *data++);
+    	length--;
+    }
+    return ~(uint32_t)value;
+}
+#endif
+
+}
+
+uint32_t CRC32C::computeTable(const char *data, size_t length, uint32_t crc) {
+    const auto &t = tables().Entries;
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    while (length >= 8) {
+    	uint32_t low, high;
+    	memcpy(&low, p, sizeof(low));
+    	memcpy(&high, p + 4, sizeof(high));
+    	low ^= crc;
+    	crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+    	      t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+    	p      += 8;
+    	length -= 8;
+    }
+    while (length > 0) {
+    	crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    	length--;
+    }
+    return ~crc;
+}
+
+uint32_t CRC32C::computeHardware(const char *data, size_t length, uint32_t crc) {
+#if defined(__x86_64__)
+    return crc32Hardware(data, length, crc);
+#else
+    return computeTable(data, length, crc);
+#endif
+}
+
+bool CRC32C::hardware() {
+#if defined(__x86_64__)
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+uint32_t CRC32C::compute(const char *data, size_t length, uint32_t crc) {
+    static uint32_t (*const kernel)(const char *, size_t, uint32_t) = hardware() ? computeHardware : computeTable;
+    return kernel(data, length, crc);
+}
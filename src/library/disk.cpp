@@ -6,6 +6,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -26,12 +27,21 @@ void Disk::open(const char *path, size_t nblocks) {
     Blocks = nblocks;
     Reads  = 0;
     Writes = 0;
+    CacheHits	   = 0;
+    CacheMisses	   = 0;
+    CacheEvictions = 0;
 }
 
 Disk::~Disk() {
     if (FileDescriptor > 0) {
-    	printf("%lu disk block reads\n", Reads);
-    	printf("%lu disk block writes\n", Writes);
+    	sync();
+    	printf("%lu disk block reads\n", Reads.load());
+    	printf("%lu disk block writes\n", Writes.load());
+    	if (Cache.capacity() > 0) {
+    	    printf("%lu cache hits\n", CacheHits.load());
+    	    printf("%lu cache misses\n", CacheMisses.load());
+    	    printf("%lu cache evictions\n", CacheEvictions.load());
+	}
     	close(FileDescriptor);
     	FileDescriptor = 0;
     }
@@ -56,38 +66,274 @@ void Disk::sanity_check(int blocknum, char *data) {
     }
 }
 
+void Disk::read_blocks(int blocknum, struct iovec *iov, int iovcnt) {
+    off_t  offset = (off_t)blocknum*BLOCK_SIZE;
+    size_t nbytes = 0;
+    for (int i = 0; i < iovcnt; i++) {
+    	nbytes += iov[i].iov_len;
+    }
+
+    // Positional I/O leaves the shared file offset alone; loop on short reads
+    while (iovcnt > 0) {
+    	ssize_t result = iovcnt == 1 ? pread(FileDescriptor, iov->iov_base, iov->iov_len, offset)
+				     : preadv(FileDescriptor, iov, iovcnt, offset);
+    	if (result <= 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+
+    	offset += result;
+    	while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+    	    result -= iov->iov_len;
+    	    iov++;
+    	    iovcnt--;
+	}
+    	if (iovcnt > 0) {
+    	    iov->iov_base = (char *)iov->iov_base + result;
+    	    iov->iov_len -= result;
+	}
+    }
+
+    Reads += nbytes / BLOCK_SIZE;
+}
+
+void Disk::write_blocks(int blocknum, struct iovec *iov, int iovcnt) {
+    off_t  offset = (off_t)blocknum*BLOCK_SIZE;
+    size_t nbytes = 0;
+    for (int i = 0; i < iovcnt; i++) {
+    	nbytes += iov[i].iov_len;
+    }
+
+    while (iovcnt > 0) {
+    	ssize_t result = iovcnt == 1 ? pwrite(FileDescriptor, iov->iov_base, iov->iov_len, offset)
+				     : pwritev(FileDescriptor, iov, iovcnt, offset);
+    	if (result <= 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+
+    	offset += result;
+    	while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+    	    result -= iov->iov_len;
+    	    iov++;
+    	    iovcnt--;
+	}
+    	if (iovcnt > 0) {
+    	    iov->iov_base = (char *)iov->iov_base + result;
+    	    iov->iov_len -= result;
+	}
+    }
+
+    Writes += nbytes / BLOCK_SIZE;
+}
+
+void Disk::read_block(int blocknum, char *data) {
+    struct iovec iov = {data, BLOCK_SIZE};
+    read_blocks(blocknum, &iov, 1);
+    wait();
+}
+
+void Disk::write_block(int blocknum, const char *data) {
+    struct iovec iov = {const_cast<char *>(data), BLOCK_SIZE};
+    write_blocks(blocknum, &iov, 1);
+    wait();
+}
+
+bool Disk::zero_blocks(int blocknum, size_t nblocks) {
+#ifdef FALLOC_FL_ZERO_RANGE
+    off_t offset = (off_t)blocknum*BLOCK_SIZE;
+    off_t length = (off_t)nblocks*BLOCK_SIZE;
+
+    // Zero the range in place, or failing that deallocate it; holes read
+    // back as zeros and the image keeps its size
+    if (fallocate(FileDescriptor, FALLOC_FL_ZERO_RANGE, offset, length) == 0 ||
+	fallocate(FileDescriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+    	Writes += nblocks;
+    	return true;
+    }
+#endif
+    return false;
+}
+
+BlockCache::Writer Disk::write_back() {
+    return [this](int blocknum, const char *data) { write_block(blocknum, data); };
+}
+
+void Disk::set_cache_size(size_t nblocks) {
+    std::lock_guard<std::mutex> guard(CacheLock);
+    CacheEvictions += Cache.resize(nblocks, write_back());
+}
+
+void Disk::sync() {
+    {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	Cache.flush(write_back());
+    }
+    flush();
+}
+
+void Disk::sync(int blocknum) {
+    std::lock_guard<std::mutex> guard(CacheLock);
+    Cache.flush(blocknum, write_back());
+}
+
 void Disk::read(int blocknum, char *data) {
     sanity_check(blocknum, data);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    if (Cache.capacity() == 0) {
+    	read_block(blocknum, data);
+    	return;
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	if (Cache.lookup(blocknum, data)) {
+    	    CacheHits++;
+    	    return;
+	}
     }
 
-    Reads++;
+    CacheMisses++;
+    read_block(blocknum, data);
+
+    // Another thread may have cached a newer copy while the lock was dropped
+    std::lock_guard<std::mutex> guard(CacheLock);
+    if (!Cache.lookup(blocknum, data) && Cache.insert(blocknum, data, false, write_back())) {
+    	CacheEvictions++;
+    }
 }
 
 void Disk::write(int blocknum, char *data) {
     sanity_check(blocknum, data);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    if (Cache.capacity() == 0) {
+    	write_block(blocknum, data);
+    	return;
     }
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    // Write-back: the block only reaches the image on eviction or sync
+    std::lock_guard<std::mutex> guard(CacheLock);
+    if (Cache.insert(blocknum, data, true, write_back())) {
+    	CacheEvictions++;
+    }
+}
+
+void Disk::read(int blocknum, size_t nblocks, char *data) {
+    std::vector<Request> requests(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	requests[i] = Request{blocknum + (int)i, data + i*BLOCK_SIZE};
+    }
+    readv(requests);
+}
+
+void Disk::write(int blocknum, size_t nblocks, char *data) {
+    std::vector<Request> requests(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	requests[i] = Request{blocknum + (int)i, data + i*BLOCK_SIZE};
+    }
+    writev(requests);
+}
+
+void Disk::zero(int blocknum, size_t nblocks) {
+    static const char zeros[BLOCK_SIZE] = {0};
+
+    if (nblocks == 0) {
+    	return;
+    }
+    sanity_check(blocknum, const_cast<char *>(zeros));
+    sanity_check(blocknum + nblocks - 1, const_cast<char *>(zeros));
+
+    if (!zero_blocks(blocknum, nblocks)) {
+    	// Every iovec points at the same zeroed block
+    	for (size_t done = 0; done < nblocks; ) {
+    	    size_t count = nblocks - done < IOV_MAX ? nblocks - done : IOV_MAX;
+    	    std::vector<struct iovec> run(count, iovec{const_cast<char *>(zeros), BLOCK_SIZE});
+    	    write_blocks(blocknum + done, run.data(), count);
+    	    wait();
+    	    done += count;
+	}
+    }
+
+    std::lock_guard<std::mutex> guard(CacheLock);
+    if (Cache.size() > 0) {
+    	for (size_t i = 0; i < nblocks; i++) {
+    	    Cache.update(blocknum + i, zeros, false);
+	}
     }
+}
+
+void Disk::readv(const std::vector<Request> &requests) {
+    std::vector<const Request *> misses;
+    std::vector<struct iovec> run;
+    int first = 0;
+
+    for (auto &request : requests) {
+    	sanity_check(request.Block, request.Data);
+    }
+
+    // Cached blocks (possibly dirty) take precedence over the image
+    if (Cache.capacity() > 0) {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	for (auto &request : requests) {
+    	    if (Cache.lookup(request.Block, request.Data)) {
+    	    	CacheHits++;
+	    } else {
+    	    	CacheMisses++;
+    	    	misses.push_back(&request);
+	    }
+	}
+    } else {
+    	for (auto &request : requests) {
+    	    misses.push_back(&request);
+	}
+    }
+
+    for (auto request : misses) {
+    	if (!run.empty() && (request->Block != first + (int)run.size() || run.size() == IOV_MAX)) {
+    	    read_blocks(first, run.data(), run.size());
+    	    run.clear();
+	}
+    	if (run.empty()) {
+    	    first = request->Block;
+	}
+    	run.push_back(iovec{request->Data, BLOCK_SIZE});
+    }
+
+    if (!run.empty()) {
+    	read_blocks(first, run.data(), run.size());
+    }
+    wait();
+}
+
+void Disk::writev(const std::vector<Request> &requests) {
+    std::vector<struct iovec> run;
+    int first = 0;
 
-    Writes++;
+    for (auto &request : requests) {
+    	sanity_check(request.Block, request.Data);
+
+    	if (!run.empty() && (request.Block != first + (int)run.size() || run.size() == IOV_MAX)) {
+    	    write_blocks(first, run.data(), run.size());
+    	    run.clear();
+	}
+    	if (run.empty()) {
+    	    first = request.Block;
+	}
+    	run.push_back(iovec{request.Data, BLOCK_SIZE});
+    }
+
+    if (!run.empty()) {
+    	write_blocks(first, run.data(), run.size());
+    }
+    wait();
+
+    // Bulk writes go straight to the image; keep cached copies coherent
+    std::lock_guard<std::mutex> guard(CacheLock);
+    if (Cache.size() > 0) {
+    	for (auto &request : requests) {
+    	    Cache.update(request.Block, request.Data, false);
+	}
+    }
 }
@@ -2,10 +2,13 @@
 
 #include "sfs/fs.h"
 #include "sfs/disk.h"
+#include "sfs/lz.h"
 
 #include <algorithm>
+#include <chrono>
 
 #include <assert.h>
+#include <cstdarg>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
@@ -13,6 +16,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <thread>
 #include <vector>
 
 // Debug file system -----------------------------------------------------------
@@ -28,29 +32,95 @@ void FileSystem::debug(Disk *disk) {
   printf("    %u blocks\n"         , block.Super.Blocks);
   printf("    %u inode blocks\n"   , block.Super.InodeBlocks);
   printf("    %u inodes\n"         , block.Super.Inodes);
+  if (hasFeature(block.Super, FEATURE_BITMAP)) {
+    printf("    %u bitmap blocks (%s)\n", block.Super.BitmapBlocks,
+           block.Super.State == STATE_CLEAN ? "clean" : "dirty");
+  }
+  if (hasFeature(block.Super, FEATURE_JOURNAL)) {
+    printf("    %u journal blocks\n", block.Super.JournalBlocks);
+  }
+  if (hasFeature(block.Super, FEATURE_EXTENTS)) {
+    printf("    extent-mapped inodes\n");
+  }
+  if (hasFeature(block.Super, FEATURE_LARGE_FILES)) {
+    printf("    %u-byte inodes for large files\n", block.Super.InodeSize);
+  }
+  if (hasFeature(block.Super, FEATURE_INLINE_DATA)) {
+    printf("    files up to %u bytes kept inline\n", getInlineCapacity(block.Super));
+  }
+  if (hasFeature(block.Super, FEATURE_COMPRESSION)) {
+    printf("    files compressed in %u-block clusters\n", CLUSTER_BLOCKS);
+  }
+  if (hasRefs(block.Super)) {
+    printf("    %u reference blocks for shared data\n", block.Super.RefBlocks);
+  }
+  if (hasFeature(block.Super, FEATURE_CLONES)) {
+    Block table;
+    disk->read(getSnapshotTable(block.Super), table.Data);
+    uint32_t snapshots = 0;
+    for (uint32_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+      snapshots += table.Snapshots[i].Head != 0;
+    }
+    printf("    %u snapshots\n", snapshots);
+  }
+  if (hasFeature(block.Super, FEATURE_CHECKSUMS)) {
+    printf("    %u checksum blocks\n", block.Super.ChecksumBlocks);
+  }
 
   // The total number of Inode blocks
-  const uint32_t inodeBlocks = block.Super.InodeBlocks;
-  const uint32_t inodeCount = block.Super.Inodes;
+  const auto superblock = block.Super;
+  const uint32_t inodeBlocks = superblock.InodeBlocks;
+  const uint32_t inodeCount = superblock.Inodes;
+  const uint32_t inodesPerBlock = getInodesPerBlock(superblock);
+  const auto read = [disk](uint32_t blk, char *data) { disk->read(blk, data); };
   for (uint32_t i = 0; i != inodeBlocks; ++i) {
     // +1 cuz inode blocks start from 1
     disk->read(i + 1, block.Data);
-    for (uint32_t inodeIndex = 0; inodeIndex != INODES_PER_BLOCK; ++inodeIndex) {
+    for (uint32_t inodeIndex = 0; inodeIndex != inodesPerBlock; ++inodeIndex) {
       // overall index over all inodes
-      const auto inodeOverallIndex = i * INODES_PER_BLOCK + inodeIndex;
+      const auto inodeOverallIndex = i * inodesPerBlock + inodeIndex;
       // There wouldn't be any valid inodes
       if (i == inodeBlocks - 1 && inodeOverallIndex >= inodeCount) {
         break;
       }
-      const auto &inode = block.Inodes[inodeIndex];
+      Inode inode;
+      decodeInode(superblock, block, inodeIndex, inode);
       if (inode.Valid == 1) {
         printf("Inode %u:\n", inodeOverallIndex);
-        printf("    size: %u bytes\n", inode.Size);
+        printf("    size: %lu bytes\n", (size_t)inode.Size);
+        if (inode.Flags & INODE_COMPRESSED && !(inode.Flags & INODE_INLINE_DATA)) {
+          printf("    compressed\n");
+        }
         // The total number of blocks related to this inode
         // x + y - 1 / y == ceil(x/y)
-        const uint32_t totalBlocks = (inode.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+        const uint32_t totalBlocks = blockCount(inode);
+        if (inode.Flags & INODE_INLINE_DATA) {
+          printf("    inline data\n");
+        } else if (hasFeature(superblock, FEATURE_EXTENTS)) {
+          // runs as start+length, then the blocks holding the ones that do
+          // not fit in the inode
+          BlockMap map;
+          loadBlockMap(superblock, inode, map, read, true);
+          printf("    extents:");
+          for (size_t k = 0; k < map.Blocks.size(); ) {
+            size_t length = 1;
+            while (k + length < map.Blocks.size() && continuesRun(map.Blocks[k + length - 1], map.Blocks[k + length])) {
+              ++length;
+            }
+            printf(" %u+%lu", map.Blocks[k], length);
+            k += length;
+          }
+          printf("\n");
+          if (!map.Meta.empty()) {
+            printf("    overflow blocks:");
+            for (auto blk : map.Meta) {
+              printf(" %u", blk);
+            }
+            printf("\n");
+          }
+        }
         // Here we only calculate the direct blocks. 5 here cuz for an inode block 5 ptrs are direct.
-        if (totalBlocks <= 5) {
+        else if (totalBlocks <= 5) {
           // only direct blocks
           printf("    direct blocks:");
           for (uint32_t k = 0; k != totalBlocks; ++k) {
@@ -62,16 +132,20 @@ void FileSystem::debug(Disk *disk) {
           printf("    direct blocks: %u %u %u %u %u\n",
                  inode.Direct[0], inode.Direct[1], inode.Direct[2],
                  inode.Direct[3], inode.Direct[4]);
-          // then print the indirect block
+          // then print the indirect block, and the ones above further leaves
           printf("    indirect block: %u\n", inode.Indirect);
-          // finally print all indirect blocks in this indirect block
-          // k stands for the indirect block index, starting from 5
-          // k + 5 != ... instead of k != ... - 5 cuz they're unsigned
-          Block indirectBlock;
-          disk->read(inode.Indirect, indirectBlock.Data);
+          BlockMap map;
+          loadBlockMap(superblock, inode, map, read, true);
+          if (map.Meta.size() > 0 && map.Meta[0] != 0) {
+            printf("    double indirect block: %u\n", map.Meta[0]);
+          }
+          if (map.Meta.size() > 1 && map.Meta[1] != 0) {
+            printf("    triple indirect block: %u\n", map.Meta[1]);
+          }
+          // finally print all blocks mapped by the leaves
           printf("    indirect data blocks:");
-          for (uint32_t k = 0; k + 5 != totalBlocks; ++k) {
-            printf(" %u", indirectBlock.Pointers[k]);
+          for (uint32_t k = 5; k < map.Blocks.size(); ++k) {
+            printf(" %u", map.Blocks[k]);
           }
           printf("\n");
         }
@@ -82,24 +156,116 @@ void FileSystem::debug(Disk *disk) {
 
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk) {
+bool FileSystem::format(Disk *disk, bool fast, bool journal, uint32_t features) {
   if (disk->mounted()) { return false; }
   // Write superblock
   Block superblock;
+  memset(&superblock, 0, sizeof(superblock));
   superblock.Super.MagicNumber = MAGIC_NUMBER;
   superblock.Super.Blocks = disk->size();
   // ceiling
   superblock.Super.InodeBlocks = (disk->size() + 10 - 1) / 10;
   superblock.Super.Inodes = superblock.Super.InodeBlocks * INODES_PER_BLOCK;
+
+  // Reserve a free-block bitmap after the inode blocks if there is room
+  const uint32_t bitmapBlocks = (disk->size() + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  const uint32_t bitmapStart = getBitmapStart(superblock.Super);
+  if (bitmapStart + bitmapBlocks < disk->size()) {
+    superblock.Super.FeatureMagic = FEATURE_MAGIC;
+    superblock.Super.Features = FEATURE_BITMAP;
+    superblock.Super.State = STATE_CLEAN;
+    superblock.Super.BitmapBlocks = bitmapBlocks;
+
+    // and a journal after the bitmap if it is big enough to be worth it
+    const uint32_t journalStart = getJournalStart(superblock.Super);
+    uint32_t journalBlocks = disk->size() / JOURNAL_FRACTION;
+    journalBlocks = journalBlocks < JOURNAL_MAX_BLOCKS ? journalBlocks : JOURNAL_MAX_BLOCKS;
+    if (journal && journalBlocks >= JOURNAL_MIN_BLOCKS && journalStart + journalBlocks < disk->size()) {
+      superblock.Super.Features |= FEATURE_JOURNAL;
+      superblock.Super.JournalBlocks = journalBlocks;
+    }
+    // inline contents follow the large inode fields, and compressed files
+    // are flagged in them
+    if (features & (FEATURE_INLINE_DATA | FEATURE_COMPRESSION)) {
+      features |= FEATURE_LARGE_FILES;
+    }
+    superblock.Super.Features |= features & (FEATURE_EXTENTS | FEATURE_LARGE_FILES | FEATURE_INLINE_DATA | FEATURE_COMPRESSION);
+    if (features & FEATURE_LARGE_FILES) {
+      superblock.Super.InodeSize = features & FEATURE_INLINE_DATA ? INLINE_INODE_SIZE : LARGE_INODE_SIZE;
+      superblock.Super.Inodes = superblock.Super.InodeBlocks * getInodesPerBlock(superblock.Super);
+    }
+    // shared blocks are counted in a table after the journal, followed by
+    // the snapshot table; compressed clusters are rewritten whole, so they
+    // are never shared
+    if (features & (FEATURE_DEDUP | FEATURE_CLONES)) {
+      const uint32_t refBlocks = (disk->size() + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+      const uint32_t tableBlocks = features & FEATURE_CLONES ? 1 : 0;
+      if (features & FEATURE_COMPRESSION || getRefStart(superblock.Super) + refBlocks + tableBlocks >= disk->size()) {
+        return false;
+      }
+      superblock.Super.Features |= features & (FEATURE_DEDUP | FEATURE_CLONES);
+      superblock.Super.RefBlocks = refBlocks;
+    }
+    // and the checksums of data blocks after those
+    if (features & FEATURE_CHECKSUMS) {
+      const uint32_t checksumBlocks = (disk->size() + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+      if (getChecksumStart(superblock.Super) + checksumBlocks >= disk->size()) {
+        return false;
+      }
+      superblock.Super.Features |= FEATURE_CHECKSUMS;
+      superblock.Super.ChecksumBlocks = checksumBlocks;
+    }
+  } else if (features & (FEATURE_EXTENTS | FEATURE_LARGE_FILES | FEATURE_INLINE_DATA | FEATURE_COMPRESSION |
+                         FEATURE_DEDUP | FEATURE_CLONES | FEATURE_CHECKSUMS)) {
+    // only images with optional fields can say how inodes map blocks
+    return false;
+  }
   disk->write(0, superblock.Data);
 
+  // Only metadata blocks start out allocated
+  const uint32_t dataStart = getDataStart(superblock.Super);
+  Bitmap freeBlocks(disk->size(), true);
+  for (uint32_t i = 0; i < dataStart; ++i) {
+    freeBlocks.reset(i);
+  }
+
+  if (fast) {
+    // one call clears the whole inode table, one the journal and one the
+    // reference, snapshot and checksum tables
+    disk->zero(1, superblock.Super.InodeBlocks);
+    if (hasFeature(superblock.Super, FEATURE_JOURNAL)) {
+      disk->zero(getJournalStart(superblock.Super), superblock.Super.JournalBlocks);
+      Journal::format(disk, getJournalStart(superblock.Super));
+    }
+    if (getDataStart(superblock.Super) > getRefStart(superblock.Super)) {
+      disk->zero(getRefStart(superblock.Super), getDataStart(superblock.Super) - getRefStart(superblock.Super));
+    }
+    for (uint32_t i = 0; i < superblock.Super.BitmapBlocks; ++i) {
+      Block bitmapBlock;
+      packBitmap(freeBlocks, i, bitmapBlock);
+      disk->write(bitmapStart + i, bitmapBlock.Data);
+    }
+    disk->sync();
+    return true;
+  }
+
   // Clear all other blocks
   Block emptyBlock;
   memset(&emptyBlock.Data, 0, sizeof(emptyBlock));
   // note the i+1 here, otherwise the index will exceed the array boundary.
   for (uint32_t i = 0; i + 1 < disk->size(); ++i) {
-    disk->write(i + 1, emptyBlock.Data);
+    if (i + 1 >= bitmapStart && i + 1 < bitmapStart + superblock.Super.BitmapBlocks) {
+      Block bitmapBlock;
+      packBitmap(freeBlocks, i + 1 - bitmapStart, bitmapBlock);
+      disk->write(i + 1, bitmapBlock.Data);
+    } else {
+      disk->write(i + 1, emptyBlock.Data);
+    }
+  }
+  if (hasFeature(superblock.Super, FEATURE_JOURNAL)) {
+    Journal::format(disk, getJournalStart(superblock.Super));
   }
+  disk->sync();
   return true;
 }
 
@@ -109,6 +275,188 @@ bool FileSystem::mount(Disk *disk) {
   if (disk->mounted()) { return false; }
   // Read superblock
   const auto superblock = getSuperblock(disk);
+  if (!checkSuperblock(superblock)) {
+    return false;
+  }
+  const bool bitmap = hasFeature(superblock, FEATURE_BITMAP);
+  const bool dedup = hasRefs(superblock);
+  const bool checksummed = hasFeature(superblock, FEATURE_CHECKSUMS);
+
+  // Set device and mount
+  disk->mount();
+
+  // Copy metadata
+  this->disk = disk;
+  this->superblock = superblock;
+  dirtyBitmapBlocks.assign(bitmap ? superblock.BitmapBlocks : 0, false);
+  
+  inodeShards.reset(new InodeShard[superblock.InodeBlocks]);
+  blockMaps.clear();
+  duplicateBlocks.clear();
+
+  // Metadata committed before a crash reaches its home blocks before any
+  // of it is read
+  journalReplayed = 0;
+  if (hasFeature(superblock, FEATURE_JOURNAL)) {
+    journal.reset(new Journal(disk, getJournalStart(superblock), superblock.JournalBlocks));
+    journalReplayed = journal->replay();
+  }
+
+  // Load the inode table on a pool of workers, each taking the next chunk
+  // of inode blocks until none are left. Unless the bitmap is clean they
+  // also claim the blocks of every inode, each in its own bitmap.
+  const bool scan = !(bitmap && superblock.State == STATE_CLEAN);
+  const uint32_t chunks = (superblock.InodeBlocks + MOUNT_CHUNK_BLOCKS - 1) / MOUNT_CHUNK_BLOCKS;
+  size_t threads = mountThreads ? mountThreads : std::thread::hardware_concurrency();
+  threads = std::max<size_t>(1, std::min<size_t>(threads, chunks));
+  std::vector<ScanState> states(threads);
+  std::unique_ptr<std::atomic<uint64_t>[]> visited;
+  if (scan && dedup) {
+    visited.reset(new std::atomic<uint64_t>[(disk->size() + 63) / 64]);
+    for (size_t i = 0; i < (disk->size() + 63) / 64; ++i) {
+      visited[i] = 0;
+    }
+  }
+  for (auto &state : states) {
+    state.FreeInodes.assign(superblock.Inodes, false);
+    state.Claimed.assign(scan ? disk->size() : 0, false);
+    state.Data.assign(scan && dedup ? disk->size() : 0, false);
+    state.Pointers.assign(scan && dedup ? disk->size() : 0, false);
+    state.Visited = visited.get();
+  }
+  std::atomic<uint32_t> next(0);
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i) {
+    workers.emplace_back(&FileSystem::scanInodeBlocks, this, std::ref(next), scan, std::ref(states[i]));
+  }
+  scanInodeBlocks(next, scan, states[0]);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto &state : states) {
+    if (state.Error) {
+      journal.reset();
+      disk->unmount();
+      this->disk = nullptr;
+      inodeShards.reset();
+      std::rethrow_exception(state.Error);
+    }
+  }
+
+  // snapshots hold references too; their blocks are few enough for one
+  // thread
+  if (scan && hasFeature(superblock, FEATURE_CLONES)) {
+    Block table;
+    disk->read(getSnapshotTable(superblock), table.Data);
+    for (uint32_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+      std::vector<std::pair<uint32_t, Inode>> inodes;
+      std::vector<uint32_t> chain;
+      loadSnapshot(table.Snapshots[i].Head, [disk](uint32_t blk, char *data) { disk->read(blk, data); }, inodes, chain);
+      for (auto blk : chain) {
+        claimBlock(states[0], blk);
+      }
+      for (auto &entry : inodes) {
+        claimInodeBlocks(entry.second, states[0]);
+      }
+    }
+  }
+
+  // Merge what the workers found
+  freeInodes.assign(superblock.Inodes, false);
+  for (auto &state : states) {
+    for (size_t i = 0; i < freeInodes.words(); ++i) {
+      freeInodes.assignWord(i, freeInodes.word(i) | state.FreeInodes.word(i));
+    }
+  }
+
+  if (dedup) {
+    loadRefs();
+  }
+  freeBlocks.assign(disk->size(), true);
+  if (!scan) {
+    // a clean bitmap can be trusted as is
+    loadBitmap();
+  } else {
+    // after a crash the on-disk bitmap is rebuilt from the scan; metadata
+    // is claimed first, so data pointers into it count as duplicates. With
+    // shared blocks, data or pointer blocks claimed again the same way are
+    // shared instead.
+    ScanState merged;
+    merged.Claimed.assign(disk->size(), false);
+    merged.Data.assign(dedup ? disk->size() : 0, false);
+    merged.Pointers.assign(dedup ? disk->size() : 0, false);
+    for (uint32_t i = 0; i < getDataStart(superblock); ++i) {
+      merged.Claimed.set(i);
+    }
+    for (auto &state : states) {
+      merged.Duplicates.insert(merged.Duplicates.end(), state.Duplicates.begin(), state.Duplicates.end());
+      merged.Shared.insert(merged.Shared.end(), state.Shared.begin(), state.Shared.end());
+      for (size_t i = 0; i < merged.Claimed.words(); ++i) {
+        uint64_t both = merged.Claimed.word(i) & state.Claimed.word(i);
+        if (dedup) {
+          uint64_t shared = both & ((merged.Data.word(i) & state.Data.word(i)) |
+                                    (merged.Pointers.word(i) & state.Pointers.word(i)));
+          both &= ~shared;
+          for (; shared; shared &= shared - 1) {
+            merged.Shared.push_back(i * 64 + __builtin_ctzll(shared));
+          }
+          merged.Data.assignWord(i, merged.Data.word(i) | state.Data.word(i));
+          merged.Pointers.assignWord(i, merged.Pointers.word(i) | state.Pointers.word(i));
+        }
+        for (; both; both &= both - 1) {
+          merged.Duplicates.push_back(i * 64 + __builtin_ctzll(both));
+        }
+        merged.Claimed.assignWord(i, merged.Claimed.word(i) | state.Claimed.word(i));
+      }
+    }
+
+    // the counts in the reference table are rebuilt the same way; a
+    // pointer block may have held data before the crash, so its hash goes
+    if (dedup) {
+      for (uint32_t i = 0; i < superblock.Blocks; ++i) {
+        refs[i].Count = merged.Data.test(i) || merged.Pointers.test(i) ? 1 : 0;
+        if (!merged.Data.test(i)) {
+          refs[i].Hash = 0;
+        }
+      }
+      for (auto blk : merged.Shared) {
+        refs[blk].Count += 1;
+      }
+      for (uint32_t i = 0; i < dirtyRefBlocks.size(); ++i) {
+        dirtyRefBlocks[i] = true;
+      }
+    }
+    for (size_t i = 0; i < freeBlocks.words(); ++i) {
+      freeBlocks.assignWord(i, ~merged.Claimed.word(i));
+    }
+    for (uint32_t i = 0; i < dirtyBitmapBlocks.size(); ++i) {
+      dirtyBitmapBlocks[i] = true;
+    }
+
+    std::sort(merged.Duplicates.begin(), merged.Duplicates.end());
+    merged.Duplicates.erase(std::unique(merged.Duplicates.begin(), merged.Duplicates.end()), merged.Duplicates.end());
+    duplicateBlocks.swap(merged.Duplicates);
+  }
+  if (dedup) {
+    indexRefs();
+  }
+  if (checksummed) {
+    loadChecksums();
+    if (scan) {
+      rebuildChecksums();
+    }
+  }
+
+  // until unmount, a crash must force the full scan
+  if (bitmap) {
+    this->superblock.State = 0;
+    writeSuperblock();
+  }
+
+  return true;
+}
+
+bool FileSystem::checkSuperblock(const SuperBlock &superblock) {
   if (superblock.MagicNumber != MAGIC_NUMBER) {
     return false;
   }
@@ -118,8 +466,24 @@ bool FileSystem::mount(Disk *disk) {
     return false;
   }
   
+  // large inode records are a power of two that fits a block
+  const uint32_t inodeSize = superblock.InodeSize;
+  if (hasFeature(superblock, FEATURE_LARGE_FILES) &&
+      (inodeSize < LARGE_INODE_SIZE || inodeSize > Disk::BLOCK_SIZE || (inodeSize & (inodeSize - 1)))) {
+    return false;
+  }
+  // and leave room for inline contents, which are kept in memory
+  if (hasFeature(superblock, FEATURE_INLINE_DATA) &&
+      (!hasFeature(superblock, FEATURE_LARGE_FILES) || inodeSize <= LARGE_INODE_SIZE || inodeSize > INLINE_INODE_SIZE)) {
+    return false;
+  }
+  // which is where compressed files are flagged too
+  if (hasFeature(superblock, FEATURE_COMPRESSION) && !hasFeature(superblock, FEATURE_LARGE_FILES)) {
+    return false;
+  }
+
   // # of inodes and # of superblock.inodes should be consistent
-  if (superblock.Inodes != superblock.InodeBlocks * INODES_PER_BLOCK) {
+  if (superblock.Inodes != superblock.InodeBlocks * getInodesPerBlock(superblock)) {
     return false;
   }
 
@@ -128,295 +492,3675 @@ bool FileSystem::mount(Disk *disk) {
     return false;
   }
 
-  // Set device and mount
-  disk->mount();
+  // the bitmap must cover every block and fit on the disk
+  const bool bitmap = hasFeature(superblock, FEATURE_BITMAP);
+  if (bitmap && (superblock.BitmapBlocks != (superblock.Blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK ||
+                 getBitmapStart(superblock) + superblock.BitmapBlocks > superblock.Blocks)) {
+    return false;
+  }
 
-  // Copy metadata
-  this->disk = disk;
-  
-  // Allocate free block bitmap
-  freeBlocks = std::vector<bool>(disk->size(), true);
-  freeBlocks[0] = false;
-  Block inodeBlock;
-  for (uint32_t i = 0; i < superblock.InodeBlocks; ++i) {
-    disk->read(i + 1, inodeBlock.Data);
-    freeBlocks[i + 1] = false;
-    initFreeBlocks_forInodeBlock(inodeBlock.Inodes);
+  // so must the journal, which needs a bitmap in front of it
+  if (hasFeature(superblock, FEATURE_JOURNAL) &&
+      (!bitmap || superblock.JournalBlocks < Journal::MIN_BLOCKS || getDataStart(superblock) > superblock.Blocks)) {
+    return false;
+  }
+
+  // and the reference table, which never counts compressed clusters
+  const bool dedup = hasRefs(superblock);
+  if (dedup && (!bitmap || hasFeature(superblock, FEATURE_COMPRESSION) ||
+                superblock.RefBlocks != (superblock.Blocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK ||
+                getDataStart(superblock) > superblock.Blocks)) {
+    return false;
   }
 
+  // and the checksum table
+  const bool checksummed = hasFeature(superblock, FEATURE_CHECKSUMS);
+  if (checksummed && (!bitmap ||
+                      superblock.ChecksumBlocks != (superblock.Blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK ||
+                      getDataStart(superblock) > superblock.Blocks)) {
+    return false;
+  }
   return true;
 }
 
-void FileSystem::initFreeBlocks_forInodeBlock(const Inode (&inodes)[INODES_PER_BLOCK]) {
-  const auto disk = getDisk();
-  for (uint32_t i = 0; i < INODES_PER_BLOCK; ++i) {
-    const auto &inode = inodes[i];
-    if (inode.Valid == 1) {
-      // The total number of blocks related to this inode
-      // x + y - 1 / y == ceil(x/y)
-      const uint32_t totalBlocks = (inode.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
-      // Here we only calculate the direct blocks. 5 here cuz for an inode block 5 ptrs are direct.
-      if (totalBlocks == 0) {}
-      else if (totalBlocks <= 5) {
-        // only direct blocks
-        for (uint32_t k = 0; k != totalBlocks; ++k) {
-          freeBlocks[inode.Direct[k]] = false;
-        }
-      } else {
-        freeBlocks[inode.Direct[0]] = false;
-        freeBlocks[inode.Direct[1]] = false;
-        freeBlocks[inode.Direct[2]] = false;
-        freeBlocks[inode.Direct[3]] = false;
-        freeBlocks[inode.Direct[4]] = false;
-        freeBlocks[inode.Indirect] = false;
-
-        // k stands for the indirect block index, starting from 5
-        // k + 5 != ... instead of k != ... - 5 cuz they're unsigned
-        Block indirectBlock;
-        disk->read(inode.Indirect, indirectBlock.Data);
-        for (uint32_t k = 0; k + 5 != totalBlocks; ++k) {
-          freeBlocks[indirectBlock.Pointers[k]] = false;
+void FileSystem::scanInodeBlocks(std::atomic<uint32_t> &next, bool scan, ScanState &state) {
+  const uint32_t chunkBlocks = MOUNT_CHUNK_BLOCKS;
+  std::vector<Block> inodeBlocks(std::min(chunkBlocks, superblock.InodeBlocks));
+  try {
+    for (uint32_t i = next.fetch_add(chunkBlocks); i < superblock.InodeBlocks; i = next.fetch_add(chunkBlocks)) {
+      const uint32_t count = std::min(chunkBlocks, superblock.InodeBlocks - i);
+      disk->read(i + 1, count, inodeBlocks[0].Data);
+      for (uint32_t j = 0; j < count; ++j) {
+        // every inode block has a shard of its own, so workers never share one
+        loadInodeBlock(i + j, inodeBlocks[j], state.FreeInodes);
+        if (scan) {
+          initFreeBlocks_forInodeBlock(inodeBlocks[j], state);
         }
       }
     }
+  } catch (...) {
+    state.Error = std::current_exception();
   }
 }
 
-// Create inode ----------------------------------------------------------------
-
-ssize_t FileSystem::create() {
-  // Locate free inode in inode table
-  const auto disk = getDisk();
-  const auto &superblock = getSuperblock();
-  // Iterate through inode blocks, and then for each
-  // block iterate through all inodes
-  Block inodeBlock;
-  for (uint32_t i = 0; i < superblock.InodeBlocks; ++i) {
-    disk->read(i + 1, inodeBlock.Data);
-    for (uint32_t j = 0; j < INODES_PER_BLOCK; ++j) {
-      auto &inode = inodeBlock.Inodes[j];
-      // Because inodes are all located at the start of the disk,
-      // if we can find an invalid one it can be used for creation.
-      if (inode.Valid == 0) {
-        inode.Valid = 1;
-        inode.Size = 0;
-        // make inode change persistent
-        disk->write(i + 1, inodeBlock.Data);
-        // the inumber
-        return i * INODES_PER_BLOCK + j;
-      }
+void FileSystem::loadInodeBlock(uint32_t index, const Block &block, Bitmap &freeInodes) {
+  const uint32_t inodesPerBlock = getInodesPerBlock();
+  for (uint32_t i = 0; i < inodesPerBlock; ++i) {
+    const uint32_t inumber = index * inodesPerBlock + i;
+    Inode inode;
+    decodeInode(superblock, block, i, inode);
+    if (inode.Valid == 0) {
+      freeInodes.set(inumber);
+    } else {
+      // keep anything that is not free, so write back does not lose it
+      inodeShards[index].Inodes[inumber] = inode;
     }
   }
-  
-  // Record inode if not found
-  return -1;
 }
 
-// Remove inode ----------------------------------------------------------------
-
-bool FileSystem::remove(size_t inumber) {
-  // Load inode information
-  Block inodeBlock;
-  auto &inode = getInode(inumber, inodeBlock);
-  if (inode.Valid == 0) { return false; }
-
-  // The total number of blocks related to this inode
-  // x + y - 1 / y == ceil(x/y)
-  const uint32_t totalBlocks = (inode.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
-  // Here we only calculate the direct blocks. 5 here cuz for an inode block 5 ptrs are direct.
-  if (totalBlocks == 0) {}
-  else if (totalBlocks <= 5) {
-    // free direct blocks
-    for (uint32_t k = 0; k != totalBlocks; ++k) {
-      freeBlocks[inode.Direct[k]] = true;
-    }
+void FileSystem::decodeInode(const SuperBlock &superblock, const Block &block, uint32_t index, Inode &inode) {
+  memset(&inode, 0, sizeof(inode));
+  const char *data = block.Data + index * getInodeRecordSize(superblock);
+  const bool large = hasFeature(superblock, FEATURE_LARGE_FILES);
+  if (hasFeature(superblock, FEATURE_EXTENTS) && large) {
+    LargeExtentRecord record;
+    memcpy(&record, data, sizeof(record));
+    inode.Valid = record.Valid;
+    inode.Flags = record.Flags;
+    inode.Size = record.Size;
+    inode.Extents = record.Extents;
+    inode.Overflow = record.Overflow;
+    memcpy(inode.Inline, record.Inline, sizeof(record.Inline));
+  } else if (hasFeature(superblock, FEATURE_EXTENTS)) {
+    ExtentRecord record;
+    memcpy(&record, data, sizeof(record));
+    inode.Valid = record.Valid;
+    inode.Size = record.Size;
+    inode.Extents = record.Extents;
+    inode.Overflow = record.Overflow;
+    memcpy(inode.Inline, record.Inline, sizeof(record.Inline));
+  } else if (large) {
+    LargePointerRecord record;
+    memcpy(&record, data, sizeof(record));
+    inode.Valid = record.Valid;
+    inode.Flags = record.Flags;
+    inode.Size = record.Size;
+    memcpy(inode.Direct, record.Direct, sizeof(record.Direct));
+    inode.Indirect = record.Indirect;
+    inode.DoubleIndirect = record.DoubleIndirect;
+    inode.TripleIndirect = record.TripleIndirect;
   } else {
-    // free indirect blocks
-    freeBlocks[inode.Direct[0]] = true;
-    freeBlocks[inode.Direct[1]] = true;
-    freeBlocks[inode.Direct[2]] = true;
-    freeBlocks[inode.Direct[3]] = true;
-    freeBlocks[inode.Direct[4]] = true;
-    freeBlocks[inode.Indirect] = true;
+    PointerRecord record;
+    memcpy(&record, data, sizeof(record));
+    inode.Valid = record.Valid;
+    inode.Size = record.Size;
+    memcpy(inode.Direct, record.Direct, sizeof(record.Direct));
+    inode.Indirect = record.Indirect;
+  }
 
-    // k stands for the indirect block index, starting from 5
-    // k + 5 != ... instead of k != ... - 5 cuz they're unsigned
-    Block indirectBlock;
-    disk->read(inode.Indirect, indirectBlock.Data);
-    for (uint32_t k = 0; k + 5 != totalBlocks; ++k) {
-      freeBlocks[indirectBlock.Pointers[k]] = true;
+  // contents of a small file follow the fields; a size past the room there
+  // can only come from a damaged record
+  if (inode.Flags & INODE_INLINE_DATA) {
+    const uint32_t capacity = getInlineCapacity(superblock);
+    if (inode.Size > capacity) {
+      inode.Size = capacity;
     }
+    memcpy(inode.Data, data + LARGE_INODE_SIZE, inode.Size);
   }
+}
 
-  // Clear inode in inode table
-  // No need to clean other fields since it's an invalid inode
-  inode.Valid = 0;
-  disk->write(getInodeBlkIndex(inumber), inodeBlock.Data);
+void FileSystem::encodeInode(const SuperBlock &superblock, const Inode &inode, uint32_t index, Block &block) {
+  char *data = block.Data + index * getInodeRecordSize(superblock);
+  const bool large = hasFeature(superblock, FEATURE_LARGE_FILES);
+  if (hasFeature(superblock, FEATURE_EXTENTS) && large) {
+    LargeExtentRecord record;
+    memset(&record, 0, sizeof(record));
+    record.Valid = inode.Valid;
+    record.Flags = inode.Flags;
+    record.Size = inode.Size;
+    record.Extents = inode.Extents;
+    record.Overflow = inode.Overflow;
+    memcpy(record.Inline, inode.Inline, sizeof(record.Inline));
+    memcpy(data, &record, sizeof(record));
+  } else if (hasFeature(superblock, FEATURE_EXTENTS)) {
+    ExtentRecord record;
+    record.Valid = inode.Valid;
+    record.Size = inode.Size;
+    record.Extents = inode.Extents;
+    record.Overflow = inode.Overflow;
+    memcpy(record.Inline, inode.Inline, sizeof(record.Inline));
+    memcpy(data, &record, sizeof(record));
+  } else if (large) {
+    LargePointerRecord record;
+    memset(&record, 0, sizeof(record));
+    record.Valid = inode.Valid;
+    record.Flags = inode.Flags;
+    record.Size = inode.Size;
+    memcpy(record.Direct, inode.Direct, sizeof(record.Direct));
+    record.Indirect = inode.Indirect;
+    record.DoubleIndirect = inode.DoubleIndirect;
+    record.TripleIndirect = inode.TripleIndirect;
+    memcpy(data, &record, sizeof(record));
+  } else {
+    PointerRecord record;
+    record.Valid = inode.Valid;
+    record.Size = inode.Size;
+    memcpy(record.Direct, inode.Direct, sizeof(record.Direct));
+    record.Indirect = inode.Indirect;
+    memcpy(data, &record, sizeof(record));
+  }
+  if (inode.Flags & INODE_INLINE_DATA) {
+    memcpy(data + LARGE_INODE_SIZE, inode.Data, inode.Size);
+  }
+}
 
+bool FileSystem::loadInode(size_t inumber, Inode &inode) {
+  if (inodeShards == nullptr || inumber >= superblock.Inodes) {
+    return false;
+  }
+  auto &shard = inodeShards[inumber / getInodesPerBlock()];
+  std::lock_guard<std::mutex> guard(shard.Lock);
+  auto it = shard.Inodes.find(inumber);
+  if (it == shard.Inodes.end() || it->second.Valid != 1) {
+    return false;
+  }
+  inode = it->second;
   return true;
 }
 
-// Inode stat ------------------------------------------------------------------
+void FileSystem::storeInode(uint32_t inumber, const Inode &inode) {
+  auto &shard = inodeShards[inumber / getInodesPerBlock()];
+  std::lock_guard<std::mutex> guard(shard.Lock);
+  if (inode.Valid == 0) {
+    shard.Inodes.erase(inumber);
+  } else {
+    shard.Inodes[inumber] = inode;
+  }
+  shard.Dirty = true;
+}
 
-ssize_t FileSystem::stat(size_t inumber) {
-  // Load inode information
-  Block inodeBlock;
-  uint32_t inodeBlkIndex = inumber / INODES_PER_BLOCK + 1;
-  uint32_t offset = inumber % INODES_PER_BLOCK;
-  
-  if (inodeBlkIndex > disk->size()) { return -1; }
-  disk->read(inodeBlkIndex, inodeBlock.Data);
-  if (inodeBlock.Inodes[offset].Valid == 1) {
-    return inodeBlock.Inodes[offset].Size;
+void FileSystem::writeInodes() {
+  std::vector<Block> blocks;
+  std::vector<Disk::Request> requests;
+
+  // one block per dirty inode block, packed under its shard lock
+  for (uint32_t i = 0; i < superblock.InodeBlocks; ++i) {
+    auto &shard = inodeShards[i];
+    std::lock_guard<std::mutex> guard(shard.Lock);
+    if (!shard.Dirty) {
+      continue;
+    }
+    blocks.emplace_back();
+    memset(&blocks.back(), 0, sizeof(Block));
+    for (const auto &entry : shard.Inodes) {
+      encodeInode(superblock, entry.second, entry.first % getInodesPerBlock(), blocks.back());
+    }
+    shard.Dirty = false;
+    requests.push_back(Disk::Request{(int)(i + 1), nullptr});
+  }
+  for (size_t i = 0; i < requests.size(); ++i) {
+    requests[i].Data = blocks[i].Data;
   }
+  writeMetadata(requests);
+}
 
-  return -1;
+void FileSystem::writeSuperblock() {
+  Block block;
+  memset(&block, 0, sizeof(block));
+  block.Super = superblock;
+  for (uint32_t i = 0; i < checksumRegions.size(); ++i) {
+    if (checksumRegions[i]) {
+      block.Tail.ChecksumRegions[i / 8] |= 1 << (i % 8);
+    }
+  }
+  disk->write(0, block.Data);
+  // the state must reach the disk even when the cache holds everything else
+  disk->sync(0);
 }
 
-// Read from inode -------------------------------------------------------------
+void FileSystem::packBitmap(const Bitmap &freeBlocks, uint32_t bitmapIndex, Block &block) {
+  memset(&block, 0, sizeof(block));
+  // on disk a set bit means allocated, so words are stored inverted
+  const uint32_t wordsPerBlock = BITS_PER_BLOCK / 64;
+  const uint32_t first = bitmapIndex * wordsPerBlock;
+  for (uint32_t i = 0; i < wordsPerBlock && first + i < freeBlocks.words(); ++i) {
+    uint64_t used = ~freeBlocks.word(first + i);
+    const size_t bits = freeBlocks.size() - (size_t)(first + i) * 64;
+    if (bits < 64) {
+      used &= (1ull << bits) - 1;
+    }
+    for (uint32_t b = 0; b < 8; ++b) {
+      block.Data[i * 8 + b] = used >> (b * 8);
+    }
+  }
+}
 
-ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
-  // Load inode information
-  Block inodeBlock;
+void FileSystem::loadBitmap() {
+  const uint32_t bitmapBlocks = superblock.BitmapBlocks;
+  const uint32_t wordsPerBlock = BITS_PER_BLOCK / 64;
+  std::vector<Block> bitmap(bitmapBlocks);
+  disk->read(getBitmapStart(superblock), bitmapBlocks, bitmap[0].Data);
+  for (size_t i = 0; i < freeBlocks.words() && i < (size_t)bitmapBlocks * wordsPerBlock; ++i) {
+    const auto &block = bitmap[i / wordsPerBlock];
+    uint64_t used = 0;
+    for (uint32_t b = 0; b < 8; ++b) {
+      used |= (uint64_t)(uint8_t)block.Data[(i % wordsPerBlock) * 8 + b] << (b * 8);
+    }
+    freeBlocks.assignWord(i, ~used);
+  }
+}
 
-  auto &inode = getInode(inumber, inodeBlock);
-  if (inode.Valid == 0) {
-    return -1;
+void FileSystem::writeBitmap(bool all) {
+  std::vector<Block> blocks;
+  std::vector<uint32_t> indices;
+  std::unique_lock<std::mutex> lock(freeBlocksLock);
+  for (uint32_t i = 0; i < dirtyBitmapBlocks.size(); ++i) {
+    if (all || dirtyBitmapBlocks[i]) {
+      indices.push_back(i);
+      dirtyBitmapBlocks[i] = false;
+    }
   }
-  
-  // Adjust length
-  if (offset >= inode.Size) {
-    return -1;
+
+  blocks.resize(indices.size());
+  std::vector<Disk::Request> requests(indices.size());
+  for (uint32_t i = 0; i < indices.size(); ++i) {
+    packBitmap(freeBlocks, indices[i], blocks[i]);
+    requests[i] = Disk::Request{(int)(getBitmapStart(superblock) + indices[i]), blocks[i].Data};
   }
+  lock.unlock();
+  writeMetadata(requests);
+}
 
-  length = length > inode.Size - offset ? inode.Size - offset : length;
+void FileSystem::loadRefs() {
+  refs.assign((size_t)superblock.RefBlocks * REFS_PER_BLOCK, RefEntry{0, 0, 0});
+  disk->read(getRefStart(superblock), superblock.RefBlocks, (char *)refs.data());
+  dirtyRefBlocks.assign(superblock.RefBlocks, false);
+}
 
-  // Read block and copy to data
-  uint32_t startBlk = offset / Disk::BLOCK_SIZE;
+void FileSystem::writeRefs(bool all) {
+  std::vector<Block> blocks;
+  std::vector<uint32_t> indices;
+  std::unique_lock<std::mutex> lock(refsLock);
+  for (uint32_t i = 0; i < dirtyRefBlocks.size(); ++i) {
+    if (all || dirtyRefBlocks[i]) {
+      indices.push_back(i);
+      dirtyRefBlocks[i] = false;
+    }
+  }
 
-  // the offset point to read from the first block
-  uint32_t fstBlkStartOffset = offset % Disk::BLOCK_SIZE;
-  
-  Block buffer;
-  Block indirectBlk;
-  auto blkIndex = startBlk;
-  uint32_t writeCount = 0;
-  while (writeCount < length) {
-    auto diskBlkNo = getDiskBlkNo(inode, blkIndex, indirectBlk);
-    disk->read(diskBlkNo, buffer.Data);
-    for (uint32_t j = blkIndex == startBlk ? fstBlkStartOffset : 0;
-         j < Disk::BLOCK_SIZE and writeCount < length;
-         ++j) {
-      data[writeCount++] = buffer.Data[j];
-    }
-    blkIndex += 1;
+  blocks.resize(indices.size());
+  std::vector<Disk::Request> requests(indices.size());
+  for (uint32_t i = 0; i < indices.size(); ++i) {
+    memcpy(blocks[i].Data, &refs[(size_t)indices[i] * REFS_PER_BLOCK], Disk::BLOCK_SIZE);
+    requests[i] = Disk::Request{(int)(getRefStart(superblock) + indices[i]), blocks[i].Data};
   }
-  
-  return length;
+  lock.unlock();
+  writeMetadata(requests);
 }
 
-// Write to inode --------------------------------------------------------------
+void FileSystem::indexRefs() {
+  // entries of free blocks are stale, and only counted blocks are shared
+  dedupIndex.clear();
+  for (uint32_t blk = getDataStart(superblock); blk < superblock.Blocks; ++blk) {
+    auto &ref = refs[blk];
+    if (ref.Count == 0 || freeBlocks.test(blk)) {
+      if (ref.Count != 0 || ref.Hash != 0) {
+        ref = RefEntry{0, 0, 0};
+        markRefDirty(blk);
+      }
+      continue;
+    }
+    if (ref.Hash != 0) {
+      dedupIndex.emplace(ref.Hash, blk);
+    }
+  }
+}
 
-ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
-  // Load inode
-  Block inodeBlock;
+void FileSystem::loadChecksums() {
+  checksums.assign((size_t)superblock.ChecksumBlocks * CHECKSUMS_PER_BLOCK, 0);
+  disk->read(getChecksumStart(superblock), superblock.ChecksumBlocks, (char *)checksums.data());
+  dirtyChecksumBlocks.assign(superblock.ChecksumBlocks, false);
 
-  auto &inode = getInode(inumber, inodeBlock);
-  if (inode.Valid == 0) {
-    return -1;
+  Block block;
+  disk->read(0, block.Data);
+  const uint32_t regions = (superblock.Blocks + getChecksumRegionBlocks(superblock) - 1) / getChecksumRegionBlocks(superblock);
+  checksumRegions.assign(regions, false);
+  for (uint32_t i = 0; i < regions; ++i) {
+    checksumRegions[i] = block.Tail.ChecksumRegions[i / 8] & (1 << (i % 8));
   }
-  
-  if (offset > inode.Size) {
-    return -1;
+  writtenRegions.assign(regions, false);
+  busyRegions.assign(regions, 0);
+  checksumsRecomputed = 0;
+}
+
+void FileSystem::writeChecksums(bool all) {
+  std::vector<Block> blocks;
+  std::vector<uint32_t> indices;
+  std::unique_lock<std::mutex> lock(checksumsLock);
+  for (uint32_t i = 0; i < dirtyChecksumBlocks.size(); ++i) {
+    if (all || dirtyChecksumBlocks[i]) {
+      indices.push_back(i);
+      dirtyChecksumBlocks[i] = false;
+    }
   }
 
-  uint32_t startBlk = offset / Disk::BLOCK_SIZE;
+  blocks.resize(indices.size());
+  std::vector<Disk::Request> requests(indices.size());
+  for (uint32_t i = 0; i < indices.size(); ++i) {
+    memcpy(blocks[i].Data, &checksums[(size_t)indices[i] * CHECKSUMS_PER_BLOCK], Disk::BLOCK_SIZE);
+    requests[i] = Disk::Request{(int)(getChecksumStart(superblock) + indices[i]), blocks[i].Data};
+  }
+  lock.unlock();
+  writeMetadata(requests);
+}
 
-  // write the first block starting at this offset.
-  uint32_t fstBlkStartOffset = offset % Disk::BLOCK_SIZE;
-  
-  Block indirectBlk;
-  Block dataBlock;
-  uint32_t writeCount = 0;
-  uint32_t blkIndex = startBlk;
-  while (writeCount < length) {
-    ssize_t blk; // data block No.
-    // need to allocate a new block for inode
-    if (blkIndex >= blockCount(inode)) {
-      blk = allocateBlockForInode(inode);
-      if (blk == -1) {
-        if (offset + writeCount > inode.Size){
-          inode.Size = offset + writeCount;
-        }
-        disk->write(getInodeBlkIndex(inumber), inodeBlock.Data);
-        return writeCount;
-      }
-    } else {
-      blk = getDiskBlkNo(inode, blkIndex, indirectBlk);
+void FileSystem::rebuildChecksums() {
+  // data blocks are written in place before the table is synced, so after
+  // a crash the entries of the regions written since may be older than
+  // their blocks; elsewhere they are kept, so damage there is still found
+  for (uint32_t blk = 0; blk < superblock.Blocks; ++blk) {
+    if (checksums[blk] != 0 && freeBlocks.test(blk)) {
+      checksums[blk] = 0;
+      markChecksumDirty(blk);
     }
-    disk->read(blk, dataBlock.Data);
-    // write to data block
-    for (uint32_t i = blkIndex == startBlk ? fstBlkStartOffset : 0;
-         i < Disk::BLOCK_SIZE and writeCount < length;
-         ++i) {
-      dataBlock.Data[i] = data[writeCount++];
+  }
+
+  const uint32_t BATCH = 256;
+  const uint32_t regionBlocks = getChecksumRegionBlocks(superblock);
+  std::vector<Block> blocks(BATCH);
+  for (uint32_t region = 0; region < checksumRegions.size(); ++region) {
+    if (!checksumRegions[region]) {
+      continue;
     }
-    
-    disk->write(blk, dataBlock.Data);
-    if (offset + writeCount > inode.Size){
-      inode.Size = offset + writeCount;
+    const uint32_t end = std::min((uint64_t)superblock.Blocks, (uint64_t)(region + 1) * regionBlocks);
+    for (uint32_t first = std::max(region * regionBlocks, getDataStart(superblock)); first < end; first += BATCH) {
+      const uint32_t count = std::min(BATCH, end - first);
+      std::vector<Disk::Request> requests;
+      for (uint32_t blk = first; blk < first + count; ++blk) {
+        if (checksums[blk] != 0) {
+          requests.push_back(Disk::Request{(int)blk, blocks[requests.size()].Data});
+        }
+      }
+      disk->readv(requests);
+      for (auto &request : requests) {
+        const uint32_t sum = checksumBlock(request.Data);
+        if (checksums[request.Block] != sum) {
+          checksums[request.Block] = sum;
+          markChecksumDirty(request.Block);
+          checksumsRecomputed += 1;
+        }
+      }
     }
-    blkIndex += 1;
   }
-  disk->write(getInodeBlkIndex(inumber), inodeBlock.Data);
-  return writeCount;
 }
 
-ssize_t FileSystem::allocateBlockForInode(Inode &inode) {
-  uint32_t blocks = blockCount(inode);
-  // allocate a direct block
-  if (blocks < POINTERS_PER_INODE) {
-    auto blk = allocateBlock();
-    // failed to allocate
-    if (blk == -1) {
-      return -1;
+void FileSystem::clearChecksumRegions() {
+  std::lock_guard<std::mutex> guard(checksumsLock);
+  bool changed = false;
+  for (uint32_t i = 0; i < checksumRegions.size(); ++i) {
+    if (checksumRegions[i] && !writtenRegions[i] && busyRegions[i] == 0) {
+      checksumRegions[i] = false;
+      changed = true;
     }
-    // `blocks` is the next index
-    inode.Direct[blocks] = blk;
-    return blk;
   }
-  // need to alloc an indirect block besides a data block
-  else if (blocks == POINTERS_PER_INODE) {
-    auto indBlk = allocateBlock();
-    if (indBlk == -1) {
-      return -1;
+  if (changed) {
+    writeSuperblock();
+  }
+}
+
+void FileSystem::writeData(const std::vector<Disk::Request> &requests) {
+  if (!hasFeature(FEATURE_CHECKSUMS)) {
+    disk->writev(requests);
+    return;
+  }
+  std::vector<uint32_t> sums;
+  for (auto &request : requests) {
+    sums.push_back(checksumBlock(request.Data));
+  }
+  const uint32_t regionBlocks = getChecksumRegionBlocks(superblock);
+  {
+    // the region is marked on disk before the block can be newer than its
+    // entry there
+    std::lock_guard<std::mutex> guard(checksumsLock);
+    bool marked = false;
+    for (size_t i = 0; i < requests.size(); ++i) {
+      const uint32_t region = requests[i].Block / regionBlocks;
+      if (!checksumRegions[region]) {
+        checksumRegions[region] = true;
+        marked = true;
+      }
+      writtenRegions[region] = true;
+      busyRegions[region] += 1;
+      checksums[requests[i].Block] = sums[i];
+      markChecksumDirty(requests[i].Block);
     }
-    
-    auto blk = allocateBlock();
-    if (blk == -1) {
-      // reclaim the indirect blk
-      reclaimBlock(indBlk);
-      return -1;
+    if (marked) {
+      writeSuperblock();
     }
-    inode.Indirect = indBlk;
-    Block ptrBlock;
-    ptrBlock.Pointers[0] = blk;
-    disk->write(indBlk, ptrBlock.Data);
-    return blk;
   }
-  // indirect data block
-  else {
-    auto blk = allocateBlock();
-    if (blk == -1) {
-      return -1;
+  disk->writev(requests);
+  std::lock_guard<std::mutex> guard(checksumsLock);
+  for (auto &request : requests) {
+    busyRegions[request.Block / regionBlocks] -= 1;
+  }
+}
+
+bool FileSystem::verifyData(const std::vector<Disk::Request> &requests, size_t first, size_t last) {
+  if (!hasFeature(FEATURE_CHECKSUMS)) {
+    return true;
+  }
+  last = std::min(last, requests.size());
+  std::vector<uint32_t> sums;
+  for (size_t i = first; i < last; ++i) {
+    sums.push_back(checksumBlock(requests[i].Data));
+  }
+  size_t errors = 0;
+  {
+    std::lock_guard<std::mutex> guard(checksumsLock);
+    for (size_t i = first; i < last; ++i) {
+      const uint32_t expected = checksums[requests[i].Block];
+      errors += expected != 0 && expected != sums[i - first];
     }
-    Block ptrBlock;
-    disk->read(inode.Indirect, ptrBlock.Data);
-    ptrBlock.Pointers[blocks - POINTERS_PER_INODE] = blk;
-    disk->write(inode.Indirect, ptrBlock.Data);
-    return blk;
   }
-  // not reachable
-  throw std::runtime_error("Not reachable");
-  return -1;
+  checksumErrors += errors;
+  return errors == 0;
+}
+
+// Unmount file system ---------------------------------------------------------
+
+void FileSystem::unmount() {
+  if (disk == nullptr) { return; }
+  const size_t readahead = readaheadMax;
+  // Write back anything still sitting in the block cache
+  sync();
+  journal.reset();
+  // only now is the on-disk bitmap trustworthy
+  if (hasFeature(FEATURE_BITMAP)) {
+    superblock.State = STATE_CLEAN;
+    writeSuperblock();
+  }
+  disk->unmount();
+  disk = nullptr;
+  freeBlocks.assign(0, false);
+  dirtyBitmapBlocks.clear();
+  refs.clear();
+  dedupIndex.clear();
+  dirtyRefBlocks.clear();
+  checksums.clear();
+  dirtyChecksumBlocks.clear();
+  checksumRegions.clear();
+  writtenRegions.clear();
+  busyRegions.clear();
+  inodeShards.reset();
+  freeInodes.assign(0, false);
+  blockMaps.clear();
+  setReadahead(0);
+  readaheadMax = readahead;
+}
+
+// Sync file system ------------------------------------------------------------
+
+void FileSystem::sync() {
+  if (disk == nullptr) { return; }
+  // concurrent syncs could otherwise write an older copy of a block last
+  std::lock_guard<std::mutex> guard(syncLock);
+  writeInodes();
+  writeBitmap(false);
+  writeRefs(false);
+  if (hasFeature(FEATURE_CHECKSUMS)) {
+    std::lock_guard<std::mutex> guard(checksumsLock);
+    writtenRegions.assign(writtenRegions.size(), false);
+  }
+  writeChecksums(false);
+  if (journal) {
+    // one transaction for everything logged since the last sync, unless it
+    // is more than the whole log holds
+    journal->commit();
+  } else {
+    disk->sync();
+  }
+  if (hasFeature(FEATURE_CHECKSUMS)) {
+    clearChecksumRegions();
+  }
+}
+
+void FileSystem::checkpoint() {
+  if (journal) {
+    journal->checkpoint();
+  }
+}
+
+void FileSystem::initFreeBlocks_forInodeBlock(const Block &block, ScanState &state) {
+  const uint32_t inodesPerBlock = getInodesPerBlock();
+  for (uint32_t i = 0; i < inodesPerBlock; ++i) {
+    Inode inode;
+    decodeInode(superblock, block, i, inode);
+    if (inode.Valid == 1) {
+      claimInodeBlocks(inode, state);
+    }
+  }
+}
+
+void FileSystem::claimInodeBlocks(const Inode &inode, ScanState &state) {
+  const auto disk = getDisk();
+  if (state.Visited == nullptr || hasFeature(FEATURE_EXTENTS)) {
+    // data blocks, then the pointer or overflow blocks that map them
+    BlockMap map;
+    loadBlockMap(superblock, inode, map, [disk](uint32_t blk, char *data) { disk->read(blk, data); }, true);
+    for (auto blk : map.Blocks) {
+      claimSharedBlock(state, state.Data, blk);
+    }
+    for (const auto *blocks : {&map.Leaves, &map.Seconds, &map.Meta}) {
+      for (auto blk : *blocks) {
+        claimSharedBlock(state, state.Pointers, blk);
+      }
+    }
+    return;
+  }
+
+  // a pointer block is claimed once for every block or inode pointing to
+  // it, but only the first worker to get there claims what it points to
+  // in turn; `count` is the number of inode blocks under it
+  std::function<void(uint32_t, int, uint64_t)> walk = [&](uint32_t blk, int level, uint64_t count) {
+    if (blk == 0 || blk >= state.Claimed.size()) {
+      return;
+    }
+    claimSharedBlock(state, state.Pointers, blk);
+    const uint64_t bit = 1ull << (blk % 64);
+    if (state.Visited[blk / 64].fetch_or(bit) & bit) {
+      return;
+    }
+    Block pointers;
+    disk->read(blk, pointers.Data);
+    const uint64_t span = level == 0 ? 1 : level == 1 ? POINTERS_PER_BLOCK : (uint64_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+    for (uint32_t i = 0; i < POINTERS_PER_BLOCK && i * span < count; ++i) {
+      if (level == 0) {
+        claimSharedBlock(state, state.Data, pointers.Pointers[i]);
+      } else {
+        walk(pointers.Pointers[i], level - 1, std::min(span, count - i * span));
+      }
+    }
+  };
+  if (inode.Flags & INODE_INLINE_DATA) {
+    return;
+  }
+  uint64_t mapped = std::min(blockCount(inode), getMaxBlocks(superblock));
+  for (uint32_t i = 0; i < mapped && i < POINTERS_PER_INODE; ++i) {
+    claimSharedBlock(state, state.Data, inode.Direct[i]);
+  }
+  mapped -= std::min<uint64_t>(mapped, POINTERS_PER_INODE);
+  uint64_t span = POINTERS_PER_BLOCK;
+  int level = 0;
+  for (auto blk : {inode.Indirect, inode.DoubleIndirect, inode.TripleIndirect}) {
+    if (mapped > 0) {
+      walk(blk, level, std::min(mapped, span));
+    }
+    mapped -= std::min(mapped, span);
+    span *= POINTERS_PER_BLOCK;
+    level += 1;
+  }
+}
+
+// Create inode ----------------------------------------------------------------
+
+ssize_t FileSystem::create() {
+  SharedGuard tableGuard(tableLock);
+
+  // Locate free inode in inode table, lowest inumber first
+  ssize_t inumber;
+  {
+    std::lock_guard<std::mutex> guard(freeInodesLock);
+    freeInodes.seek(0);
+    inumber = freeInodes.allocate();
+  }
+  if (inumber == -1) {
+    return -1;
+  }
+
+  Inode inode;
+  memset(&inode, 0, sizeof(inode));
+  inode.Valid = 1;
+  inode.Size = 0;
+  // new files start out in the inode when the format allows it
+  if (hasFeature(FEATURE_INLINE_DATA)) {
+    inode.Flags = INODE_INLINE_DATA;
+  }
+  if (hasFeature(FEATURE_COMPRESSION)) {
+    inode.Flags |= INODE_COMPRESSED;
+  }
+  // the inode block is written back on sync
+  storeInode(inumber, inode);
+  return inumber;
+}
+
+// Remove inode ----------------------------------------------------------------
+
+bool FileSystem::remove(size_t inumber) {
+  syncIfCrowded();
+  SharedGuard tableGuard(tableLock);
+  std::lock_guard<RWLock> guard(getInodeLock(inumber));
+
+  // Load inode information
+  Inode inode;
+  if (!loadInode(inumber, inode)) { return false; }
+
+  // free data blocks, then the pointer or overflow blocks; shared pointer
+  // blocks only lose a reference
+  if (hasRefs()) {
+    releaseInodeBlocks(inode);
+  } else {
+    const auto map = getBlockMap(inumber, inode);
+    if (!map->Blocks.empty()) {
+      loadMapRange(*map, 0, map->Blocks.size() - 1);
+    }
+    for (auto blk : map->Blocks) {
+      if (blk != 0) {
+        releaseBlock(blk);
+      }
+    }
+    for (const auto *blocks : {&map->Leaves, &map->Seconds, &map->Meta}) {
+      for (auto blk : *blocks) {
+        if (blk != 0) {
+          reclaimBlock(blk);
+        }
+      }
+    }
+  }
+
+  // Clear inode in inode table
+  dropReadahead(inumber);
+  dropCluster(inumber);
+  {
+    std::lock_guard<std::mutex> guard(blockMapsLock);
+    blockMaps.erase(inumber);
+  }
+  inode.Valid = 0;
+  storeInode(inumber, inode);
+  std::lock_guard<std::mutex> freeGuard(freeInodesLock);
+  freeInodes.set(inumber);
+
+  return true;
+}
+
+// Clones and snapshots --------------------------------------------------------
+
+ssize_t FileSystem::clone(size_t inumber) {
+  syncIfCrowded();
+  if (disk == nullptr || !hasFeature(FEATURE_CLONES)) {
+    return -1;
+  }
+  SharedGuard tableGuard(tableLock);
+  ssize_t target;
+  {
+    std::lock_guard<std::mutex> guard(freeInodesLock);
+    freeInodes.seek(0);
+    target = freeInodes.allocate();
+  }
+  if (target == -1) {
+    return -1;
+  }
+
+  // the two stripes are taken in order, so clones in opposite directions
+  // cannot deadlock
+  RWLock *first = &getInodeLock(inumber);
+  RWLock *second = &getInodeLock(target);
+  if (second < first) {
+    std::swap(first, second);
+  }
+  std::lock_guard<RWLock> firstGuard(*first);
+  std::unique_lock<RWLock> secondGuard;
+  if (second != first) {
+    secondGuard = std::unique_lock<RWLock>(*second);
+  }
+
+  Inode inode;
+  if (!loadInode(inumber, inode) || !shareInodeBlocks(inode)) {
+    std::lock_guard<std::mutex> guard(freeInodesLock);
+    freeInodes.set(target);
+    return -1;
+  }
+  storeInode(target, inode);
+  return target;
+}
+
+void FileSystem::lockInodes() {
+  for (auto &lock : inodeLocks) {
+    lock.lock();
+  }
+}
+
+void FileSystem::unlockInodes() {
+  for (auto &lock : inodeLocks) {
+    lock.unlock();
+  }
+}
+
+void FileSystem::loadSnapshot(uint32_t head, const std::function<void(uint32_t, char *)> &read,
+                              std::vector<std::pair<uint32_t, Inode>> &inodes, std::vector<uint32_t> &blocks) {
+  const uint32_t record = getInodeRecordSize(superblock);
+  const uint32_t perBlock = (Disk::BLOCK_SIZE - sizeof(SnapshotHeader)) / (sizeof(uint32_t) + record);
+  // a chain that loops or runs off the disk is cut short
+  Block block;
+  Block unpacked;
+  memset(&unpacked, 0, sizeof(unpacked));
+  for (uint32_t next = head; next != 0 && next < superblock.Blocks && blocks.size() < superblock.Blocks;) {
+    read(next, block.Data);
+    blocks.push_back(next);
+    SnapshotHeader header;
+    memcpy(&header, block.Data, sizeof(header));
+    const uint32_t count = std::min(header.Count, perBlock);
+    const char *numbers = block.Data + sizeof(header);
+    const char *records = numbers + (size_t)count * sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t inumber;
+      memcpy(&inumber, numbers + i * sizeof(uint32_t), sizeof(inumber));
+      memcpy(unpacked.Data, records + (size_t)i * record, record);
+      Inode inode;
+      decodeInode(superblock, unpacked, 0, inode);
+      if (inumber < superblock.Inodes && inode.Valid == 1) {
+        inodes.emplace_back(inumber, inode);
+      }
+    }
+    next = header.Next;
+  }
+}
+
+ssize_t FileSystem::snapshot() {
+  syncIfCrowded();
+  if (disk == nullptr || !hasFeature(FEATURE_CLONES)) {
+    return -1;
+  }
+  std::lock_guard<RWLock> tableGuard(tableLock);
+  Block table;
+  readMetadata(getSnapshotTable(superblock), table.Data);
+  uint32_t id = 0;
+  while (id < MAX_SNAPSHOTS && table.Snapshots[id].Head != 0) {
+    id += 1;
+  }
+  if (id == MAX_SNAPSHOTS) {
+    return -1;
+  }
+
+  // no file changes while its inode is copied; each copy takes its own
+  // references, so the files can change again right after
+  lockInodes();
+  std::vector<std::pair<uint32_t, Inode>> inodes;
+  bool shared = true;
+  for (uint32_t i = 0; i < superblock.InodeBlocks && shared; ++i) {
+    std::vector<std::pair<uint32_t, Inode>> valid;
+    {
+      auto &shard = inodeShards[i];
+      std::lock_guard<std::mutex> guard(shard.Lock);
+      for (const auto &entry : shard.Inodes) {
+        if (entry.second.Valid == 1) {
+          valid.push_back(entry);
+        }
+      }
+    }
+    std::sort(valid.begin(), valid.end(), [](const std::pair<uint32_t, Inode> &a, const std::pair<uint32_t, Inode> &b) {
+      return a.first < b.first;
+    });
+    for (auto &entry : valid) {
+      shared = shareInodeBlocks(entry.second);
+      if (!shared) {
+        break;
+      }
+      inodes.push_back(entry);
+    }
+  }
+  unlockInodes();
+
+  // the inodes go to a chain of blocks, inumbers first in each
+  const uint32_t record = getInodeRecordSize(superblock);
+  const uint32_t perBlock = (Disk::BLOCK_SIZE - sizeof(SnapshotHeader)) / (sizeof(uint32_t) + record);
+  const size_t count = std::max<size_t>(1, (inodes.size() + perBlock - 1) / perBlock);
+  std::vector<uint32_t> chain;
+  while (shared && chain.size() < count) {
+    const auto blk = allocateBlock();
+    if (blk == -1) {
+      shared = false;
+      break;
+    }
+    chain.push_back(blk);
+  }
+  if (!shared) {
+    for (auto blk : chain) {
+      reclaimBlock(blk);
+    }
+    for (auto &entry : inodes) {
+      releaseInodeBlocks(entry.second);
+    }
+    return -1;
+  }
+
+  std::vector<Block> blocks(count);
+  std::vector<Disk::Request> requests;
+  Block packed;
+  for (size_t b = 0; b < count; ++b) {
+    memset(&blocks[b], 0, sizeof(Block));
+    const size_t first = b * perBlock;
+    const SnapshotHeader header{b + 1 < count ? chain[b + 1] : 0,
+                                (uint32_t)std::min((size_t)perBlock, inodes.size() - std::min(first, inodes.size()))};
+    memcpy(blocks[b].Data, &header, sizeof(header));
+    char *numbers = blocks[b].Data + sizeof(header);
+    char *records = numbers + (size_t)header.Count * sizeof(uint32_t);
+    for (uint32_t i = 0; i < header.Count; ++i) {
+      const auto &entry = inodes[first + i];
+      memcpy(numbers + i * sizeof(uint32_t), &entry.first, sizeof(uint32_t));
+      memset(&packed, 0, sizeof(packed));
+      encodeInode(superblock, entry.second, 0, packed);
+      memcpy(records + (size_t)i * record, packed.Data, record);
+    }
+    requests.push_back(Disk::Request{(int)chain[b], blocks[b].Data});
+  }
+  writeMetadata(requests);
+  table.Snapshots[id] = SnapshotEntry{chain[0], (uint32_t)inodes.size()};
+  writeMetadata(getSnapshotTable(superblock), table.Data);
+  return id;
+}
+
+bool FileSystem::rollback(size_t id) {
+  syncIfCrowded();
+  if (disk == nullptr || !hasFeature(FEATURE_CLONES) || id >= MAX_SNAPSHOTS) {
+    return false;
+  }
+  std::lock_guard<RWLock> tableGuard(tableLock);
+  Block table;
+  readMetadata(getSnapshotTable(superblock), table.Data);
+  if (table.Snapshots[id].Head == 0) {
+    return false;
+  }
+  std::vector<std::pair<uint32_t, Inode>> inodes;
+  std::vector<uint32_t> chain;
+  loadSnapshot(table.Snapshots[id].Head, [this](uint32_t blk, char *data) { readMetadata(blk, data); }, inodes, chain);
+
+  lockInodes();
+  // the snapshot is kept, so the inodes restored from it take references
+  // of their own before the ones they replace drop theirs
+  for (size_t i = 0; i < inodes.size(); ++i) {
+    if (!shareInodeBlocks(inodes[i].second)) {
+      for (size_t j = 0; j < i; ++j) {
+        releaseInodeBlocks(inodes[j].second);
+      }
+      unlockInodes();
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < superblock.InodeBlocks; ++i) {
+    auto &shard = inodeShards[i];
+    std::vector<std::pair<uint32_t, Inode>> live;
+    {
+      std::lock_guard<std::mutex> guard(shard.Lock);
+      for (const auto &entry : shard.Inodes) {
+        if (entry.second.Valid == 1) {
+          live.push_back(entry);
+        }
+      }
+      shard.Inodes.clear();
+      shard.Dirty = true;
+    }
+    for (auto &entry : live) {
+      releaseInodeBlocks(entry.second);
+      dropReadahead(entry.first);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(blockMapsLock);
+    blockMaps.clear();
+  }
+  {
+    std::lock_guard<std::mutex> guard(freeInodesLock);
+    freeInodes.assign(superblock.Inodes, true);
+    for (auto &entry : inodes) {
+      freeInodes.reset(entry.first);
+    }
+  }
+  for (auto &entry : inodes) {
+    storeInode(entry.first, entry.second);
+  }
+  unlockInodes();
+  return true;
+}
+
+bool FileSystem::removeSnapshot(size_t id) {
+  syncIfCrowded();
+  if (disk == nullptr || !hasFeature(FEATURE_CLONES) || id >= MAX_SNAPSHOTS) {
+    return false;
+  }
+  std::lock_guard<RWLock> tableGuard(tableLock);
+  Block table;
+  readMetadata(getSnapshotTable(superblock), table.Data);
+  if (table.Snapshots[id].Head == 0) {
+    return false;
+  }
+  // blocks only the snapshot still points to are freed with it
+  std::vector<std::pair<uint32_t, Inode>> inodes;
+  std::vector<uint32_t> chain;
+  loadSnapshot(table.Snapshots[id].Head, [this](uint32_t blk, char *data) { readMetadata(blk, data); }, inodes, chain);
+  for (auto &entry : inodes) {
+    releaseInodeBlocks(entry.second);
+  }
+  for (auto blk : chain) {
+    reclaimBlock(blk);
+  }
+  table.Snapshots[id] = SnapshotEntry{0, 0};
+  writeMetadata(getSnapshotTable(superblock), table.Data);
+  return true;
+}
+
+std::vector<size_t> FileSystem::getSnapshots() {
+  std::vector<size_t> ids;
+  if (disk == nullptr || !hasFeature(FEATURE_CLONES)) {
+    return ids;
+  }
+  SharedGuard tableGuard(tableLock);
+  Block table;
+  readMetadata(getSnapshotTable(superblock), table.Data);
+  for (uint32_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+    if (table.Snapshots[i].Head != 0) {
+      ids.push_back(i);
+    }
+  }
+  return ids;
+}
+
+// Inode stat ------------------------------------------------------------------
+
+ssize_t FileSystem::stat(size_t inumber) {
+  // Served from the inode table, no disk access
+  Inode inode;
+  if (!loadInode(inumber, inode)) {
+    return -1;
+  }
+  return inode.Size;
+}
+
+// Read from inode -------------------------------------------------------------
+
+ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
+  SharedGuard guard(getInodeLock(inumber));
+
+  // Load inode information
+  Inode inode;
+  if (!loadInode(inumber, inode)) {
+    return -1;
+  }
+  
+  // Adjust length
+  if (offset >= inode.Size) {
+    return -1;
+  }
+
+  length = length > inode.Size - offset ? inode.Size - offset : length;
+  if (length == 0) {
+    return 0;
+  }
+
+  // inline contents came with the inode, so there is nothing to read
+  if (inode.Flags & INODE_INLINE_DATA) {
+    memcpy(data, inode.Data + offset, length);
+    return length;
+  }
+
+  const auto mapPtr = getBlockMap(inumber, inode);
+  auto &map = *mapPtr;
+  if (inode.Flags & INODE_COMPRESSED) {
+    return readCompressed(inumber, map, inode.Size, data, length, offset);
+  }
+
+  // Read block and copy to data
+  uint32_t startBlk = offset / Disk::BLOCK_SIZE;
+  uint32_t endBlk = (offset + length - 1) / Disk::BLOCK_SIZE;
+  uint32_t count = endBlk - startBlk + 1;
+
+  // the offset point to read from the first block
+  uint32_t fstBlkStartOffset = offset % Disk::BLOCK_SIZE;
+
+  loadMapRange(map, startBlk, endBlk);
+
+  // a read that starts where the previous one ended keeps the stream going;
+  // readers of the same stream take turns
+  std::shared_ptr<Readahead> ra;
+  std::unique_lock<std::mutex> raLock;
+  bool sequential = false;
+  if (readaheadMax > 0) {
+    ra = getReadaheadState(inumber);
+    raLock = std::unique_lock<std::mutex>(ra->Lock);
+    sequential = offset == ra->NextOffset;
+    ra->NextOffset = offset + length;
+  }
+
+  // whether inode block `blockIndex` is wholly inside the requested range
+  auto isFull = [&](uint32_t blockIndex) {
+    const size_t blkStart = (size_t)blockIndex * Disk::BLOCK_SIZE;
+    return blkStart >= offset && blkStart + Disk::BLOCK_SIZE <= offset + length;
+  };
+
+  // one request list, so physically contiguous blocks become a single read;
+  // full blocks land in `data` directly, only partial ones are bounced, and
+  // holes are zeroed without any I/O
+  Block partial[2];
+  std::vector<Disk::Request> requests;
+  auto request = [&requests](uint32_t blk, char *target) {
+    if (blk == 0) {
+      memset(target, 0, Disk::BLOCK_SIZE);
+    } else {
+      requests.push_back(Disk::Request{(int)blk, target});
+    }
+  };
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint32_t blockIndex = startBlk + i;
+    char *target = isFull(blockIndex)
+                 ? data + ((size_t)blockIndex * Disk::BLOCK_SIZE - offset)
+                 : partial[i == 0 ? 0 : 1].Data;
+    if (ra != nullptr && blockIndex >= ra->First && blockIndex - ra->First < ra->Blocks.size()) {
+      // already prefetched
+      memcpy(target, ra->Blocks[blockIndex - ra->First].Data, Disk::BLOCK_SIZE);
+      if (!ra->Used[blockIndex - ra->First]) {
+        ra->Used[blockIndex - ra->First] = true;
+        readaheadHits += 1;
+      }
+      continue;
+    }
+    request(map.Blocks[blockIndex], target);
+  }
+
+  // prefetch the next window in the same vectored read
+  const size_t wanted = requests.size();
+  if (ra != nullptr && !sequential) {
+    dropReadahead(*ra, UINT32_MAX);
+    ra->Window = 0;
+  } else if (ra != nullptr) {
+    ra->Window = ra->Window == 0 ? (count > READAHEAD_INITIAL ? count : READAHEAD_INITIAL) : ra->Window * 2;
+    ra->Window = std::min((size_t)ra->Window, readaheadMax.load());
+    dropReadahead(*ra, endBlk + 1);
+    if (!ra->Blocks.empty() && ra->First != endBlk + 1) {
+      dropReadahead(*ra, UINT32_MAX);
+    }
+    if (ra->Blocks.empty()) {
+      ra->First = endBlk + 1;
+    }
+    const uint32_t have = ra->First + ra->Blocks.size();
+    const uint32_t until = std::min((size_t)endBlk + 1 + ra->Window, map.Blocks.size());
+    if (until > have) {
+      loadMapRange(map, have, until - 1);
+      const size_t old = ra->Blocks.size();
+      ra->Blocks.resize(old + until - have);
+      ra->Used.resize(old + until - have, false);
+      for (uint32_t i = 0; i < until - have; ++i) {
+        request(map.Blocks[have + i], ra->Blocks[old + i].Data);
+      }
+    }
+  }
+  disk->readv(requests);
+  if (!verifyData(requests, 0, wanted)) {
+    if (ra != nullptr) {
+      dropReadahead(*ra, UINT32_MAX);
+    }
+    return -1;
+  }
+  if (ra != nullptr && !verifyData(requests, wanted)) {
+    // the next read fetches the bad block itself, and fails then
+    dropReadahead(*ra, UINT32_MAX);
+  }
+
+  // copy the partial head and tail out of their bounce blocks
+  if (!isFull(startBlk)) {
+    memcpy(data, partial[0].Data + fstBlkStartOffset,
+           std::min(length, (size_t)Disk::BLOCK_SIZE - fstBlkStartOffset));
+  }
+  if (count > 1 && !isFull(endBlk)) {
+    const size_t blkStart = (size_t)endBlk * Disk::BLOCK_SIZE;
+    memcpy(data + (blkStart - offset), partial[1].Data, offset + length - blkStart);
+  }
+  
+  return length;
+}
+
+std::shared_ptr<FileSystem::Readahead> FileSystem::getReadaheadState(uint32_t inumber) {
+  std::shared_ptr<Readahead> victim;
+  std::unique_lock<std::mutex> lock(readaheadsLock);
+  auto it = readaheads.find(inumber);
+  if (it != readaheads.end()) {
+    return it->second;
+  }
+
+  if (readaheads.size() >= READAHEAD_STREAMS) {
+    victim = readaheads.begin()->second;
+    readaheads.erase(readaheads.begin());
+  }
+  auto ra = std::make_shared<Readahead>();
+  ra->NextOffset = 0;
+  ra->Window = 0;
+  ra->First = 0;
+  readaheads[inumber] = ra;
+  lock.unlock();
+
+  // the evicted stream may still be in use by a reader of another inode
+  if (victim) {
+    std::lock_guard<std::mutex> guard(victim->Lock);
+    dropReadahead(*victim, UINT32_MAX);
+  }
+  return ra;
+}
+
+void FileSystem::dropReadahead(Readahead &ra, uint32_t index) {
+  size_t drop = 0;
+  while (drop < ra.Blocks.size() && ra.First + drop < index) {
+    if (!ra.Used[drop]) {
+      readaheadWasted += 1;
+    }
+    drop += 1;
+  }
+  ra.Blocks.erase(ra.Blocks.begin(), ra.Blocks.begin() + drop);
+  ra.Used.erase(ra.Used.begin(), ra.Used.begin() + drop);
+  ra.First += drop;
+}
+
+void FileSystem::dropReadahead(uint32_t inumber) {
+  std::shared_ptr<Readahead> ra;
+  {
+    std::lock_guard<std::mutex> guard(readaheadsLock);
+    auto it = readaheads.find(inumber);
+    if (it == readaheads.end()) {
+      return;
+    }
+    ra = it->second;
+    readaheads.erase(it);
+  }
+  std::lock_guard<std::mutex> guard(ra->Lock);
+  dropReadahead(*ra, UINT32_MAX);
+}
+
+void FileSystem::setReadahead(size_t blocks) {
+  readaheadMax = blocks;
+  if (blocks == 0) {
+    std::vector<uint32_t> inumbers;
+    {
+      std::lock_guard<std::mutex> guard(readaheadsLock);
+      for (const auto &entry : readaheads) {
+        inumbers.push_back(entry.first);
+      }
+    }
+    for (auto inumber : inumbers) {
+      dropReadahead(inumber);
+    }
+  }
+}
+
+// Write to inode --------------------------------------------------------------
+
+ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
+  syncIfCrowded();
+  std::lock_guard<RWLock> guard(getInodeLock(inumber));
+
+  // Load inode; changes are published with storeInode at the end
+  Inode inode;
+  if (!loadInode(inumber, inode)) {
+    return -1;
+  }
+  
+  if (length == 0) {
+    return 0;
+  }
+
+  // small files stay in the inode; a write past the end leaves zeros
+  // behind the old contents
+  if (inode.Flags & INODE_INLINE_DATA && offset + length <= getInlineCapacity(superblock)) {
+    if (offset > inode.Size) {
+      memset(inode.Data + inode.Size, 0, offset - inode.Size);
+    }
+    memcpy(inode.Data + offset, data, length);
+    if (offset + length > inode.Size) {
+      inode.Size = offset + length;
+    }
+    storeInode(inumber, inode);
+    return length;
+  }
+
+  // nothing fits at or past the largest size the file can map, so the file
+  // is left as it is
+  if ((uint64_t)offset >= (uint64_t)getMaxBlocks(superblock) * Disk::BLOCK_SIZE) {
+    return 0;
+  }
+
+  // prefetched blocks may be overwritten below
+  dropReadahead(inumber);
+
+  uint32_t startBlk = offset / Disk::BLOCK_SIZE;
+
+  // write the first block starting at this offset.
+  uint32_t fstBlkStartOffset = offset % Disk::BLOCK_SIZE;
+
+  // one that outgrows the inode moves what it held to its first data block
+  const auto mapPtr = getBlockMap(inumber, inode);
+  auto &map = *mapPtr;
+  if (inode.Flags & INODE_INLINE_DATA && !spillInline(inode, map)) {
+    return -1;
+  }
+  if (inode.Flags & INODE_COMPRESSED) {
+    return writeCompressed(inumber, inode, map, data, length, offset);
+  }
+  if (hasRefs()) {
+    return writeShared(inumber, inode, map, data, length, offset);
+  }
+
+  // a write past the end leaves holes up to `offset`; the holes it covers
+  // and the blocks past the end are allocated, or as many as fit
+  const uint32_t blocks = map.Blocks.size();
+  const uint64_t end = ((uint64_t)offset + length + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+  uint32_t needed = std::min(end, (uint64_t)getMaxBlocks(superblock));
+  const bool extents = hasFeature(FEATURE_EXTENTS);
+  if (needed > 0) {
+    loadMapRange(map, startBlk, needed - 1);
+  }
+  // the head and tail blocks hold nothing to keep if they are holes
+  const uint32_t lastBlk = needed > 0 ? needed - 1 : 0;
+  const bool headHole = startBlk < blocks && map.Blocks[startBlk] == 0;
+  const bool tailHole = lastBlk < blocks && map.Blocks[lastBlk] == 0;
+  if (needed > blocks && !resizeBlockMap(inode, map, needed)) {
+    needed = blocks;
+  }
+  uint32_t index = startBlk;
+  while (index < needed) {
+    if (map.Blocks[index] != 0) {
+      index += 1;
+      continue;
+    }
+    // the leaf is allocated ahead of the data it points to
+    if (reserveMapBlocks(inode, map, index) < 0) {
+      break;
+    }
+    // ask for the whole hole at once so the file stays contiguous, but stop
+    // where the next leaf has to come
+    uint32_t want = 1;
+    const uint32_t room = getMapRoom(map, index);
+    while (index + want < needed && want < room && map.Blocks[index + want] == 0) {
+      want += 1;
+    }
+    // extent-mapped files grow the run before the hole when the block after
+    // it is free, and otherwise start a run long enough for the whole hole
+    ssize_t goal = -1;
+    if (extents) {
+      goal = index > 0 && map.Blocks[index - 1] != 0 ? map.Blocks[index - 1] + 1 : disk->size();
+    }
+    size_t length;
+    auto start = allocateRun(want, length, goal);
+    if (start == -1) {
+      break;
+    }
+    size_t k = 0;
+    while (k < length && allocateBlockForInode(inode, map, index + k, start + k) != -1) {
+      k += 1;
+    }
+    index += k;
+    if (k < length) {
+      // the inode is full
+      for (; k < length; ++k) {
+        reclaimBlock(start + k);
+      }
+      break;
+    }
+  }
+  if (index < end) {
+    // only write what fits in the allocated blocks, and drop what was
+    // added past the end of the file for the rest
+    length = (size_t)index * Disk::BLOCK_SIZE > offset ? (size_t)index * Disk::BLOCK_SIZE - offset : 0;
+    const size_t size = length > 0 ? std::max((size_t)inode.Size, offset + length) : inode.Size;
+    if (map.Blocks.size() > (size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE) {
+      resizeBlockMap(inode, map, (size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE);
+    }
+    releaseMapBlocks(inode, map, index);
+  }
+  // new pointers reach the disk once per call
+  flushBlockMap(inode, map);
+
+  if (length > 0) {
+    uint32_t count = (fstBlkStartOffset + length + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    const size_t end = offset + length;
+    loadMapRange(map, startBlk, startBlk + count - 1);
+
+    // full blocks are written straight from `data`; a partial head or tail
+    // block is read first only if it holds file bytes outside the range
+    Block partial[2];
+    std::vector<Disk::Request> requests(count);
+    std::vector<Disk::Request> preReads;
+    for (uint32_t i = 0; i < count; ++i) {
+      const size_t blkStart = (size_t)(startBlk + i) * Disk::BLOCK_SIZE;
+      const size_t blkEnd = blkStart + Disk::BLOCK_SIZE;
+      const int blk = map.Blocks[startBlk + i];
+      if (blkStart >= offset && blkEnd <= end) {
+        requests[i] = Disk::Request{blk, data + (blkStart - offset)};
+        continue;
+      }
+      auto &block = partial[i == 0 ? 0 : 1];
+      const size_t keepEnd = std::min(blkEnd, (size_t)inode.Size);
+      const bool hole = (i == 0 && headHole) || (i == count - 1 && tailHole);
+      if (!hole && keepEnd > blkStart && (blkStart < offset || keepEnd > end)) {
+        preReads.push_back(Disk::Request{blk, block.Data});
+      } else {
+        memset(block.Data, 0, sizeof(block.Data));
+      }
+      requests[i] = Disk::Request{blk, block.Data};
+    }
+    // a bad block that is partly overwritten gets a new checksum, but is
+    // still counted
+    disk->readv(preReads);
+    verifyData(preReads);
+
+    // merge the new bytes into the partial blocks
+    for (uint32_t i = 0; i < count; i += count > 1 ? count - 1 : 1) {
+      const size_t blkStart = (size_t)(startBlk + i) * Disk::BLOCK_SIZE;
+      if (requests[i].Data != partial[i == 0 ? 0 : 1].Data) {
+        continue;
+      }
+      const size_t from = std::max(offset, blkStart);
+      const size_t to = std::min(end, blkStart + Disk::BLOCK_SIZE);
+      memcpy(requests[i].Data + (from - blkStart), data + (from - offset), to - from);
+    }
+    writeData(requests);
+  }
+
+  // a write that placed nothing does not grow the file up to `offset`
+  if (length > 0 && offset + length > inode.Size) {
+    inode.Size = offset + length;
+  }
+  // pointers or size may have changed; written back on sync
+  storeInode(inumber, inode);
+  return length;
+}
+
+// Truncate and punch holes ---------------------------------------------------
+
+bool FileSystem::truncate(size_t inumber, size_t size) {
+  syncIfCrowded();
+  std::lock_guard<RWLock> guard(getInodeLock(inumber));
+
+  Inode inode;
+  if (!loadInode(inumber, inode)) {
+    return false;
+  }
+  if (size == inode.Size) {
+    return true;
+  }
+  const uint64_t blocks = ((uint64_t)size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+  if (blocks > getMaxBlocks(superblock)) {
+    return false;
+  }
+
+  // inline contents only need zeros where the file grows
+  if (inode.Flags & INODE_INLINE_DATA && size <= getInlineCapacity(superblock)) {
+    if (size > inode.Size) {
+      memset(inode.Data + inode.Size, 0, size - inode.Size);
+    }
+    inode.Size = size;
+    storeInode(inumber, inode);
+    return true;
+  }
+
+  dropReadahead(inumber);
+  const auto map = getBlockMap(inumber, inode);
+  if (inode.Flags & INODE_INLINE_DATA && !spillInline(inode, *map)) {
+    return false;
+  }
+  if (inode.Flags & INODE_COMPRESSED) {
+    dropCluster(inumber);
+    const bool done = truncateCompressed(inode, *map, size);
+    flushBlockMap(inode, *map);
+    storeInode(inumber, inode);
+    return done;
+  }
+
+  // pointer blocks shared with a clone are copied before they change
+  if (size < inode.Size && !unshareMapRange(inode, *map, size / Disk::BLOCK_SIZE, map->Blocks.size())) {
+    flushBlockMap(inode, *map);
+    storeInode(inumber, inode);
+    return false;
+  }
+
+  // the last block is zeroed past the new end, so growing the file again
+  // reads zeros there
+  if (size < inode.Size && size % Disk::BLOCK_SIZE != 0) {
+    loadMapRange(*map, size / Disk::BLOCK_SIZE, size / Disk::BLOCK_SIZE);
+    if (!zeroBlockRange(inode, *map, size, std::min((size_t)inode.Size, size - size % Disk::BLOCK_SIZE + Disk::BLOCK_SIZE))) {
+      flushBlockMap(inode, *map);
+      storeInode(inumber, inode);
+      return false;
+    }
+  }
+  if (!resizeBlockMap(inode, *map, blocks)) {
+    flushBlockMap(inode, *map);
+    storeInode(inumber, inode);
+    return false;
+  }
+  flushBlockMap(inode, *map);
+  inode.Size = size;
+  storeInode(inumber, inode);
+  return true;
+}
+
+bool FileSystem::punchHole(size_t inumber, size_t offset, size_t length) {
+  syncIfCrowded();
+  std::lock_guard<RWLock> guard(getInodeLock(inumber));
+
+  Inode inode;
+  if (!loadInode(inumber, inode)) {
+    return false;
+  }
+  // nothing past the end to punch
+  const size_t end = std::min((size_t)inode.Size, offset + length);
+  if (offset >= end) {
+    return true;
+  }
+
+  if (inode.Flags & INODE_INLINE_DATA) {
+    memset(inode.Data + offset, 0, end - offset);
+    storeInode(inumber, inode);
+    return true;
+  }
+
+  dropReadahead(inumber);
+  const auto mapPtr = getBlockMap(inumber, inode);
+  auto &map = *mapPtr;
+  if (inode.Flags & INODE_COMPRESSED) {
+    dropCluster(inumber);
+    const bool done = punchCompressed(inode, map, offset, end);
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return done;
+  }
+  const uint32_t first = offset / Disk::BLOCK_SIZE;
+  const uint32_t last = (end - 1) / Disk::BLOCK_SIZE;
+  loadMapRange(map, first, last);
+  if (!unshareMapRange(inode, map, first, last)) {
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return false;
+  }
+
+  // partial blocks at either end are zeroed, whole ones become holes
+  const size_t firstFull = (offset + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+  const size_t lastFull = end == inode.Size ? last + 1 : end / Disk::BLOCK_SIZE;
+  bool zeroed;
+  if (firstFull >= lastFull) {
+    zeroed = zeroBlockRange(inode, map, offset, std::min(end, (size_t)(first + 1) * Disk::BLOCK_SIZE)) &&
+             (last == first || zeroBlockRange(inode, map, (size_t)last * Disk::BLOCK_SIZE, end));
+  } else {
+    zeroed = zeroBlockRange(inode, map, offset, firstFull * Disk::BLOCK_SIZE) &&
+             zeroBlockRange(inode, map, lastFull * Disk::BLOCK_SIZE, end);
+  }
+  if (!zeroed) {
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return false;
+  }
+  const bool extents = hasFeature(FEATURE_EXTENTS);
+  for (size_t i = firstFull; i < lastFull; ++i) {
+    const uint32_t blk = map.Blocks[i];
+    if (blk == 0) {
+      continue;
+    }
+    releaseBlock(blk);
+    map.Blocks[i] = 0;
+    if (i < POINTERS_PER_INODE) {
+      inode.Direct[i] = 0;
+    } else if (!extents) {
+      map.DirtyLeaves[(i - POINTERS_PER_INODE) / POINTERS_PER_BLOCK] = true;
+    }
+  }
+  if (extents) {
+    map.Runs = 0;
+    for (size_t i = 0; i < map.Blocks.size(); ++i) {
+      if (i == 0 || !continuesRun(map.Blocks[i - 1], map.Blocks[i])) {
+        map.Runs += 1;
+      }
+    }
+    map.Dirty = true;
+    // splitting a run frees a block, so there is room for another
+    // overflow block if one is needed
+    reserveExtentBlocks(map);
+  }
+  releaseMapBlocks(inode, map, firstFull, last);
+  flushBlockMap(inode, map);
+  storeInode(inumber, inode);
+  return true;
+}
+
+// Defragment ------------------------------------------------------------------
+
+ssize_t FileSystem::getRuns(size_t inumber) {
+  SharedGuard guard(getInodeLock(inumber));
+
+  Inode inode;
+  if (!loadInode(inumber, inode)) {
+    return -1;
+  }
+  if (inode.Flags & INODE_INLINE_DATA) {
+    return 0;
+  }
+  const auto mapPtr = getBlockMap(inumber, inode);
+  auto &map = *mapPtr;
+  if (!map.Blocks.empty()) {
+    loadMapRange(map, 0, map.Blocks.size() - 1);
+  }
+  return countDataRuns(map.Blocks);
+}
+
+ssize_t FileSystem::defragment(size_t inumber) {
+  syncIfCrowded();
+  std::lock_guard<RWLock> guard(getInodeLock(inumber));
+
+  Inode inode;
+  if (!loadInode(inumber, inode)) {
+    return -1;
+  }
+  if (inode.Flags & INODE_INLINE_DATA) {
+    return 0;
+  }
+  const auto mapPtr = getBlockMap(inumber, inode);
+  auto &map = *mapPtr;
+  if (map.Blocks.empty()) {
+    return 0;
+  }
+  const uint32_t last = map.Blocks.size() - 1;
+  loadMapRange(map, 0, last);
+  const uint32_t before = countDataRuns(map.Blocks);
+  if (before <= 1) {
+    return before;
+  }
+
+  // pointer blocks shared with a clone or snapshot are copied first, as
+  // for a write, so that the data blocks still shared are those another
+  // file points to itself; they stay where they are
+  if (!unshareMapRange(inode, map, 0, last)) {
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return countDataRuns(map.Blocks);
+  }
+  std::vector<uint32_t> moved; // inode blocks whose data block moves
+  {
+    std::unique_lock<std::mutex> refGuard(refsLock, std::defer_lock);
+    if (hasRefs()) {
+      refGuard.lock();
+    }
+    for (uint32_t i = 0; i <= last; ++i) {
+      if (map.Blocks[i] != 0 && (!hasRefs() || refs[map.Blocks[i]].Count <= 1)) {
+        moved.push_back(i);
+      }
+    }
+  }
+
+  // the first run is the longest free one found, and each one after it
+  // continues where the one before ended if it can
+  std::vector<uint32_t> target;
+  ssize_t goal = superblock.Blocks;
+  while (target.size() < moved.size()) {
+    size_t length;
+    const auto start = allocateRun(moved.size() - target.size(), length, goal);
+    if (start < 0) {
+      break;
+    }
+    for (size_t j = 0; j < length; ++j) {
+      target.push_back(start + j);
+    }
+    goal = start + length;
+  }
+  std::vector<uint32_t> blocks(map.Blocks);
+  for (size_t j = 0; j < target.size(); ++j) {
+    blocks[moved[j]] = target[j];
+  }
+  if (target.size() < moved.size() || countDataRuns(blocks) >= before) {
+    for (auto blk : target) {
+      reclaimBlock(blk);
+    }
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return countDataRuns(map.Blocks);
+  }
+
+  // copy the data before anything points at the copies; a block that
+  // does not match its checksum is not given a new one
+  const size_t BATCH = 256;
+  std::vector<Block> data(std::min(BATCH, moved.size()));
+  size_t copied = 0;
+  while (copied < moved.size()) {
+    const size_t count = std::min(BATCH, moved.size() - copied);
+    std::vector<Disk::Request> reads, writes;
+    for (size_t k = 0; k < count; ++k) {
+      reads.push_back(Disk::Request{(int)map.Blocks[moved[copied + k]], data[k].Data});
+      writes.push_back(Disk::Request{(int)target[copied + k], data[k].Data});
+    }
+    if (!readData(reads)) {
+      break;
+    }
+    writeData(writes);
+    for (size_t k = 0; k < count; ++k) {
+      trackDataBlock(target[copied + k], data[k].Data);
+    }
+    copied += count;
+  }
+  if (copied < moved.size()) {
+    for (size_t j = 0; j < target.size(); ++j) {
+      if (j < copied) {
+        releaseBlock(target[j]);
+      } else {
+        reclaimBlock(target[j]);
+      }
+    }
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return -1;
+  }
+
+  std::vector<uint32_t> old;
+  for (auto i : moved) {
+    old.push_back(map.Blocks[i]);
+  }
+  if (!replaceMapBlocks(inode, map, 0, blocks)) {
+    for (auto blk : target) {
+      releaseBlock(blk);
+    }
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return before;
+  }
+  flushBlockMap(inode, map);
+  storeInode(inumber, inode);
+
+  // the old blocks are only freed once the new map is on disk, so a crash
+  // leaves the file at one place or the other
+  sync();
+  for (auto blk : old) {
+    releaseBlock(blk);
+  }
+  return countDataRuns(map.Blocks);
+}
+
+// Scrub -----------------------------------------------------------------------
+
+size_t FileSystem::scrub(size_t first, size_t count, std::vector<uint32_t> &corrupt) {
+  if (disk == nullptr || !hasFeature(FEATURE_CHECKSUMS)) {
+    return 0;
+  }
+  const size_t end = std::min(first + std::min(count, (size_t)superblock.Blocks), (size_t)superblock.Blocks);
+  first = std::max(first, (size_t)getDataStart(superblock));
+
+  // blocks are written in place under their inode's lock, so holding them
+  // all keeps the blocks and their checksums together while they are read
+  const size_t BATCH = 256;
+  std::vector<Block> blocks(BATCH);
+  size_t checked = 0;
+  lockInodes();
+  for (size_t from = first; from < end; from += BATCH) {
+    std::vector<Disk::Request> requests;
+    std::vector<uint32_t> expected;
+    {
+      std::lock_guard<std::mutex> guard(checksumsLock);
+      for (size_t blk = from; blk < std::min(from + BATCH, end); ++blk) {
+        if (checksums[blk] != 0) {
+          requests.push_back(Disk::Request{(int)blk, blocks[requests.size()].Data});
+          expected.push_back(checksums[blk]);
+        }
+      }
+    }
+    disk->readv(requests);
+    for (size_t i = 0; i < requests.size(); ++i) {
+      if (checksumBlock(requests[i].Data) != expected[i]) {
+        corrupt.push_back(requests[i].Block);
+        checksumErrors += 1;
+      }
+    }
+    checked += requests.size();
+  }
+  unlockInodes();
+  return checked;
+}
+
+// Check file system -----------------------------------------------------------
+
+bool FileSystem::check(Disk *disk, bool repair, CheckReport &report) {
+  report = CheckReport();
+  if (disk->mounted() || this->disk != nullptr) {
+    return false;
+  }
+  const auto superblock = getSuperblock(disk);
+  if (!checkSuperblock(superblock) || superblock.Blocks > disk->size()) {
+    report.Problems.push_back("superblock: not valid");
+    return false;
+  }
+  // metadata committed before a crash reaches its home blocks first
+  if (hasFeature(superblock, FEATURE_JOURNAL)) {
+    Journal(disk, getJournalStart(superblock), superblock.JournalBlocks).replay();
+  }
+  this->disk = disk;
+  this->superblock = superblock;
+
+  // the tables are only kept up to date by a clean unmount; otherwise the
+  // next mount rebuilds them anyway
+  report.Clean = hasFeature(FEATURE_BITMAP) && superblock.State == STATE_CLEAN;
+  try {
+    CheckMaps maps;
+    CheckState found;
+    checkScan(maps, repair, found);
+    report.Inodes = found.Inodes;
+    for (auto &problem : found.Problems) {
+      report.Problems.push_back(problem.second);
+    }
+
+    // clearing pointers to blocks in use elsewhere and removing snapshots
+    // change what is claimed, so the blocks are claimed again after that
+    bool pending = repair && (!found.Duplicates.empty() || !found.Snapshots.empty());
+    if (report.Clean) {
+      checkTables(maps, found.Shared, repair && !pending, &report.Problems);
+    }
+    for (int round = 0; pending && round < 4; ++round) {
+      for (auto &slot : found.Duplicates) {
+        Block block;
+        const uint32_t blk = slot.Holder != 0 ? slot.Holder : getInodeBlkIndex(slot.Inumber);
+        disk->read(blk, block.Data);
+        if (slot.Holder != 0) {
+          if (slot.Extent) {
+            block.Overflow.Extents[slot.Index].Start = 0;
+          } else {
+            block.Pointers[slot.Index] = 0;
+          }
+        } else {
+          Inode inode;
+          decodeInode(superblock, block, slot.Inumber % getInodesPerBlock(), inode);
+          uint32_t *fields[] = {&inode.Indirect, &inode.DoubleIndirect, &inode.TripleIndirect};
+          if (slot.Extent) {
+            inode.Inline[slot.Index].Start = 0;
+          } else if (slot.Index < POINTERS_PER_INODE) {
+            inode.Direct[slot.Index] = 0;
+          } else {
+            *fields[slot.Index - POINTERS_PER_INODE] = 0;
+          }
+          encodeInode(superblock, inode, slot.Inumber % getInodesPerBlock(), block);
+        }
+        disk->write(blk, block.Data);
+      }
+      if (!found.Snapshots.empty()) {
+        Block table;
+        disk->read(getSnapshotTable(superblock), table.Data);
+        for (auto id : found.Snapshots) {
+          table.Snapshots[id] = SnapshotEntry{0, 0};
+        }
+        disk->write(getSnapshotTable(superblock), table.Data);
+      }
+      found = CheckState();
+      checkScan(maps, repair, found);
+      pending = !found.Duplicates.empty() || !found.Snapshots.empty();
+      if (report.Clean && !pending) {
+        checkTables(maps, found.Shared, true, nullptr);
+      }
+    }
+
+    for (size_t i = 0; i < ((size_t)superblock.Blocks + 63) / 64; ++i) {
+      report.Blocks += __builtin_popcountll(maps.Claimed[i]);
+    }
+    disk->sync();
+  } catch (...) {
+    this->disk = nullptr;
+    throw;
+  }
+  this->disk = nullptr;
+  return true;
+}
+
+void FileSystem::checkScan(CheckMaps &maps, bool repair, CheckState &found) {
+  // one bit per block for what claimed it, whatever the size of the disk
+  const size_t words = ((size_t)superblock.Blocks + 63) / 64;
+  const bool shared = hasRefs();
+  for (auto *bits : {&maps.Claimed, &maps.Data, &maps.Pointers, &maps.Other}) {
+    bits->reset(bits == &maps.Claimed || shared ? new std::atomic<uint64_t>[words] : nullptr);
+    for (size_t i = 0; *bits && i < words; ++i) {
+      (*bits)[i] = 0;
+    }
+  }
+  for (uint32_t blk = 0; blk < getDataStart(superblock); ++blk) {
+    checkClaim(maps, maps.Other.get(), blk);
+  }
+
+  // the inode table is split between workers as on mount
+  const uint32_t chunks = (superblock.InodeBlocks + MOUNT_CHUNK_BLOCKS - 1) / MOUNT_CHUNK_BLOCKS;
+  size_t threads = mountThreads ? mountThreads : std::thread::hardware_concurrency();
+  threads = std::max<size_t>(1, std::min<size_t>(threads, chunks));
+  std::vector<CheckState> states(threads);
+  for (auto &state : states) {
+    state.Maps = &maps;
+    state.Repair = repair;
+  }
+  std::atomic<uint32_t> next(0);
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i) {
+    workers.emplace_back(&FileSystem::checkInodeBlocks, this, std::ref(next), std::ref(states[i]));
+  }
+  checkInodeBlocks(next, states[0]);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto &state : states) {
+    if (state.Error) {
+      std::rethrow_exception(state.Error);
+    }
+    found.Inodes += state.Inodes;
+    found.Problems.insert(found.Problems.end(), state.Problems.begin(), state.Problems.end());
+    found.Shared.insert(found.Shared.end(), state.Shared.begin(), state.Shared.end());
+    found.Duplicates.insert(found.Duplicates.end(), state.Duplicates.begin(), state.Duplicates.end());
+  }
+  std::stable_sort(found.Problems.begin(), found.Problems.end(),
+                   [](const std::pair<uint32_t, std::string> &a, const std::pair<uint32_t, std::string> &b) {
+                     return a.first < b.first;
+                   });
+
+  // snapshots come after the files, so a block both use is the snapshot's
+  // problem; one with any problem is removed whole rather than fixed
+  if (!hasFeature(FEATURE_CLONES)) {
+    return;
+  }
+  Block table;
+  disk->read(getSnapshotTable(superblock), table.Data);
+  const uint32_t record = getInodeRecordSize(superblock);
+  const uint32_t perBlock = (Disk::BLOCK_SIZE - sizeof(SnapshotHeader)) / (sizeof(uint32_t) + record);
+  for (uint32_t id = 0; id < MAX_SNAPSHOTS; ++id) {
+    CheckState state;
+    state.Maps = &maps;
+    state.Snapshot = id;
+    Block block;
+    for (uint32_t next = table.Snapshots[id].Head; next != 0;) {
+      if (next < getDataStart(superblock) || next >= superblock.Blocks) {
+        checkProblem(state, UINT32_MAX, "block %u out of range", next);
+        break;
+      }
+      if (checkClaim(maps, maps.Other.get(), next) != CLAIM_FIRST) {
+        checkProblem(state, UINT32_MAX, "block %u already in use", next);
+        break;
+      }
+      disk->read(next, block.Data);
+      SnapshotHeader header;
+      memcpy(&header, block.Data, sizeof(header));
+      if (header.Count > perBlock) {
+        checkProblem(state, UINT32_MAX, "block %u is damaged", next);
+        break;
+      }
+      const char *numbers = block.Data + sizeof(header);
+      const char *records = numbers + (size_t)header.Count * sizeof(uint32_t);
+      Block unpacked;
+      memset(&unpacked, 0, sizeof(unpacked));
+      for (uint32_t i = 0; i < header.Count; ++i) {
+        uint32_t inumber;
+        memcpy(&inumber, numbers + i * sizeof(uint32_t), sizeof(inumber));
+        memcpy(unpacked.Data, records + (size_t)i * record, record);
+        Inode inode;
+        decodeInode(superblock, unpacked, 0, inode);
+        if (inumber >= superblock.Inodes || inode.Valid != 1) {
+          checkProblem(state, UINT32_MAX, "block %u holds inode %u, which is not valid", next, inumber);
+          continue;
+        }
+        uint64_t recordSize = inode.Size;
+        if (hasFeature(FEATURE_LARGE_FILES)) {
+          memcpy(&recordSize, unpacked.Data + offsetof(LargePointerRecord, Size), sizeof(recordSize));
+        }
+        checkInode(inumber, inode, recordSize, state);
+      }
+      next = header.Next;
+    }
+    if (state.Damaged) {
+      found.Snapshots.push_back(id);
+    }
+    for (auto &problem : state.Problems) {
+      found.Problems.push_back(problem);
+    }
+    found.Shared.insert(found.Shared.end(), state.Shared.begin(), state.Shared.end());
+  }
+}
+
+void FileSystem::checkInodeBlocks(std::atomic<uint32_t> &next, CheckState &state) {
+  const uint32_t chunkBlocks = MOUNT_CHUNK_BLOCKS;
+  const uint32_t inodesPerBlock = getInodesPerBlock();
+  std::vector<Block> inodeBlocks(std::min(chunkBlocks, superblock.InodeBlocks));
+  try {
+    for (uint32_t i = next.fetch_add(chunkBlocks); i < superblock.InodeBlocks; i = next.fetch_add(chunkBlocks)) {
+      const uint32_t count = std::min(chunkBlocks, superblock.InodeBlocks - i);
+      disk->read(i + 1, count, inodeBlocks[0].Data);
+      for (uint32_t j = 0; j < count; ++j) {
+        // every inode block belongs to one worker, and so does every
+        // pointer block, to the first one to claim it
+        auto &block = inodeBlocks[j];
+        bool changed = false;
+        for (uint32_t k = 0; k < inodesPerBlock; ++k) {
+          Inode inode;
+          decodeInode(superblock, block, k, inode);
+          if (inode.Valid == 0) {
+            continue;
+          }
+          uint64_t recordSize = inode.Size;
+          if (hasFeature(FEATURE_LARGE_FILES)) {
+            memcpy(&recordSize, block.Data + k * getInodeRecordSize(superblock) + offsetof(LargePointerRecord, Size),
+                   sizeof(recordSize));
+          }
+          if (checkInode((i + j) * inodesPerBlock + k, inode, recordSize, state)) {
+            encodeInode(superblock, inode, k, block);
+            changed = true;
+          }
+        }
+        if (changed && state.Repair) {
+          disk->write(i + j + 1, block.Data);
+        }
+      }
+    }
+  } catch (...) {
+    state.Error = std::current_exception();
+  }
+}
+
+bool FileSystem::checkInode(uint32_t inumber, Inode &inode, uint64_t recordSize, CheckState &state) {
+  if (inode.Valid != 1) {
+    checkProblem(state, inumber, "neither free nor in use (%u)", inode.Valid);
+    memset(&inode, 0, sizeof(inode));
+    return true;
+  }
+  state.Inodes += 1;
+
+  bool changed = false;
+  uint32_t flags = 0;
+  if (hasFeature(FEATURE_INLINE_DATA)) {
+    flags |= INODE_INLINE_DATA;
+  }
+  if (hasFeature(FEATURE_COMPRESSION)) {
+    flags |= INODE_COMPRESSED;
+  }
+  if (inode.Flags & ~flags) {
+    checkProblem(state, inumber, "flags %#x are not used here", inode.Flags & ~flags);
+    // the size was cut down to the inline room there is not
+    if (inode.Flags & ~flags & INODE_INLINE_DATA) {
+      inode.Size = recordSize;
+    }
+    inode.Flags &= flags;
+    changed = true;
+  }
+  if (inode.Flags & INODE_INLINE_DATA) {
+    if (recordSize > inode.Size) {
+      checkProblem(state, inumber, "size %lu is more than its record holds", (unsigned long)recordSize);
+      changed = true;
+    }
+    return changed;
+  }
+
+  const uint64_t maxSize = (uint64_t)getMaxBlocks(superblock) * Disk::BLOCK_SIZE;
+  if (inode.Size > maxSize) {
+    checkProblem(state, inumber, "size %lu is more than it can map", (unsigned long)inode.Size);
+    inode.Size = maxSize;
+    changed = true;
+  }
+  const uint64_t blocks = (inode.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+  if (hasFeature(FEATURE_EXTENTS)) {
+    return checkExtents(inumber, inode, blocks, state) || changed;
+  }
+
+  for (uint32_t i = 0; i < POINTERS_PER_INODE; ++i) {
+    changed |= checkPointer(inode.Direct[i], -1, i < blocks ? 1 : 0, CheckSlot{inumber, 0, i, false}, state);
+  }
+  uint64_t rest = blocks > POINTERS_PER_INODE ? blocks - POINTERS_PER_INODE : 0;
+  uint64_t span = POINTERS_PER_BLOCK;
+  uint32_t *fields[] = {&inode.Indirect, &inode.DoubleIndirect, &inode.TripleIndirect};
+  for (int level = 0; level < 3; ++level) {
+    const uint64_t count = std::min(rest, span);
+    changed |= checkPointer(*fields[level], level, count, CheckSlot{inumber, 0, POINTERS_PER_INODE + level, false}, state);
+    rest -= count;
+    span *= POINTERS_PER_BLOCK;
+  }
+  return changed;
+}
+
+bool FileSystem::checkPointer(uint32_t &blk, int level, uint64_t count, const CheckSlot &slot, CheckState &state) {
+  if (blk == 0) {
+    return false;
+  }
+  const char *kind = level < 0 ? "block" : "pointer block";
+  if (count == 0) {
+    checkProblem(state, slot.Inumber, "%s %u past the end of the file", kind, blk);
+    blk = 0;
+    return true;
+  }
+  if (blk < getDataStart(superblock) || blk >= superblock.Blocks) {
+    checkProblem(state, slot.Inumber, "%s %u out of range", kind, blk);
+    blk = 0;
+    return true;
+  }
+
+  auto &maps = *state.Maps;
+  switch (checkClaim(maps, level < 0 ? maps.Data.get() : maps.Pointers.get(), blk)) {
+  case CLAIM_SHARED:
+    // what a shared pointer block points to is checked once
+    state.Shared.push_back(blk);
+    return false;
+  case CLAIM_DUPLICATE:
+    checkProblem(state, slot.Inumber, "%s %u already in use", kind, blk);
+    if (state.Snapshot < 0) {
+      state.Duplicates.push_back(slot);
+    }
+    return false;
+  case CLAIM_FIRST:
+    break;
+  }
+  if (level < 0) {
+    return false;
+  }
+
+  Block pointers;
+  disk->read(blk, pointers.Data);
+  const uint64_t span = level == 0 ? 1 : level == 1 ? POINTERS_PER_BLOCK : (uint64_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+  bool changed = false;
+  for (uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
+    const uint64_t first = i * span;
+    changed |= checkPointer(pointers.Pointers[i], level - 1, first < count ? std::min(span, count - first) : 0,
+                            CheckSlot{slot.Inumber, blk, i, false}, state);
+  }
+  if (changed && state.Repair) {
+    disk->write(blk, pointers.Data);
+  }
+  return false;
+}
+
+bool FileSystem::checkExtents(uint32_t inumber, Inode &inode, uint64_t blocks, CheckState &state) {
+  bool changed = false;
+  uint64_t covered = 0;
+  uint32_t seen = 0;
+  const uint32_t inlineExtents = getInodeExtents(superblock);
+  for (; seen < inode.Extents && seen < inlineExtents && covered < blocks; ++seen) {
+    changed |= checkExtent(inode.Inline[seen], covered, blocks, CheckSlot{inumber, 0, seen, true}, state);
+  }
+
+  // every overflow block but the last is full, and they are never shared
+  Block block;          // the overflow block whose extents were checked last
+  uint32_t holder = 0;  // its number, 0 for the inode record
+  bool dirty = false;
+  bool trimmed = false;
+  while (true) {
+    uint32_t &link = holder == 0 ? inode.Overflow : block.Overflow.Next;
+    const uint32_t next = link;
+    if (seen < inode.Extents && covered >= blocks) {
+      checkProblem(state, inumber, "%u extents past the end of the file", inode.Extents - seen);
+      inode.Extents = seen;
+      changed = trimmed = true;
+    }
+    if (next == 0) {
+      break;
+    }
+    const char *problem = nullptr;
+    Block overflow;
+    if (seen >= inode.Extents) {
+      problem = trimmed ? "" : "not needed";
+    } else if (next < getDataStart(superblock) || next >= superblock.Blocks) {
+      problem = "out of range";
+    } else {
+      disk->read(next, overflow.Data);
+      if (overflow.Overflow.Count == 0 || overflow.Overflow.Count > EXTENTS_PER_BLOCK) {
+        problem = "damaged";
+      } else if (checkClaim(*state.Maps, state.Maps->Pointers.get(), next) != CLAIM_FIRST) {
+        problem = "already in use";
+      }
+    }
+    if (problem != nullptr) {
+      if (*problem) {
+        checkProblem(state, inumber, "overflow block %u %s", next, problem);
+      }
+      link = 0;
+      (holder == 0 ? changed : dirty) = true;
+      break;
+    }
+
+    if (holder != 0 && dirty && state.Repair) {
+      disk->write(holder, block.Data);
+    }
+    block = overflow;
+    holder = next;
+    dirty = false;
+    for (uint32_t i = 0; i < block.Overflow.Count && seen < inode.Extents; ++i, ++seen) {
+      if (covered >= blocks) {
+        checkProblem(state, inumber, "%u extents past the end of the file", inode.Extents - seen);
+        inode.Extents = seen;
+        block.Overflow.Count = i;
+        block.Overflow.Next = 0;
+        changed = dirty = trimmed = true;
+        break;
+      }
+      dirty |= checkExtent(block.Overflow.Extents[i], covered, blocks, CheckSlot{inumber, holder, i, true}, state);
+    }
+  }
+  if (holder != 0 && dirty && state.Repair) {
+    disk->write(holder, block.Data);
+  }
+  if (seen < inode.Extents) {
+    checkProblem(state, inumber, "%u extents, but only %u found", inode.Extents, seen);
+    inode.Extents = seen;
+    changed = true;
+  }
+  return changed;
+}
+
+bool FileSystem::checkExtent(Extent &extent, uint64_t &covered, uint64_t blocks, const CheckSlot &slot, CheckState &state) {
+  bool changed = false;
+  if (extent.Length > blocks - covered) {
+    checkProblem(state, slot.Inumber, "extent of %u blocks past the end of the file", extent.Length);
+    extent.Length = blocks - covered;
+    changed = true;
+  }
+  covered += extent.Length;
+  if (extent.Start == 0 || extent.Length == 0) {
+    return changed;
+  }
+  if (extent.Start < getDataStart(superblock) || (uint64_t)extent.Start + extent.Length > superblock.Blocks) {
+    checkProblem(state, slot.Inumber, "extent of blocks %u-%lu out of range", extent.Start,
+                 (unsigned long)extent.Start + extent.Length - 1);
+    extent.Start = 0;
+    return true;
+  }
+
+  // the whole extent becomes a hole if any of it is in use elsewhere
+  auto &maps = *state.Maps;
+  bool duplicate = false;
+  for (uint32_t k = 0; k < extent.Length; ++k) {
+    switch (checkClaim(maps, maps.Data.get(), extent.Start + k)) {
+    case CLAIM_SHARED:
+      state.Shared.push_back(extent.Start + k);
+      break;
+    case CLAIM_DUPLICATE:
+      if (!duplicate) {
+        checkProblem(state, slot.Inumber, "block %u already in use", extent.Start + k);
+        if (state.Snapshot < 0) {
+          state.Duplicates.push_back(slot);
+        }
+      }
+      duplicate = true;
+      break;
+    case CLAIM_FIRST:
+      break;
+    }
+  }
+  return changed;
+}
+
+FileSystem::CheckClaim FileSystem::checkClaim(CheckMaps &maps, std::atomic<uint64_t> *kind, uint32_t blk) {
+  // the kind goes first, so whoever finds the block claimed sees how
+  const uint64_t bit = 1ull << (blk % 64);
+  if (kind != nullptr) {
+    kind[blk / 64].fetch_or(bit);
+  }
+  if (!(maps.Claimed[blk / 64].fetch_or(bit) & bit)) {
+    return CLAIM_FIRST;
+  }
+  if (kind == nullptr) {
+    return CLAIM_DUPLICATE;
+  }
+  for (auto *other : {maps.Data.get(), maps.Pointers.get(), maps.Other.get()}) {
+    if (other != kind && (other[blk / 64].load() & bit)) {
+      return CLAIM_DUPLICATE;
+    }
+  }
+  return CLAIM_SHARED;
+}
+
+void FileSystem::checkProblem(CheckState &state, uint32_t inumber, const char *format, ...) {
+  char text[256];
+  int length;
+  if (state.Snapshot < 0) {
+    length = snprintf(text, sizeof(text), "inode %u: ", inumber);
+  } else if (inumber == UINT32_MAX) {
+    length = snprintf(text, sizeof(text), "snapshot %d: ", state.Snapshot);
+  } else {
+    length = snprintf(text, sizeof(text), "snapshot %d, inode %u: ", state.Snapshot, inumber);
+  }
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text + length, sizeof(text) - length, format, args);
+  va_end(args);
+  state.Problems.emplace_back(inumber, text);
+  state.Damaged = true;
+}
+
+void FileSystem::checkTables(const CheckMaps &maps, std::vector<uint32_t> shared, bool repair,
+                             std::vector<std::string> *problems) {
+  auto claimed = [&maps](size_t blk) { return maps.Claimed[blk / 64].load() & (1ull << (blk % 64)); };
+  auto report = [problems](size_t count, const char *what) {
+    if (problems != nullptr && count > 0) {
+      problems->push_back(std::to_string(count) + what);
+    }
+  };
+  std::vector<Disk::Request> requests;
+
+  // the bitmap, compared block by block with the one the claims make
+  Bitmap freeBlocks(superblock.Blocks, true);
+  for (size_t i = 0; i < freeBlocks.words(); ++i) {
+    freeBlocks.assignWord(i, ~maps.Claimed[i].load());
+  }
+  std::vector<Block> bitmap(superblock.BitmapBlocks);
+  std::vector<Block> packed(superblock.BitmapBlocks);
+  disk->read(getBitmapStart(superblock), superblock.BitmapBlocks, bitmap[0].Data);
+  size_t lost = 0, leaked = 0;
+  for (uint32_t b = 0; b < superblock.BitmapBlocks; ++b) {
+    packBitmap(freeBlocks, b, packed[b]);
+    if (memcmp(bitmap[b].Data, packed[b].Data, Disk::BLOCK_SIZE) == 0) {
+      continue;
+    }
+    for (uint32_t i = 0; i < Disk::BLOCK_SIZE / 8; ++i) {
+      uint64_t before, after;
+      memcpy(&before, bitmap[b].Data + i * 8, sizeof(before));
+      memcpy(&after, packed[b].Data + i * 8, sizeof(after));
+      lost += __builtin_popcountll(after & ~before);
+      leaked += __builtin_popcountll(before & ~after);
+    }
+    requests.push_back(Disk::Request{(int)(getBitmapStart(superblock) + b), packed[b].Data});
+  }
+  report(lost, " blocks in use are marked free");
+  report(leaked, " free blocks are marked in use");
+
+  // one reference for every time a data or pointer block was claimed
+  std::vector<RefEntry> refs;
+  size_t counts = 0;
+  if (hasRefs()) {
+    auto counted = [&maps](size_t blk) {
+      return (maps.Data[blk / 64].load() | maps.Pointers[blk / 64].load()) & (1ull << (blk % 64));
+    };
+    std::sort(shared.begin(), shared.end());
+    refs.resize((size_t)superblock.RefBlocks * REFS_PER_BLOCK);
+    disk->read(getRefStart(superblock), superblock.RefBlocks, (char *)refs.data());
+    std::vector<bool> dirty(superblock.RefBlocks, false);
+    auto more = shared.begin();
+    for (uint32_t blk = 0; blk < superblock.Blocks; ++blk) {
+      uint32_t count = claimed(blk) && counted(blk) ? 1 : 0;
+      for (; more != shared.end() && *more == blk; ++more) {
+        count += 1;
+      }
+      if (refs[blk].Count != count) {
+        counts += 1;
+        refs[blk].Count = count;
+        if (count == 0) {
+          refs[blk].Hash = 0;
+        }
+        dirty[blk / REFS_PER_BLOCK] = true;
+      }
+    }
+    for (uint32_t i = 0; i < superblock.RefBlocks; ++i) {
+      if (dirty[i]) {
+        requests.push_back(Disk::Request{(int)(getRefStart(superblock) + i), (char *)&refs[(size_t)i * REFS_PER_BLOCK]});
+      }
+    }
+  }
+  report(counts, " reference counts are wrong");
+
+  // and no checksum for a free block
+  std::vector<uint32_t> checksums;
+  size_t stale = 0;
+  if (hasFeature(FEATURE_CHECKSUMS)) {
+    checksums.resize((size_t)superblock.ChecksumBlocks * CHECKSUMS_PER_BLOCK);
+    disk->read(getChecksumStart(superblock), superblock.ChecksumBlocks, (char *)checksums.data());
+    std::vector<bool> dirty(superblock.ChecksumBlocks, false);
+    for (uint32_t blk = 0; blk < superblock.Blocks; ++blk) {
+      if (checksums[blk] != 0 && !claimed(blk)) {
+        stale += 1;
+        checksums[blk] = 0;
+        dirty[blk / CHECKSUMS_PER_BLOCK] = true;
+      }
+    }
+    for (uint32_t i = 0; i < superblock.ChecksumBlocks; ++i) {
+      if (dirty[i]) {
+        requests.push_back(Disk::Request{(int)(getChecksumStart(superblock) + i),
+                                         (char *)&checksums[(size_t)i * CHECKSUMS_PER_BLOCK]});
+      }
+    }
+  }
+  report(stale, " free blocks have a checksum");
+
+  if (repair) {
+    disk->writev(requests);
+  }
+}
+
+// Compressed files -----------------------------------------------------------
+
+bool FileSystem::loadCluster(BlockMap &map, uint32_t index, size_t size, char *data) {
+  memset(data, 0, (size_t)CLUSTER_BYTES);
+  const size_t blocks = (size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+  const size_t base = (size_t)index * CLUSTER_BLOCKS;
+  if (base >= blocks) {
+    return true;
+  }
+  const uint32_t slots = std::min(blocks - base, (size_t)CLUSTER_BLOCKS);
+  loadMapRange(map, base, base + slots - 1);
+  if (map.Blocks[base] == 0) {
+    return true;
+  }
+
+  // stored as it is, straight into `data`
+  std::vector<Disk::Request> requests;
+  if (map.Blocks[base + slots - 1] != 0) {
+    for (uint32_t j = 0; j < slots; ++j) {
+      requests.push_back(Disk::Request{(int)map.Blocks[base + j], data + (size_t)j * Disk::BLOCK_SIZE});
+    }
+    return readData(requests);
+  }
+
+  uint32_t used = 0;
+  while (used < slots && map.Blocks[base + used] != 0) {
+    used += 1;
+  }
+  std::vector<Block> stored(used);
+  for (uint32_t j = 0; j < used; ++j) {
+    requests.push_back(Disk::Request{(int)map.Blocks[base + j], stored[j].Data});
+  }
+  if (!readData(requests)) {
+    return false;
+  }
+  ClusterHeader header;
+  memcpy(&header, stored[0].Data, sizeof(header));
+  if (header.Length > used * Disk::BLOCK_SIZE - sizeof(header) || header.Size > CLUSTER_BYTES) {
+    return false;
+  }
+  auto start = std::chrono::steady_clock::now();
+  const bool valid = LZ::decompress(stored[0].Data + sizeof(header), header.Length, data, header.Size);
+  codecNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  return valid;
+}
+
+bool FileSystem::storeCluster(Inode &inode, BlockMap &map, uint32_t index, const char *data, size_t bytes) {
+  const size_t base = (size_t)index * CLUSTER_BLOCKS;
+  const uint32_t blocks = (bytes + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+  const uint32_t slots = std::min(map.Blocks.size() - base, (size_t)CLUSTER_BLOCKS);
+  assert(blocks <= slots);
+  loadMapRange(map, base, base + slots - 1);
+
+  // all zeros is a hole; otherwise compressed, if that saves a block
+  uint32_t used = 0;
+  std::vector<Block> stored;
+  bool zeros = true;
+  for (size_t i = 0; i < bytes && zeros; ++i) {
+    zeros = data[i] == 0;
+  }
+  if (!zeros) {
+    stored.resize(blocks);
+    memset(stored.data(), 0, blocks * sizeof(Block));
+    size_t length = 0;
+    if (blocks > 1) {
+      auto start = std::chrono::steady_clock::now();
+      length = LZ::compress(data, bytes, stored[0].Data + sizeof(ClusterHeader),
+                            (blocks - 1) * Disk::BLOCK_SIZE - sizeof(ClusterHeader));
+      codecNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+    if (length > 0) {
+      const ClusterHeader header{(uint32_t)length, (uint32_t)bytes};
+      memcpy(stored[0].Data, &header, sizeof(header));
+      used = (sizeof(header) + length + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    } else {
+      memcpy(stored[0].Data, data, bytes);
+      used = blocks;
+    }
+  }
+  compressionInput += bytes;
+  compressionOutput += (size_t)used * Disk::BLOCK_SIZE;
+
+  // the new blocks are allocated and written before the old ones are let go
+  const bool extents = hasFeature(FEATURE_EXTENTS);
+  std::vector<uint32_t> fresh;
+  auto release = [&]() {
+    for (auto blk : fresh) {
+      reclaimBlock(blk);
+    }
+    return false;
+  };
+  while (fresh.size() < used) {
+    ssize_t goal = -1;
+    if (extents) {
+      const uint32_t prev = !fresh.empty() ? fresh.back() : base > 0 ? map.Blocks[base - 1] : 0;
+      goal = prev != 0 ? prev + 1 : disk->size();
+    }
+    size_t length;
+    auto start = allocateRun(used - fresh.size(), length, goal);
+    if (start == -1) {
+      return release();
+    }
+    for (size_t i = 0; i < length; ++i) {
+      fresh.push_back(start + i);
+    }
+  }
+  for (uint32_t j = 0; j < used; ++j) {
+    if (reserveMapBlocks(inode, map, base + j) < 0) {
+      return release();
+    }
+  }
+  std::vector<Disk::Request> requests;
+  for (uint32_t j = 0; j < used; ++j) {
+    requests.push_back(Disk::Request{(int)fresh[j], stored[j].Data});
+  }
+  writeData(requests);
+
+  const std::vector<uint32_t> old(map.Blocks.begin() + base, map.Blocks.begin() + base + slots);
+  fresh.resize(slots, 0);
+  if (!replaceMapBlocks(inode, map, base, fresh)) {
+    fresh.resize(used);
+    return release();
+  }
+  for (auto blk : old) {
+    if (blk != 0) {
+      reclaimBlock(blk);
+    }
+  }
+  if (used == 0) {
+    releaseMapBlocks(inode, map, base);
+  }
+  return true;
+}
+
+bool FileSystem::replaceMapBlocks(Inode &inode, BlockMap &map, size_t first, const std::vector<uint32_t> &blocks) {
+  const bool extents = hasFeature(FEATURE_EXTENTS);
+  const size_t count = blocks.size();
+
+  // runs are counted again around the range only
+  auto runs = [&map, first, count]() {
+    uint32_t runs = 0;
+    for (size_t i = first; i < first + count + 1 && i < map.Blocks.size(); ++i) {
+      runs += i == 0 || !continuesRun(map.Blocks[i - 1], map.Blocks[i]);
+    }
+    return runs;
+  };
+  const std::vector<uint32_t> old(map.Blocks.begin() + first, map.Blocks.begin() + first + count);
+  const uint32_t oldRuns = map.Runs;
+  const uint32_t before = extents ? runs() : 0;
+  auto set = [&](size_t i, uint32_t blk) {
+    if (map.Blocks[i] == blk) {
+      return;
+    }
+    map.Blocks[i] = blk;
+    if (i < POINTERS_PER_INODE) {
+      inode.Direct[i] = blk;
+    } else if (!extents) {
+      map.DirtyLeaves[(i - POINTERS_PER_INODE) / POINTERS_PER_BLOCK] = true;
+    }
+  };
+  for (size_t j = 0; j < count; ++j) {
+    set(first + j, blocks[j]);
+  }
+  if (extents) {
+    map.Runs += runs() - before;
+    map.Dirty = true;
+    if (!reserveExtentBlocks(map)) {
+      for (size_t j = 0; j < count; ++j) {
+        set(first + j, old[j]);
+      }
+      map.Runs = oldRuns;
+      return false;
+    }
+  }
+  return true;
+}
+
+ssize_t FileSystem::readCompressed(uint32_t inumber, BlockMap &map, size_t size, char *data, size_t length, size_t offset) {
+  const uint32_t first = offset / CLUSTER_BYTES;
+  const uint32_t last = (offset + length - 1) / CLUSTER_BYTES;
+  for (uint32_t index = first; index <= last; ++index) {
+    auto cluster = getCachedCluster(inumber);
+    if (cluster == nullptr || cluster->Index != index) {
+      std::shared_ptr<Cluster> loaded = std::make_shared<Cluster>();
+      loaded->Index = index;
+      loaded->Data.resize(CLUSTER_BYTES);
+      if (!loadCluster(map, index, size, loaded->Data.data())) {
+        return -1;
+      }
+      cluster = loaded;
+      cacheCluster(inumber, cluster);
+    }
+    const size_t base = (size_t)index * CLUSTER_BYTES;
+    const size_t from = std::max(offset, base);
+    const size_t to = std::min(offset + length, base + CLUSTER_BYTES);
+    memcpy(data + (from - offset), cluster->Data.data() + (from - base), to - from);
+  }
+  return length;
+}
+
+ssize_t FileSystem::writeCompressed(uint32_t inumber, Inode &inode, BlockMap &map, const char *data, size_t length, size_t offset) {
+  const uint64_t limit = (uint64_t)getMaxBlocks(superblock) * Disk::BLOCK_SIZE;
+  length = offset < limit ? std::min((uint64_t)length, limit - offset) : 0;
+  const size_t oldSize = inode.Size;
+  size_t size = length > 0 ? std::max(oldSize, offset + length) : oldSize;
+  auto blocksOf = [](size_t bytes) {
+    return (uint32_t)((bytes + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE);
+  };
+  if (length == 0 || !resizeBlockMap(inode, map, blocksOf(size))) {
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return 0;
+  }
+
+  // every cluster the write touches is read, merged and written whole
+  const uint32_t first = offset / CLUSTER_BYTES;
+  const uint32_t last = (offset + length - 1) / CLUSTER_BYTES;
+  std::shared_ptr<Cluster> cluster;
+  uint32_t index = first;
+  for (; index <= last; ++index) {
+    auto cached = getCachedCluster(inumber);
+    cluster = std::make_shared<Cluster>();
+    cluster->Index = index;
+    if (cached != nullptr && cached->Index == index) {
+      cluster->Data = cached->Data;
+    } else {
+      cluster->Data.resize(CLUSTER_BYTES);
+      if (!loadCluster(map, index, oldSize, cluster->Data.data())) {
+        break;
+      }
+    }
+    const size_t base = (size_t)index * CLUSTER_BYTES;
+    const size_t from = std::max(offset, base);
+    const size_t to = std::min(offset + length, base + CLUSTER_BYTES);
+    memcpy(cluster->Data.data() + (from - base), data + (from - offset), to - from);
+    if (!storeCluster(inode, map, index, cluster->Data.data(), std::min(size - base, (size_t)CLUSTER_BYTES))) {
+      break;
+    }
+    cacheCluster(inumber, cluster);
+  }
+  if (index <= last) {
+    // the clusters written so far are whole, so the file ends with them
+    const size_t end = (size_t)index * CLUSTER_BYTES;
+    length = end > offset ? end - offset : 0;
+    size = length > 0 ? std::max(oldSize, end) : oldSize;
+    dropCluster(inumber);
+  }
+
+  // a partial cluster that used to end the file gets slots past the old
+  // end, which would tell it apart as compressed, so it is written again
+  const uint32_t oldLast = oldSize / CLUSTER_BYTES;
+  if (size > oldSize && oldSize % CLUSTER_BYTES != 0 && oldLast < first) {
+    std::vector<char> contents(CLUSTER_BYTES);
+    if (!loadCluster(map, oldLast, oldSize, contents.data()) ||
+        !storeCluster(inode, map, oldLast, contents.data(), std::min(size - (size_t)oldLast * CLUSTER_BYTES, (size_t)CLUSTER_BYTES))) {
+      length = 0;
+      size = oldSize;
+      dropCluster(inumber);
+    }
+  }
+  if (map.Blocks.size() > blocksOf(size)) {
+    resizeBlockMap(inode, map, blocksOf(size));
+  }
+  flushBlockMap(inode, map);
+  inode.Size = size;
+  storeInode(inumber, inode);
+  return length;
+}
+
+bool FileSystem::truncateCompressed(Inode &inode, BlockMap &map, size_t size) {
+  const size_t oldSize = inode.Size;
+  const uint32_t blocks = (size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+  const uint32_t oldBlocks = map.Blocks.size();
+  std::vector<char> contents(CLUSTER_BYTES);
+  if (size < oldSize) {
+    // the new last cluster is cut short before the blocks past it go
+    const uint32_t index = size / CLUSTER_BYTES;
+    const size_t bytes = size % CLUSTER_BYTES;
+    if (bytes != 0) {
+      if (!loadCluster(map, index, oldSize, contents.data())) {
+        return false;
+      }
+      memset(contents.data() + bytes, 0, CLUSTER_BYTES - bytes);
+      if (!storeCluster(inode, map, index, contents.data(), bytes)) {
+        return false;
+      }
+    }
+    resizeBlockMap(inode, map, blocks);
+  } else if (blocks > oldBlocks) {
+    // and the old one is written again to cover its new slots
+    const uint32_t index = oldSize / CLUSTER_BYTES;
+    const bool partial = oldSize % CLUSTER_BYTES != 0;
+    if (partial && !loadCluster(map, index, oldSize, contents.data())) {
+      return false;
+    }
+    if (!resizeBlockMap(inode, map, blocks)) {
+      return false;
+    }
+    if (partial && !storeCluster(inode, map, index, contents.data(), std::min(size - (size_t)index * CLUSTER_BYTES, (size_t)CLUSTER_BYTES))) {
+      resizeBlockMap(inode, map, oldBlocks);
+      return false;
+    }
+  }
+  inode.Size = size;
+  return true;
+}
+
+bool FileSystem::punchCompressed(Inode &inode, BlockMap &map, size_t offset, size_t end) {
+  std::vector<char> contents(CLUSTER_BYTES);
+  for (uint32_t index = offset / CLUSTER_BYTES; index <= (end - 1) / CLUSTER_BYTES; ++index) {
+    const size_t base = (size_t)index * CLUSTER_BYTES;
+    const size_t from = std::max(offset, base);
+    const size_t to = std::min(end, base + CLUSTER_BYTES);
+    // a cluster punched whole is not read
+    if (from != base || to != std::min((size_t)inode.Size, base + CLUSTER_BYTES)) {
+      if (!loadCluster(map, index, inode.Size, contents.data())) {
+        return false;
+      }
+    }
+    memset(contents.data() + (from - base), 0, to - from);
+    if (!storeCluster(inode, map, index, contents.data(), std::min((size_t)inode.Size - base, (size_t)CLUSTER_BYTES))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Deduplicated files ---------------------------------------------------------
+
+uint64_t FileSystem::hashBlock(const char *data) {
+  // FNV-1a over 64-bit words, with the high half folded in each round
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < Disk::BLOCK_SIZE; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ull;
+    hash ^= hash >> 32;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+void FileSystem::trackDataBlock(uint32_t blk, const char *data) {
+  if (!hasFeature(FEATURE_DEDUP)) {
+    holdBlock(blk);
+    return;
+  }
+  const uint64_t hash = hashBlock(data);
+  std::lock_guard<std::mutex> guard(refsLock);
+  refs[blk] = RefEntry{hash, 1, 0};
+  dedupIndex.emplace(hash, blk);
+  markRefDirty(blk);
+}
+
+void FileSystem::holdBlock(uint32_t blk) {
+  if (!hasRefs()) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(refsLock);
+  refs[blk].Count += 1;
+  markRefDirty(blk);
+}
+
+void FileSystem::releaseBlock(uint32_t blk) {
+  if (hasRefs()) {
+    std::lock_guard<std::mutex> guard(refsLock);
+    auto &ref = refs[blk];
+    markRefDirty(blk);
+    if (ref.Count > 1) {
+      ref.Count -= 1;
+      return;
+    }
+    // nobody can find it once it is out of the index
+    auto it = dedupIndex.find(ref.Hash);
+    if (it != dedupIndex.end() && it->second == blk) {
+      dedupIndex.erase(it);
+    }
+    ref = RefEntry{0, 0, 0};
+  }
+  reclaimBlock(blk);
+}
+
+void FileSystem::releaseMapBlock(uint32_t blk, int level) {
+  {
+    std::lock_guard<std::mutex> guard(refsLock);
+    auto &ref = refs[blk];
+    markRefDirty(blk);
+    if (ref.Count > 1) {
+      ref.Count -= 1;
+      return;
+    }
+    ref = RefEntry{0, 0, 0};
+  }
+  // the last reference goes, and with it one to everything below
+  Block pointers;
+  readMetadata(blk, pointers.Data);
+  for (uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
+    const uint32_t child = pointers.Pointers[i];
+    if (child == 0 || child >= superblock.Blocks) {
+      continue;
+    }
+    if (level == 0) {
+      releaseBlock(child);
+    } else {
+      releaseMapBlock(child, level - 1);
+    }
+  }
+  reclaimBlock(blk);
+}
+
+bool FileSystem::copySharedBlock(uint32_t &blk, int level) {
+  if (blk == 0) {
+    return true;
+  }
+  {
+    std::lock_guard<std::mutex> guard(refsLock);
+    if (refs[blk].Count <= 1) {
+      return true;
+    }
+  }
+  Block pointers;
+  readMetadata(blk, pointers.Data);
+  const auto copy = allocateBlock();
+  if (copy == -1) {
+    return false;
+  }
+  // the copy points to the same blocks, so they gain a user before the
+  // old block loses one
+  {
+    std::lock_guard<std::mutex> guard(refsLock);
+    refs[copy].Count = 1;
+    markRefDirty(copy);
+    for (uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
+      const uint32_t child = pointers.Pointers[i];
+      if (child != 0 && child < superblock.Blocks) {
+        refs[child].Count += 1;
+        markRefDirty(child);
+      }
+    }
+  }
+  writeMetadata(copy, pointers.Data);
+  releaseMapBlock(blk, level);
+  blk = copy;
+  return true;
+}
+
+bool FileSystem::unshareMapRange(Inode &inode, BlockMap &map, uint32_t first, uint32_t last) {
+  if (!hasRefs() || hasFeature(FEATURE_EXTENTS) || map.Blocks.empty()) {
+    return true;
+  }
+  first = std::max(first, POINTERS_PER_INODE + 0);
+  last = std::min(last, (uint32_t)map.Blocks.size() - 1);
+  if (first > last) {
+    return true;
+  }
+  // every block on the way from the inode to each leaf is made this
+  // file's own, top down, so the one above a copy can be changed to
+  // point at it
+  const uint32_t firstLeaf = (first - POINTERS_PER_INODE) / POINTERS_PER_BLOCK;
+  const uint32_t lastLeaf = (last - POINTERS_PER_INODE) / POINTERS_PER_BLOCK;
+  for (uint32_t k = firstLeaf; k <= lastLeaf; ++k) {
+    const uint32_t second = k > POINTERS_PER_BLOCK ? (k - 1 - POINTERS_PER_BLOCK) / POINTERS_PER_BLOCK : 0;
+    if (k >= 1 && k <= POINTERS_PER_BLOCK) {
+      if (!copySharedBlock(map.Meta[0], 1)) {
+        return false;
+      }
+      inode.DoubleIndirect = map.Meta[0];
+    } else if (k > POINTERS_PER_BLOCK) {
+      if (!copySharedBlock(map.Meta[1], 2)) {
+        return false;
+      }
+      inode.TripleIndirect = map.Meta[1];
+      if (second < map.Seconds.size()) {
+        const uint32_t old = map.Seconds[second];
+        if (!copySharedBlock(map.Seconds[second], 1)) {
+          return false;
+        }
+        map.Dirty = map.Dirty || map.Seconds[second] != old;
+      }
+    }
+    if (k >= map.Leaves.size()) {
+      continue;
+    }
+    const uint32_t old = map.Leaves[k];
+    if (!copySharedBlock(map.Leaves[k], 0)) {
+      return false;
+    }
+    if (map.Leaves[k] == old) {
+      continue;
+    }
+    if (k == 0) {
+      inode.Indirect = map.Leaves[k];
+    } else if (k <= POINTERS_PER_BLOCK) {
+      map.Dirty = true;
+    } else {
+      map.DirtySeconds[second] = true;
+    }
+  }
+  return true;
+}
+
+bool FileSystem::shareInodeBlocks(Inode &inode) {
+  if (inode.Flags & INODE_INLINE_DATA) {
+    return true;
+  }
+  if (!hasFeature(FEATURE_EXTENTS)) {
+    // the blocks the inode points to stand for everything below them
+    const uint32_t direct = std::min(blockCount(inode), POINTERS_PER_INODE + 0);
+    std::lock_guard<std::mutex> guard(refsLock);
+    for (uint32_t i = 0; i < direct; ++i) {
+      if (inode.Direct[i] != 0) {
+        refs[inode.Direct[i]].Count += 1;
+        markRefDirty(inode.Direct[i]);
+      }
+    }
+    for (auto blk : {inode.Indirect, inode.DoubleIndirect, inode.TripleIndirect}) {
+      if (blk != 0) {
+        refs[blk].Count += 1;
+        markRefDirty(blk);
+      }
+    }
+    return true;
+  }
+
+  // overflow blocks are rewritten as the runs change, so the copy gets a
+  // chain of its own and shares every data block instead
+  BlockMap map;
+  loadBlockMap(superblock, inode, map, [this](uint32_t blk, char *data) { readMetadata(blk, data); }, true);
+  std::vector<uint32_t> copies;
+  for (size_t b = 0; b < map.Meta.size(); ++b) {
+    const auto blk = allocateBlock();
+    if (blk == -1) {
+      for (auto copy : copies) {
+        reclaimBlock(copy);
+      }
+      return false;
+    }
+    copies.push_back(blk);
+  }
+  std::vector<Block> blocks(copies.size());
+  std::vector<Disk::Request> requests;
+  for (size_t b = 0; b < copies.size(); ++b) {
+    readMetadata(map.Meta[b], blocks[b].Data);
+    blocks[b].Overflow.Next = b + 1 < copies.size() ? copies[b + 1] : 0;
+    requests.push_back(Disk::Request{(int)copies[b], blocks[b].Data});
+  }
+  writeMetadata(requests);
+  {
+    std::lock_guard<std::mutex> guard(refsLock);
+    for (auto blk : copies) {
+      refs[blk].Count = 1;
+      markRefDirty(blk);
+    }
+    for (auto blk : map.Blocks) {
+      if (blk != 0) {
+        refs[blk].Count += 1;
+        markRefDirty(blk);
+      }
+    }
+  }
+  inode.Overflow = copies.empty() ? 0 : copies[0];
+  return true;
+}
+
+void FileSystem::releaseInodeBlocks(const Inode &inode) {
+  if (inode.Flags & INODE_INLINE_DATA) {
+    return;
+  }
+  if (hasFeature(FEATURE_EXTENTS)) {
+    BlockMap map;
+    loadBlockMap(superblock, inode, map, [this](uint32_t blk, char *data) { readMetadata(blk, data); }, true);
+    for (const auto *blocks : {&map.Blocks, &map.Meta}) {
+      for (auto blk : *blocks) {
+        if (blk != 0) {
+          releaseBlock(blk);
+        }
+      }
+    }
+    return;
+  }
+  const uint32_t direct = std::min(blockCount(inode), POINTERS_PER_INODE + 0);
+  for (uint32_t i = 0; i < direct; ++i) {
+    if (inode.Direct[i] != 0) {
+      releaseBlock(inode.Direct[i]);
+    }
+  }
+  int level = 0;
+  for (auto blk : {inode.Indirect, inode.DoubleIndirect, inode.TripleIndirect}) {
+    if (blk != 0) {
+      releaseMapBlock(blk, level);
+    }
+    level += 1;
+  }
+}
+
+ssize_t FileSystem::writeShared(uint32_t inumber, Inode &inode, BlockMap &map, const char *data, size_t length, size_t offset) {
+  const uint64_t limit = (uint64_t)getMaxBlocks(superblock) * Disk::BLOCK_SIZE;
+  length = offset < limit ? std::min((uint64_t)length, limit - offset) : 0;
+  const size_t oldSize = inode.Size;
+  auto blocksOf = [](size_t bytes) {
+    return (uint32_t)((bytes + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE);
+  };
+  if (length == 0 || (blocksOf(offset + length) > map.Blocks.size() && !resizeBlockMap(inode, map, blocksOf(offset + length)))) {
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return 0;
+  }
+
+  // full blocks are stored straight from `data`; a partial head or tail
+  // block is merged with what the file held there first
+  const uint32_t first = offset / Disk::BLOCK_SIZE;
+  const uint32_t last = (offset + length - 1) / Disk::BLOCK_SIZE;
+  loadMapRange(map, first, last);
+  if (!unshareMapRange(inode, map, first, last)) {
+    flushBlockMap(inode, map);
+    storeInode(inumber, inode);
+    return 0;
+  }
+  Block partial[2];
+  PendingWrites pending;
+  uint32_t index = first;
+  for (; index <= last; ++index) {
+    const size_t blkStart = (size_t)index * Disk::BLOCK_SIZE;
+    const char *contents;
+    if (blkStart >= offset && blkStart + Disk::BLOCK_SIZE <= offset + length) {
+      contents = data + (blkStart - offset);
+    } else {
+      auto &block = partial[index == first ? 0 : 1];
+      memset(block.Data, 0, sizeof(block.Data));
+      // as for other files, a bad block is counted but still changed
+      if (map.Blocks[index] != 0 && blkStart < oldSize) {
+        readData(map.Blocks[index], block.Data);
+      }
+      const size_t from = std::max(offset, blkStart);
+      const size_t to = std::min(offset + length, blkStart + Disk::BLOCK_SIZE);
+      memcpy(block.Data + (from - blkStart), data + (from - offset), to - from);
+      contents = block.Data;
+    }
+    if (!storeSharedBlock(inode, map, index, contents, pending)) {
+      break;
+    }
+  }
+  std::vector<Disk::Request> requests;
+  for (auto &write : pending) {
+    requests.push_back(Disk::Request{(int)write.first, (char *)write.second});
+  }
+  writeData(requests);
+
+  if (index <= last) {
+    // the disk is full: the blocks stored so far are kept, and what was
+    // added past the end of the file for the rest is dropped
+    length = (size_t)index * Disk::BLOCK_SIZE > offset ? (size_t)index * Disk::BLOCK_SIZE - offset : 0;
+    const size_t size = length > 0 ? std::max(oldSize, offset + length) : oldSize;
+    if (map.Blocks.size() > blocksOf(size)) {
+      resizeBlockMap(inode, map, blocksOf(size));
+    }
+    releaseMapBlocks(inode, map, index, last);
+  }
+  flushBlockMap(inode, map);
+  if (length > 0 && offset + length > inode.Size) {
+    inode.Size = offset + length;
+  }
+  storeInode(inumber, inode);
+  return length;
+}
+
+bool FileSystem::storeSharedBlock(Inode &inode, BlockMap &map, uint32_t index, const char *data, PendingWrites &pending) {
+  const uint32_t old = map.Blocks[index];
+  auto setBlock = [&](uint32_t blk) {
+    return replaceMapBlocks(inode, map, index, std::vector<uint32_t>(1, blk));
+  };
+
+  // with dedup all zeros is a hole
+  const bool dedup = hasFeature(FEATURE_DEDUP);
+  bool zeros = dedup;
+  for (size_t i = 0; i < Disk::BLOCK_SIZE && zeros; ++i) {
+    zeros = data[i] == 0;
+  }
+  if (zeros) {
+    if (old != 0) {
+      if (!setBlock(0)) {
+        return false;
+      }
+      releaseBlock(old);
+    }
+    return true;
+  }
+
+  // a block with the same hash is taken first, so it cannot be freed or
+  // written in place while its contents are compared
+  const uint64_t hash = dedup ? hashBlock(data) : 0;
+  uint32_t shared = 0;
+  if (dedup) {
+    std::lock_guard<std::mutex> guard(refsLock);
+    auto it = dedupIndex.find(hash);
+    if (it != dedupIndex.end()) {
+      shared = it->second;
+      if (shared != old) {
+        refs[shared].Count += 1;
+        markRefDirty(shared);
+      }
+    }
+  }
+  if (shared != 0) {
+    Block stored;
+    const auto it = pending.find(shared);
+    const char *contents = stored.Data;
+    if (it != pending.end()) {
+      contents = it->second;
+    } else {
+      disk->read(shared, stored.Data);
+    }
+    const bool same = memcmp(contents, data, Disk::BLOCK_SIZE) == 0;
+    if (same && shared == old) {
+      dedupHits += 1;
+      return true;
+    }
+    if (same && reserveMapBlocks(inode, map, index) >= 0 && setBlock(shared)) {
+      dedupHits += 1;
+      if (old != 0) {
+        releaseBlock(old);
+      }
+      return true;
+    }
+    if (shared != old) {
+      releaseBlock(shared);
+    }
+  }
+
+  // a block only this one points to is written in place
+  if (old != 0) {
+    std::lock_guard<std::mutex> guard(refsLock);
+    auto &ref = refs[old];
+    if (ref.Count <= 1) {
+      if (dedup) {
+        auto it = dedupIndex.find(ref.Hash);
+        if (it != dedupIndex.end() && it->second == old) {
+          dedupIndex.erase(it);
+        }
+        ref = RefEntry{hash, 1, 0};
+        dedupIndex.emplace(hash, old);
+        markRefDirty(old);
+      }
+      pending[old] = data;
+      return true;
+    }
+  }
+
+  // and a shared one is copied; extent-mapped files ask for the block
+  // after the one before so runs stay long
+  ssize_t goal = -1;
+  if (hasFeature(FEATURE_EXTENTS)) {
+    goal = index > 0 && map.Blocks[index - 1] != 0 ? map.Blocks[index - 1] + 1 : disk->size();
+  }
+  size_t length;
+  const auto blk = allocateRun(1, length, goal);
+  if (blk == -1) {
+    return false;
+  }
+  if (reserveMapBlocks(inode, map, index) < 0) {
+    reclaimBlock(blk);
+    return false;
+  }
+  trackDataBlock(blk, data);
+  if (!setBlock(blk)) {
+    releaseBlock(blk);
+    return false;
+  }
+  pending[blk] = data;
+  if (old != 0) {
+    releaseBlock(old);
+  }
+  return true;
+}
+
+std::shared_ptr<const FileSystem::Cluster> FileSystem::getCachedCluster(uint32_t inumber) {
+  std::lock_guard<std::mutex> guard(clustersLock);
+  auto it = clusters.find(inumber);
+  return it == clusters.end() ? nullptr : it->second;
+}
+
+void FileSystem::cacheCluster(uint32_t inumber, const std::shared_ptr<const Cluster> &cluster) {
+  std::lock_guard<std::mutex> guard(clustersLock);
+  if (clusters.size() >= CLUSTER_CACHE_FILES && clusters.find(inumber) == clusters.end()) {
+    clusters.erase(clusters.begin());
+  }
+  clusters[inumber] = cluster;
+}
+
+void FileSystem::dropCluster(uint32_t inumber) {
+  std::lock_guard<std::mutex> guard(clustersLock);
+  clusters.erase(inumber);
+}
+
+std::shared_ptr<FileSystem::BlockMap> FileSystem::getBlockMap(uint32_t inumber, const Inode &inode) {
+  {
+    std::lock_guard<std::mutex> guard(blockMapsLock);
+    auto it = blockMaps.find(inumber);
+    if (it != blockMaps.end()) {
+      return it->second;
+    }
+  }
+
+  auto map = std::make_shared<BlockMap>();
+  loadBlockMap(superblock, inode, *map, [this](uint32_t blk, char *data) { readMetadata(blk, data); }, false);
+
+  // maps are flushed after every call, so any of them can be dropped; a
+  // reader racing on the same inode may have added one in the meantime
+  std::lock_guard<std::mutex> guard(blockMapsLock);
+  auto inserted = blockMaps.emplace(inumber, map);
+  if (inserted.second && blockMaps.size() > BLOCK_MAPS) {
+    auto victim = blockMaps.begin();
+    if (victim == inserted.first) {
+      ++victim;
+    }
+    blockMaps.erase(victim);
+  }
+  return inserted.first->second;
+}
+
+void FileSystem::loadBlockMap(const SuperBlock &superblock, const Inode &inode, BlockMap &map,
+                              const std::function<void(uint32_t, char *)> &read, bool leaves) {
+  const uint32_t totalBlocks = blockCount(inode);
+  map.Blocks.clear();
+  map.Leaves.clear();
+  map.Seconds.clear();
+  map.Meta.clear();
+  map.Runs = 0;
+  map.Dirty = false;
+
+  if (!hasFeature(superblock, FEATURE_EXTENTS)) {
+    const uint32_t mapped = std::min(totalBlocks, getMaxBlocks(superblock));
+    for (uint32_t i = 0; i < mapped && i < POINTERS_PER_INODE; ++i) {
+      map.Blocks.push_back(getDiskBlkNo_direct(inode, i));
+    }
+    map.Blocks.resize(mapped, 0);
+
+    // leaf 0 is the indirect block, the next 1024 hang off the double
+    // indirect block, and the rest off the blocks of the triple one; any
+    // of them is 0 where the file only has holes
+    const uint32_t leafCount = mapped > POINTERS_PER_INODE
+                             ? (mapped - POINTERS_PER_INODE + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK : 0;
+    if (hasFeature(superblock, FEATURE_LARGE_FILES)) {
+      map.Meta.push_back(inode.DoubleIndirect);
+      map.Meta.push_back(inode.TripleIndirect);
+    }
+    if (leafCount > 0) {
+      map.Leaves.push_back(inode.Indirect);
+    }
+    Block pointers;
+    if (leafCount > 1) {
+      const uint32_t last = std::min(leafCount, POINTERS_PER_BLOCK + 1);
+      if (inode.DoubleIndirect != 0) {
+        read(inode.DoubleIndirect, pointers.Data);
+        map.Leaves.insert(map.Leaves.end(), pointers.Pointers, pointers.Pointers + last - 1);
+      }
+      map.Leaves.resize(last, 0);
+    }
+    if (leafCount > 1 + POINTERS_PER_BLOCK) {
+      const uint32_t seconds = (leafCount - 1 - POINTERS_PER_BLOCK + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
+      if (inode.TripleIndirect != 0) {
+        read(inode.TripleIndirect, pointers.Data);
+        map.Seconds.assign(pointers.Pointers, pointers.Pointers + seconds);
+      }
+      map.Seconds.resize(seconds, 0);
+      for (auto second : map.Seconds) {
+        const size_t count = std::min(leafCount - map.Leaves.size(), (size_t)POINTERS_PER_BLOCK);
+        if (second != 0) {
+          read(second, pointers.Data);
+          map.Leaves.insert(map.Leaves.end(), pointers.Pointers, pointers.Pointers + count);
+        } else {
+          map.Leaves.resize(map.Leaves.size() + count, 0);
+        }
+      }
+    }
+    map.Loaded.assign(leafCount, false);
+    map.DirtyLeaves.assign(leafCount, false);
+    map.DirtySeconds.assign(map.Seconds.size(), false);
+    for (uint32_t k = 0; leaves && k < leafCount; ++k) {
+      loadLeaf(map, k, read);
+    }
+  } else {
+    auto append = [&](const Extent &extent) {
+      for (uint32_t k = 0; k < extent.Length && map.Blocks.size() < totalBlocks; ++k) {
+        map.Blocks.push_back(extent.Start == 0 ? 0 : extent.Start + k);
+      }
+    };
+    const uint32_t inlineExtents = getInodeExtents(superblock);
+    uint32_t seen = 0;
+    for (; seen < inode.Extents && seen < inlineExtents; ++seen) {
+      append(inode.Inline[seen]);
+    }
+    // every overflow block but the last is full, so a chain that loops or
+    // runs off the disk is cut short
+    Block overflow;
+    uint32_t next = inode.Overflow;
+    while (seen < inode.Extents && map.Blocks.size() < totalBlocks && next != 0 && next < superblock.Blocks &&
+           map.Meta.size() < totalBlocks) {
+      read(next, overflow.Data);
+      map.Meta.push_back(next);
+      const uint32_t count = overflow.Overflow.Count < EXTENTS_PER_BLOCK ? overflow.Overflow.Count : EXTENTS_PER_BLOCK;
+      if (count == 0) {
+        break;
+      }
+      for (uint32_t i = 0; i < count && seen < inode.Extents; ++i, ++seen) {
+        append(overflow.Overflow.Extents[i]);
+      }
+      next = overflow.Overflow.Next;
+    }
+  }
+
+  // a damaged inode may map fewer blocks than its size calls for
+  map.Blocks.resize(totalBlocks, 0);
+  if (hasFeature(superblock, FEATURE_EXTENTS)) {
+    for (size_t i = 0; i < map.Blocks.size(); ++i) {
+      if (i == 0 || !continuesRun(map.Blocks[i - 1], map.Blocks[i])) {
+        map.Runs += 1;
+      }
+    }
+  }
+}
+
+void FileSystem::loadLeaf(BlockMap &map, uint32_t k, const std::function<void(uint32_t, char *)> &read) {
+  // a missing leaf maps only holes, which Blocks already holds
+  if (map.Leaves[k] != 0) {
+    Block pointers;
+    read(map.Leaves[k], pointers.Data);
+    const size_t first = POINTERS_PER_INODE + (size_t)k * POINTERS_PER_BLOCK;
+    for (size_t i = 0; i < POINTERS_PER_BLOCK && first + i < map.Blocks.size(); ++i) {
+      map.Blocks[first + i] = pointers.Pointers[i];
+    }
+  }
+  map.Loaded[k] = true;
+}
+
+void FileSystem::loadMapRange(BlockMap &map, uint32_t first, uint32_t last) {
+  if (map.Leaves.empty() || last < POINTERS_PER_INODE || first > last) {
+    return;
+  }
+  first = std::max(first, POINTERS_PER_INODE + 0);
+  // readers of the same inode share the map, so they take turns loading
+  std::lock_guard<std::mutex> guard(map.Lock);
+  for (size_t k = (first - POINTERS_PER_INODE) / POINTERS_PER_BLOCK;
+       k <= (last - POINTERS_PER_INODE) / POINTERS_PER_BLOCK && k < map.Leaves.size(); ++k) {
+    if (!map.Loaded[k]) {
+      loadLeaf(map, k, [this](uint32_t blk, char *data) { readMetadata(blk, data); });
+    }
+  }
+}
+
+void FileSystem::flushBlockMap(Inode &inode, BlockMap &map) {
+  if (hasFeature(FEATURE_EXTENTS)) {
+    if (!map.Dirty) {
+      return;
+    }
+    // collapse the map into runs; the first ones go into the inode record
+    std::vector<Extent> extents;
+    for (auto blk : map.Blocks) {
+      if (!extents.empty() && continuesRun(extents.back().Start == 0 ? 0 : extents.back().Start + extents.back().Length - 1, blk)) {
+        extents.back().Length += 1;
+      } else {
+        extents.push_back(Extent{blk, 1});
+      }
+    }
+    const uint32_t inlineExtents = getInodeExtents(superblock);
+    inode.Extents = extents.size();
+    memset(inode.Inline, 0, sizeof(inode.Inline));
+    for (uint32_t i = 0; i < extents.size() && i < inlineExtents; ++i) {
+      inode.Inline[i] = extents[i];
+    }
+
+    // the rest fill overflow blocks, and any block left over is freed
+    const size_t rest = extents.size() > inlineExtents ? extents.size() - inlineExtents : 0;
+    const size_t overflowBlocks = (rest + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+    assert(map.Meta.size() >= overflowBlocks);
+    while (map.Meta.size() > overflowBlocks) {
+      releaseBlock(map.Meta.back());
+      map.Meta.pop_back();
+    }
+    inode.Overflow = map.Meta.empty() ? 0 : map.Meta[0];
+
+    std::vector<Block> blocks(map.Meta.size());
+    std::vector<Disk::Request> requests;
+    for (size_t b = 0; b < map.Meta.size(); ++b) {
+      memset(&blocks[b], 0, sizeof(Block));
+      auto &overflow = blocks[b].Overflow;
+      overflow.Next = b + 1 < map.Meta.size() ? map.Meta[b + 1] : 0;
+      overflow.Count = std::min(rest - b * EXTENTS_PER_BLOCK, (size_t)EXTENTS_PER_BLOCK);
+      for (uint32_t i = 0; i < overflow.Count; ++i) {
+        overflow.Extents[i] = extents[inlineExtents + b * EXTENTS_PER_BLOCK + i];
+      }
+      requests.push_back(Disk::Request{(int)map.Meta[b], blocks[b].Data});
+    }
+    writeMetadata(requests);
+    map.Dirty = false;
+    return;
+  }
+
+  // changed leaves, then the blocks above them that changed with them
+  std::vector<Block> blocks;
+  std::vector<uint32_t> targets;
+  auto pack = [&](uint32_t target, const std::vector<uint32_t> &pointers, size_t first) {
+    blocks.emplace_back();
+    memset(&blocks.back(), 0, sizeof(Block));
+    for (size_t i = 0; i < POINTERS_PER_BLOCK && first + i < pointers.size(); ++i) {
+      blocks.back().Pointers[i] = pointers[first + i];
+    }
+    targets.push_back(target);
+  };
+  for (size_t k = 0; k < map.Leaves.size(); ++k) {
+    if (map.DirtyLeaves[k]) {
+      assert(map.Loaded[k]);
+      pack(map.Leaves[k], map.Blocks, POINTERS_PER_INODE + k * POINTERS_PER_BLOCK);
+      map.DirtyLeaves[k] = false;
+    }
+  }
+  for (size_t j = 0; j < map.Seconds.size(); ++j) {
+    if (map.DirtySeconds[j]) {
+      pack(map.Seconds[j], map.Leaves, 1 + POINTERS_PER_BLOCK + j * POINTERS_PER_BLOCK);
+      map.DirtySeconds[j] = false;
+    }
+  }
+  if (map.Dirty && map.Meta.size() > 0 && map.Meta[0] != 0) {
+    pack(map.Meta[0], map.Leaves, 1);
+  }
+  if (map.Dirty && map.Meta.size() > 1 && map.Meta[1] != 0) {
+    pack(map.Meta[1], map.Seconds, 0);
+  }
+  map.Dirty = false;
+
+  std::vector<Disk::Request> requests;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    requests.push_back(Disk::Request{(int)targets[i], blocks[i].Data});
+  }
+  writeMetadata(requests);
+}
+
+ssize_t FileSystem::allocateBlockForInode(Inode &inode, BlockMap &map, uint32_t index, uint32_t blk) {
+  assert(index < map.Blocks.size() && map.Blocks[index] == 0);
+  if (hasFeature(FEATURE_EXTENTS)) {
+    // the block may start an extent, split a hole into two, or join the
+    // runs on either side; more runs may not fit in the overflow blocks
+    auto starts = [&map](size_t i) {
+      return i < map.Blocks.size() && (i == 0 || !continuesRun(map.Blocks[i - 1], map.Blocks[i]));
+    };
+    const int before = starts(index) + starts(index + 1);
+    map.Blocks[index] = blk;
+    const uint32_t runs = map.Runs;
+    map.Runs += starts(index) + starts(index + 1) - before;
+    if (!reserveExtentBlocks(map)) {
+      map.Blocks[index] = 0;
+      map.Runs = runs;
+      return -1;
+    }
+    map.Dirty = true;
+    return blk;
+  }
+  // a direct block
+  if (index < POINTERS_PER_INODE) {
+    inode.Direct[index] = blk;
+    map.Blocks[index] = blk;
+    return blk;
+  }
+  // no leaf reserved for this block
+  const uint32_t leaf = (index - POINTERS_PER_INODE) / POINTERS_PER_BLOCK;
+  if (leaf >= map.Leaves.size() || map.Leaves[leaf] == 0) {
+    return -1;
+  }
+  // a block pointed to by a leaf, written by flushBlockMap
+  map.DirtyLeaves[leaf] = true;
+  map.Blocks[index] = blk;
+  return blk;
+}
+
+bool FileSystem::reserveExtentBlocks(BlockMap &map) {
+  while (map.Runs > getInodeExtents(superblock) + map.Meta.size() * EXTENTS_PER_BLOCK) {
+    auto overflow = allocateBlock();
+    if (overflow == -1) {
+      return false;
+    }
+    holdBlock(overflow);
+    map.Meta.push_back(overflow);
+  }
+  return true;
+}
+
+int FileSystem::reserveMapBlocks(Inode &inode, BlockMap &map, uint32_t index) {
+  // extent-mapped files get overflow blocks as their runs are added
+  if (hasFeature(FEATURE_EXTENTS) || index < POINTERS_PER_INODE) {
+    return 0;
+  }
+  const uint32_t leaf = (index - POINTERS_PER_INODE) / POINTERS_PER_BLOCK;
+  if (leaf >= getMaxLeaves(superblock)) {
+    return -1;
+  }
+  if (map.Leaves.size() <= leaf) {
+    // the leaves in between map only holes
+    map.Leaves.resize(leaf + 1, 0);
+    map.Loaded.resize(leaf + 1, true);
+    map.DirtyLeaves.resize(leaf + 1, false);
+  }
+  if (map.Leaves[leaf] != 0) {
+    return 0;
+  }
+
+  // the double or triple indirect block and a block of the triple one come
+  // first if they are missing, then the leaf itself
+  const uint32_t second = leaf > POINTERS_PER_BLOCK ? (leaf - 1 - POINTERS_PER_BLOCK) / POINTERS_PER_BLOCK : 0;
+  if (leaf > POINTERS_PER_BLOCK && map.Seconds.size() <= second) {
+    map.Seconds.resize(second + 1, 0);
+    map.DirtySeconds.resize(second + 1, false);
+  }
+  const bool needDouble = leaf >= 1 && leaf <= POINTERS_PER_BLOCK && map.Meta[0] == 0;
+  const bool needTriple = leaf > POINTERS_PER_BLOCK && map.Meta[1] == 0;
+  const bool needSecond = leaf > POINTERS_PER_BLOCK && map.Seconds[second] == 0;
+  std::vector<uint32_t> allocated;
+  for (int i = needDouble + needTriple + needSecond + 1; i > 0; --i) {
+    auto blk = allocateBlock();
+    if (blk == -1) {
+      for (auto taken : allocated) {
+        reclaimBlock(taken);
+      }
+      return -1;
+    }
+    allocated.push_back(blk);
+  }
+  for (auto blk : allocated) {
+    holdBlock(blk);
+  }
+
+  auto next = allocated.begin();
+  if (needDouble) {
+    map.Meta[0] = inode.DoubleIndirect = *next++;
+  }
+  if (needTriple) {
+    map.Meta[1] = inode.TripleIndirect = *next++;
+  }
+  if (needSecond) {
+    map.Seconds[second] = *next++;
+  }
+  if (leaf == 0) {
+    inode.Indirect = *next;
+  }
+  map.Leaves[leaf] = *next;
+  map.Loaded[leaf] = true;
+  map.DirtyLeaves[leaf] = false;
+
+  // the block pointing at the new leaf changed as well, and so did the
+  // triple indirect block if a block of it was added
+  if (leaf > POINTERS_PER_BLOCK) {
+    map.DirtySeconds[second] = true;
+  }
+  map.Dirty = map.Dirty || (leaf > 0 && leaf <= POINTERS_PER_BLOCK) || needSecond;
+  return allocated.size();
+}
+
+void FileSystem::releaseMapBlocks(Inode &inode, BlockMap &map, uint32_t first, uint32_t last) {
+  if (hasFeature(FEATURE_EXTENTS)) {
+    return;
+  }
+  const uint32_t blocks = map.Blocks.size();
+  const uint32_t leafCount = blocks > POINTERS_PER_INODE
+                           ? (blocks - POINTERS_PER_INODE + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK : 0;
+  // whether entries [from, to) of `pointers` are all 0
+  auto empty = [](const std::vector<uint32_t> &pointers, size_t from, size_t to) {
+    for (size_t i = from; i < to && i < pointers.size(); ++i) {
+      if (pointers[i] != 0) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // leaves that map nothing any more; one not loaded still maps something
+  const uint32_t firstLeaf = first > POINTERS_PER_INODE ? (first - POINTERS_PER_INODE) / POINTERS_PER_BLOCK : 0;
+  const size_t endLeaf = last < POINTERS_PER_INODE ? 0
+                       : std::min(map.Leaves.size(), (size_t)(last - POINTERS_PER_INODE) / POINTERS_PER_BLOCK + 1);
+  bool freed = false;
+  for (uint32_t k = firstLeaf; k < endLeaf; ++k) {
+    const size_t from = POINTERS_PER_INODE + (size_t)k * POINTERS_PER_BLOCK;
+    if (map.Leaves[k] == 0 ||
+        (k < leafCount && (!map.Loaded[k] || !empty(map.Blocks, from, from + POINTERS_PER_BLOCK)))) {
+      continue;
+    }
+    releaseBlock(map.Leaves[k]);
+    map.Leaves[k] = 0;
+    map.DirtyLeaves[k] = false;
+    if (k == 0) {
+      inode.Indirect = 0;
+    } else if (k <= POINTERS_PER_BLOCK) {
+      map.Dirty = true;
+    } else {
+      map.DirtySeconds[(k - 1 - POINTERS_PER_BLOCK) / POINTERS_PER_BLOCK] = true;
+    }
+    freed = true;
+  }
+  if (map.Leaves.size() > leafCount) {
+    map.Leaves.resize(leafCount);
+    map.Loaded.resize(leafCount);
+    map.DirtyLeaves.resize(leafCount);
+  }
+  if (!freed || map.Meta.empty()) {
+    return;
+  }
+
+  // then the blocks of the triple indirect block left with no leaves, and
+  // the double and triple indirect blocks themselves, among those above
+  // the leaves looked at
+  for (size_t j = 0; j < map.Seconds.size(); ++j) {
+    const size_t from = 1 + POINTERS_PER_BLOCK + j * POINTERS_PER_BLOCK;
+    if (from + POINTERS_PER_BLOCK <= firstLeaf || from >= endLeaf) {
+      continue;
+    }
+    if (map.Seconds[j] != 0 && empty(map.Leaves, from, from + POINTERS_PER_BLOCK)) {
+      releaseBlock(map.Seconds[j]);
+      map.Seconds[j] = 0;
+      map.DirtySeconds[j] = false;
+      map.Dirty = true;
+    }
+  }
+  const size_t seconds = leafCount > 1 + POINTERS_PER_BLOCK
+                       ? (leafCount - 1 - POINTERS_PER_BLOCK + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK : 0;
+  if (map.Seconds.size() > seconds) {
+    map.Seconds.resize(seconds);
+    map.DirtySeconds.resize(seconds);
+  }
+  if (map.Meta[0] != 0 && firstLeaf <= POINTERS_PER_BLOCK && endLeaf > 1 &&
+      empty(map.Leaves, 1, 1 + POINTERS_PER_BLOCK)) {
+    releaseBlock(map.Meta[0]);
+    map.Meta[0] = inode.DoubleIndirect = 0;
+  }
+  if (map.Meta[1] != 0 && endLeaf > 1 + POINTERS_PER_BLOCK && empty(map.Seconds, 0, map.Seconds.size())) {
+    releaseBlock(map.Meta[1]);
+    map.Meta[1] = inode.TripleIndirect = 0;
+  }
+}
+
+uint32_t FileSystem::getMapRoom(const BlockMap &map, uint32_t index) const {
+  const uint32_t maxBlocks = getMaxBlocks(superblock);
+  if (index >= maxBlocks) {
+    return 0;
+  }
+  if (hasFeature(FEATURE_EXTENTS)) {
+    return maxBlocks - index;
+  }
+  if (index < POINTERS_PER_INODE) {
+    return POINTERS_PER_INODE - index;
+  }
+  // the rest of the leaf
+  return POINTERS_PER_BLOCK - (index - POINTERS_PER_INODE) % POINTERS_PER_BLOCK;
+}
+
+bool FileSystem::resizeBlockMap(Inode &inode, BlockMap &map, uint32_t blocks) {
+  const uint32_t old = map.Blocks.size();
+  const bool extents = hasFeature(FEATURE_EXTENTS);
+  if (blocks >= old) {
+    // the new blocks are one hole, which may continue the last run
+    if (extents && blocks > old && (old == 0 || map.Blocks[old - 1] != 0)) {
+      map.Runs += 1;
+      if (!reserveExtentBlocks(map)) {
+        map.Runs -= 1;
+        return false;
+      }
+      map.Dirty = true;
+    }
+    map.Blocks.resize(blocks, 0);
+    return true;
+  }
+
+  // the leaves being cut are read to find the blocks they hold
+  loadMapRange(map, blocks, old - 1);
+  if (!unshareMapRange(inode, map, blocks, old - 1)) {
+    return false;
+  }
+  for (uint32_t i = blocks; i < old; ++i) {
+    if (map.Blocks[i] == 0) {
+      continue;
+    }
+    releaseBlock(map.Blocks[i]);
+    if (i < POINTERS_PER_INODE) {
+      inode.Direct[i] = 0;
+    } else if (!extents) {
+      // the leaf keeps no pointers past the end
+      map.DirtyLeaves[(i - POINTERS_PER_INODE) / POINTERS_PER_BLOCK] = true;
+    }
+  }
+  map.Blocks.resize(blocks);
+  releaseMapBlocks(inode, map, blocks);
+
+  if (extents) {
+    map.Runs = 0;
+    for (size_t i = 0; i < map.Blocks.size(); ++i) {
+      if (i == 0 || !continuesRun(map.Blocks[i - 1], map.Blocks[i])) {
+        map.Runs += 1;
+      }
+    }
+    map.Dirty = true;
+  }
+  return true;
+}
+
+bool FileSystem::spillInline(Inode &inode, BlockMap &map) {
+  assert(map.Blocks.empty());
+  if (inode.Size > 0) {
+    ssize_t goal = hasFeature(FEATURE_EXTENTS) ? (ssize_t)disk->size() : -1;
+    size_t length;
+    auto blk = allocateRun(1, length, goal);
+    if (blk == -1) {
+      return false;
+    }
+    Block block;
+    memset(block.Data, 0, sizeof(block.Data));
+    memcpy(block.Data, inode.Data, inode.Size);
+    writeData(blk, block.Data);
+    if (hasRefs()) {
+      trackDataBlock(blk, block.Data);
+    }
+    map.Blocks.push_back(0);
+    map.Runs = 1;
+    allocateBlockForInode(inode, map, 0, blk);
+  }
+  inode.Flags &= ~INODE_INLINE_DATA;
+  return true;
+}
+
+bool FileSystem::zeroBlockRange(Inode &inode, BlockMap &map, size_t from, size_t to) {
+  const uint32_t index = from / Disk::BLOCK_SIZE;
+  if (from >= to || map.Blocks[index] == 0) {
+    return true;
+  }
+  Block block;
+  readData(map.Blocks[index], block.Data);
+  memset(block.Data + from % Disk::BLOCK_SIZE, 0, to - from);
+  if (!hasRefs()) {
+    writeData(map.Blocks[index], block.Data);
+    return true;
+  }
+  // a shared block is copied rather than changed under its other users
+  PendingWrites pending;
+  if (!storeSharedBlock(inode, map, index, block.Data, pending)) {
+    return false;
+  }
+  for (auto &write : pending) {
+    writeData(write.first, (char *)write.second);
+  }
+  return true;
 }
@@ -0,0 +1,302 @@
+// journal.cpp: Metadata write-ahead journal
+
+#include "sfs/journal.h"
+
+#include <chrono>
+#include <stdexcept>
+
+#include <string.h>
+
+Journal::Journal(Disk *disk, uint32_t start, uint32_t blocks)
+    : Device(disk), Start(start), Length(blocks - 1), Head(0), Tail(0), Used(0),
+      Sequence(1), HeadSequence(1), Stopping(false), Commits(0), LoggedBlocks(0), Checkpoints(0), Oversized(0) {
+    if (blocks < MIN_BLOCKS) {
+    	throw std::invalid_argument("journal is too small");
+    }
+    Checkpointer = std::thread(&Journal::work, this);
+}
+
+Journal::~Journal() {
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	Stopping = true;
+    }
+    Wakeup.notify_one();
+    Checkpointer.join();
+    checkpoint();
+}
+
+void Journal::format(Disk *disk, uint32_t start) {
+    char block[Disk::BLOCK_SIZE] = {0};
+    Header header = {HEADER_MAGIC, 1, 0};
+    memcpy(block, &header, sizeof(header));
+    disk->writev({Disk::Request{(int)start, block}});
+}
+
+uint32_t Journal::checksum(const std::vector<Descriptor> &descriptors, const std::vector<const char *> &blocks) {
+    // FNV-1a over the home block numbers and the logged contents
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const char *data, size_t length) {
+    	for (size_t i = 0; i < length; i++) {
+    	    hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+	}
+    };
+    for (auto &descriptor : descriptors) {
+    	mix((const char *)&descriptor, sizeof(uint32_t) * (3 + descriptor.Count));
+    }
+    for (auto block : blocks) {
+    	mix(block, Disk::BLOCK_SIZE);
+    }
+    return hash;
+}
+
+void Journal::write_header() {
+    char block[Disk::BLOCK_SIZE] = {0};
+    Header header = {HEADER_MAGIC, HeadSequence, Head};
+    memcpy(block, &header, sizeof(header));
+    // Log blocks bypass the cache so they reach the image in this order
+    Device->writev({Disk::Request{(int)Start, block}});
+}
+
+void Journal::write_transaction() {
+    const size_t count = Committing.size();
+    const size_t length = transaction_blocks(count);
+    if (Used + length > Length) {
+    	checkpoint_locked();
+    }
+
+    // Each descriptor is followed by the blocks it lists
+    std::vector<Descriptor> descriptors((count + DESCRIPTOR_BLOCKS - 1) / DESCRIPTOR_BLOCKS);
+    std::vector<const char *> blocks;
+    std::vector<Disk::Request> requests;
+    uint32_t position = Tail;
+    auto it = Committing.begin();
+    for (auto &descriptor : descriptors) {
+    	memset(&descriptor, 0, sizeof(descriptor));
+    	descriptor.Magic    = DESCRIPTOR_MAGIC;
+    	descriptor.Sequence = Sequence;
+    	requests.push_back(Disk::Request{block(position++), (char *)&descriptor});
+    	for (; it != Committing.end() && descriptor.Count < DESCRIPTOR_BLOCKS; ++it) {
+    	    descriptor.Blocks[descriptor.Count++] = it->first;
+    	    requests.push_back(Disk::Request{block(position++), const_cast<char *>(it->second.data())});
+    	    blocks.push_back(it->second.data());
+	}
+    }
+
+    char commitBlock[Disk::BLOCK_SIZE] = {0};
+    Commit commit = {COMMIT_MAGIC, Sequence, (uint32_t)count, checksum(descriptors, blocks)};
+    memcpy(commitBlock, &commit, sizeof(commit));
+
+    // The commit block only follows once everything it vouches for is written
+    Device->writev(requests);
+    Device->writev({Disk::Request{block(position), commitBlock}});
+
+    Tail = (Tail + length) % Length;
+    Used += length;
+    Sequence++;
+    Commits++;
+    LoggedBlocks += count;
+}
+
+void Journal::checkpoint_locked() {
+    BlockMap snapshot;
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	snapshot = Committed;
+    }
+    if (snapshot.empty() && Used == 0) {
+    	return;
+    }
+
+    // Nothing new is committed while CommitLock is held, so everything in
+    // Committed is home once this write is done
+    std::vector<Disk::Request> requests;
+    for (auto &entry : snapshot) {
+    	requests.push_back(Disk::Request{(int)entry.first, entry.second.data()});
+    }
+    Device->writev(requests);
+
+    Head = Tail;
+    HeadSequence = Sequence;
+    Used = 0;
+    write_header();
+
+    std::lock_guard<std::mutex> guard(Lock);
+    Committed.clear();
+    Checkpoints++;
+}
+
+void Journal::work() {
+    std::unique_lock<std::mutex> lock(Lock);
+    while (!Stopping) {
+    	// Checkpoint when commit asks for log space, or a while after the
+    	// last commit so repeated updates of a block are written home once
+    	Wakeup.wait_for(lock, std::chrono::seconds(1));
+    	if (Stopping || Committed.empty()) {
+    	    continue;
+	}
+    	lock.unlock();
+    	checkpoint();
+    	lock.lock();
+    }
+}
+
+size_t Journal::replay() {
+    std::lock_guard<std::mutex> guard(CommitLock);
+
+    char buffer[Disk::BLOCK_SIZE];
+    Device->read(Start, buffer);
+    Header header;
+    memcpy(&header, buffer, sizeof(header));
+
+    size_t replayed = 0;
+    uint32_t position = 0;
+    uint32_t sequence = 1;
+    if (header.Magic == HEADER_MAGIC && header.Head < Length) {
+    	position = header.Head;
+    	sequence = header.Sequence;
+    	for (uint32_t scanned = 0; scanned < Length; ) {
+    	    // Read descriptors and the blocks after each up to the block that
+    	    // is not one, which has to be the commit
+    	    std::vector<Descriptor> descriptors;
+    	    std::vector<char> data;
+    	    uint32_t length = 0;
+    	    while (true) {
+    	    	Descriptor descriptor;
+    	    	Device->read(block(position + length), buffer);
+    	    	memcpy(&descriptor, buffer, sizeof(descriptor));
+    	    	if (descriptor.Magic != DESCRIPTOR_MAGIC || descriptor.Sequence != sequence ||
+    	    	    descriptor.Count == 0 || descriptor.Count > DESCRIPTOR_BLOCKS ||
+    	    	    scanned + length + descriptor.Count + 2 > Length) {
+    	    	    break;
+		}
+    	    	const size_t first = data.size();
+    	    	data.resize(first + descriptor.Count * Disk::BLOCK_SIZE);
+    	    	std::vector<Disk::Request> requests;
+    	    	for (uint32_t i = 0; i < descriptor.Count; i++) {
+    	    	    requests.push_back(Disk::Request{block(position + length + 1 + i), &data[first + i * Disk::BLOCK_SIZE]});
+		}
+    	    	Device->readv(requests);
+    	    	descriptors.push_back(descriptor);
+    	    	length += 1 + descriptor.Count;
+	    }
+
+    	    // Stop at the first transaction that is not completely there
+    	    Commit commit;
+    	    memcpy(&commit, buffer, sizeof(commit));
+    	    std::vector<const char *> blocks;
+    	    std::vector<Disk::Request> requests;
+    	    for (auto &descriptor : descriptors) {
+    	    	for (uint32_t i = 0; i < descriptor.Count; i++) {
+    	    	    requests.push_back(Disk::Request{(int)descriptor.Blocks[i], &data[blocks.size() * Disk::BLOCK_SIZE]});
+    	    	    blocks.push_back(&data[blocks.size() * Disk::BLOCK_SIZE]);
+		}
+	    }
+    	    if (descriptors.empty() || commit.Magic != COMMIT_MAGIC || commit.Sequence != sequence ||
+    	    	commit.Count != blocks.size() || commit.Checksum != checksum(descriptors, blocks)) {
+    	    	break;
+	    }
+
+    	    for (auto &request : requests) {
+    	    	if ((size_t)request.Block >= Device->size()) {
+    	    	    throw std::runtime_error("journal names a block past the end of the disk");
+		}
+	    }
+    	    Device->writev(requests);
+
+    	    position = (position + length + 1) % Length;
+    	    scanned += length + 1;
+    	    sequence++;
+    	    replayed++;
+	}
+    }
+
+    Head = Tail = position;
+    HeadSequence = Sequence = sequence;
+    Used = 0;
+    write_header();
+    return replayed;
+}
+
+void Journal::log(uint32_t blocknum, const char *data) {
+    // Committing from here could split a change the caller has only logged
+    // part of between two transactions
+    std::lock_guard<std::mutex> guard(Lock);
+    Running[blocknum].assign(data, data + Disk::BLOCK_SIZE);
+}
+
+bool Journal::crowded() {
+    std::lock_guard<std::mutex> guard(Lock);
+    return transaction_blocks(Running.size()) * 2 >= Length;
+}
+
+bool Journal::lookup(uint32_t blocknum, char *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+    for (auto map : {&Running, &Committing, &Committed}) {
+    	auto it = map->find(blocknum);
+    	if (it != map->end()) {
+    	    memcpy(data, it->second.data(), Disk::BLOCK_SIZE);
+    	    return true;
+	}
+    }
+    return false;
+}
+
+void Journal::revoke(uint32_t blocknum) {
+    bool committed;
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	Running.erase(blocknum);
+    	committed = Committing.count(blocknum) || Committed.count(blocknum);
+    }
+
+    // Replay must never see a committed copy once the block is reused, so
+    // the transactions holding it are checkpointed out of the log first
+    if (committed) {
+    	checkpoint();
+    }
+}
+
+void Journal::commit() {
+    std::lock_guard<std::mutex> guard(CommitLock);
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	if (Running.empty()) {
+    	    return;
+	}
+    	Committing.swap(Running);
+    }
+
+    // Ordered mode: data reaches the image before metadata pointing at it
+    Device->sync();
+
+    if (transaction_blocks(Committing.size()) <= Length) {
+    	write_transaction();
+    	std::lock_guard<std::mutex> guard(Lock);
+    	for (auto &entry : Committing) {
+    	    Committed[entry.first].swap(entry.second);
+	}
+    	Committing.clear();
+    } else {
+    	// Nothing older may land on these blocks after they are written, so
+    	// the log is emptied first
+    	checkpoint_locked();
+    	std::vector<Disk::Request> requests;
+    	for (auto &entry : Committing) {
+    	    requests.push_back(Disk::Request{(int)entry.first, entry.second.data()});
+	}
+    	Device->writev(requests);
+    	std::lock_guard<std::mutex> guard(Lock);
+    	Committing.clear();
+    	Oversized++;
+    }
+
+    if (Used * 2 >= Length) {
+    	Wakeup.notify_one();
+    }
+}
+
+void Journal::checkpoint() {
+    std::lock_guard<std::mutex> guard(CommitLock);
+    checkpoint_locked();
+}
@@ -0,0 +1,163 @@
+// lz.cpp: LZ77 block compression
+
+#include "sfs/lz.h"
+
+#include <string.h>
+
+namespace {
+
+// Positions of recent 4-byte sequences, by hash
+const size_t HASH_BITS = 12;
+
+uint32_t load32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write the extra bytes of a length that did not fit in its nibble
+bool putLength(char *dst, size_t &op, size_t capacity, size_t length) {
+    while (length >= 255) {
+    	if (op >= capacity) {
+    	    return false;
+	}
+    	dst[op++] = (char)255;
+    	length -= 255;
+    }
+    if (op >= capacity) {
+    	return false;
+    }
+    dst[op++] = (char)length;
+    return true;
+}
+
+// Read the extra bytes of a length whose nibble was 15
+bool getLength(const unsigned char *src, size_t &ip, size_t srcLength, size_t &length) {
+    unsigned char byte;
+    do {
+    	if (ip >= srcLength) {
+    	    return false;
+	}
+    	byte = src[ip++];
+    	length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Emit one sequence; without a match it is the last one
+bool putSequence(char *dst, size_t &op, size_t capacity, const char *literals, size_t literalLength,
+                 size_t offset, size_t matchLength) {
+    if (op >= capacity) {
+    	return false;
+    }
+    const size_t extra = matchLength ? matchLength - LZ::MIN_MATCH : 0;
+    dst[op++] = (char)(((literalLength < 15 ? literalLength : 15) << 4) | (extra < 15 ? extra : 15));
+    if (literalLength >= 15 && !putLength(dst, op, capacity, literalLength - 15)) {
+    	return false;
+    }
+    if (capacity - op < literalLength) {
+    	return false;
+    }
+    memcpy(dst + op, literals, literalLength);
+    op += literalLength;
+    if (matchLength == 0) {
+    	return true;
+    }
+    if (capacity - op < 2) {
+    	return false;
+    }
+    dst[op++] = (char)(offset & 0xff);
+    dst[op++] = (char)(offset >> 8);
+    return extra < 15 || putLength(dst, op, capacity, extra - 15);
+}
+
+}
+
+size_t LZ::compress(const char *src, size_t length, char *dst, size_t capacity) {
+    uint32_t table[1 << HASH_BITS];	// Position + 1 of the last sequence with each hash
+    memset(table, 0, sizeof(table));
+
+    size_t op	  = 0;
+    size_t anchor = 0;	    // Start of the literals not yet emitted
+    size_t ip	  = 0;
+    while (ip + MIN_MATCH <= length) {
+    	const uint32_t value = load32(src + ip);
+    	const uint32_t h     = hash(value);
+    	const size_t   ref   = table[h];
+    	table[h] = ip + 1;
+    	if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || load32(src + ref - 1) != value) {
+    	    ip++;
+    	    continue;
+	}
+
+    	// Extend the match as far as it goes
+    	const size_t start = ref - 1;
+    	size_t match = MIN_MATCH;
+    	while (ip + match < length && src[start + match] == src[ip + match]) {
+    	    match++;
+	}
+    	if (!putSequence(dst, op, capacity, src + anchor, ip - anchor, ip - start, match)) {
+    	    return 0;
+	}
+    	ip    += match;
+    	anchor = ip;
+    }
+
+    if (!putSequence(dst, op, capacity, src + anchor, length - anchor, 0, 0)) {
+    	return 0;
+    }
+    return op;
+}
+
+bool LZ::decompress(const char *src, size_t srcLength, char *dst, size_t length) {
+    const unsigned char *in = (const unsigned char *)src;
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < srcLength) {
+    	const unsigned char token = in[ip++];
+
+    	size_t literals = token >> 4;
+    	if (literals == 15 && !getLength(in, ip, srcLength, literals)) {
+    	    return false;
+	}
+    	if (srcLength - ip < literals || length - op < literals) {
+    	    return false;
+	}
+    	memcpy(dst + op, src + ip, literals);
+    	ip += literals;
+    	op += literals;
+
+    	// The last sequence has no match
+    	if (ip == srcLength) {
+    	    break;
+	}
+    	if (srcLength - ip < 2) {
+    	    return false;
+	}
+    	const size_t offset = in[ip] | (in[ip + 1] << 8);
+    	ip += 2;
+    	size_t match = token & 15;
+    	if (match == 15 && !getLength(in, ip, srcLength, match)) {
+    	    return false;
+	}
+    	match += MIN_MATCH;
+    	if (offset == 0 || offset > op || length - op < match) {
+    	    return false;
+	}
+
+    	// A match that overlaps what it copies repeats it, so go byte by byte
+    	if (offset >= match) {
+    	    memcpy(dst + op, dst + op - offset, match);
+    	    op += match;
+	} else {
+    	    for (size_t i = 0; i < match; i++, op++) {
+    	    	dst[op] = dst[op - offset];
+	    }
+	}
+    }
+    return op == length;
+}
@@ -0,0 +1,73 @@
+// mapped_disk.cpp: Memory-mapped disk emulator
+
+#include "sfs/mapped_disk.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void MappedDisk::open(const char *path, size_t nblocks) {
+    Disk::open(path, nblocks);
+
+    if (nblocks == 0) {
+    	return;
+    }
+
+    void *mapping = mmap(NULL, nblocks*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to mmap %s: %s", path, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+    Mapping = (char *)mapping;
+}
+
+MappedDisk::~MappedDisk() {
+    if (Mapping != nullptr) {
+    	// Write back while the mapping is still alive
+    	sync();
+    	munmap(Mapping, Blocks*BLOCK_SIZE);
+    	Mapping = nullptr;
+    }
+}
+
+void MappedDisk::read_blocks(int blocknum, struct iovec *iov, int iovcnt) {
+    const char *source = Mapping + (size_t)blocknum*BLOCK_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+    	memcpy(iov[i].iov_base, source, iov[i].iov_len);
+    	source += iov[i].iov_len;
+    	Reads  += iov[i].iov_len / BLOCK_SIZE;
+    }
+}
+
+void MappedDisk::write_blocks(int blocknum, struct iovec *iov, int iovcnt) {
+    char *target = Mapping + (size_t)blocknum*BLOCK_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+    	memcpy(target, iov[i].iov_base, iov[i].iov_len);
+    	target += iov[i].iov_len;
+    	Writes += iov[i].iov_len / BLOCK_SIZE;
+    }
+}
+
+void MappedDisk::flush() {
+    if (Mapping != nullptr && msync(Mapping, Blocks*BLOCK_SIZE, MS_SYNC) < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to msync: %s", strerror(errno));
+    	throw std::runtime_error(what);
+    }
+}
+
+const char *MappedDisk::block(int blocknum) {
+    if (blocknum < 0 || blocknum >= (int)Blocks) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "blocknum (%d) is out of range!", blocknum);
+    	throw std::invalid_argument(what);
+    }
+
+    sync(blocknum);
+    Reads++;
+    return Mapping + (size_t)blocknum*BLOCK_SIZE;
+}
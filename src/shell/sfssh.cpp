@@ -1,15 +1,22 @@
 // sfssh.cpp: Simple file system shell
 
+#include "sfs/async_disk.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
+#include "sfs/mapped_disk.h"
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Macros
 
@@ -20,37 +27,85 @@
 void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_cache(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_readahead(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2, char *arg3, char *arg4);
 void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2, char *arg3);
+void do_truncate(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_punch(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2, char *arg3);
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_snapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_snapshots(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_rollback(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_unsnap(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_scrub(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
-bool copyout(FileSystem &fs, size_t inumber, const char *path);
-bool copyin(FileSystem &fs, const char *path, size_t inumber);
+bool copyout(FileSystem &fs, size_t inumber, const char *path, size_t offset = 0, size_t length = SIZE_MAX);
+bool copyin(FileSystem &fs, const char *path, size_t inumber, size_t offset = 0);
 
 // Main execution
 
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m | -q depth] <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "    -m        memory-map the disk image\n");
+    fprintf(stderr, "    -q depth  keep up to depth asynchronous requests in flight\n");
+}
+
 int main(int argc, char *argv[]) {
-    Disk	disk;
-    FileSystem	fs;
+    bool   mapped = false;
+    size_t depth  = 0;
+    int	   option;
+
+    while ((option = getopt(argc, argv, "mq:")) != -1) {
+    	switch (option) {
+    	    case 'm':
+    	    	mapped = true;
+    	    	break;
+    	    case 'q':
+    	    	depth = atoi(optarg);
+    	    	break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return EXIT_FAILURE;
+	}
+    }
 
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    if (argc - optind != 2) {
+    	usage(argv[0]);
     	return EXIT_FAILURE;
     }
 
+    const char *path    = argv[optind];
+    size_t	nblocks = atoi(argv[optind + 1]);
+
+    std::unique_ptr<Disk> disk;
+    if (mapped) {
+    	disk.reset(new MappedDisk());
+    } else if (depth > 0) {
+    	disk.reset(new AsyncDisk(depth));
+    } else {
+    	disk.reset(new Disk());
+    }
+    FileSystem	fs;
+
     try {
-    	disk.open(argv[1], atoi(argv[2]));
+    	disk->open(path, nblocks);
     } catch (std::runtime_error &e) {
-    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	fprintf(stderr, "Unable to open disk %s: %s\n", path, e.what());
     	return EXIT_FAILURE;
     }
 
     while (true) {
-	char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
+	char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ], arg3[BUFSIZ], arg4[BUFSIZ];
 
     	fprintf(stderr, "folks> ");
     	fflush(stderr);
@@ -59,31 +114,57 @@ int main(int argc, char *argv[]) {
     	    break;
     	}
 
-    	int args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
+    	int args = sscanf(line, "%s %s %s %s %s", cmd, arg1, arg2, arg3, arg4);
     	if (args == 0) {
     	    continue;
 	}
 
 	if (streq(cmd, "debug")) {
-	    do_debug(disk, fs, args, arg1, arg2);
+	    do_debug(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "format")) {
-	    do_format(disk, fs, args, arg1, arg2);
+	    do_format(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "mount")) {
-	    do_mount(disk, fs, args, arg1, arg2);
+	    do_mount(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "unmount")) {
+	    do_unmount(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "sync")) {
+	    do_sync(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "cache")) {
+	    do_cache(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "readahead")) {
+	    do_readahead(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "cat")) {
-	    do_cat(disk, fs, args, arg1, arg2);
+	    do_cat(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyout")) {
-	    do_copyout(disk, fs, args, arg1, arg2);
+	    do_copyout(*disk, fs, args, arg1, arg2, arg3, arg4);
 	} else if (streq(cmd, "create")) {
-	    do_create(disk, fs, args, arg1, arg2);
+	    do_create(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "remove")) {
-	    do_remove(disk, fs, args, arg1, arg2);
+	    do_remove(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "stat")) {
-	    do_stat(disk, fs, args, arg1, arg2);
+	    do_stat(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyin")) {
-	    do_copyin(disk, fs, args, arg1, arg2);
+	    do_copyin(*disk, fs, args, arg1, arg2, arg3);
+	} else if (streq(cmd, "truncate")) {
+	    do_truncate(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "punch")) {
+	    do_punch(*disk, fs, args, arg1, arg2, arg3);
+	} else if (streq(cmd, "clone")) {
+	    do_clone(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "snapshot")) {
+	    do_snapshot(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "snapshots")) {
+	    do_snapshots(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "rollback")) {
+	    do_rollback(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "unsnap")) {
+	    do_unsnap(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "defrag")) {
+	    do_defrag(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "scrub")) {
+	    do_scrub(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "help")) {
-	    do_help(disk, fs, args, arg1, arg2);
+	    do_help(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
 	    break;
 	} else {
@@ -92,6 +173,23 @@ int main(int argc, char *argv[]) {
 	}
     }
 
+    // unmounting drops any prefetched blocks, so they count as wasted
+    fs.unmount();
+    if (fs.getReadahead() > 0) {
+    	printf("%lu readahead hits\n", fs.getReadaheadHits());
+    	printf("%lu readahead wasted\n", fs.getReadaheadWasted());
+    }
+    if (fs.getCompressionInput() > 0) {
+    	printf("%lu bytes compressed to %lu (%.2fx), %.3f s in codec\n", fs.getCompressionInput(),
+    	       fs.getCompressionOutput(), (double)fs.getCompressionInput() / std::max<size_t>(fs.getCompressionOutput(), 1),
+    	       fs.getCodecSeconds());
+    }
+    if (fs.getDedupHits() > 0) {
+    	printf("%lu blocks deduplicated\n", fs.getDedupHits());
+    }
+    if (fs.getChecksumErrors() > 0) {
+    	printf("%lu checksum errors\n", fs.getChecksumErrors());
+    }
     return EXIT_SUCCESS;
 }
 
@@ -103,19 +201,57 @@ void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     	return;
     }
 
+    // debug reads the disk, so inodes kept in memory (or in the journal)
+    // must reach their home blocks first
+    fs.sync();
+    fs.checkpoint();
     fs.debug(&disk);
 }
 
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-    	printf("Usage: format\n");
+    // options are `fast` and a comma-separated list of features
+    bool     fast	= false;
+    uint32_t features	= 0;
+    bool     valid	= true;
+    for (int i = 1; i < args; i++) {
+    	char *arg = i == 1 ? arg1 : arg2;
+    	if (streq(arg, "fast") && !fast) {
+    	    fast = true;
+    	    continue;
+	}
+    	for (char *name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+    	    if (streq(name, "extents")) {
+    	    	features |= FileSystem::FEATURE_EXTENTS;
+	    } else if (streq(name, "large")) {
+    	    	features |= FileSystem::FEATURE_LARGE_FILES;
+	    } else if (streq(name, "inline")) {
+    	    	features |= FileSystem::FEATURE_INLINE_DATA;
+	    } else if (streq(name, "compress")) {
+    	    	features |= FileSystem::FEATURE_COMPRESSION;
+	    } else if (streq(name, "dedup")) {
+    	    	features |= FileSystem::FEATURE_DEDUP;
+	    } else if (streq(name, "clones")) {
+    	    	features |= FileSystem::FEATURE_CLONES;
+	    } else if (streq(name, "checksums")) {
+    	    	features |= FileSystem::FEATURE_CHECKSUMS;
+	    } else {
+    	    	valid = false;
+	    }
+	}
+    }
+    if (!valid) {
+    	printf("Usage: format  [fast] [extents,large,inline,compress,dedup,clones,checksums]\n");
     	return;
     }
 
-    if (fs.format(&disk)) {
-    	printf("disk formatted.\n");
-    } else {
+    auto start = std::chrono::steady_clock::now();
+    if (!fs.format(&disk, fast, true, features)) {
     	printf("format failed!\n");
+    } else if (fast) {
+    	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    	printf("disk formatted in %.3f seconds.\n", elapsed.count());
+    } else {
+    	printf("disk formatted.\n");
     }
 }
 
@@ -127,11 +263,65 @@ void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 
     if (fs.mount(&disk)) {
     	printf("disk mounted.\n");
+    	if (fs.getJournalReplayed() > 0) {
+    	    printf("replayed %lu journal transactions.\n", fs.getJournalReplayed());
+	}
+    	if (fs.getChecksumsRecomputed() > 0) {
+    	    printf("recomputed %lu checksums after a crash.\n", fs.getChecksumsRecomputed());
+	}
+    	for (auto block : fs.getDuplicateBlocks()) {
+    	    printf("block %u is allocated more than once!\n", block);
+	}
     } else {
     	printf("mount failed!\n");
     }
 }
 
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: unmount\n");
+    	return;
+    }
+
+    if (disk.mounted()) {
+    	fs.unmount();
+    	printf("disk unmounted.\n");
+    } else {
+    	printf("unmount failed!\n");
+    }
+}
+
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: sync\n");
+    	return;
+    }
+
+    fs.sync();
+    disk.sync();
+    printf("disk synced.\n");
+}
+
+void do_cache(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: cache <blocks>\n");
+    	return;
+    }
+
+    disk.set_cache_size(atoi(arg1));
+    printf("cache holds %lu blocks.\n", disk.cache_size());
+}
+
+void do_readahead(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: readahead <blocks>\n");
+    	return;
+    }
+
+    fs.setReadahead(atoi(arg1));
+    printf("readahead window up to %lu blocks.\n", fs.getReadahead());
+}
+
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: cat <inode>\n");
@@ -143,13 +333,16 @@ void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 3) {
-    	printf("Usage: copyout <inode> <file>\n");
+void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2, char *arg3, char *arg4) {
+    if (args < 3 || args > 5) {
+    	printf("Usage: copyout <inode> <file> [offset] [length]\n");
     	return;
     }
 
-    if (!copyout(fs, atoi(arg1), arg2)) {
+    // with an offset and length only that part of the file is copied
+    size_t offset = args >= 4 ? strtoull(arg3, NULL, 10) : 0;
+    size_t length = args == 5 ? strtoull(arg4, NULL, 10) : SIZE_MAX;
+    if (!copyout(fs, atoi(arg1), arg2, offset, length)) {
     	printf("copyout failed!\n");
     }
 }
@@ -197,34 +390,206 @@ void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 3) {
-    	printf("Usage: copyin <inode> <file>\n");
+void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2, char *arg3) {
+    if (args != 3 && args != 4) {
+    	printf("Usage: copyin <file> <inode> [offset]\n");
     	return;
     }
 
-    if (!copyin(fs, arg1, atoi(arg2))) {
+    // with an offset the file is written there, past a hole if it is
+    // beyond the end
+    size_t offset = args == 4 ? strtoull(arg3, NULL, 10) : 0;
+    if (!copyin(fs, arg1, atoi(arg2), offset)) {
     	printf("copyin failed!\n");
     }
 }
 
+void do_truncate(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: truncate <inode> <size>\n");
+    	return;
+    }
+
+    ssize_t inumber = atoi(arg1);
+    size_t  size    = strtoull(arg2, NULL, 10);
+    if (fs.truncate(inumber, size)) {
+    	printf("inode %ld truncated to %lu bytes.\n", inumber, size);
+    } else {
+    	printf("truncate failed!\n");
+    }
+}
+
+void do_punch(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2, char *arg3) {
+    if (args != 4) {
+    	printf("Usage: punch <inode> <offset> <length>\n");
+    	return;
+    }
+
+    ssize_t inumber = atoi(arg1);
+    size_t  offset  = strtoull(arg2, NULL, 10);
+    size_t  length  = strtoull(arg3, NULL, 10);
+    if (fs.punchHole(inumber, offset, length)) {
+    	printf("punched %lu bytes at %lu in inode %ld.\n", length, offset, inumber);
+    } else {
+    	printf("punch failed!\n");
+    }
+}
+
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: clone <inode>\n");
+    	return;
+    }
+
+    ssize_t inumber = atoi(arg1);
+    ssize_t copy    = fs.clone(inumber);
+    if (copy >= 0) {
+    	printf("cloned inode %ld to inode %ld.\n", inumber, copy);
+    } else {
+    	printf("clone failed!\n");
+    }
+}
+
+void do_snapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: snapshot\n");
+    	return;
+    }
+
+    ssize_t id = fs.snapshot();
+    if (id >= 0) {
+    	printf("created snapshot %ld.\n", id);
+    } else {
+    	printf("snapshot failed!\n");
+    }
+}
+
+void do_snapshots(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: snapshots\n");
+    	return;
+    }
+
+    auto ids = fs.getSnapshots();
+    printf("%lu snapshots", ids.size());
+    for (auto id : ids) {
+    	printf(" %lu", id);
+    }
+    printf("\n");
+}
+
+void do_rollback(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: rollback <snapshot>\n");
+    	return;
+    }
+
+    size_t id = atoi(arg1);
+    if (fs.rollback(id)) {
+    	printf("rolled back to snapshot %lu.\n", id);
+    } else {
+    	printf("rollback failed!\n");
+    }
+}
+
+void do_unsnap(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: unsnap <snapshot>\n");
+    	return;
+    }
+
+    size_t id = atoi(arg1);
+    if (fs.removeSnapshot(id)) {
+    	printf("removed snapshot %lu.\n", id);
+    } else {
+    	printf("unsnap failed!\n");
+    }
+}
+
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 2) {
+    	printf("Usage: defrag [inode]\n");
+    	return;
+    }
+
+    // one file, or every file, reporting only those that changed
+    size_t first = 0, end = fs.getInodeCount();
+    if (args == 2) {
+    	first = atoi(arg1);
+    	end   = first + 1;
+    }
+    size_t files = 0, before = 0, after = 0;
+    for (size_t inumber = first; inumber < end; inumber++) {
+    	ssize_t runs = fs.getRuns(inumber);
+    	ssize_t now  = runs < 0 ? -1 : fs.defragment(inumber);
+    	if (now < 0) {
+    	    if (args == 2) {
+    	    	printf("defrag failed!\n");
+    	    	return;
+	    }
+    	    continue;
+	}
+    	if (args == 2 || now != runs) {
+    	    printf("inode %lu: %ld runs -> %ld runs.\n", inumber, runs, now);
+	}
+    	files++;
+    	before += runs;
+    	after  += now;
+    }
+    if (args == 1) {
+    	printf("%lu files: %lu runs -> %lu runs.\n", files, before, after);
+    }
+}
+
+void do_scrub(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: scrub\n");
+    	return;
+    }
+
+    // a batch at a time, so writers only wait for one
+    const size_t BATCH = 4096;
+    std::vector<uint32_t> corrupt;
+    size_t checked = 0;
+    for (size_t first = 0; first < disk.size(); first += BATCH) {
+    	checked += fs.scrub(first, BATCH, corrupt);
+    }
+    for (auto blk : corrupt) {
+    	printf("block %u does not match its checksum.\n", blk);
+    }
+    printf("%lu blocks checked, %lu corrupt.\n", checked, corrupt.size());
+}
+
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [fast] [extents,large,inline,compress,dedup,clones]\n");
     printf("    mount\n");
+    printf("    unmount\n");
+    printf("    sync\n");
+    printf("    cache   <blocks>\n");
+    printf("    readahead <blocks>\n");
     printf("    debug\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
     printf("    cat     <inode>\n");
     printf("    stat    <inode>\n");
-    printf("    copyin  <file> <inode>\n");
-    printf("    copyout <inode> <file>\n");
+    printf("    copyin  <file> <inode> [offset]\n");
+    printf("    copyout <inode> <file> [offset] [length]\n");
+    printf("    truncate <inode> <size>\n");
+    printf("    punch   <inode> <offset> <length>\n");
+    printf("    clone   <inode>\n");
+    printf("    snapshot\n");
+    printf("    snapshots\n");
+    printf("    rollback <snapshot>\n");
+    printf("    unsnap  <snapshot>\n");
+    printf("    defrag  [inode]\n");
+    printf("    scrub\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
 }
 
-bool copyout(FileSystem &fs, size_t inumber, const char *path) {
+bool copyout(FileSystem &fs, size_t inumber, const char *path, size_t offset, size_t length) {
     FILE *stream = fopen(path, "wb");
     if (stream == nullptr) {
     	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
@@ -232,22 +597,30 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
     }
 
     char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
+    const size_t start = offset;
     while (true) {
-    	ssize_t result = fs.read(inumber, buffer, sizeof(buffer), offset);
+    	// a zero length still asks the file system for nothing once
+    	const size_t wanted = std::min(sizeof(buffer), length - (offset - start));
+    	ssize_t result = fs.read(inumber, buffer, wanted, offset);
     	if (result <= 0) {
+    	    // reading at the end fails too, but one before it is an error,
+    	    // such as a block that does not match its checksum
+    	    if (result < 0 && fs.stat(inumber) > (ssize_t)offset) {
+    	    	fclose(stream);
+    	    	return false;
+	    }
     	    break;
 	}
 	fwrite(buffer, 1, result, stream);
 	offset += result;
     }
 
-    printf("%lu bytes copied\n", offset);
+    printf("%lu bytes copied\n", offset - start);
     fclose(stream);
     return true;
 }
 
-bool copyin(FileSystem &fs, const char *path, size_t inumber) {
+bool copyin(FileSystem &fs, const char *path, size_t inumber, size_t offset) {
     FILE *stream = fopen(path, "rb");
     if (stream == nullptr) {
     	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
@@ -255,7 +628,7 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     }
 
     char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
+    const size_t start = offset;
     while (true) {
     	ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
     	if (result <= 0) {
@@ -274,7 +647,7 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
 	}
     }
 
-    printf("%lu bytes copied\n", offset);
+    printf("%lu bytes copied\n", offset - start);
     fclose(stream);
     return true;
 }
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: debug output (including block counters) matches the default backend
+
+for IMAGE in 5 20 200; do
+    echo -n "Testing async debug on data/image.$IMAGE ... "
+    if diff -u <(./bin/sfssh data/image.$IMAGE $IMAGE <<<debug 2> /dev/null) \
+	       <(./bin/sfssh -q 8 data/image.$IMAGE $IMAGE <<<debug 2> /dev/null) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: copyin and copyout with many requests in flight
+
+cat <<EOF | ./bin/sfssh -q 32 data/yuxiang.1000 1000 > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/yuxiang.jpg
+EOF
+cat <<EOF | ./bin/sfssh -q 32 $SCRATCH/image.1000 1000 > /dev/null 2>&1
+format
+mount
+create
+copyin $SCRATCH/yuxiang.jpg 0
+EOF
+cat <<EOF | ./bin/sfssh -q 1 $SCRATCH/image.1000 1000 > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/yuxiang.copy
+EOF
+echo -n "Testing async copyin in $SCRATCH/image.1000 ... "
+if [ $(md5sum $SCRATCH/yuxiang.jpg | awk '{print $1}') = '4fc399e56f88395f5ad6ddd8505c31f1' ] &&
+   [ $(md5sum $SCRATCH/yuxiang.copy | awk '{print $1}') = '4fc399e56f88395f5ad6ddd8505c31f1' ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -0,0 +1,73 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a cleanly unmounted image mounts from the bitmap without the block scan
+
+clean-mount-output() {
+    cat <<EOF
+disk mounted.
+22 disk block reads
+2 disk block writes
+EOF
+}
+
+./bin/sfssh $SCRATCH/image.200 200 <<<format > /dev/null 2>&1
+echo -n "Testing clean mount on $SCRATCH/image.200 ... "
+if diff -u <(./bin/sfssh $SCRATCH/image.200 200 <<<mount 2> /dev/null) <(clean-mount-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: allocations persist across mounts through the bitmap
+
+cat <<EOF | ./bin/sfssh data/image.200 200 > /dev/null 2>&1
+mount
+copyout 1 $SCRATCH/1.txt
+copyout 2 $SCRATCH/2.txt
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+mount
+create
+copyin $SCRATCH/2.txt 0
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+mount
+create
+copyin $SCRATCH/1.txt 1
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/2.copy
+copyout 1 $SCRATCH/1.copy
+EOF
+echo -n "Testing bitmap persistence in $SCRATCH/image.200 ... "
+if [ $(md5sum $SCRATCH/1.copy | awk '{print $1}') = '0af623d6d8cb0a514816e17c7386a298' ] &&
+   [ $(md5sum $SCRATCH/2.copy | awk '{print $1}') = '307fe5cee7ac87c3b06ea5bda80301ee' ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Test: a dirty state forces the full scan and rewrites the bitmap
+
+dirty-mount-output() {
+    cat <<EOF
+disk mounted.
+22 disk block reads
+3 disk block writes
+EOF
+}
+
+printf '\x00\x00\x00\x00' | dd of=$SCRATCH/image.200 bs=1 seek=24 conv=notrunc 2> /dev/null
+echo -n "Testing dirty mount on $SCRATCH/image.200 ... "
+if diff -u <(./bin/sfssh $SCRATCH/image.200 200 <<<mount 2> /dev/null) <(dirty-mount-output) > $SCRATCH/test.log &&
+   diff -u <(./bin/sfssh $SCRATCH/image.200 200 <<<mount 2> /dev/null) <(clean-mount-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,52 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: copyin and copyout through a write-back cache on data/image.200
+
+cat <<EOF | ./bin/sfssh data/image.200 200 > /dev/null 2>&1
+mount
+copyout 2 $SCRATCH/2.txt
+copyout 9 $SCRATCH/9.txt
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/output 2>&1
+cache 8
+format
+mount
+create
+copyin $SCRATCH/9.txt 0
+create
+copyin $SCRATCH/2.txt 1
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/9.copy
+copyout 1 $SCRATCH/2.copy
+EOF
+echo -n "Testing cache write-back in $SCRATCH/image.200 ... "
+if [ $(md5sum $SCRATCH/2.copy | awk '{print $1}') = '307fe5cee7ac87c3b06ea5bda80301ee' ] &&
+   [ $(md5sum $SCRATCH/9.copy | awk '{print $1}') = 'cc4e48a5fe0ba15b13a98b3fd34b340e' ] &&
+   grep -q 'cache hits' $SCRATCH/output; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Test: repeated metadata reads are served from the cache
+
+debug-input() {
+    echo mount
+    for i in $(seq $1); do
+    	echo debug
+    done
+}
+
+echo -n "Testing cache hits on data/image.200 ... "
+UNCACHED=$(debug-input 1 | ./bin/sfssh data/image.200 200 2> /dev/null | awk '/disk block reads/ {print $1}')
+CACHED=$( (echo cache 32; debug-input 10) | ./bin/sfssh data/image.200 200 2> /dev/null | awk '/disk block reads/ {print $1}')
+if [ "$CACHED" -le "$UNCACHED" ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -0,0 +1,117 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a data block changed behind the file system's back fails the reads
+# of its file and is found by scrub, and writing the file again replaces it
+
+head -c 20000 /dev/urandom > $SCRATCH/data.bin
+head -c 60000 /dev/urandom > $SCRATCH/other.bin
+
+checksum-write-input() {
+    cat <<EOF2
+format checksums
+mount
+create
+create
+copyin $SCRATCH/data.bin 0
+copyin $SCRATCH/other.bin 1
+debug
+scrub
+EOF2
+}
+
+checksum-write-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+20000 bytes copied
+60000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+    1 checksum blocks
+Inode 0:
+    size: 20000 bytes
+    direct blocks: 23 24 25 26 27
+Inode 1:
+    size: 60000 bytes
+    direct blocks: 28 29 30 31 32
+    indirect block: 33
+    indirect data blocks: 34 35 36 37 38 39 40 41 42 43
+20 blocks checked, 0 corrupt.
+EOF2
+}
+
+checksum-read-input() {
+    cat <<EOF2
+mount
+copyout 0 $SCRATCH/data.copy
+copyout 1 $SCRATCH/other.copy
+scrub
+copyin $SCRATCH/data.bin 0
+scrub
+copyout 0 $SCRATCH/data.copy
+EOF2
+}
+
+checksum-read-output() {
+    cat <<EOF2
+disk mounted.
+copyout failed!
+60000 bytes copied
+block 25 does not match its checksum.
+20 blocks checked, 1 corrupt.
+20000 bytes copied
+20 blocks checked, 0 corrupt.
+20000 bytes copied
+2 checksum errors
+EOF2
+}
+
+echo -n "Testing checksums in $SCRATCH/image.checksum ... "
+if diff -u <(checksum-write-input | ./bin/sfssh $SCRATCH/image.checksum 200 2> /dev/null | sed -e '/disk block/d') <(checksum-write-output) > $SCRATCH/test.log &&
+   dd if=/dev/urandom of=$SCRATCH/image.checksum bs=4096 seek=25 count=1 conv=notrunc 2> /dev/null &&
+   diff -u <(checksum-read-input | ./bin/sfssh $SCRATCH/image.checksum 200 2> /dev/null | sed -e '/disk block/d') <(checksum-read-output) >> $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy && cmp -s $SCRATCH/other.bin $SCRATCH/other.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: a mount after a crash recomputes only the entries of the blocks
+# written since the last sync, so older damage is still found
+
+crash-input() {
+    cat <<EOF2
+mount
+scrub
+EOF2
+}
+
+crash-output() {
+    cat <<EOF2
+disk mounted.
+block 25 does not match its checksum.
+20 blocks checked, 1 corrupt.
+1 checksum errors
+EOF2
+}
+
+echo -n "Testing checksums after a crash in $SCRATCH/image.crash ... "
+if checksum-write-input | ./bin/sfssh $SCRATCH/image.crash 200 > /dev/null 2>&1 &&
+   dd if=/dev/urandom of=$SCRATCH/image.crash bs=4096 seek=25 count=1 conv=notrunc 2> /dev/null &&
+   printf '\x00\x00\x00\x00' | dd of=$SCRATCH/image.crash bs=1 seek=24 conv=notrunc 2> /dev/null &&
+   diff -u <(crash-input | ./bin/sfssh $SCRATCH/image.crash 200 2> /dev/null | sed -e '/disk block/d') <(crash-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
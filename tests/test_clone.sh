@@ -0,0 +1,136 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a clone shares every block with the file it was made from, and
+# writing to it copies only the clone's blocks
+
+head -c 20000 /dev/urandom > $SCRATCH/data.bin
+cp $SCRATCH/data.bin $SCRATCH/changed.bin
+echo "changed" | dd of=$SCRATCH/changed.bin bs=1 seek=5000 conv=notrunc 2> /dev/null
+
+clone-input() {
+    cat <<EOF2
+format clones
+mount
+create
+copyin $SCRATCH/data.bin 0
+clone 0
+debug
+copyin $SCRATCH/changed.bin 1
+unmount
+mount
+copyout 0 $SCRATCH/data.copy
+copyout 1 $SCRATCH/changed.copy
+debug
+EOF2
+}
+
+clone-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+20000 bytes copied
+cloned inode 0 to inode 1.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+    1 reference blocks for shared data
+    0 snapshots
+Inode 0:
+    size: 20000 bytes
+    direct blocks: 24 25 26 27 28
+Inode 1:
+    size: 20000 bytes
+    direct blocks: 24 25 26 27 28
+20000 bytes copied
+disk unmounted.
+disk mounted.
+20000 bytes copied
+20000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+    1 reference blocks for shared data
+    0 snapshots
+Inode 0:
+    size: 20000 bytes
+    direct blocks: 24 25 26 27 28
+Inode 1:
+    size: 20000 bytes
+    direct blocks: 29 30 31 32 33
+EOF2
+}
+
+echo -n "Testing clone in $SCRATCH/image.clone ... "
+if diff -u <(clone-input | ./bin/sfssh $SCRATCH/image.clone 200 2> /dev/null | sed -e '/disk block/d') <(clone-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy && cmp -s $SCRATCH/changed.bin $SCRATCH/changed.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: rolling back to a snapshot brings back removed and overwritten
+# files, and removing it afterwards keeps what was rolled back to
+
+snapshot-input() {
+    cat <<EOF2
+format clones
+mount
+create
+create
+copyin $SCRATCH/data.bin 0
+copyin $SCRATCH/changed.bin 1
+snapshot
+snapshots
+remove 0
+copyin $SCRATCH/data.bin 1
+rollback 0
+unsnap 0
+snapshots
+unmount
+mount
+copyout 0 $SCRATCH/data.copy
+copyout 1 $SCRATCH/changed.copy
+EOF2
+}
+
+snapshot-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+20000 bytes copied
+20000 bytes copied
+created snapshot 0.
+1 snapshots 0
+removed inode 0.
+20000 bytes copied
+rolled back to snapshot 0.
+removed snapshot 0.
+0 snapshots
+disk unmounted.
+disk mounted.
+20000 bytes copied
+20000 bytes copied
+EOF2
+}
+
+echo -n "Testing snapshot rollback in $SCRATCH/image.clone ... "
+if diff -u <(snapshot-input | ./bin/sfssh $SCRATCH/image.clone 200 2> /dev/null | sed -e '/disk block/d') <(snapshot-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy && cmp -s $SCRATCH/changed.bin $SCRATCH/changed.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
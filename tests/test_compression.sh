@@ -0,0 +1,86 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a log-like file is stored in compressed clusters of a few blocks
+# each, and reads back the same after a remount
+
+for i in $(seq 1 3000); do
+    echo "2026-10-16 12:00:$((i % 60)) INFO request $((i * 7919 % 100000)) served in $((i % 300))ms"
+done > $SCRATCH/log.txt
+
+compression-input() {
+    cat <<EOF2
+format compress
+mount
+create
+copyin $SCRATCH/log.txt 0
+unmount
+mount
+copyout 0 $SCRATCH/log.copy
+debug
+EOF2
+}
+
+compression-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+$(wc -c < $SCRATCH/log.txt | tr -d " ") bytes copied
+disk unmounted.
+disk mounted.
+$(wc -c < $SCRATCH/log.txt | tr -d " ") bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    1280 inodes
+    1 bitmap blocks (dirty)
+    64-byte inodes for large files
+    files compressed in 16-block clusters
+Inode 0:
+    size: $(wc -c < $SCRATCH/log.txt | tr -d " ") bytes
+    compressed
+    direct blocks: 24 25 26 27 0
+    indirect block: 30
+    indirect data blocks: 0 0 0 0 0 0 0 0 0 0 0 31 32 33 34 0 0 0 0 0 0 0 0 0 0 0 0 35 36 0 0 0 0 0 0
+EOF2
+}
+
+echo -n "Testing compression in $SCRATCH/image.compress ... "
+if diff -u <(compression-input | ./bin/sfssh $SCRATCH/image.compress 200 2> /dev/null | sed -e '/disk block/d' -e '/in codec/d') <(compression-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/log.txt $SCRATCH/log.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: random data does not compress, so its clusters are stored as they
+# are until a punched hole leaves zeros to compress in them
+
+head -c 100000 /dev/urandom > $SCRATCH/random.bin
+cp $SCRATCH/random.bin $SCRATCH/punched.bin
+dd if=/dev/zero of=$SCRATCH/punched.bin bs=1 seek=1000 count=70000 conv=notrunc 2> /dev/null
+
+echo -n "Testing compression of random data in $SCRATCH/image.compress ... "
+if printf "format compress,extents\nmount\ncreate\ncopyin $SCRATCH/random.bin 0\npunch 0 1000 70000\nunmount\nmount\ncopyout 0 $SCRATCH/random.copy\ndebug\n" |
+   ./bin/sfssh $SCRATCH/image.compress 200 2> /dev/null | grep -q "^    extents: 63+1 0+15 64+8 0+1$" &&
+   cmp -s $SCRATCH/punched.bin $SCRATCH/random.copy; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Test: an empty read of a compressed file copies nothing
+
+echo -n "Testing an empty read of a compressed file in $SCRATCH/image.compress ... "
+if printf "format compress\nmount\ncreate\ncopyin $SCRATCH/random.bin 0\ncopyout 0 $SCRATCH/empty.copy 0 0\n" |
+   ./bin/sfssh $SCRATCH/image.compress 200 2> /dev/null | grep -q "^0 bytes copied$" &&
+   [ ! -s $SCRATCH/empty.copy ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -49,3 +49,17 @@ if [ $(md5sum $SCRATCH/1.txt | awk '{print $1}') = '0af623d6d8cb0a514816e17c7386
 else
     echo "Failure"
 fi
+
+# Test: data/yuxiang.1000
+
+cat <<EOF | ./bin/sfssh data/yuxiang.1000 1000 > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/yuxiang.jpg
+EOF
+
+echo -n "Testing copyout in data/yuxiang.1000 ... "
+if [ $(md5sum $SCRATCH/yuxiang.jpg | awk '{print $1}') = '4fc399e56f88395f5ad6ddd8505c31f1' ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -537,8 +537,8 @@ Inode 126:
 Inode 127:
     size: 0 bytes
     direct blocks:
-262 disk block reads
-127 disk block writes
+6 disk block reads
+1 disk block writes
 EOF
 }
 
@@ -0,0 +1,120 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a file copied in twice is stored once, and the copy left behind when
+# one is removed still reads back the same after a remount
+
+head -c 20000 /dev/urandom > $SCRATCH/data.bin
+
+dedup-input() {
+    cat <<EOF2
+format dedup
+mount
+create
+create
+copyin $SCRATCH/data.bin 0
+copyin $SCRATCH/data.bin 1
+debug
+remove 0
+unmount
+mount
+copyout 1 $SCRATCH/data.copy
+debug
+EOF2
+}
+
+dedup-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+20000 bytes copied
+20000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+    1 reference blocks for shared data
+Inode 0:
+    size: 20000 bytes
+    direct blocks: 23 24 25 26 27
+Inode 1:
+    size: 20000 bytes
+    direct blocks: 23 24 25 26 27
+removed inode 0.
+disk unmounted.
+disk mounted.
+20000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+    1 reference blocks for shared data
+Inode 1:
+    size: 20000 bytes
+    direct blocks: 23 24 25 26 27
+5 blocks deduplicated
+EOF2
+}
+
+echo -n "Testing dedup in $SCRATCH/image.dedup ... "
+if diff -u <(dedup-input | ./bin/sfssh $SCRATCH/image.dedup 200 2> /dev/null | sed -e '/disk block/d') <(dedup-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: writing to a shared block copies it, so the other file keeps its
+# contents, while blocks the two files still have in common stay shared
+
+cp $SCRATCH/data.bin $SCRATCH/changed.bin
+echo "changed" | dd of=$SCRATCH/changed.bin bs=1 seek=5000 conv=notrunc 2> /dev/null
+
+echo -n "Testing dedup copy-on-write in $SCRATCH/image.dedup ... "
+if printf "format dedup\nmount\ncreate\ncreate\ncopyin $SCRATCH/data.bin 0\ncopyin $SCRATCH/changed.bin 1\nunmount\nmount\ncopyout 0 $SCRATCH/data.copy\ncopyout 1 $SCRATCH/changed.copy\ndebug\n" |
+   ./bin/sfssh $SCRATCH/image.dedup 200 2> /dev/null | grep -A 2 "^Inode 1:$" | grep -q "^    direct blocks: 23 28 25 26 27$" &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy && cmp -s $SCRATCH/changed.bin $SCRATCH/changed.copy; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Test: on a full disk, a write past the end of a file whose blocks are
+# counted places nothing and does not grow the file up to where it started
+
+head -c 100 /dev/urandom > $SCRATCH/tiny.bin
+head -c 4096 /dev/urandom > $SCRATCH/block.bin
+head -c 2000000 /dev/urandom > $SCRATCH/huge.bin
+
+full-input() {
+    cat <<EOF2
+format $1
+mount
+create
+copyin $SCRATCH/tiny.bin 0
+create
+copyin $SCRATCH/huge.bin 1
+copyin $SCRATCH/block.bin 0 163840
+stat 0
+EOF2
+}
+
+for format in dedup dedup,extents clones; do
+    echo -n "Testing a write past the end on a full disk ($format) in $SCRATCH/image.full ... "
+    if full-input $format | ./bin/sfssh $SCRATCH/image.full 200 2> /dev/null | sed -e '/disk block/d' | tail -n 2 |
+       diff -u - <(printf "0 bytes copied\ninode 0 has size 100 bytes.\n") > $SCRATCH/test.log; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
@@ -0,0 +1,136 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a file rewritten after a hole was punched in it is moved into one
+# run, and reads back the same after a remount
+
+head -c 20000 /dev/urandom > $SCRATCH/data.bin
+
+defrag-input() {
+    cat <<EOF2
+format
+mount
+create
+create
+copyin $SCRATCH/data.bin 0
+copyin $SCRATCH/data.bin 1
+punch 0 4096 8192
+copyin $SCRATCH/data.bin 0
+defrag 0
+debug
+unmount
+mount
+copyout 0 $SCRATCH/data.copy
+EOF2
+}
+
+defrag-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+20000 bytes copied
+20000 bytes copied
+punched 8192 bytes at 4096 in inode 0.
+20000 bytes copied
+inode 0: 3 runs -> 1 runs.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+Inode 0:
+    size: 20000 bytes
+    direct blocks: 34 35 36 37 38
+Inode 1:
+    size: 20000 bytes
+    direct blocks: 27 28 29 30 31
+disk unmounted.
+disk mounted.
+20000 bytes copied
+EOF2
+}
+
+echo -n "Testing defrag in $SCRATCH/image.defrag ... "
+if diff -u <(defrag-input | ./bin/sfssh $SCRATCH/image.defrag 200 2> /dev/null | sed -e '/disk block/d') <(defrag-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: defragmenting every file leaves the blocks a clone shares where
+# they are
+
+defrag-clones-input() {
+    cat <<EOF2
+format clones
+mount
+create
+copyin $SCRATCH/data.bin 0
+clone 0
+create
+copyin $SCRATCH/data.bin 2
+punch 1 4096 8192
+punch 2 4096 8192
+copyin $SCRATCH/data.bin 2
+defrag
+debug
+unmount
+mount
+copyout 0 $SCRATCH/data.copy
+copyout 2 $SCRATCH/defrag.copy
+EOF2
+}
+
+defrag-clones-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+20000 bytes copied
+cloned inode 0 to inode 1.
+created inode 2.
+20000 bytes copied
+punched 8192 bytes at 4096 in inode 1.
+punched 8192 bytes at 4096 in inode 2.
+20000 bytes copied
+inode 2: 3 runs -> 1 runs.
+3 files: 6 runs -> 4 runs.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+    1 reference blocks for shared data
+    0 snapshots
+Inode 0:
+    size: 20000 bytes
+    direct blocks: 24 25 26 27 28
+Inode 1:
+    size: 20000 bytes
+    direct blocks: 24 0 0 27 28
+Inode 2:
+    size: 20000 bytes
+    direct blocks: 36 37 38 39 40
+disk unmounted.
+disk mounted.
+20000 bytes copied
+20000 bytes copied
+EOF2
+}
+
+echo -n "Testing defrag with clones in $SCRATCH/image.defrag ... "
+if diff -u <(defrag-clones-input | ./bin/sfssh $SCRATCH/image.defrag 200 2> /dev/null | sed -e '/disk block/d') <(defrag-clones-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy && cmp -s $SCRATCH/data.bin $SCRATCH/defrag.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
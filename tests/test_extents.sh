@@ -0,0 +1,63 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a file past the pointer limit fits in one extent and survives a remount
+
+seq 1 1500000 > $SCRATCH/big.txt
+
+extents-input() {
+    cat <<EOF2
+format extents
+mount
+create
+copyin $SCRATCH/big.txt 0
+unmount
+mount
+copyout 0 $SCRATCH/big.copy
+debug
+EOF2
+}
+
+extents-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+$(wc -c < $SCRATCH/big.txt | tr -d " ") bytes copied
+disk unmounted.
+disk mounted.
+$(wc -c < $SCRATCH/big.txt | tr -d " ") bytes copied
+SuperBlock:
+    magic number is valid
+    4096 blocks
+    410 inode blocks
+    52480 inodes
+    1 bitmap blocks (dirty)
+    64 journal blocks
+    extent-mapped inodes
+Inode 0:
+    size: $(wc -c < $SCRATCH/big.txt | tr -d " ") bytes
+    extents: 476+2659
+EOF2
+}
+
+echo -n "Testing extents in $SCRATCH/image.extents ... "
+if diff -u <(extents-input | ./bin/sfssh $SCRATCH/image.extents 4096 2> /dev/null | sed -e '/disk block/d') <(extents-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/big.txt $SCRATCH/big.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: block pointers stop at 5 direct and 1024 indirect blocks
+
+echo -n "Testing pointer limit in $SCRATCH/image.pointers ... "
+if printf "format\nmount\ncreate\ncopyin $SCRATCH/big.txt 0\n" | ./bin/sfssh $SCRATCH/image.pointers 4096 2> /dev/null |
+   grep -q "^$(((5 + 1024) * 4096)) bytes copied"; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -8,6 +8,7 @@ SuperBlock:
     5 blocks
     1 inode blocks
     128 inodes
+    1 bitmap blocks (clean)
 2 disk block reads
 5 disk block writes
 EOF
@@ -21,6 +22,7 @@ SuperBlock:
     20 blocks
     2 inode blocks
     256 inodes
+    1 bitmap blocks (clean)
 3 disk block reads
 20 disk block writes
 EOF
@@ -34,6 +36,7 @@ SuperBlock:
     200 blocks
     20 inode blocks
     2560 inodes
+    1 bitmap blocks (clean)
 21 disk block reads
 200 disk block writes
 EOF
@@ -65,3 +68,44 @@ test-format() {
 test-format data/image.5   5   image-5-output
 test-format data/image.20  20  image-20-output
 test-format data/image.200 200 image-200-output
+
+# Test: a fast format only clears metadata but leaves a usable file system
+
+fast-input() {
+    cat <<EOF2
+format fast
+debug
+mount
+create
+copyin README.md 0
+copyout 0 $DISK.README.md
+EOF2
+}
+
+fast-output() {
+    cat <<EOF2
+disk formatted in N seconds.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (clean)
+disk mounted.
+created inode 0.
+$(wc -c < README.md | tr -d " ") bytes copied
+$(wc -c < README.md | tr -d " ") bytes copied
+EOF2
+}
+
+DISK=data/image.200.fast
+cp data/image.200 $DISK
+echo -n "Testing fast format on $DISK ... "
+if diff -u <(fast-input | ./bin/sfssh $DISK 200 2> /dev/null | sed -e 's/in [0-9.]* seconds/in N seconds/' -e '/disk block/d') <(fast-output) > test.log &&
+   cmp -s README.md $DISK.README.md; then
+    echo "Success"
+else
+    echo "Failure"
+    cat test.log
+fi
+rm -f $DISK $DISK.README.md test.log
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: the checker finds nothing wrong with an image that was unmounted
+# cleanly, finds each kind of damage written into it, and repairs it
+
+head -c 30000 /dev/urandom > $SCRATCH/data.bin
+
+populate-input() {
+    cat <<EOF2
+format
+mount
+create
+create
+copyin $SCRATCH/data.bin 0
+copyin $SCRATCH/data.bin 1
+unmount
+EOF2
+}
+
+# Patch `bytes` (printf escapes) into the image at byte `offset`
+patch() {
+    printf "$2" | dd of=$SCRATCH/image.fsck bs=1 seek=$1 conv=notrunc 2> /dev/null
+}
+
+clean-output() {
+    cat <<EOF2
+2 inodes, 40 blocks in use.
+no problems found.
+EOF2
+}
+
+damaged-output() {
+    cat <<EOF2
+inode 0: block 5000 out of range
+inode 0: block 50 past the end of the file
+inode 1: block 22 already in use
+inode 2: neither free nor in use (7)
+3 free blocks are marked in use
+2 inodes, 38 blocks in use.
+5 problems found.
+EOF2
+}
+
+repaired-output() {
+    cat <<EOF2
+inode 0: block 5000 out of range
+inode 0: block 50 past the end of the file
+inode 1: block 22 already in use
+inode 2: neither free nor in use (7)
+3 free blocks are marked in use
+2 inodes, 38 blocks in use.
+5 problems repaired.
+EOF2
+}
+
+echo -n "Testing fsck in $SCRATCH/image.fsck ... "
+populate-input | ./bin/sfssh $SCRATCH/image.fsck 200 > /dev/null 2>&1
+./bin/sfsck $SCRATCH/image.fsck 2> /dev/null | sed -e "/disk block/d" > $SCRATCH/clean.log
+clean=${PIPESTATUS[0]}
+
+# The inode table starts at block 1 with 32-byte records and the bitmap
+# is block 21; inode 0 has direct blocks 22-26 and indirect block 27
+patch $((1 * 4096 + 12)) '\x88\x13\x00\x00'	# inode 0, direct block 1 -> 5000
+patch $((1 * 4096 + 32 + 8)) '\x16\x00\x00\x00'	# inode 1, direct block 0 -> 22
+patch $((1 * 4096 + 64)) '\x07\x00\x00\x00'	# inode 2, valid -> 7
+patch $((27 * 4096 + 20)) '\x32\x00\x00\x00'	# indirect block 27, entry 5 -> 50
+patch $((21 * 4096 + 12)) '\x10'			# bitmap, block 100 in use
+
+./bin/sfsck $SCRATCH/image.fsck 2> /dev/null | sed -e "/disk block/d" > $SCRATCH/damaged.log
+damaged=${PIPESTATUS[0]}
+./bin/sfsck -r $SCRATCH/image.fsck 2> /dev/null | sed -e "/disk block/d" > $SCRATCH/repaired.log
+repaired=${PIPESTATUS[0]}
+./bin/sfsck $SCRATCH/image.fsck 2> /dev/null | sed -e "/disk block/d" > $SCRATCH/rechecked.log
+rechecked=${PIPESTATUS[0]}
+
+if diff -u $SCRATCH/clean.log <(clean-output) > $SCRATCH/test.log && [ $clean -eq 0 ] &&
+   diff -u $SCRATCH/damaged.log <(damaged-output) >> $SCRATCH/test.log && [ $damaged -eq 4 ] &&
+   diff -u $SCRATCH/repaired.log <(repaired-output) >> $SCRATCH/test.log && [ $repaired -eq 1 ] &&
+   diff -u $SCRATCH/rechecked.log <(clean-output | sed -e 's/40 blocks/38 blocks/') >> $SCRATCH/test.log && [ $rechecked -eq 0 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: files that fit after the inode fields stay there, larger ones get blocks
+
+seq 1 100 > $SCRATCH/small.txt
+seq 1 200 > $SCRATCH/medium.txt
+
+inline-input() {
+    cat <<EOF2
+format inline
+mount
+create
+copyin $SCRATCH/small.txt 0
+create
+copyin $SCRATCH/medium.txt 1
+unmount
+mount
+copyout 0 $SCRATCH/small.copy
+copyout 1 $SCRATCH/medium.copy
+debug
+EOF2
+}
+
+inline-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+$(wc -c < $SCRATCH/small.txt | tr -d " ") bytes copied
+created inode 1.
+$(wc -c < $SCRATCH/medium.txt | tr -d " ") bytes copied
+disk unmounted.
+disk mounted.
+$(wc -c < $SCRATCH/small.txt | tr -d " ") bytes copied
+$(wc -c < $SCRATCH/medium.txt | tr -d " ") bytes copied
+SuperBlock:
+    magic number is valid
+    4096 blocks
+    410 inode blocks
+    3280 inodes
+    1 bitmap blocks (dirty)
+    64 journal blocks
+    512-byte inodes for large files
+    files up to 448 bytes kept inline
+Inode 0:
+    size: $(wc -c < $SCRATCH/small.txt | tr -d " ") bytes
+    inline data
+Inode 1:
+    size: $(wc -c < $SCRATCH/medium.txt | tr -d " ") bytes
+    direct blocks: 476
+EOF2
+}
+
+echo -n "Testing inline data in $SCRATCH/image.inline ... "
+if diff -u <(inline-input | ./bin/sfssh $SCRATCH/image.inline 4096 2> /dev/null | sed -e '/disk block/d') <(inline-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/small.txt $SCRATCH/small.copy && cmp -s $SCRATCH/medium.txt $SCRATCH/medium.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,14 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: metadata synced before a crash survives through journal replay
+
+echo -n "Testing journal replay in $SCRATCH/image.journal ... "
+if ./bin/journal_crash $SCRATCH/image.journal > $SCRATCH/test.log 2>&1; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
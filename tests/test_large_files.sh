@@ -0,0 +1,67 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a file past the indirect block goes on through the double indirect
+# block, with each leaf allocated ahead of the data it points to
+
+seq 1 1500000 > $SCRATCH/big.txt
+
+large-input() {
+    cat <<EOF2
+format large
+mount
+create
+copyin $SCRATCH/big.txt 0
+unmount
+mount
+copyout 0 $SCRATCH/big.copy
+debug
+EOF2
+}
+
+large-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+$(wc -c < $SCRATCH/big.txt | tr -d " ") bytes copied
+disk unmounted.
+disk mounted.
+$(wc -c < $SCRATCH/big.txt | tr -d " ") bytes copied
+SuperBlock:
+    magic number is valid
+    4096 blocks
+    410 inode blocks
+    26240 inodes
+    1 bitmap blocks (dirty)
+    64 journal blocks
+    64-byte inodes for large files
+Inode 0:
+    size: $(wc -c < $SCRATCH/big.txt | tr -d " ") bytes
+    direct blocks: 476 477 478 479 480
+    indirect block: 481
+    double indirect block: 1506
+    indirect data blocks: $(echo $(seq 482 1505) $(seq 1508 2531) $(seq 2533 3138))
+EOF2
+}
+
+echo -n "Testing large files in $SCRATCH/image.large ... "
+if diff -u <(large-input | ./bin/sfssh $SCRATCH/image.large 4096 2> /dev/null | sed -e '/disk block/d') <(large-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/big.txt $SCRATCH/big.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: removing the file frees the leaves and the double indirect block too
+
+echo -n "Testing large file remove in $SCRATCH/image.large ... "
+if printf "mount\nremove 0\ncreate\ncopyin $SCRATCH/big.txt 0\ndebug\n" | ./bin/sfssh $SCRATCH/image.large 4096 2> /dev/null |
+   grep -q "^    double indirect block: 1506$"; then
+    echo "Success"
+else
+    echo "Failure"
+fi
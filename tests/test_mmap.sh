@@ -0,0 +1,45 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: debug output (including block counters) matches the default backend
+
+for IMAGE in 5 20 200; do
+    echo -n "Testing mmap debug on data/image.$IMAGE ... "
+    if diff -u <(./bin/sfssh data/image.$IMAGE $IMAGE <<<debug 2> /dev/null) \
+	       <(./bin/sfssh -m data/image.$IMAGE $IMAGE <<<debug 2> /dev/null) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: copyin through the mapping is visible to the default backend
+
+cat <<EOF | ./bin/sfssh -m data/image.200 200 > /dev/null 2>&1
+mount
+copyout 2 $SCRATCH/2.txt
+copyout 9 $SCRATCH/9.txt
+EOF
+cat <<EOF | ./bin/sfssh -m $SCRATCH/image.200 200 > /dev/null 2>&1
+format
+mount
+create
+copyin $SCRATCH/9.txt 0
+create
+copyin $SCRATCH/2.txt 1
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/9.copy
+copyout 1 $SCRATCH/2.copy
+EOF
+echo -n "Testing mmap copyin in $SCRATCH/image.200 ... "
+if [ $(md5sum $SCRATCH/2.copy | awk '{print $1}') = '307fe5cee7ac87c3b06ea5bda80301ee' ] &&
+   [ $(md5sum $SCRATCH/9.copy | awk '{print $1}') = 'cc4e48a5fe0ba15b13a98b3fd34b340e' ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
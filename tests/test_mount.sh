@@ -141,3 +141,26 @@ else
     echo "Failure"
     cat $SCRATCH/test.log
 fi
+
+# inode 3 of image.20 shares block 4 with inode 2 and points at inode block 1
+
+doubly-allocated-output() {
+    cat <<EOF
+disk mounted.
+block 1 is allocated more than once!
+block 4 is allocated more than once!
+4 disk block reads
+0 disk block writes
+EOF
+}
+
+cp data/image.20 $SCRATCH/image.20
+echo -n -e $(printf '\\x%x\\x%x\\x%x\\x%x' 0x04 0x00 0x00 0x00) | dd of=$SCRATCH/image.20 bs=1 seek=4200 conv=notrunc 2> /dev/null
+echo -n -e $(printf '\\x%x\\x%x\\x%x\\x%x' 0x01 0x00 0x00 0x00) | dd of=$SCRATCH/image.20 bs=1 seek=4204 conv=notrunc 2> /dev/null
+echo -n "Testing doubly-allocated mount on $SCRATCH/image.20 ... "
+if diff -u <(bad-mount-input| ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(doubly-allocated-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a sequential copyout is served from readahead without extra reads
+
+sequential-output() {
+    cat <<EOF
+readahead window up to 32 blocks.
+disk mounted.
+2042182 bytes copied
+491 readahead hits
+0 readahead wasted
+602 disk block reads
+0 disk block writes
+EOF
+}
+
+echo -n "Testing readahead copyout in data/yuxiang.1000 ... "
+if diff -u <(printf "readahead 32\nmount\ncopyout 0 $SCRATCH/yuxiang.jpg\n" | ./bin/sfssh data/yuxiang.1000 1000 2> /dev/null) <(sequential-output) > $SCRATCH/test.log &&
+   [ $(md5sum $SCRATCH/yuxiang.jpg | awk '{print $1}') = '4fc399e56f88395f5ad6ddd8505c31f1' ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: writes drop prefetched blocks so later reads see new data
+
+cat <<EOF | ./bin/sfssh data/image.200 200 > /dev/null 2>&1
+mount
+copyout 2 $SCRATCH/2.txt
+copyout 9 $SCRATCH/9.txt
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/output 2> /dev/null
+format
+mount
+readahead 64
+create
+copyin $SCRATCH/9.txt 0
+copyout 0 $SCRATCH/9.copy
+copyin $SCRATCH/2.txt 0
+copyout 0 $SCRATCH/2.copy
+EOF
+echo -n "Testing readahead after write in $SCRATCH/image.200 ... "
+if [ $(md5sum $SCRATCH/9.copy | awk '{print $1}') = 'cc4e48a5fe0ba15b13a98b3fd34b340e' ] &&
+   cmp -s <(head -c $(stat -c %s $SCRATCH/2.txt) $SCRATCH/2.copy) $SCRATCH/2.txt &&
+   grep -q '[1-9][0-9]* readahead hits' $SCRATCH/output; then
+    echo "Success"
+else
+    echo "Failure"
+fi
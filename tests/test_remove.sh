@@ -62,8 +62,8 @@ SuperBlock:
 Inode 2:
     size: 0 bytes
     direct blocks:
-21 disk block reads
-8 disk block writes
+8 disk block reads
+2 disk block writes
 EOF
 }
 
@@ -156,8 +156,8 @@ Inode 1:
 Inode 2:
     size: 965 bytes
     direct blocks: 4
-26 disk block reads
-10 disk block writes
+11 disk block reads
+6 disk block writes
 EOF
 }
 
@@ -230,8 +230,8 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
-52 disk block reads
-18 disk block writes
+25 disk block reads
+10 disk block writes
 EOF
 }
 
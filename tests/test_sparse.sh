@@ -0,0 +1,118 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a punched block and a grown tail are holes that read back as zeros
+# and take no data blocks, with the zeros merged into one run each
+
+seq 1 3000 > $SCRATCH/data.txt
+cp $SCRATCH/data.txt $SCRATCH/sparse.txt
+dd if=/dev/zero of=$SCRATCH/sparse.txt bs=4096 seek=1 count=1 conv=notrunc 2> /dev/null
+truncate -s 40000 $SCRATCH/sparse.txt
+
+sparse-input() {
+    cat <<EOF2
+format extents
+mount
+create
+copyin $SCRATCH/data.txt 0
+punch 0 4096 4096
+truncate 0 40000
+unmount
+mount
+copyout 0 $SCRATCH/sparse.copy
+debug
+EOF2
+}
+
+sparse-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+$(wc -c < $SCRATCH/data.txt | tr -d " ") bytes copied
+punched 4096 bytes at 4096 in inode 0.
+inode 0 truncated to 40000 bytes.
+disk unmounted.
+disk mounted.
+40000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    1 bitmap blocks (dirty)
+    extent-mapped inodes
+Inode 0:
+    size: 40000 bytes
+    extents: 22+1 0+1 24+2 0+6
+    overflow blocks: 26
+EOF2
+}
+
+echo -n "Testing sparse files in $SCRATCH/image.sparse ... "
+if diff -u <(sparse-input | ./bin/sfssh $SCRATCH/image.sparse 200 2> /dev/null | sed -e '/disk block/d') <(sparse-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/sparse.txt $SCRATCH/sparse.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: shrinking a file frees the blocks past the new end, and the part of
+# the last block that was cut off reads as zeros when the file grows again
+
+head -c 5000 $SCRATCH/sparse.txt > $SCRATCH/short.txt
+truncate -s 9000 $SCRATCH/short.txt
+
+echo -n "Testing truncate in $SCRATCH/image.sparse ... "
+if printf "mount\ntruncate 0 5000\ntruncate 0 9000\ncopyout 0 $SCRATCH/short.copy\ndebug\n" | ./bin/sfssh $SCRATCH/image.sparse 200 2> /dev/null |
+   grep -q "^    extents: 22+1 0+2$" && cmp -s $SCRATCH/short.txt $SCRATCH/short.copy; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Test: a write past the largest file the inode can map places nothing and
+# leaves the file as it was
+
+head -c 100 /dev/urandom > $SCRATCH/tiny.bin
+head -c 2000000 /dev/urandom > $SCRATCH/huge.bin
+
+echo -n "Testing a write past the largest file in $SCRATCH/image.nothing ... "
+# block 2000 is past the 5 direct and 1024 indirect pointers
+if diff -u <(printf "format\nmount\ncreate\ncopyin $SCRATCH/tiny.bin 0 8192000\nstat 0\ncopyout 0 $SCRATCH/empty.copy\n" |
+	     ./bin/sfssh $SCRATCH/image.nothing 200 2> /dev/null | sed -e '/disk block/d') \
+	   <(printf "disk formatted.\ndisk mounted.\ncreated inode 0.\n0 bytes copied\ninode 0 has size 0 bytes.\n0 bytes copied\n") > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: on a full disk, a write past the end of a file places nothing and
+# does not grow the file up to where it started
+
+full-input() {
+    cat <<EOF2
+format $1
+mount
+create
+copyin $SCRATCH/huge.bin 0
+create
+copyin $SCRATCH/tiny.bin 1 40960
+stat 1
+EOF2
+}
+
+for format in pointers extents; do
+    echo -n "Testing a write past the end on a full disk ($format) in $SCRATCH/image.nothing ... "
+    if full-input ${format/pointers/} | ./bin/sfssh $SCRATCH/image.nothing 200 2> /dev/null | sed -e '/disk block/d' | tail -n 3 |
+       diff -u - <(printf "created inode 1.\n0 bytes copied\ninode 1 has size 0 bytes.\n") > $SCRATCH/test.log; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
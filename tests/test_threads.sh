@@ -0,0 +1,16 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: concurrent clients see their own writes and never corrupt each other
+
+for threads in 1 8; do
+    echo -n "Testing $threads-thread stress in $SCRATCH/image.stress ... "
+    if ./bin/thread_stress $SCRATCH/image.stress $threads 3000 > $SCRATCH/test.log 2>&1; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done